@@ -0,0 +1,35 @@
+#include "fs/byte_order.h"
+
+// Table of the CRC-32.
+struct crc_table {
+  uint32_t t[256];
+
+  crc_table();
+};
+
+static const crc_table kCrcTable;
+
+uint32_t fs::crc32(uint32_t crc, const void* data, uint64_t len)
+{
+  const uint8_t* p = reinterpret_cast<const uint8_t*>(data);
+
+  crc = ~crc;
+
+  for (uint64_t i = 0; i < len; i++) {
+    crc = kCrcTable.t[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+  }
+
+  return ~crc;
+}
+
+crc_table::crc_table()
+{
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t c = i;
+    for (unsigned j = 0; j < 8; j++) {
+      c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+    }
+
+    t[i] = c;
+  }
+}
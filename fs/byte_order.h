@@ -0,0 +1,54 @@
+#ifndef FS_BYTE_ORDER_H
+#define FS_BYTE_ORDER_H
+
+#include <stdint.h>
+
+namespace fs {
+  // Encode little-endian integer.
+  void put_le32(uint8_t* p, uint32_t v);
+  void put_le64(uint8_t* p, uint64_t v);
+
+  // Decode little-endian integer.
+  uint32_t get_le32(const uint8_t* p);
+  uint64_t get_le64(const uint8_t* p);
+
+  // Compute CRC-32 (reflected polynomial 0xedb88320) of 'len' bytes,
+  // continuing 'crc' (0 for the first bytes).
+  uint32_t crc32(uint32_t crc, const void* data, uint64_t len);
+
+  inline void put_le32(uint8_t* p, uint32_t v)
+  {
+    for (unsigned i = 0; i < 4; i++) {
+      p[i] = static_cast<uint8_t>(v >> (8 * i));
+    }
+  }
+
+  inline void put_le64(uint8_t* p, uint64_t v)
+  {
+    for (unsigned i = 0; i < 8; i++) {
+      p[i] = static_cast<uint8_t>(v >> (8 * i));
+    }
+  }
+
+  inline uint32_t get_le32(const uint8_t* p)
+  {
+    uint32_t v = 0;
+    for (unsigned i = 0; i < 4; i++) {
+      v |= static_cast<uint32_t>(p[i]) << (8 * i);
+    }
+
+    return v;
+  }
+
+  inline uint64_t get_le64(const uint8_t* p)
+  {
+    uint64_t v = 0;
+    for (unsigned i = 0; i < 8; i++) {
+      v |= static_cast<uint64_t>(p[i]) << (8 * i);
+    }
+
+    return v;
+  }
+}
+
+#endif // FS_BYTE_ORDER_H
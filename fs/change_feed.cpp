@@ -0,0 +1,73 @@
+#include "fs/change_feed.h"
+
+bool fs::change_feed::create(file_model& fm, callback fn, void* arg)
+{
+  clear();
+
+  if (!fm.add_listener(on_change, this)) {
+    return false;
+  }
+
+  _M_file_model = &fm;
+
+  _M_fn = fn;
+  _M_arg = arg;
+
+  return true;
+}
+
+void fs::change_feed::clear()
+{
+  if (_M_file_model) {
+    flush();
+
+    _M_file_model->remove_listener(on_change, this);
+    _M_file_model = NULL;
+  }
+
+  _M_fn = NULL;
+  _M_arg = NULL;
+}
+
+void fs::change_feed::flush()
+{
+  if (_M_pending) {
+    _M_pending = false;
+    _M_fn(_M_off, _M_oldlen, _M_newlen, _M_arg);
+  }
+}
+
+void fs::change_feed::add(uint64_t off, uint64_t oldlen, uint64_t newlen)
+{
+  // If the change doesn't touch the range replaced by the pending event...
+  if ((_M_pending) &&
+      ((off > _M_off + _M_newlen) || (off + oldlen < _M_off))) {
+    flush();
+  }
+
+  if (!_M_pending) {
+    _M_pending = true;
+
+    _M_off = off;
+    _M_oldlen = oldlen;
+    _M_newlen = newlen;
+
+    return;
+  }
+
+  // Merge: the end of the range replaced by both changes (after the
+  // pending event and before it).
+  uint64_t end = _M_off + _M_newlen;
+  if (end < off + oldlen) {
+    end = off + oldlen;
+  }
+
+  uint64_t oldend = end - _M_newlen + _M_oldlen;
+
+  if (off < _M_off) {
+    _M_off = off;
+  }
+
+  _M_oldlen = oldend - _M_off;
+  _M_newlen = end - _M_off - oldlen + newlen;
+}
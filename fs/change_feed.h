@@ -0,0 +1,102 @@
+#ifndef FS_CHANGE_FEED_H
+#define FS_CHANGE_FEED_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include "fs/file_model.h"
+
+namespace fs {
+  // Feed of the ranges of a file_model which change, coalesced.
+  //
+  // The changes reported by the file_model are merged while each one
+  // touches or overlaps the range replaced by the previous ones (typing,
+  // backspaces, overwriting...): the pending event is delivered to the
+  // callback when a change elsewhere is performed or when flush() is
+  // called. Events are delivered in order and each one is in the
+  // coordinates of the file once the previous events have been applied:
+  // the range [off, off + oldlen) has been replaced with 'newlen' bytes.
+  //
+  // The feed has to be cleared (or destroyed) before the file_model is
+  // destroyed.
+  class change_feed {
+    public:
+      typedef file_model::change_listener callback;
+
+      // Constructor.
+      change_feed();
+
+      // Destructor.
+      ~change_feed();
+
+      // Create: bind to the file model.
+      bool create(file_model& fm, callback fn, void* arg);
+
+      // Clear (the pending event is delivered).
+      void clear();
+
+      // Deliver the pending event (if any).
+      void flush();
+
+      // Is an event pending?
+      bool pending() const;
+
+    private:
+      // File model.
+      file_model* _M_file_model;
+
+      // Callback.
+      callback _M_fn;
+      void* _M_arg;
+
+      // Pending event.
+      bool _M_pending;
+
+      uint64_t _M_off;
+      uint64_t _M_oldlen;
+      uint64_t _M_newlen;
+
+      // Add event.
+      void add(uint64_t off, uint64_t oldlen, uint64_t newlen);
+
+      // Change listener.
+      static void on_change(uint64_t off,
+                            uint64_t oldlen,
+                            uint64_t newlen,
+                            void* arg);
+
+      // Disable copy constructor and assignment operator.
+      change_feed(const change_feed&) = delete;
+      change_feed& operator=(const change_feed&) = delete;
+  };
+
+  inline change_feed::change_feed()
+    : _M_file_model(NULL),
+      _M_fn(NULL),
+      _M_arg(NULL),
+      _M_pending(false),
+      _M_off(0),
+      _M_oldlen(0),
+      _M_newlen(0)
+  {
+  }
+
+  inline change_feed::~change_feed()
+  {
+    clear();
+  }
+
+  inline bool change_feed::pending() const
+  {
+    return _M_pending;
+  }
+
+  inline void change_feed::on_change(uint64_t off,
+                                     uint64_t oldlen,
+                                     uint64_t newlen,
+                                     void* arg)
+  {
+    reinterpret_cast<change_feed*>(arg)->add(off, oldlen, newlen);
+  }
+}
+
+#endif // FS_CHANGE_FEED_H
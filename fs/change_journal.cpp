@@ -0,0 +1,198 @@
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "fs/change_journal.h"
+#include "fs/byte_order.h"
+
+// Get length of the padding of the data of a record.
+static uint64_t padding(uint64_t len);
+
+bool fs::change_journal::open(const char* filename)
+{
+  close();
+
+  // Open file for reading.
+  int fd;
+  if ((fd = ::open(filename, O_RDONLY)) < 0) {
+    return false;
+  }
+
+  // Get file status.
+  struct stat sbuf;
+  if ((fstat(fd, &sbuf) < 0) ||
+      (!S_ISREG(sbuf.st_mode)) ||
+      (static_cast<uint64_t>(sbuf.st_size) < kHeaderSize)) {
+    ::close(fd);
+    return false;
+  }
+
+  // Map file into memory.
+  if ((_M_data = mmap(NULL,
+                      sbuf.st_size,
+                      PROT_READ,
+                      MAP_SHARED,
+                      fd,
+                      0)) == MAP_FAILED) {
+    ::close(fd);
+    return false;
+  }
+
+  ::close(fd);
+
+  _M_filesize = sbuf.st_size;
+
+  // Check header.
+  const uint8_t* hdr = reinterpret_cast<const uint8_t*>(_M_data);
+  if ((get_le32(hdr) != kMagic) ||
+      (get_le32(hdr + 4) != kVersion) ||
+      (get_le32(hdr + 16) != crc32(0, hdr, 16))) {
+    close();
+    return false;
+  }
+
+  _M_nchanges = get_le64(hdr + 8);
+  _M_nchange = 0;
+  _M_off = kHeaderSize;
+
+  return true;
+}
+
+void fs::change_journal::close()
+{
+  if (_M_data != MAP_FAILED) {
+    munmap(_M_data, _M_filesize);
+    _M_data = MAP_FAILED;
+  }
+
+  _M_filesize = 0;
+
+  _M_nchanges = 0;
+  _M_nchange = 0;
+  _M_off = 0;
+}
+
+bool fs::change_journal::next(entry& e)
+{
+  if ((_M_nchange == _M_nchanges) ||
+      (_M_filesize - _M_off < kRecordHeaderSize)) {
+    return false;
+  }
+
+  const uint8_t* rec = reinterpret_cast<const uint8_t*>(_M_data) + _M_off;
+
+  switch (get_le32(rec)) {
+    case static_cast<uint32_t>(file_change::type::kModify):
+      e.t = file_change::type::kModify;
+      break;
+    case static_cast<uint32_t>(file_change::type::kAdd):
+      e.t = file_change::type::kAdd;
+      break;
+    case static_cast<uint32_t>(file_change::type::kRemove):
+      e.t = file_change::type::kRemove;
+      break;
+    default:
+      return false;
+  }
+
+  e.off = get_le64(rec + 8);
+  e.len = get_le64(rec + 16);
+
+  if (e.len == 0) {
+    return false;
+  }
+
+  // Length of the data.
+  uint64_t datalen = (e.t == file_change::type::kRemove) ? 0 : e.len;
+
+  uint64_t left = _M_filesize - _M_off - kRecordHeaderSize;
+  if ((datalen > left) || (padding(datalen) > left - datalen)) {
+    return false;
+  }
+
+  e.data = (datalen > 0) ? rec + kRecordHeaderSize : NULL;
+
+  if (get_le32(rec + 4) != record_crc(rec, e.data, datalen)) {
+    return false;
+  }
+
+  _M_off += kRecordHeaderSize + datalen + padding(datalen);
+  _M_nchange++;
+
+  return true;
+}
+
+bool fs::change_journal::write_header(FILE* file, uint64_t nchanges)
+{
+  uint8_t hdr[kHeaderSize];
+  put_le32(hdr, kMagic);
+  put_le32(hdr + 4, kVersion);
+  put_le64(hdr + 8, nchanges);
+  put_le32(hdr + 16, crc32(0, hdr, 16));
+  put_le32(hdr + 20, 0);
+
+  return (fwrite(hdr, 1, kHeaderSize, file) == kHeaderSize);
+}
+
+bool fs::change_journal::write_change(FILE* file,
+                                      file_change::type t,
+                                      uint64_t off,
+                                      const uint8_t* data,
+                                      uint64_t len)
+{
+  static const uint8_t kPadding[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+
+  // Length of the data.
+  uint64_t datalen = (t == file_change::type::kRemove) ? 0 : len;
+
+  uint8_t rec[kRecordHeaderSize];
+  put_le32(rec, static_cast<uint32_t>(t));
+  put_le64(rec + 8, off);
+  put_le64(rec + 16, len);
+  put_le32(rec + 4, record_crc(rec, data, datalen));
+
+  return ((fwrite(rec, 1, kRecordHeaderSize, file) == kRecordHeaderSize) &&
+          (fwrite(data, 1, datalen, file) == datalen) &&
+          (fwrite(kPadding, 1, padding(datalen), file) == padding(datalen)));
+}
+
+bool fs::change_journal::is_binary(const char* filename)
+{
+  FILE* file;
+  if ((file = fopen(filename, "rb")) == NULL) {
+    return false;
+  }
+
+  uint8_t magic[4];
+  bool binary = ((fread(magic, 1, sizeof(magic), file) == sizeof(magic)) &&
+                 (get_le32(magic) == kMagic));
+
+  fclose(file);
+
+  return binary;
+}
+
+bool fs::change_journal::to_binary(const char* textfile, const char* binfile)
+{
+  file_changes changes;
+  return ((changes.load(textfile)) && (changes.save_binary(binfile)));
+}
+
+bool fs::change_journal::to_text(const char* binfile, const char* textfile)
+{
+  file_changes changes;
+  return ((changes.load(binfile)) && (changes.save(textfile)));
+}
+
+uint32_t fs::change_journal::record_crc(const uint8_t* rec,
+                                        const uint8_t* data,
+                                        uint64_t datalen)
+{
+  // The type, the offset, the length and the data.
+  return crc32(crc32(crc32(0, rec, 4), rec + 8, 16), data, datalen);
+}
+
+uint64_t padding(uint64_t len)
+{
+  return (8 - (len % 8)) % 8;
+}
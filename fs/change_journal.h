@@ -0,0 +1,132 @@
+#ifndef FS_CHANGE_JOURNAL_H
+#define FS_CHANGE_JOURNAL_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include "fs/file_change.h"
+
+namespace fs {
+  // Binary changes file.
+  //
+  // All the integers are little-endian:
+  //   - Header (24 bytes): magic ("FCHG"), version (4 bytes), number of
+  //     changes (8 bytes), CRC-32 of the previous 16 bytes (4 bytes) and
+  //     4 reserved bytes.
+  //   - One record per change (24 bytes): type (4 bytes: 0 modify, 1 add,
+  //     2 remove), CRC-32 of the type, the offset, the length and the data
+  //     (4 bytes), offset (8 bytes) and length (8 bytes), followed by the
+  //     data (modifications and additions) and padded to a multiple of
+  //     8 bytes.
+  //
+  // The file is mapped into memory and the data of the changes is not
+  // copied while iterating.
+  class change_journal {
+    public:
+      static const size_t kHeaderSize = 24;
+      static const size_t kRecordHeaderSize = 24;
+
+      // Change of the file.
+      struct entry {
+        file_change::type t;
+
+        uint64_t off;
+        uint64_t len;
+
+        // Data (modifications and additions, it points into the mapping).
+        const uint8_t* data;
+      };
+
+      // Constructor.
+      change_journal();
+
+      // Destructor.
+      ~change_journal();
+
+      // Open.
+      bool open(const char* filename);
+
+      // Close.
+      void close();
+
+      // Get number of changes.
+      uint64_t size() const;
+
+      // Get next change (returns false once all the changes have been read
+      // or if the file is corrupted).
+      bool next(entry& e);
+
+      // Have all the changes been read?
+      bool eof() const;
+
+      // Write header.
+      static bool write_header(FILE* file, uint64_t nchanges);
+
+      // Write change.
+      static bool write_change(FILE* file,
+                               file_change::type t,
+                               uint64_t off,
+                               const uint8_t* data,
+                               uint64_t len);
+
+      // Is the file a binary changes file?
+      static bool is_binary(const char* filename);
+
+      // Convert a text changes file to binary.
+      static bool to_binary(const char* textfile, const char* binfile);
+
+      // Convert a binary changes file to text.
+      static bool to_text(const char* binfile, const char* textfile);
+
+    private:
+      static const uint32_t kMagic = 0x47484346; // "FCHG"
+      static const uint32_t kVersion = 1;
+
+      // Pointer to memory mapped file.
+      void* _M_data;
+      uint64_t _M_filesize;
+
+      // Number of changes.
+      uint64_t _M_nchanges;
+
+      // Next change.
+      uint64_t _M_nchange;
+      uint64_t _M_off;
+
+      // Compute CRC-32 of a record.
+      static uint32_t record_crc(const uint8_t* rec,
+                                 const uint8_t* data,
+                                 uint64_t datalen);
+
+      // Disable copy constructor and assignment operator.
+      change_journal(const change_journal&) = delete;
+      change_journal& operator=(const change_journal&) = delete;
+  };
+
+  inline change_journal::change_journal()
+    : _M_data(MAP_FAILED),
+      _M_filesize(0),
+      _M_nchanges(0),
+      _M_nchange(0),
+      _M_off(0)
+  {
+  }
+
+  inline change_journal::~change_journal()
+  {
+    close();
+  }
+
+  inline uint64_t change_journal::size() const
+  {
+    return _M_nchanges;
+  }
+
+  inline bool change_journal::eof() const
+  {
+    return (_M_nchange == _M_nchanges);
+  }
+}
+
+#endif // FS_CHANGE_JOURNAL_H
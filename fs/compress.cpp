@@ -0,0 +1,257 @@
+#include <stdlib.h>
+#include <string.h>
+#include "fs/compress.h"
+
+static const uint64_t kMinMatch = 4;
+static const uint64_t kMaxDistance = 65535;
+
+static const unsigned kHashBits = 12;
+
+// Maximum length which fits in the token.
+static const uint64_t kTokenMask = 15;
+
+// Hash the 4 bytes at 'p'.
+static uint32_t hash(const uint8_t* p);
+
+// Write the extra bytes of a length.
+static bool put_length(uint64_t len, uint8_t*& op, const uint8_t* oend);
+
+// Read the extra bytes of a length.
+static bool get_length(uint64_t& len,
+                       const uint8_t*& ip,
+                       const uint8_t* iend);
+
+// Write sequence (the match is omitted if 'matchlen' is 0).
+static bool put_sequence(const uint8_t* literals,
+                         uint64_t litlen,
+                         uint64_t distance,
+                         uint64_t matchlen,
+                         uint8_t*& op,
+                         const uint8_t* oend);
+
+uint64_t fs::compress_bound(uint64_t len)
+{
+  return len + (len / 255) + 16;
+}
+
+uint64_t fs::compress(const void* src,
+                      uint64_t len,
+                      void* dest,
+                      uint64_t destsize)
+{
+  const uint8_t* begin = reinterpret_cast<const uint8_t*>(src);
+  const uint8_t* end = begin + len;
+
+  uint8_t* op = reinterpret_cast<uint8_t*>(dest);
+  const uint8_t* oend = op + destsize;
+
+  // Last position seen for each hash.
+  const uint8_t* table[1u << kHashBits];
+  for (size_t i = 0; i < (1u << kHashBits); i++) {
+    table[i] = NULL;
+  }
+
+  const uint8_t* anchor = begin;
+  const uint8_t* ip = begin;
+
+  while (ip + kMinMatch <= end) {
+    uint32_t h = hash(ip);
+    const uint8_t* ref = table[h];
+    table[h] = ip;
+
+    // If there is no match...
+    if ((!ref) ||
+        (static_cast<uint64_t>(ip - ref) > kMaxDistance) ||
+        (memcmp(ref, ip, kMinMatch) != 0)) {
+      ip++;
+      continue;
+    }
+
+    // Extend match.
+    const uint8_t* mp = ip + kMinMatch;
+    const uint8_t* rp = ref + kMinMatch;
+    while ((mp < end) && (*mp == *rp)) {
+      mp++;
+      rp++;
+    }
+
+    if (!put_sequence(anchor, ip - anchor, ip - ref, mp - ip, op, oend)) {
+      return 0;
+    }
+
+    ip = mp;
+    anchor = ip;
+  }
+
+  // Last literals.
+  if (!put_sequence(anchor, end - anchor, 0, 0, op, oend)) {
+    return 0;
+  }
+
+  return op - reinterpret_cast<uint8_t*>(dest);
+}
+
+bool fs::decompress(const void* src,
+                    uint64_t len,
+                    void* dest,
+                    uint64_t destlen)
+{
+  const uint8_t* ip = reinterpret_cast<const uint8_t*>(src);
+  const uint8_t* iend = ip + len;
+
+  uint8_t* begin = reinterpret_cast<uint8_t*>(dest);
+  uint8_t* op = begin;
+  const uint8_t* oend = begin + destlen;
+
+  while (ip < iend) {
+    uint8_t token = *ip++;
+
+    // Literals.
+    uint64_t litlen = token >> 4;
+    if ((litlen == kTokenMask) && (!get_length(litlen, ip, iend))) {
+      return false;
+    }
+
+    if ((litlen > static_cast<uint64_t>(iend - ip)) ||
+        (litlen > static_cast<uint64_t>(oend - op))) {
+      return false;
+    }
+
+    memcpy(op, ip, litlen);
+    ip += litlen;
+    op += litlen;
+
+    // Last sequence?
+    if (ip == iend) {
+      break;
+    }
+
+    // Match.
+    if (iend - ip < 2) {
+      return false;
+    }
+
+    uint64_t distance = static_cast<uint64_t>(ip[0]) |
+                        (static_cast<uint64_t>(ip[1]) << 8);
+
+    ip += 2;
+
+    uint64_t matchlen = token & kTokenMask;
+    if ((matchlen == kTokenMask) && (!get_length(matchlen, ip, iend))) {
+      return false;
+    }
+
+    matchlen += kMinMatch;
+
+    if ((distance == 0) ||
+        (distance > static_cast<uint64_t>(op - begin)) ||
+        (matchlen > static_cast<uint64_t>(oend - op))) {
+      return false;
+    }
+
+    // The match might overlap the output: copy byte by byte.
+    const uint8_t* ref = op - distance;
+    for (uint64_t i = 0; i < matchlen; i++) {
+      op[i] = ref[i];
+    }
+
+    op += matchlen;
+  }
+
+  return (op == oend);
+}
+
+uint32_t hash(const uint8_t* p)
+{
+  uint32_t v;
+  memcpy(&v, p, sizeof(uint32_t));
+
+  return (v * 2654435761u) >> (32 - kHashBits);
+}
+
+bool put_length(uint64_t len, uint8_t*& op, const uint8_t* oend)
+{
+  for (; len >= 255; len -= 255) {
+    if (op == oend) {
+      return false;
+    }
+
+    *op++ = 255;
+  }
+
+  if (op == oend) {
+    return false;
+  }
+
+  *op++ = static_cast<uint8_t>(len);
+
+  return true;
+}
+
+bool get_length(uint64_t& len, const uint8_t*& ip, const uint8_t* iend)
+{
+  uint8_t c;
+  do {
+    if (ip == iend) {
+      return false;
+    }
+
+    c = *ip++;
+    len += c;
+  } while (c == 255);
+
+  return true;
+}
+
+bool put_sequence(const uint8_t* literals,
+                  uint64_t litlen,
+                  uint64_t distance,
+                  uint64_t matchlen,
+                  uint8_t*& op,
+                  const uint8_t* oend)
+{
+  if (op == oend) {
+    return false;
+  }
+
+  uint8_t* token = op++;
+
+  if (litlen >= kTokenMask) {
+    *token = kTokenMask << 4;
+
+    if (!put_length(litlen - kTokenMask, op, oend)) {
+      return false;
+    }
+  } else {
+    *token = litlen << 4;
+  }
+
+  if (litlen > static_cast<uint64_t>(oend - op)) {
+    return false;
+  }
+
+  memcpy(op, literals, litlen);
+  op += litlen;
+
+  if (matchlen == 0) {
+    return true;
+  }
+
+  if (oend - op < 2) {
+    return false;
+  }
+
+  *op++ = static_cast<uint8_t>(distance);
+  *op++ = static_cast<uint8_t>(distance >> 8);
+
+  matchlen -= kMinMatch;
+
+  if (matchlen >= kTokenMask) {
+    *token |= kTokenMask;
+    return put_length(matchlen - kTokenMask, op, oend);
+  }
+
+  *token |= matchlen;
+
+  return true;
+}
@@ -0,0 +1,28 @@
+#ifndef FS_COMPRESS_H
+#define FS_COMPRESS_H
+
+#include <stdint.h>
+
+namespace fs {
+  // LZ77 compression (byte oriented, sequences of literals followed by a
+  // match of at least 4 bytes at a distance of up to 64 KiB).
+
+  // Get the maximum length of the compressed data.
+  uint64_t compress_bound(uint64_t len);
+
+  // Compress 'len' bytes from 'src' into 'dest' (returns the length of the
+  // compressed data or 0 if it doesn't fit in 'destsize' bytes).
+  uint64_t compress(const void* src,
+                    uint64_t len,
+                    void* dest,
+                    uint64_t destsize);
+
+  // Decompress 'len' bytes from 'src' into 'dest' (the decompressed data
+  // must be exactly 'destlen' bytes long).
+  bool decompress(const void* src,
+                  uint64_t len,
+                  void* dest,
+                  uint64_t destlen);
+}
+
+#endif // FS_COMPRESS_H
@@ -3,19 +3,31 @@
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <time.h>
 #include "fs/file_change.h"
+#include "fs/compress.h"
+#include "fs/change_journal.h"
+
+// Tables of the hexadecimal encoding.
+struct hex_tables {
+  // Hexadecimal digits of each byte.
+  char digits[2 * 256];
+
+  // Value of each character (0xff if it is not a hexadecimal digit).
+  uint8_t values[256];
+
+  hex_tables();
+};
+
+static const hex_tables kHexTables;
 
 void fs::file_changes::clear()
 {
+  discard_merge();
+
   if (_M_changes) {
     for (size_t i = 0; i < _M_used; i++) {
-      if (_M_changes[i].olddata) {
-        free(_M_changes[i].olddata);
-      }
-
-      if (_M_changes[i].newdata) {
-        free(_M_changes[i].newdata);
-      }
+      free_change(_M_changes[i]);
     }
 
     free(_M_changes);
@@ -24,10 +36,28 @@ void fs::file_changes::clear()
 
   _M_size = 0;
   _M_used = 0;
+
+  _M_memory = 0;
+
+  _M_first_in_memory = 0;
+
+  _M_coalesce = false;
+
+  // Discard the records of the journal.
+  if (_M_journal_fd != -1) {
+    if (ftruncate(_M_journal_fd, 0) == 0) {
+      _M_journal_len = 0;
+    }
+  }
 }
 
 bool fs::file_changes::load(const char* filename)
 {
+  // If the file is a binary changes file...
+  if (change_journal::is_binary(filename)) {
+    return load_binary(filename);
+  }
+
   // If the file doesn't exist or is not a regular file...
   struct stat sbuf;
   if ((stat(filename, &sbuf) < 0) || (!S_ISREG(sbuf.st_mode))) {
@@ -58,301 +88,237 @@ bool fs::file_changes::load(const char* filename)
   }
 
   const uint8_t* begin = reinterpret_cast<const uint8_t*>(buf);
-  const uint8_t* end = begin + sbuf.st_size;
 
-  size_t nline = 0;
-  size_t nchanges = 0;
-
-  do {
-    nline++;
-
-    // Search end of line.
-    const uint8_t* eol;
-    if ((eol = reinterpret_cast<const uint8_t*>(
-                 memchr(begin, '\n', end - begin)
-               )) == NULL) {
-      munmap(buf, sbuf.st_size);
-      close(fd);
-
-      return false;
-    }
+  bool ret = load_text(begin, begin + sbuf.st_size);
 
-    // If the line is too short...
-    size_t linelen;
-    if ((linelen = eol - begin) < 20) {
-      munmap(buf, sbuf.st_size);
-      close(fd);
-
-      return false;
-    }
+  munmap(buf, sbuf.st_size);
+  close(fd);
 
-    // First line?
-    if (nline == 1) {
-      if (memcmp(begin, "Number of changes: ", 19) != 0) {
-        munmap(buf, sbuf.st_size);
-        close(fd);
+  return ret;
+}
 
-        return false;
-      }
+bool fs::file_changes::load_text(const uint8_t* begin, const uint8_t* end)
+{
+  // Search end of the first line.
+  const uint8_t* eol;
+  if (((eol = reinterpret_cast<const uint8_t*>(
+                memchr(begin, '\n', end - begin)
+              )) == NULL) ||
+      (eol - begin < 20) ||
+      (memcmp(begin, "Number of changes: ", 19) != 0)) {
+    return false;
+  }
 
-      // Parse number of changes.
-      begin += 19;
-      size_t l = 0;
-      while (begin < eol) {
-        if ((*begin >= '0') && (*begin <= '9')) {
-          uint64_t tmp;
-          if ((tmp = (nchanges * 10) + (*begin - '0')) < nchanges) {
-            munmap(buf, sbuf.st_size);
-            close(fd);
+  // Parse number of changes.
+  begin += 19;
 
-            return false;
-          }
+  uint64_t nchanges;
+  if ((!parse_number(begin, eol, '.', nchanges)) || (begin + 1 != eol)) {
+    return false;
+  }
 
-          nchanges = tmp;
-          l++;
-        } else if ((l > 0) && (*begin == '.') && (begin + 1 == eol)) {
-          break;
-        } else {
-          munmap(buf, sbuf.st_size);
-          close(fd);
+  begin = eol + 1;
 
-          return false;
-        }
+  // Buffer where the data of the changes is decoded.
+  uint8_t* data = NULL;
+  uint64_t size = 0;
 
-        begin++;
-      }
+  bool ret = true;
+  while ((ret) && (begin < end)) {
+    ret = load_change(begin, end, data, size);
+  }
 
-      begin = eol + 1;
-      continue;
-    }
+  if (data) {
+    free(data);
+  }
 
-    fs::file_change::type t;
+  return ((ret) && (nchanges == _M_used));
+}
 
-    // Get type of the file change.
-    size_t skip;
-    if (memcmp(begin, "Modify: ", 8) == 0) {
-      t = fs::file_change::type::kModify;
-      skip = 8;
-    } else if (memcmp(begin, "Add: ", 5) == 0) {
-      t = fs::file_change::type::kAdd;
-      skip = 5;
-    } else if (memcmp(begin, "Remove: ", 8) == 0) {
-      t = fs::file_change::type::kRemove;
-      skip = 8;
-    } else {
-      munmap(buf, sbuf.st_size);
-      close(fd);
+bool fs::file_changes::load_change(const uint8_t*& begin,
+                                   const uint8_t* end,
+                                   uint8_t*& data,
+                                   uint64_t& size)
+{
+  // Search end of line.
+  const uint8_t* eol;
+  if (((eol = reinterpret_cast<const uint8_t*>(
+                memchr(begin, '\n', end - begin)
+              )) == NULL) ||
+      (eol - begin < 20)) {
+    return false;
+  }
 
-      return false;
-    }
+  fs::file_change::type t;
 
-    begin += skip;
+  // Get type of the file change.
+  if (memcmp(begin, "Modify: ", 8) == 0) {
+    t = fs::file_change::type::kModify;
+    begin += 8;
+  } else if (memcmp(begin, "Add: ", 5) == 0) {
+    t = fs::file_change::type::kAdd;
+    begin += 5;
+  } else if (memcmp(begin, "Remove: ", 8) == 0) {
+    t = fs::file_change::type::kRemove;
+    begin += 8;
+  } else {
+    return false;
+  }
 
-    // Parse offset.
-    if (memcmp(begin, "offset: ", 8) != 0) {
-      munmap(buf, sbuf.st_size);
-      close(fd);
+  // Parse offset.
+  if ((eol - begin < 8) || (memcmp(begin, "offset: ", 8) != 0)) {
+    return false;
+  }
 
-      return false;
-    }
+  begin += 8;
 
-    begin += 8;
+  uint64_t off;
+  if (!parse_number(begin, eol, ',', off)) {
+    return false;
+  }
 
-    uint64_t off = 0;
-    size_t l = 0;
-    while (begin < eol) {
-      if ((*begin >= '0') && (*begin <= '9')) {
-        uint64_t tmp;
-        if ((tmp = (off * 10) + (*begin - '0')) < off) {
-          munmap(buf, sbuf.st_size);
-          close(fd);
+  // Parse length.
+  if ((eol - begin <= 10) || (memcmp(begin, ", length: ", 10) != 0)) {
+    return false;
+  }
 
-          return false;
-        }
+  begin += 10;
 
-        off = tmp;
-        l++;
-      } else if ((l > 0) && (*begin == ',')) {
-        break;
-      } else {
-        munmap(buf, sbuf.st_size);
-        close(fd);
+  uint64_t len;
+  if ((!parse_number(begin, eol, '.', len)) ||
+      (begin + 1 != eol) ||
+      (len == 0)) {
+    return false;
+  }
 
-        return false;
-      }
+  begin = eol + 1;
 
-      begin++;
-    }
+  if (t == file_change::type::kRemove) {
+    return remove(off, NULL, len);
+  }
 
-    // Parse length.
-    if ((begin + 10 >= eol) || (memcmp(begin, ", length: ", 10) != 0)) {
-      munmap(buf, sbuf.st_size);
-      close(fd);
+  // The data is on the next line.
+  if (((eol = reinterpret_cast<const uint8_t*>(
+                memchr(begin, '\n', end - begin)
+              )) == NULL) ||
+      (static_cast<uint64_t>(eol - begin) / 2 != len) ||
+      (static_cast<uint64_t>(eol - begin) % 2 != 0)) {
+    return false;
+  }
 
+  if (len > size) {
+    uint8_t* d;
+    if ((d = reinterpret_cast<uint8_t*>(realloc(data, len))) == NULL) {
       return false;
     }
 
-    begin += 10;
+    data = d;
+    size = len;
+  }
 
-    uint64_t len = 0;
-    l = 0;
-    while (begin < eol) {
-      if ((*begin >= '0') && (*begin <= '9')) {
-        uint64_t tmp;
-        if ((tmp = (len * 10) + (*begin - '0')) < len) {
-          munmap(buf, sbuf.st_size);
-          close(fd);
+  if ((!decode_hex(begin, len, data)) ||
+      (!register_change(t, off, NULL, data, len))) {
+    return false;
+  }
 
-          return false;
-        }
+  begin = eol + 1;
 
-        len = tmp;
-        l++;
-      } else if ((l > 0) &&
-                 (*begin == '.') &&
-                 (begin + 1 == eol) &&
-                 (len > 0)) {
-        break;
-      } else {
-        munmap(buf, sbuf.st_size);
-        close(fd);
+  return true;
+}
 
-        return false;
-      }
+bool fs::file_changes::parse_number(const uint8_t*& ptr,
+                                    const uint8_t* eol,
+                                    uint8_t terminator,
+                                    uint64_t& n)
+{
+  n = 0;
 
-      begin++;
+  const uint8_t* begin = ptr;
+  while ((ptr < eol) && (*ptr >= '0') && (*ptr <= '9')) {
+    uint64_t tmp;
+    if ((tmp = (n * 10) + (*ptr - '0')) < n) {
+      return false;
     }
 
-    begin = eol + 1;
-
-    if (t == file_change::type::kRemove) {
-      if (!remove(off, NULL, len)) {
-        munmap(buf, sbuf.st_size);
-        close(fd);
-
-        return false;
-      }
-    } else {
-      if ((eol = reinterpret_cast<const uint8_t*>(
-                   memchr(begin, '\n', end - begin)
-                 )) == NULL) {
-        munmap(buf, sbuf.st_size);
-        close(fd);
-
-        return false;
-      }
-
-      if ((linelen = eol - begin) != 2 * len) {
-        munmap(buf, sbuf.st_size);
-        close(fd);
-
-        return false;
-      }
-
-      uint8_t* line;
-      if ((line = reinterpret_cast<uint8_t*>(malloc(len))) == NULL) {
-        munmap(buf, sbuf.st_size);
-        close(fd);
-
-        return false;
-      }
-
-      l = 0;
-
-      for (size_t i = 0; i < linelen; i += 2) {
-        uint8_t c;
-        if ((begin[i] >= '0') && (begin[i] <= '9')) {
-          c = begin[i] - '0';
-        } else if ((begin[i] >= 'a') && (begin[i] <= 'f')) {
-          c = begin[i] - 'a' + 10;
-        } else if ((begin[i] >= 'A') && (begin[i] <= 'F')) {
-          c = begin[i] - 'A' + 10;
-        } else {
-          free(line);
-
-          munmap(buf, sbuf.st_size);
-          close(fd);
-
-          return false;
-        }
+    n = tmp;
+    ptr++;
+  }
 
-        if ((begin[i + 1] >= '0') && (begin[i + 1] <= '9')) {
-          c = (c * 16) + (begin[i + 1] - '0');
-        } else if ((begin[i + 1] >= 'a') && (begin[i + 1] <= 'f')) {
-          c = (c * 16) + (begin[i + 1] - 'a' + 10);
-        } else if ((begin[i + 1] >= 'A') && (begin[i + 1] <= 'F')) {
-          c = (c * 16) + (begin[i + 1] - 'A' + 10);
-        } else {
-          free(line);
+  // At least one digit followed by the terminator.
+  return ((ptr > begin) && (ptr < eol) && (*ptr == terminator));
+}
 
-          munmap(buf, sbuf.st_size);
-          close(fd);
+bool fs::file_changes::load_binary(const char* filename)
+{
+  change_journal journal;
+  if (!journal.open(filename)) {
+    return false;
+  }
 
-          return false;
-        }
+  change_journal::entry e;
+  while (journal.next(e)) {
+    if (!register_change(e.t, e.off, NULL, e.data, e.len)) {
+      return false;
+    }
+  }
 
-        line[l++] = c;
-      }
+  return ((journal.eof()) && (journal.size() == _M_used));
+}
 
-      if (!register_change(t, off, NULL, line, len)) {
-        free(line);
+bool fs::file_changes::save(const char* filename) const
+{
+  FILE* file;
+  if ((file = fopen(filename, "w+")) == NULL) {
+    return false;
+  }
 
-        munmap(buf, sbuf.st_size);
-        close(fd);
+  setvbuf(file, NULL, _IOFBF, kWriteBufferSize);
 
-        return false;
-      }
+  // The replacements and the batches are saved as one change per position
+  // (or two if the length changes).
+  size_t nchanges = 0;
+  for (size_t i = 0; i < _M_used; i++) {
+    nchanges += saved_changes(_M_changes[i]);
+  }
 
-      free(line);
+  fprintf(file, "Number of changes: %zu.\n", nchanges);
 
-      begin = eol + 1;
-    }
-  } while (begin < end);
+  if (!expand(write_text, file)) {
+    fclose(file);
+    return false;
+  }
 
-  munmap(buf, sbuf.st_size);
-  close(fd);
+  fclose(file);
 
-  return (nchanges == _M_used);
+  return true;
 }
 
-bool fs::file_changes::save(const char* filename) const
+bool fs::file_changes::save_binary(const char* filename) const
 {
   FILE* file;
-  if ((file = fopen(filename, "w+")) == NULL) {
+  if ((file = fopen(filename, "wb")) == NULL) {
     return false;
   }
 
-  fprintf(file, "Number of changes: %zu.\n", _M_used);
+  setvbuf(file, NULL, _IOFBF, kWriteBufferSize);
 
+  size_t nchanges = 0;
   for (size_t i = 0; i < _M_used; i++) {
-    switch (_M_changes[i].t) {
-      case file_change::type::kModify:
-        fprintf(file,
-                "Modify: offset: %llu, length: %llu.\n",
-                _M_changes[i].off,
-                _M_changes[i].len);
-
-        hexdump(file, _M_changes[i].newdata, _M_changes[i].len);
-        break;
-      case file_change::type::kAdd:
-        fprintf(file,
-                "Add: offset: %llu, length: %llu.\n",
-                _M_changes[i].off,
-                _M_changes[i].len);
+    nchanges += saved_changes(_M_changes[i]);
+  }
 
-        hexdump(file, _M_changes[i].newdata, _M_changes[i].len);
-        break;
-      case file_change::type::kRemove:
-        fprintf(file,
-                "Remove: offset: %llu, length: %llu.\n",
-                _M_changes[i].off,
-                _M_changes[i].len);
+  if ((!change_journal::write_header(file, nchanges)) ||
+      (!expand(write_binary, file))) {
+    fclose(file);
+    ::remove(filename);
 
-        break;
-    }
+    return false;
   }
 
-  fclose(file);
+  if (fclose(file) != 0) {
+    ::remove(filename);
+    return false;
+  }
 
   return true;
 }
@@ -360,6 +326,8 @@ bool fs::file_changes::save(const char* filename) const
 bool fs::file_changes::register_change(file_change::type type,
                                        uint64_t off,
                                        void* olddata,
+                                       file_piece* pieces,
+                                       size_t npieces,
                                        const void* newdata,
                                        uint64_t len)
 {
@@ -367,6 +335,16 @@ bool fs::file_changes::register_change(file_change::type type,
     return true;
   }
 
+  discard_merge();
+
+  uint64_t t = (_M_coalesce_max_len > 0) ? now() : 0;
+
+  // If the change can be merged into the last one...
+  if (coalesce(type, off, olddata, pieces, npieces, newdata, len, t)) {
+    _M_last_change_time = t;
+    return true;
+  }
+
   if (!allocate()) {
     return false;
   }
@@ -383,6 +361,8 @@ bool fs::file_changes::register_change(file_change::type type,
     chg->newdata = NULL;
   }
 
+  chg->referenced = false;
+
   chg->t = type;
 
   chg->off = off;
@@ -391,75 +371,1551 @@ bool fs::file_changes::register_change(file_change::type type,
 
   chg->len = len;
 
+  chg->pieces = pieces;
+  chg->npieces = npieces;
+
+  chg->newlen = len;
+
+  chg->positions = NULL;
+  chg->npositions = 0;
+
+  chg->journal_off = file_change::kNotInJournal;
+  chg->spilled = false;
+
+  chg->memory = change_memory(*chg);
+  _M_memory += chg->memory;
+
   _M_used++;
 
+  _M_coalesce = true;
+  _M_last_change_time = t;
+
   return true;
 }
 
-bool fs::file_changes::erase_last_change()
+bool fs::file_changes::register_reference(file_change::type type,
+                                          uint64_t off,
+                                          void* olddata,
+                                          file_piece* pieces,
+                                          size_t npieces,
+                                          const void* newdata,
+                                          uint64_t len)
 {
-  if (_M_used == 0) {
-    return false;
+  if (len == 0) {
+    return true;
   }
 
-  if (_M_changes[_M_used - 1].olddata) {
-    free(_M_changes[_M_used - 1].olddata);
-  }
+  discard_merge();
 
-  if (_M_changes[_M_used - 1].newdata) {
-    free(_M_changes[_M_used - 1].newdata);
+  if (!allocate()) {
+    return false;
   }
 
-  _M_used--;
+  struct file_change* chg = &_M_changes[_M_used];
+
+  chg->t = type;
+
+  chg->off = off;
+
+  chg->olddata = reinterpret_cast<uint8_t*>(olddata);
+  chg->newdata = reinterpret_cast<uint8_t*>(const_cast<void*>(newdata));
+  chg->referenced = true;
+
+  chg->len = len;
+
+  chg->pieces = pieces;
+  chg->npieces = npieces;
+
+  chg->newlen = len;
+
+  chg->positions = NULL;
+  chg->npositions = 0;
+
+  chg->journal_off = file_change::kNotInJournal;
+  chg->spilled = false;
+
+  chg->memory = change_memory(*chg);
+  _M_memory += chg->memory;
+
+  _M_used++;
+
+  // The next change is not merged into this one.
+  _M_coalesce = false;
 
   return true;
 }
 
-bool fs::file_changes::erase_from_position(size_t pos)
+bool fs::file_changes::replace(void* olddata,
+                               uint64_t len,
+                               const void* newdata,
+                               uint64_t newlen,
+                               uint64_t* positions,
+                               size_t npositions)
 {
-  if (pos >= _M_used) {
+  if (npositions == 0) {
+    return true;
+  }
+
+  discard_merge();
+
+  if (!allocate()) {
     return false;
   }
 
-  for (size_t i = pos; i < _M_used; i++) {
-    if (_M_changes[i].olddata) {
-      free(_M_changes[i].olddata);
-    }
+  struct file_change* chg = &_M_changes[_M_used];
 
-    if (_M_changes[i].newdata) {
-      free(_M_changes[i].newdata);
+  if (newlen > 0) {
+    if ((chg->newdata = reinterpret_cast<uint8_t*>(malloc(newlen))) == NULL) {
+      return false;
     }
+
+    memcpy(chg->newdata, newdata, newlen);
+  } else {
+    chg->newdata = NULL;
   }
 
-  _M_used = pos;
+  chg->referenced = false;
+
+  chg->t = file_change::type::kReplace;
+
+  chg->off = positions[0];
+
+  chg->olddata = reinterpret_cast<uint8_t*>(olddata);
+
+  chg->len = len;
+
+  chg->pieces = NULL;
+  chg->npieces = 0;
+
+  chg->newlen = newlen;
+
+  chg->positions = positions;
+  chg->npositions = npositions;
+
+  chg->journal_off = file_change::kNotInJournal;
+  chg->spilled = false;
+
+  chg->memory = change_memory(*chg);
+  _M_memory += chg->memory;
+
+  _M_used++;
+
+  _M_coalesce = false;
 
   return true;
 }
 
-bool fs::file_changes::allocate()
+bool fs::file_changes::batch(void* olddata,
+                             uint64_t len,
+                             file_piece* pieces,
+                             size_t npieces,
+                             void* newdata,
+                             uint64_t newlen,
+                             uint64_t* edits,
+                             size_t nedits)
 {
-  if (_M_used == _M_size) {
-    size_t size = (_M_size == 0) ? 32 : _M_size * 2;
+  if (nedits == 0) {
+    return true;
+  }
 
-    struct file_change* changes;
-    if ((changes = reinterpret_cast<struct file_change*>(
-                     realloc(_M_changes, size * sizeof(struct file_change))
-                   )) == NULL) {
-      return false;
-    }
+  discard_merge();
 
-    _M_changes = changes;
-    _M_size = size;
+  if (!allocate()) {
+    return false;
   }
 
+  struct file_change* chg = &_M_changes[_M_used];
+
+  chg->t = file_change::type::kBatch;
+
+  chg->off = edits[0];
+
+  chg->olddata = reinterpret_cast<uint8_t*>(olddata);
+  chg->newdata = reinterpret_cast<uint8_t*>(newdata);
+  chg->referenced = false;
+
+  chg->len = len;
+
+  chg->pieces = pieces;
+  chg->npieces = npieces;
+
+  chg->newlen = newlen;
+
+  chg->positions = edits;
+  chg->npositions = 3 * nedits;
+
+  chg->journal_off = file_change::kNotInJournal;
+  chg->spilled = false;
+
+  chg->memory = change_memory(*chg);
+  _M_memory += chg->memory;
+
+  _M_used++;
+
+  _M_coalesce = false;
+
   return true;
 }
 
-void fs::file_changes::hexdump(FILE* file, const uint8_t* data, uint64_t len)
+bool fs::file_changes::clone(uint64_t off,
+                             uint64_t len,
+                             uint64_t dst,
+                             bool move)
 {
-  for (uint64_t i = 0; i < len; i++, data++) {
-    fprintf(file, "%02x", *data);
+  if (len == 0) {
+    return true;
+  }
+
+  discard_merge();
+
+  if (!allocate()) {
+    return false;
   }
 
-  fprintf(file, "\n");
+  struct file_change* chg = &_M_changes[_M_used];
+
+  chg->t = move ? file_change::type::kMove : file_change::type::kCopy;
+
+  chg->off = off;
+
+  chg->olddata = NULL;
+  chg->newdata = NULL;
+  chg->referenced = false;
+
+  chg->len = len;
+
+  chg->pieces = NULL;
+  chg->npieces = 0;
+
+  chg->newlen = len;
+
+  chg->positions = NULL;
+  chg->npositions = 0;
+
+  chg->dst = dst;
+
+  chg->journal_off = file_change::kNotInJournal;
+  chg->spilled = false;
+
+  chg->memory = 0;
+
+  _M_used++;
+
+  _M_coalesce = false;
+
+  return true;
+}
+
+bool fs::file_changes::fill(uint64_t off,
+                            void* olddata,
+                            file_piece* pieces,
+                            size_t npieces,
+                            uint64_t len,
+                            const void* pattern,
+                            size_t patternlen,
+                            uint64_t filllen)
+{
+  if (filllen == 0) {
+    return true;
+  }
+
+  discard_merge();
+
+  if (!allocate()) {
+    return false;
+  }
+
+  struct file_change* chg = &_M_changes[_M_used];
+
+  if ((chg->newdata = reinterpret_cast<uint8_t*>(
+                        malloc(patternlen)
+                      )) == NULL) {
+    return false;
+  }
+
+  memcpy(chg->newdata, pattern, patternlen);
+
+  chg->referenced = false;
+
+  chg->t = file_change::type::kFill;
+
+  chg->off = off;
+
+  chg->olddata = reinterpret_cast<uint8_t*>(olddata);
+
+  chg->len = len;
+
+  chg->pieces = pieces;
+  chg->npieces = npieces;
+
+  chg->newlen = filllen;
+
+  chg->positions = NULL;
+  chg->npositions = 0;
+
+  chg->patternlen = patternlen;
+
+  chg->journal_off = file_change::kNotInJournal;
+  chg->spilled = false;
+
+  chg->memory = change_memory(*chg);
+  _M_memory += chg->memory;
+
+  _M_used++;
+
+  _M_coalesce = false;
+
+  return true;
+}
+
+bool fs::file_changes::materialize(const uint8_t* begin, const uint8_t* end)
+{
+  for (size_t i = 0; i < _M_used; i++) {
+    struct file_change* chg = &_M_changes[i];
+
+    for (size_t j = 0; j < chg->npieces; j++) {
+      struct file_piece* piece = &chg->pieces[j];
+
+      // If the piece doesn't reference the range (or it has been spilled to
+      // the journal)...
+      if ((piece->owned) ||
+          (!piece->data) ||
+          (piece->data >= end) ||
+          (piece->data + piece->len <= begin)) {
+        continue;
+      }
+
+      // Split the piece: [data, from) [from, to) [to, data + len).
+      const uint8_t* from = (piece->data > begin) ? piece->data : begin;
+      const uint8_t* to = (piece->data + piece->len < end) ?
+                                                           piece->data +
+                                                           piece->len :
+                                                           end;
+
+      size_t n = (from > piece->data) + 1 + (to < piece->data + piece->len);
+
+      uint8_t* data;
+      if ((data = reinterpret_cast<uint8_t*>(malloc(to - from))) == NULL) {
+        return false;
+      }
+
+      memcpy(data, from, to - from);
+
+      if (n > 1) {
+        struct file_piece* pieces;
+        if ((pieces = reinterpret_cast<struct file_piece*>(
+                        realloc(chg->pieces,
+                                (chg->npieces + n - 1) *
+                                sizeof(struct file_piece))
+                      )) == NULL) {
+          free(data);
+          return false;
+        }
+
+        chg->pieces = pieces;
+        piece = &pieces[j];
+
+        memmove(piece + n,
+                piece + 1,
+                (chg->npieces - j - 1) * sizeof(struct file_piece));
+
+        chg->npieces += (n - 1);
+      }
+
+      const uint8_t* pdata = piece->data;
+      uint64_t plen = piece->len;
+
+      if (from > pdata) {
+        piece->data = pdata;
+        piece->len = from - pdata;
+        piece->owned = false;
+
+        piece++;
+        j++;
+      }
+
+      piece->data = data;
+      piece->len = to - from;
+      piece->owned = true;
+
+      if (to < pdata + plen) {
+        piece++;
+        j++;
+
+        piece->data = to;
+        piece->len = (pdata + plen) - to;
+        piece->owned = false;
+      }
+
+      _M_memory += (to - from);
+      chg->memory += (to - from);
+    }
+  }
+
+  return true;
+}
+
+bool fs::file_changes::open_journal(const char* filename, bool compress)
+{
+  close_journal();
+
+  int fd;
+  if ((fd = open(filename, O_CREAT | O_TRUNC | O_RDWR, 0600)) < 0) {
+    return false;
+  }
+
+  // The journal is only used while the file changes exist.
+  unlink(filename);
+
+  _M_journal_fd = fd;
+  _M_journal_len = 0;
+  _M_compress = compress;
+
+  return true;
+}
+
+void fs::file_changes::close_journal()
+{
+  if (_M_journal_fd == -1) {
+    return;
+  }
+
+  // Read the spilled changes back (or drop them if they cannot be read).
+  for (size_t i = _M_used; i > 0; i--) {
+    if ((_M_changes[i - 1].spilled) && (!fetch(i - 1))) {
+      erase_first(i);
+      break;
+    }
+  }
+
+  close(_M_journal_fd);
+  _M_journal_fd = -1;
+
+  _M_journal_len = 0;
+}
+
+size_t fs::file_changes::trim()
+{
+  size_t dropped = 0;
+
+  // Too many changes?
+  if ((_M_max_changes > 0) && (_M_used > _M_max_changes)) {
+    dropped = _M_used - _M_max_changes;
+    erase_first(dropped);
+  }
+
+  if (_M_max_memory == 0) {
+    return dropped;
+  }
+
+  // Spill (or drop) the oldest changes, except the most recent one.
+  while ((_M_memory > _M_max_memory) && (_M_first_in_memory + 1 < _M_used)) {
+    if (_M_changes[_M_first_in_memory].spilled) {
+      _M_first_in_memory++;
+    } else if ((_M_journal_fd != -1) && (spill(_M_first_in_memory))) {
+      _M_first_in_memory++;
+    } else {
+      dropped += (_M_first_in_memory + 1);
+      erase_first(_M_first_in_memory + 1);
+    }
+  }
+
+  return dropped;
+}
+
+bool fs::file_changes::fetch(size_t pos)
+{
+  if (pos >= _M_used) {
+    return false;
+  }
+
+  struct file_change* chg = &_M_changes[pos];
+
+  // If the data is in memory...
+  if (!chg->spilled) {
+    return true;
+  }
+
+  uint8_t* olddata;
+  uint8_t* newdata;
+  uint64_t* positions;
+  if (!read_record(*chg, olddata, newdata, positions)) {
+    return false;
+  }
+
+  // The pieces which have been written to the journal point to the old
+  // data (the other ones reference a mapped file).
+  if (chg->pieces) {
+    uint64_t off = 0;
+    for (size_t i = 0; i < chg->npieces; i++) {
+      if (!chg->pieces[i].data) {
+        chg->pieces[i].data = olddata + off;
+        off += chg->pieces[i].len;
+      }
+    }
+  }
+
+  chg->olddata = olddata;
+  chg->newdata = newdata;
+  chg->positions = positions;
+
+  chg->spilled = false;
+
+  _M_memory -= chg->memory;
+  chg->memory = change_memory(*chg);
+  _M_memory += chg->memory;
+
+  if (_M_first_in_memory > pos) {
+    _M_first_in_memory = pos;
+  }
+
+  _M_coalesce = false;
+
+  return true;
+}
+
+bool fs::file_changes::erase_last_change()
+{
+  if (_M_used == 0) {
+    return false;
+  }
+
+  // If the last change has been merged into the previous one...
+  if (_M_merge.valid) {
+    struct file_change* chg = &_M_changes[_M_used - 1];
+
+    if (chg->olddata) {
+      free(chg->olddata);
+    }
+
+    // The owned pieces are shared with the backup.
+    if (chg->pieces) {
+      free(chg->pieces);
+    }
+
+    chg->off = _M_merge.off;
+    chg->len = _M_merge.len;
+    chg->newlen = _M_merge.len;
+    chg->olddata = _M_merge.olddata;
+    chg->pieces = _M_merge.pieces;
+    chg->npieces = _M_merge.npieces;
+
+    _M_memory -= chg->memory;
+    chg->memory = change_memory(*chg);
+    _M_memory += chg->memory;
+
+    _M_merge.valid = false;
+
+    _M_coalesce = false;
+
+    return true;
+  }
+
+  _M_memory -= _M_changes[_M_used - 1].memory;
+
+  free_change(_M_changes[_M_used - 1]);
+
+  _M_used--;
+
+  if (_M_first_in_memory > _M_used) {
+    _M_first_in_memory = _M_used;
+  }
+
+  _M_coalesce = false;
+
+  return true;
+}
+
+bool fs::file_changes::erase_from_position(size_t pos)
+{
+  if (pos >= _M_used) {
+    return false;
+  }
+
+  discard_merge();
+
+  for (size_t i = pos; i < _M_used; i++) {
+    _M_memory -= _M_changes[i].memory;
+
+    free_change(_M_changes[i]);
+  }
+
+  _M_used = pos;
+
+  if (_M_first_in_memory > _M_used) {
+    _M_first_in_memory = _M_used;
+  }
+
+  _M_coalesce = false;
+
+  return true;
+}
+
+bool fs::file_changes::allocate()
+{
+  if (_M_used == _M_size) {
+    size_t size = (_M_size == 0) ? 32 : _M_size * 2;
+
+    struct file_change* changes;
+    if ((changes = reinterpret_cast<struct file_change*>(
+                     realloc(_M_changes, size * sizeof(struct file_change))
+                   )) == NULL) {
+      return false;
+    }
+
+    _M_changes = changes;
+    _M_size = size;
+  }
+
+  return true;
+}
+
+bool fs::file_changes::read_record(const struct file_change& change,
+                                   uint8_t*& olddata,
+                                   uint8_t*& newdata,
+                                   uint64_t*& positions) const
+{
+  // Read record header.
+  struct journal_record rec;
+  if (pread(_M_journal_fd,
+            &rec,
+            sizeof(struct journal_record),
+            change.journal_off) != sizeof(struct journal_record)) {
+    return false;
+  }
+
+  uint8_t* raw;
+  if ((raw = reinterpret_cast<uint8_t*>(malloc(rec.rawlen))) == NULL) {
+    return false;
+  }
+
+  off_t off = change.journal_off + sizeof(struct journal_record);
+
+  if (rec.flags & journal_record::kCompressed) {
+    uint8_t* stored;
+    if ((stored = reinterpret_cast<uint8_t*>(malloc(rec.storedlen))) == NULL) {
+      free(raw);
+      return false;
+    }
+
+    if ((pread(_M_journal_fd,
+               stored,
+               rec.storedlen,
+               off) != static_cast<ssize_t>(rec.storedlen)) ||
+        (!decompress(stored, rec.storedlen, raw, rec.rawlen))) {
+      free(stored);
+      free(raw);
+
+      return false;
+    }
+
+    free(stored);
+  } else if (pread(_M_journal_fd,
+                   raw,
+                   rec.rawlen,
+                   off) != static_cast<ssize_t>(rec.rawlen)) {
+    free(raw);
+    return false;
+  }
+
+  // Split the data.
+  uint64_t oldlen, newlen;
+  data_lengths(change, oldlen, newlen);
+
+  // Only the pieces which don't reference a mapped file are in the journal.
+  if (change.pieces) {
+    oldlen = 0;
+    for (size_t i = 0; i < change.npieces; i++) {
+      if (!change.pieces[i].data) {
+        oldlen += change.pieces[i].len;
+      }
+    }
+  }
+
+  olddata = NULL;
+  newdata = NULL;
+  positions = NULL;
+
+  if (((oldlen > 0) &&
+       ((olddata = reinterpret_cast<uint8_t*>(malloc(oldlen))) == NULL)) ||
+      ((newlen > 0) &&
+       ((newdata = reinterpret_cast<uint8_t*>(malloc(newlen))) == NULL)) ||
+      ((change.npositions > 0) &&
+       ((positions = reinterpret_cast<uint64_t*>(
+                       malloc(change.npositions * sizeof(uint64_t))
+                     )) == NULL))) {
+    if (olddata) {
+      free(olddata);
+    }
+
+    if (newdata) {
+      free(newdata);
+    }
+
+    free(raw);
+
+    return false;
+  }
+
+  if (oldlen > 0) {
+    memcpy(olddata, raw, oldlen);
+  }
+
+  if (newlen > 0) {
+    memcpy(newdata, raw + oldlen, newlen);
+  }
+
+  if (change.npositions > 0) {
+    memcpy(positions,
+           raw + oldlen + newlen,
+           change.npositions * sizeof(uint64_t));
+  }
+
+  free(raw);
+
+  return true;
+}
+
+bool fs::file_changes::spill(size_t pos)
+{
+  struct file_change* chg = &_M_changes[pos];
+
+  // The changes which reference their new data are kept in memory.
+  if (chg->referenced) {
+    return true;
+  }
+
+  // If the change hasn't been written to the journal yet...
+  bool first = (chg->journal_off == file_change::kNotInJournal);
+  if (first) {
+    uint64_t oldlen, newlen;
+    data_lengths(*chg, oldlen, newlen);
+
+    // The pieces which reference a mapped file are not written.
+    if (chg->pieces) {
+      oldlen = 0;
+      for (size_t i = 0; i < chg->npieces; i++) {
+        if (journaled_piece(*chg, chg->pieces[i], true)) {
+          oldlen += chg->pieces[i].len;
+        }
+      }
+    }
+
+    // If there is no data in memory, the change is kept as it is.
+    if (oldlen + newlen + chg->npositions == 0) {
+      return true;
+    }
+
+    struct journal_record rec;
+    rec.type = static_cast<uint32_t>(chg->t);
+    rec.flags = 0;
+    rec.off = chg->off;
+    rec.len = chg->len;
+    rec.newlen = chg->newlen;
+    rec.npositions = chg->npositions;
+    rec.rawlen = oldlen + newlen + (chg->npositions * sizeof(uint64_t));
+    rec.storedlen = rec.rawlen;
+
+    uint8_t* raw;
+    if ((raw = reinterpret_cast<uint8_t*>(malloc(rec.rawlen))) == NULL) {
+      return false;
+    }
+
+    // Old data.
+    if (chg->pieces) {
+      uint8_t* ptr = raw;
+      for (size_t i = 0; i < chg->npieces; i++) {
+        if (journaled_piece(*chg, chg->pieces[i], true)) {
+          memcpy(ptr, chg->pieces[i].data, chg->pieces[i].len);
+          ptr += chg->pieces[i].len;
+        }
+      }
+    } else if (oldlen > 0) {
+      memcpy(raw, chg->olddata, oldlen);
+    }
+
+    if (newlen > 0) {
+      memcpy(raw + oldlen, chg->newdata, newlen);
+    }
+
+    if (chg->npositions > 0) {
+      memcpy(raw + oldlen + newlen,
+             chg->positions,
+             chg->npositions * sizeof(uint64_t));
+    }
+
+    const uint8_t* stored = raw;
+    uint8_t* compressed = NULL;
+
+    if ((_M_compress) && (rec.rawlen > 0)) {
+      uint64_t bound = compress_bound(rec.rawlen);
+      if ((compressed = reinterpret_cast<uint8_t*>(malloc(bound))) != NULL) {
+        uint64_t l = compress(raw, rec.rawlen, compressed, bound);
+
+        // Keep the compressed data only if it's smaller.
+        if ((l > 0) && (l < rec.rawlen)) {
+          rec.flags |= journal_record::kCompressed;
+          rec.storedlen = l;
+
+          stored = compressed;
+        }
+      }
+    }
+
+    off_t off = _M_journal_len;
+
+    bool res = (pwrite(_M_journal_fd,
+                       &rec,
+                       sizeof(struct journal_record),
+                       off) == sizeof(struct journal_record)) &&
+               (pwrite(_M_journal_fd,
+                       stored,
+                       rec.storedlen,
+                       off + sizeof(struct journal_record)) ==
+                static_cast<ssize_t>(rec.storedlen));
+
+    if (compressed) {
+      free(compressed);
+    }
+
+    free(raw);
+
+    if (!res) {
+      return false;
+    }
+
+    chg->journal_off = _M_journal_len;
+    _M_journal_len += sizeof(struct journal_record) + rec.storedlen;
+  }
+
+  // Free the data (the pieces which reference a mapped file are kept).
+  for (size_t i = 0; i < chg->npieces; i++) {
+    struct file_piece* piece = &chg->pieces[i];
+
+    if (journaled_piece(*chg, *piece, first)) {
+      if (piece->owned) {
+        free(const_cast<uint8_t*>(piece->data));
+      }
+
+      piece->data = NULL;
+      piece->owned = false;
+    }
+  }
+
+  if (chg->olddata) {
+    free(chg->olddata);
+    chg->olddata = NULL;
+  }
+
+  if (chg->newdata) {
+    free(chg->newdata);
+    chg->newdata = NULL;
+  }
+
+  if (chg->positions) {
+    free(chg->positions);
+    chg->positions = NULL;
+  }
+
+  chg->spilled = true;
+
+  _M_memory -= chg->memory;
+  chg->memory = change_memory(*chg);
+  _M_memory += chg->memory;
+
+  return true;
+}
+
+bool fs::file_changes::journaled_piece(const struct file_change& change,
+                                       const struct file_piece& piece,
+                                       bool first)
+{
+  if ((change.olddata) &&
+      (piece.data >= change.olddata) &&
+      (piece.data < change.olddata + change.len)) {
+    return true;
+  }
+
+  return ((first) && (piece.owned));
+}
+
+void fs::file_changes::erase_first(size_t n)
+{
+  if (n == _M_used) {
+    discard_merge();
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    _M_memory -= _M_changes[i].memory;
+
+    free_change(_M_changes[i]);
+  }
+
+  memmove(_M_changes, _M_changes + n, (_M_used - n) * sizeof(file_change));
+
+  _M_used -= n;
+
+  _M_first_in_memory = (_M_first_in_memory > n) ? _M_first_in_memory - n : 0;
+}
+
+void fs::file_changes::data_lengths(const struct file_change& change,
+                                    uint64_t& oldlen,
+                                    uint64_t& newlen)
+{
+  switch (change.t) {
+    case file_change::type::kModify:
+      oldlen = change.len;
+      newlen = change.len;
+      break;
+    case file_change::type::kAdd:
+      oldlen = 0;
+      newlen = change.len;
+      break;
+    case file_change::type::kRemove:
+      oldlen = change.len;
+      newlen = 0;
+      break;
+    case file_change::type::kCopy:
+    case file_change::type::kMove:
+      // The data is not recorded.
+      oldlen = 0;
+      newlen = 0;
+      break;
+    case file_change::type::kFill:
+      // Only the pattern of the new data is recorded.
+      oldlen = change.len;
+      newlen = change.patternlen;
+      break;
+    default:
+      oldlen = change.len;
+      newlen = change.newlen;
+  }
+}
+
+bool fs::file_changes::coalesce(file_change::type type,
+                                uint64_t off,
+                                void* olddata,
+                                file_piece* pieces,
+                                size_t npieces,
+                                const void* newdata,
+                                uint64_t len,
+                                uint64_t now)
+{
+  if ((_M_coalesce_max_len == 0) || (!_M_coalesce) || (_M_used == 0)) {
+    return false;
+  }
+
+  struct file_change* prev = &_M_changes[_M_used - 1];
+
+  if ((prev->t != type) ||
+      (prev->spilled) ||
+      (prev->referenced) ||
+      (prev->journal_off != file_change::kNotInJournal) ||
+      (prev->len + len > _M_coalesce_max_len) ||
+      ((_M_coalesce_window > 0) &&
+       (now - _M_last_change_time > _M_coalesce_window))) {
+    return false;
+  }
+
+  // Does the change go after the previous change?
+  bool append;
+
+  switch (type) {
+    case file_change::type::kModify:
+    case file_change::type::kAdd:
+      if (off != prev->off + prev->len) {
+        return false;
+      }
+
+      append = true;
+      break;
+    case file_change::type::kRemove:
+      if (off == prev->off) {
+        // Delete.
+        append = true;
+      } else if (off + len == prev->off) {
+        // Backspace.
+        append = false;
+      } else {
+        return false;
+      }
+
+      break;
+    default:
+      return false;
+  }
+
+  merge_backup backup;
+  backup.off = prev->off;
+  backup.len = prev->len;
+  backup.olddata = prev->olddata;
+  backup.pieces = prev->pieces;
+  backup.npieces = prev->npieces;
+
+  // New data.
+  if (type != file_change::type::kRemove) {
+    uint8_t* data;
+    if ((data = reinterpret_cast<uint8_t*>(
+                  realloc(prev->newdata, prev->len + len)
+                )) == NULL) {
+      return false;
+    }
+
+    prev->newdata = data;
+
+    memcpy(data + prev->len, newdata, len);
+  }
+
+  // Old data.
+  if ((type != file_change::type::kAdd) &&
+      (!merge_old_data(*prev, olddata, pieces, npieces, len, append))) {
+    return false;
+  }
+
+  if (!append) {
+    prev->off = off;
+  }
+
+  prev->len += len;
+  prev->newlen = prev->len;
+
+  // The old buffers of the previous change are kept in the backup.
+  backup.valid = true;
+  _M_merge = backup;
+
+  _M_memory -= prev->memory;
+  prev->memory = change_memory(*prev);
+  _M_memory += prev->memory;
+
+  return true;
+}
+
+bool fs::file_changes::merge_old_data(struct file_change& change,
+                                      void* olddata,
+                                      file_piece* pieces,
+                                      size_t npieces,
+                                      uint64_t len,
+                                      bool append)
+{
+  // If the old data of both changes is in memory...
+  if ((!change.pieces) && (!pieces)) {
+    uint8_t* data;
+    if ((data = reinterpret_cast<uint8_t*>(
+                  malloc(change.len + len)
+                )) == NULL) {
+      return false;
+    }
+
+    if (append) {
+      memcpy(data, change.olddata, change.len);
+      memcpy(data + change.len, olddata, len);
+    } else {
+      memcpy(data, olddata, len);
+      memcpy(data + len, change.olddata, change.len);
+    }
+
+    change.olddata = data;
+
+    free(olddata);
+
+    return true;
+  }
+
+  // A change without pieces is a single piece.
+  file_piece piece1, piece2;
+  const file_piece* p1;
+  size_t n1;
+  const file_piece* p2;
+  size_t n2;
+
+  if (change.pieces) {
+    p1 = change.pieces;
+    n1 = change.npieces;
+  } else {
+    piece1.data = change.olddata;
+    piece1.len = change.len;
+    piece1.owned = false;
+
+    p1 = &piece1;
+    n1 = 1;
+  }
+
+  if (pieces) {
+    p2 = pieces;
+    n2 = npieces;
+  } else {
+    piece2.data = reinterpret_cast<uint8_t*>(olddata);
+    piece2.len = len;
+    piece2.owned = false;
+
+    p2 = &piece2;
+    n2 = 1;
+  }
+
+  // The data in memory of both changes is copied to a single buffer.
+  uint64_t len1 = change.pieces ? old_data_in_memory(change) :
+                                  change.len;
+
+  uint64_t len2 = 0;
+  if (pieces) {
+    for (size_t i = 0; i < npieces; i++) {
+      if ((!pieces[i].owned) &&
+          (olddata) &&
+          (pieces[i].data >= reinterpret_cast<uint8_t*>(olddata)) &&
+          (pieces[i].data < reinterpret_cast<uint8_t*>(olddata) + len)) {
+        len2 += pieces[i].len;
+      }
+    }
+  } else {
+    len2 = len;
+  }
+
+  uint8_t* data = NULL;
+  if ((len1 + len2 > 0) &&
+      ((data = reinterpret_cast<uint8_t*>(malloc(len1 + len2))) == NULL)) {
+    return false;
+  }
+
+  file_piece* merged;
+  if ((merged = reinterpret_cast<file_piece*>(
+                  malloc((n1 + n2) * sizeof(file_piece))
+                )) == NULL) {
+    if (data) {
+      free(data);
+    }
+
+    return false;
+  }
+
+  if (len1 > 0) {
+    memcpy(data, change.olddata, len1);
+  }
+
+  if (len2 > 0) {
+    memcpy(data + len1, olddata, len2);
+  }
+
+  // Rebase the pieces which point to the old buffers.
+  size_t n = 0;
+  for (size_t k = 0; k < 2; k++) {
+    // Pieces of the previous change?
+    bool prev = ((k == 0) == append);
+
+    const file_piece* p = prev ? p1 : p2;
+    size_t count = prev ? n1 : n2;
+    const uint8_t* buf = prev ? change.olddata :
+                                reinterpret_cast<uint8_t*>(olddata);
+    uint64_t buflen = prev ? len1 : len2;
+    uint8_t* dest = prev ? data : data + len1;
+
+    for (size_t i = 0; i < count; i++) {
+      file_piece piece = p[i];
+
+      if ((!piece.owned) &&
+          (buf) &&
+          (piece.data >= buf) &&
+          (piece.data < buf + buflen)) {
+        piece.data = dest + (piece.data - buf);
+      }
+
+      // If the piece follows the previous piece...
+      if ((n > 0) &&
+          (!piece.owned) &&
+          (!merged[n - 1].owned) &&
+          (merged[n - 1].data + merged[n - 1].len == piece.data)) {
+        merged[n - 1].len += piece.len;
+      } else {
+        merged[n++] = piece;
+      }
+    }
+  }
+
+  // The old buffers of 'change' are not freed (they are kept in the
+  // backup of the merge).
+  if (olddata) {
+    free(olddata);
+  }
+
+  if (pieces) {
+    free(pieces);
+  }
+
+  change.olddata = data;
+  change.pieces = merged;
+  change.npieces = n;
+
+  return true;
+}
+
+void fs::file_changes::discard_merge()
+{
+  if (!_M_merge.valid) {
+    return;
+  }
+
+  if (_M_merge.olddata) {
+    free(_M_merge.olddata);
+  }
+
+  // The owned pieces are shared with the merged change.
+  if (_M_merge.pieces) {
+    free(_M_merge.pieces);
+  }
+
+  _M_merge.valid = false;
+}
+
+uint64_t fs::file_changes::old_data_in_memory(const struct file_change& change)
+{
+  if (!change.olddata) {
+    return 0;
+  }
+
+  if (!change.pieces) {
+    return change.len;
+  }
+
+  // The pieces in memory which aren't owned point to 'olddata'.
+  uint64_t len = 0;
+  for (size_t i = 0; i < change.npieces; i++) {
+    const struct file_piece* piece = &change.pieces[i];
+
+    if ((!piece->owned) &&
+        (piece->data >= change.olddata) &&
+        (piece->data < change.olddata + change.len)) {
+      len += piece->len;
+    }
+  }
+
+  return len;
+}
+
+uint64_t fs::file_changes::now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (static_cast<uint64_t>(ts.tv_sec) * 1000) + (ts.tv_nsec / 1000000);
+}
+
+uint64_t fs::file_changes::change_memory(const struct file_change& change)
+{
+  uint64_t memory = old_data_in_memory(change);
+
+  if ((change.newdata) && (!change.referenced)) {
+    uint64_t oldlen, newlen;
+    data_lengths(change, oldlen, newlen);
+
+    memory += newlen;
+  }
+
+  if (change.pieces) {
+    for (size_t i = 0; i < change.npieces; i++) {
+      if (change.pieces[i].owned) {
+        memory += change.pieces[i].len;
+      }
+    }
+
+    memory += change.npieces * sizeof(struct file_piece);
+  }
+
+  memory += change.npositions * sizeof(uint64_t);
+
+  return memory;
+}
+
+bool fs::file_changes::expand(change_callback fn, void* arg) const
+{
+  for (size_t i = 0; i < _M_used; i++) {
+    const struct file_change* chg = &_M_changes[i];
+
+    // If the data has been spilled to the journal...
+    struct file_change spilled;
+    if (chg->spilled) {
+      spilled = *chg;
+
+      // The old data is not needed (the pieces belong to the change).
+      spilled.pieces = NULL;
+      spilled.npieces = 0;
+
+      if (!read_record(*chg,
+                       spilled.olddata,
+                       spilled.newdata,
+                       spilled.positions)) {
+        return false;
+      }
+
+      chg = &spilled;
+    }
+
+    bool ret = expand(*chg, fn, arg);
+
+    if (chg == &spilled) {
+      free_change(spilled);
+    }
+
+    if (!ret) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool fs::file_changes::expand(const file_change& change,
+                              change_callback fn,
+                              void* arg)
+{
+  switch (change.t) {
+    case file_change::type::kModify:
+    case file_change::type::kAdd:
+    case file_change::type::kRemove:
+      return fn(change.t, change.off, change.newdata, change.len, arg);
+    case file_change::type::kCopy:
+    case file_change::type::kMove:
+      // The data of the copies / moves is not recorded.
+      return false;
+    case file_change::type::kFill:
+      {
+        uint8_t* data;
+        if ((data = reinterpret_cast<uint8_t*>(malloc(change.newlen))) ==
+            NULL) {
+          return false;
+        }
+
+        for (uint64_t off = 0; off < change.newlen; off += change.patternlen) {
+          uint64_t left = change.newlen - off;
+
+          memcpy(data + off,
+                 change.newdata,
+                 (left < change.patternlen) ? left : change.patternlen);
+        }
+
+        bool ret = expand_edit(change.off,
+                               change.len,
+                               data,
+                               change.newlen,
+                               fn,
+                               arg);
+
+        free(data);
+
+        return ret;
+      }
+    case file_change::type::kReplace:
+      for (size_t i = 0; i < change.npositions; i++) {
+        // Offset once the previous positions have been replaced.
+        uint64_t off = change.positions[i] +
+                       (i * (change.newlen - change.len));
+
+        if (!expand_edit(off,
+                         change.len,
+                         change.newdata,
+                         change.newlen,
+                         fn,
+                         arg)) {
+          return false;
+        }
+      }
+
+      return true;
+    default: // file_change::type::kBatch.
+      {
+        const uint8_t* data = change.newdata;
+        uint64_t shift = 0;
+
+        for (size_t i = 0; i < change.npositions; i += 3) {
+          // Offset once the previous edits have been performed.
+          uint64_t off = change.positions[i] + shift;
+          uint64_t len = change.positions[i + 1];
+          uint64_t newlen = change.positions[i + 2];
+
+          if (!expand_edit(off, len, data, newlen, fn, arg)) {
+            return false;
+          }
+
+          data += newlen;
+          shift += (newlen - len);
+        }
+      }
+
+      return true;
+  }
+}
+
+bool fs::file_changes::expand_edit(uint64_t off,
+                                   uint64_t len,
+                                   const uint8_t* data,
+                                   uint64_t datalen,
+                                   change_callback fn,
+                                   void* arg)
+{
+  if (len == datalen) {
+    return fn(file_change::type::kModify, off, data, len, arg);
+  }
+
+  return (((len == 0) ||
+           (fn(file_change::type::kRemove, off, NULL, len, arg))) &&
+          ((datalen == 0) ||
+           (fn(file_change::type::kAdd, off, data, datalen, arg))));
+}
+
+bool fs::file_changes::write_text(file_change::type t,
+                                  uint64_t off,
+                                  const uint8_t* data,
+                                  uint64_t len,
+                                  void* arg)
+{
+  FILE* file = reinterpret_cast<FILE*>(arg);
+
+  switch (t) {
+    case file_change::type::kModify:
+      fprintf(file, "Modify: offset: %llu, length: %llu.\n", off, len);
+      hexdump(file, data, len);
+
+      break;
+    case file_change::type::kAdd:
+      fprintf(file, "Add: offset: %llu, length: %llu.\n", off, len);
+      hexdump(file, data, len);
+
+      break;
+    default:
+      fprintf(file, "Remove: offset: %llu, length: %llu.\n", off, len);
+  }
+
+  return true;
+}
+
+bool fs::file_changes::write_binary(file_change::type t,
+                                    uint64_t off,
+                                    const uint8_t* data,
+                                    uint64_t len,
+                                    void* arg)
+{
+  return change_journal::write_change(reinterpret_cast<FILE*>(arg),
+                                      t,
+                                      off,
+                                      data,
+                                      len);
+}
+
+size_t fs::file_changes::saved_changes(const file_change& change)
+{
+  switch (change.t) {
+    case file_change::type::kFill:
+      if (change.len == change.newlen) {
+        return 1;
+      }
+
+      return (change.len > 0) + (change.newlen > 0);
+    case file_change::type::kReplace:
+      if (change.len == change.newlen) {
+        return change.npositions;
+      }
+
+      return ((change.len > 0) + (change.newlen > 0)) * change.npositions;
+    case file_change::type::kBatch:
+      {
+        size_t n = 0;
+        for (size_t i = 0; i < change.npositions; i += 3) {
+          if (change.positions[i + 1] == change.positions[i + 2]) {
+            n++;
+          } else {
+            n += ((change.positions[i + 1] > 0) +
+                  (change.positions[i + 2] > 0));
+          }
+        }
+
+        return n;
+      }
+    default:
+      return 1;
+  }
+}
+
+void fs::file_changes::free_change(struct file_change& change)
+{
+  if (change.olddata) {
+    free(change.olddata);
+  }
+
+  if ((change.newdata) && (!change.referenced)) {
+    free(change.newdata);
+  }
+
+  if (change.pieces) {
+    for (size_t i = 0; i < change.npieces; i++) {
+      if (change.pieces[i].owned) {
+        free(const_cast<uint8_t*>(change.pieces[i].data));
+      }
+    }
+
+    free(change.pieces);
+  }
+
+  if (change.positions) {
+    free(change.positions);
+  }
+}
+
+void fs::file_changes::hexdump(FILE* file, const uint8_t* data, uint64_t len)
+{
+  static const uint64_t kBufferSize = 64 * 1024;
+
+  char buf[kBufferSize];
+
+  while (len > 0) {
+    uint64_t n = (len < kBufferSize / 2) ? len : kBufferSize / 2;
+
+    for (uint64_t i = 0; i < n; i++) {
+      memcpy(buf + (2 * i), kHexTables.digits + (2 * data[i]), 2);
+    }
+
+    fwrite(buf, 1, 2 * n, file);
+
+    data += n;
+    len -= n;
+  }
+
+  fputc('\n', file);
+}
+
+bool fs::file_changes::decode_hex(const uint8_t* src,
+                                  uint64_t len,
+                                  uint8_t* dest)
+{
+  // The invalid characters have the high bits set: they are checked once
+  // all the data has been decoded.
+  uint8_t invalid = 0;
+
+  for (uint64_t i = 0; i < len; i++, src += 2) {
+    uint8_t hi = kHexTables.values[src[0]];
+    uint8_t lo = kHexTables.values[src[1]];
+
+    invalid |= (hi | lo);
+
+    dest[i] = (hi << 4) | lo;
+  }
+
+  return ((invalid & 0xf0) == 0);
+}
+
+hex_tables::hex_tables()
+{
+  static const char kDigits[] = "0123456789abcdef";
+
+  for (unsigned i = 0; i < 256; i++) {
+    digits[2 * i] = kDigits[i >> 4];
+    digits[(2 * i) + 1] = kDigits[i & 0x0f];
+
+    if ((i >= '0') && (i <= '9')) {
+      values[i] = i - '0';
+    } else if ((i >= 'a') && (i <= 'f')) {
+      values[i] = i - 'a' + 10;
+    } else if ((i >= 'A') && (i <= 'F')) {
+      values[i] = i - 'A' + 10;
+    } else {
+      values[i] = 0xff;
+    }
+  }
 }
@@ -6,11 +6,26 @@
 #include <stdio.h>
 
 namespace fs {
+  // Piece of data: either a copy in memory or a reference to the data of a
+  // file which is mapped into memory.
+  struct file_piece {
+    const uint8_t* data;
+    uint64_t len;
+
+    // Has the data been allocated by the piece?
+    bool owned;
+  };
+
   struct file_change {
     enum class type {
       kModify,
       kAdd,
-      kRemove
+      kRemove,
+      kReplace,
+      kBatch,
+      kCopy,
+      kMove,
+      kFill
     };
 
     type t;
@@ -20,7 +35,52 @@ namespace fs {
     uint8_t* olddata;
     uint8_t* newdata;
 
+    // kModify / kAdd: does 'newdata' reference the data of a mapped file
+    // (not owned by the change)?
+    bool referenced;
+
     uint64_t len;
+
+    // kModify / kRemove / kBatch / kFill: if not NULL, the old data is made
+    // of pieces (the pieces in memory point to 'olddata'). When the change
+    // is spilled, the pieces which reference a mapped file are kept and the
+    // other ones are written to the journal ('data' is set to NULL).
+    file_piece* pieces;
+    size_t npieces;
+
+    // kReplace: 'olddata' ('len' bytes) has been replaced with 'newdata'
+    // ('newlen' bytes) at each of the 'positions' (sorted offsets before
+    // the change).
+    //
+    // kBatch: 'positions' holds the offset (before the change), the length
+    // and the new length of each edit (sorted by offset), 'olddata' ('len'
+    // bytes) and 'newdata' ('newlen' bytes) the data of the edits.
+    uint64_t newlen;
+
+    uint64_t* positions;
+    size_t npositions;
+
+    // kCopy / kMove: [off, off + len) has been copied / moved to 'dst'
+    // (offset before the change). The data is not recorded: it is in the
+    // file whenever the change is undone or redone.
+    uint64_t dst;
+
+    // kFill: 'olddata' ('len' bytes) has been replaced with 'newlen' bytes
+    // of the pattern 'newdata' ('patternlen' bytes) repeated from 'off'.
+    // Only the pattern is recorded.
+    size_t patternlen;
+
+    // Offset of the change in the journal (kNotInJournal if the change
+    // hasn't been written to the journal).
+    static const uint64_t kNotInJournal = UINT64_MAX;
+
+    uint64_t journal_off;
+
+    // Has the data been spilled to the journal (and freed)?
+    bool spilled;
+
+    // Memory used by the data of the change.
+    uint64_t memory;
   };
 
   class file_changes {
@@ -34,23 +94,84 @@ namespace fs {
       // Clear.
       void clear();
 
-      // Load.
+      // Load (text or binary format).
       bool load(const char* filename);
 
-      // Save.
+      // Save (text format: a line per change, followed by the hexadecimal
+      // dump of the data).
       bool save(const char* filename) const;
 
+      // Save in binary format (see change_journal).
+      bool save_binary(const char* filename) const;
+
       // Modify.
       bool modify(uint64_t off,
                   void* olddata,
                   const void* newdata,
                   uint64_t len);
 
+      bool modify(uint64_t off,
+                  void* olddata,
+                  file_piece* pieces,
+                  size_t npieces,
+                  const void* newdata,
+                  uint64_t len);
+
       // Add.
       bool add(uint64_t off, const void* newdata, uint64_t len);
 
+      // Modify / add with new data which is referenced, not copied (the
+      // data of a mapped file which outlives the history). The change is
+      // neither merged with other changes nor spilled to the journal.
+      bool modify_reference(uint64_t off,
+                            void* olddata,
+                            file_piece* pieces,
+                            size_t npieces,
+                            const void* newdata,
+                            uint64_t len);
+
+      bool add_reference(uint64_t off, const void* newdata, uint64_t len);
+
       // Remove.
       bool remove(uint64_t off, void* olddata, uint64_t len);
+      bool remove(uint64_t off,
+                  void* olddata,
+                  file_piece* pieces,
+                  size_t npieces,
+                  uint64_t len);
+
+      // Replace ('olddata' and 'positions' are not copied).
+      bool replace(void* olddata,
+                   uint64_t len,
+                   const void* newdata,
+                   uint64_t newlen,
+                   uint64_t* positions,
+                   size_t npositions);
+
+      // Copy / move [off, off + len) to 'dst'.
+      bool clone(uint64_t off, uint64_t len, uint64_t dst, bool move);
+
+      // Fill: [off, off + len) has been replaced with 'filllen' bytes of
+      // 'pattern' ('olddata' and 'pieces' are not copied, the pattern is).
+      bool fill(uint64_t off,
+                void* olddata,
+                file_piece* pieces,
+                size_t npieces,
+                uint64_t len,
+                const void* pattern,
+                size_t patternlen,
+                uint64_t filllen);
+
+      // Batch of 'nedits' edits ('olddata', 'pieces', 'newdata' and 'edits'
+      // are not copied, 'edits' holds 3 values per edit).
+      bool batch(void* olddata,
+                 uint64_t len,
+                 file_piece* pieces,
+                 size_t npieces,
+                 void* newdata,
+                 uint64_t newlen,
+                 uint64_t* edits,
+                 size_t nedits);
 
       // Register change.
       bool register_change(const file_change& change);
@@ -59,8 +180,55 @@ namespace fs {
                            void* olddata,
                            const void* newdata,
                            uint64_t len);
+      bool register_change(file_change::type type,
+                           uint64_t off,
+                           void* olddata,
+                           file_piece* pieces,
+                           size_t npieces,
+                           const void* newdata,
+                           uint64_t len);
+
+      // Copy the data of the pieces which reference [begin, end) (the data
+      // is about to be overwritten).
+      bool materialize(const uint8_t* begin, const uint8_t* end);
+
+      // Set the limits of the history (0: no limit). When the history
+      // exceeds 'max_memory' bytes, the oldest changes are spilled to the
+      // journal (if there is one) or dropped; when there are more than
+      // 'max_changes' changes, the oldest changes are dropped. The most
+      // recent change is always kept in memory.
+      void set_limits(uint64_t max_memory, size_t max_changes);
+
+      // Open the journal where the oldest changes are spilled ('compress':
+      // compress the spilled changes). The file is unlinked once opened.
+      bool open_journal(const char* filename, bool compress);
+
+      // Close the journal.
+      void close_journal();
+
+      // Merge the changes which are adjacent to the previous change of the
+      // same type (contiguous modifications, additions after the previous
+      // addition, removals before or at the previous removal) while the
+      // merged change is not longer than 'max_len' bytes and the changes
+      // are less than 'window' milliseconds apart ('max_len' 0: disabled,
+      // 'window' 0: no time limit).
+      void set_coalescing(uint64_t max_len, unsigned window);
+
+      // Don't merge the next change into the last one.
+      void seal();
+
+      // Enforce the limits (returns the number of changes which have been
+      // dropped from the beginning of the history).
+      size_t trim();
 
-      // Erase last change.
+      // Read the data of a spilled change back into memory.
+      bool fetch(size_t pos);
+
+      // Get memory used by the data of the changes.
+      uint64_t memory_used() const;
+
+      // Erase last change (if the last change has been merged into the
+      // previous one, only the merge is undone).
       bool erase_last_change();
 
       // Erase from position.
@@ -73,13 +241,206 @@ namespace fs {
       const struct file_change* get(size_t pos) const;
 
     private:
+      // Journal record header (followed by the old data, the new data and
+      // the positions, possibly compressed).
+      struct journal_record {
+        static const uint32_t kCompressed = 1;
+
+        uint32_t type;
+        uint32_t flags;
+        uint64_t off;
+        uint64_t len;
+        uint64_t newlen;
+        uint64_t npositions;
+
+        // Length of the data before and after compression.
+        uint64_t rawlen;
+        uint64_t storedlen;
+      };
+
       file_change* _M_changes;
       size_t _M_size;
       size_t _M_used;
 
+      // Memory used by the data of the changes.
+      uint64_t _M_memory;
+
+      // Limits (0: no limit).
+      uint64_t _M_max_memory;
+      size_t _M_max_changes;
+
+      // Journal.
+      int _M_journal_fd;
+      uint64_t _M_journal_len;
+      bool _M_compress;
+
+      // First change which might not have been spilled.
+      size_t _M_first_in_memory;
+
+      // Coalescing.
+      uint64_t _M_coalesce_max_len;
+      unsigned _M_coalesce_window;
+
+      // Can the next change be merged into the last one?
+      bool _M_coalesce;
+
+      // Time of the last change (milliseconds).
+      uint64_t _M_last_change_time;
+
+      // State of the last change before the last merge (kept until the next
+      // change, so that the merge can be undone).
+      struct merge_backup {
+        bool valid;
+
+        uint64_t off;
+        uint64_t len;
+
+        uint8_t* olddata;
+
+        file_piece* pieces;
+        size_t npieces;
+      };
+
+      merge_backup _M_merge;
+
+      // Discard the state before the last merge.
+      void discard_merge();
+
+      // Register change whose new data is referenced.
+      bool register_reference(file_change::type type,
+                              uint64_t off,
+                              void* olddata,
+                              file_piece* pieces,
+                              size_t npieces,
+                              const void* newdata,
+                              uint64_t len);
+
+      // Merge change into the last one.
+      bool coalesce(file_change::type type,
+                    uint64_t off,
+                    void* olddata,
+                    file_piece* pieces,
+                    size_t npieces,
+                    const void* newdata,
+                    uint64_t len,
+                    uint64_t now);
+
+      // Merge old data into the old data of 'change' ('append': the old
+      // data goes after the old data of 'change').
+      static bool merge_old_data(struct file_change& change,
+                                 void* olddata,
+                                 file_piece* pieces,
+                                 size_t npieces,
+                                 uint64_t len,
+                                 bool append);
+
+      // Get number of bytes of 'olddata' used by a change.
+      static uint64_t old_data_in_memory(const struct file_change& change);
+
+      // Get current time (milliseconds).
+      static uint64_t now();
+
+      // Read the data of a change from the journal.
+      bool read_record(const struct file_change& change,
+                       uint8_t*& olddata,
+                       uint8_t*& newdata,
+                       uint64_t*& positions) const;
+
+      // Spill change to the journal.
+      bool spill(size_t pos);
+
+      // Is the piece written to the journal when the change is spilled
+      // ('first': the change is written for the first time, otherwise the
+      // pieces which have been read back point to 'olddata')?
+      static bool journaled_piece(const struct file_change& change,
+                                  const struct file_piece& piece,
+                                  bool first);
+
+      // Erase the first 'n' changes.
+      void erase_first(size_t n);
+
+      // Get lengths of the old and the new data of a change.
+      static void data_lengths(const struct file_change& change,
+                               uint64_t& oldlen,
+                               uint64_t& newlen);
+
+      // Get memory used by the data of a change.
+      static uint64_t change_memory(const struct file_change& change);
+
       // Allocate.
       bool allocate();
 
+      // Free change.
+      static void free_change(struct file_change& change);
+
+      // Size of the buffer of the files which are saved.
+      static const size_t kWriteBufferSize = 1024 * 1024;
+
+      // Load text file.
+      bool load_text(const uint8_t* begin, const uint8_t* end);
+
+      // Load change of a text file (the data is decoded in 'data', which is
+      // grown if needed).
+      bool load_change(const uint8_t*& begin,
+                       const uint8_t* end,
+                       uint8_t*& data,
+                       uint64_t& size);
+
+      // Parse number followed by 'terminator' ('ptr' receives the position
+      // of the terminator).
+      static bool parse_number(const uint8_t*& ptr,
+                               const uint8_t* eol,
+                               uint8_t terminator,
+                               uint64_t& n);
+
+      // Decode 'len' bytes from 2 * 'len' hexadecimal digits.
+      static bool decode_hex(const uint8_t* src, uint64_t len, uint8_t* dest);
+
+      // Load binary file.
+      bool load_binary(const char* filename);
+
+      // Callback of expand().
+      typedef bool (*change_callback)(file_change::type t,
+                                      uint64_t off,
+                                      const uint8_t* data,
+                                      uint64_t len,
+                                      void* arg);
+
+      // Pass the changes to 'fn' as modifications, additions and removals
+      // (the replacements and the batches are expanded into one change per
+      // position, or two if the length changes).
+      bool expand(change_callback fn, void* arg) const;
+
+      // Expand change.
+      static bool expand(const file_change& change,
+                         change_callback fn,
+                         void* arg);
+
+      // Expand edit: [off, off + len) is replaced with 'datalen' bytes.
+      static bool expand_edit(uint64_t off,
+                              uint64_t len,
+                              const uint8_t* data,
+                              uint64_t datalen,
+                              change_callback fn,
+                              void* arg);
+
+      // Write change in text format.
+      static bool write_text(file_change::type t,
+                             uint64_t off,
+                             const uint8_t* data,
+                             uint64_t len,
+                             void* arg);
+
+      // Write change in binary format.
+      static bool write_binary(file_change::type t,
+                               uint64_t off,
+                               const uint8_t* data,
+                               uint64_t len,
+                               void* arg);
+
+      // Get number of changes a change is saved as.
+      static size_t saved_changes(const file_change& change);
+
       // Hexadecimal dump.
       static void hexdump(FILE* file, const uint8_t* data, uint64_t len);
 
@@ -91,23 +452,52 @@ namespace fs {
   inline file_changes::file_changes()
     : _M_changes(NULL),
       _M_size(0),
-      _M_used(0)
+      _M_used(0),
+      _M_memory(0),
+      _M_max_memory(0),
+      _M_max_changes(0),
+      _M_journal_fd(-1),
+      _M_journal_len(0),
+      _M_compress(false),
+      _M_first_in_memory(0),
+      _M_coalesce_max_len(0),
+      _M_coalesce_window(0),
+      _M_coalesce(false),
+      _M_last_change_time(0)
   {
+    _M_merge.valid = false;
   }
 
   inline file_changes::~file_changes()
   {
     clear();
+    close_journal();
+  }
+
+  inline bool file_changes::modify(uint64_t off,
+                                   void* olddata,
+                                   const void* newdata,
+                                   uint64_t len)
+  {
+    return register_change(file_change::type::kModify,
+                           off,
+                           olddata,
+                           newdata,
+                           len);
   }
 
   inline bool file_changes::modify(uint64_t off,
                                    void* olddata,
+                                   file_piece* pieces,
+                                   size_t npieces,
                                    const void* newdata,
                                    uint64_t len)
   {
     return register_change(file_change::type::kModify,
                            off,
                            olddata,
+                           pieces,
+                           npieces,
                            newdata,
                            len);
   }
@@ -117,6 +507,35 @@ namespace fs {
     return register_change(file_change::type::kAdd, off, NULL, newdata, len);
   }
 
+  inline bool file_changes::modify_reference(uint64_t off,
+                                             void* olddata,
+                                             file_piece* pieces,
+                                             size_t npieces,
+                                             const void* newdata,
+                                             uint64_t len)
+  {
+    return register_reference(file_change::type::kModify,
+                              off,
+                              olddata,
+                              pieces,
+                              npieces,
+                              newdata,
+                              len);
+  }
+
+  inline bool file_changes::add_reference(uint64_t off,
+                                          const void* newdata,
+                                          uint64_t len)
+  {
+    return register_reference(file_change::type::kAdd,
+                              off,
+                              NULL,
+                              NULL,
+                              0,
+                              newdata,
+                              len);
+  }
+
   inline bool file_changes::remove(uint64_t off,
                                    void* olddata,
                                    uint64_t len)
@@ -124,6 +543,21 @@ namespace fs {
     return register_change(file_change::type::kRemove, off, olddata, NULL, len);
   }
 
+  inline bool file_changes::remove(uint64_t off,
+                                   void* olddata,
+                                   file_piece* pieces,
+                                   size_t npieces,
+                                   uint64_t len)
+  {
+    return register_change(file_change::type::kRemove,
+                           off,
+                           olddata,
+                           pieces,
+                           npieces,
+                           NULL,
+                           len);
+  }
+
   inline bool file_changes::register_change(const file_change& change)
   {
     return register_change(change.t,
@@ -133,6 +567,38 @@ namespace fs {
                            change.len);
   }
 
+  inline bool file_changes::register_change(file_change::type type,
+                                            uint64_t off,
+                                            void* olddata,
+                                            const void* newdata,
+                                            uint64_t len)
+  {
+    return register_change(type, off, olddata, NULL, 0, newdata, len);
+  }
+
+  inline void file_changes::set_limits(uint64_t max_memory,
+                                       size_t max_changes)
+  {
+    _M_max_memory = max_memory;
+    _M_max_changes = max_changes;
+  }
+
+  inline void file_changes::set_coalescing(uint64_t max_len, unsigned window)
+  {
+    _M_coalesce_max_len = max_len;
+    _M_coalesce_window = window;
+  }
+
+  inline void file_changes::seal()
+  {
+    _M_coalesce = false;
+  }
+
+  inline uint64_t file_changes::memory_used() const
+  {
+    return _M_memory;
+  }
+
   inline size_t file_changes::size() const
   {
     return _M_used;
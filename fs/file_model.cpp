@@ -4,6 +4,7 @@
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <pthread.h>
 
 #if defined(__linux__)
   #include <linux/fs.h>
@@ -11,9 +12,86 @@
   #include <sys/disk.h>
 #endif
 
+#if defined(__GLIBC__)
+  #include <malloc.h>
+#endif
+
 #include "fs/file_model.h"
+#include "fs/compress.h"
+#include "fs/byte_order.h"
+
+thread_local const fs::file_model* fs::file_model::_M_locked = NULL;
+
+thread_local fs::file_model::cache_entry
+fs::file_model::_M_cache[fs::file_model::kCacheSize];
+
+thread_local size_t fs::file_model::_M_cache_next = 0;
+
+std::atomic<uint64_t> fs::file_model::_M_compressed_id(0);
 
 void fs::file_model::close()
+{
+  lock_guard lock(this, true);
+
+  // Discard the staged edits.
+  rollback();
+
+  // The session is over.
+  _M_session.discard();
+  _M_recovered = false;
+
+  uint64_t len = _M_len;
+
+  close_file();
+
+  _M_index.clear();
+
+  if (len > 0) {
+    notify(0, len, 0);
+  }
+}
+
+bool fs::file_model::open(const char* filename, open_mode mode)
+{
+  lock_guard lock(this, true);
+
+  // Discard the staged edits.
+  rollback();
+
+  // The previous session is over.
+  _M_session.discard();
+  _M_recovered = false;
+
+  uint64_t len = _M_len;
+
+  _M_index.clear();
+
+  if (!open_file(filename, mode)) {
+    return false;
+  }
+
+  // If the session of a previous run cannot be recovered...
+  if ((_M_session_enabled) &&
+      (!_M_read_only) &&
+      (!_M_block_device) &&
+      (!open_session())) {
+    close_file();
+
+    if (len > 0) {
+      notify(0, len, 0);
+    }
+
+    return false;
+  }
+
+  if ((len > 0) || (_M_len > 0)) {
+    notify(0, len, _M_len);
+  }
+
+  return true;
+}
+
+void fs::file_model::close_file()
 {
   _M_read_only = true;
 
@@ -28,8 +106,44 @@ void fs::file_model::close()
   _M_header.next = &_M_header;
 
   if (_M_data != MAP_FAILED) {
-    munmap(_M_data, _M_filesize);
+    // The helper thread of the prefetcher might be touching the mapping.
+    _M_prefetcher.cancel();
+
+    // If the undo records might reference the data of the file...
+    if (_M_changes.size() > 0) {
+      if (_M_nmappings == _M_mappings_size) {
+        size_t size = (_M_mappings_size == 0) ? 4 : _M_mappings_size * 2;
+
+        struct mapping* mappings;
+        if ((mappings = reinterpret_cast<struct mapping*>(
+                          realloc(_M_mappings, size * sizeof(struct mapping))
+                        )) != NULL) {
+          _M_mappings = mappings;
+          _M_mappings_size = size;
+        }
+      }
+
+      // Keep the mapping.
+      if (_M_nmappings < _M_mappings_size) {
+        struct mapping* m = &_M_mappings[_M_nmappings++];
+
+        m->data = reinterpret_cast<uint8_t*>(_M_data);
+        m->len = _M_filesize;
+        m->refs = _M_mapping_refs;
+        m->dev = _M_dev;
+        m->ino = _M_ino;
+      } else if (_M_changes.materialize(
+                   reinterpret_cast<const uint8_t*>(_M_data),
+                   reinterpret_cast<const uint8_t*>(_M_data) + _M_filesize
+                 )) {
+        unmap(_M_data, _M_filesize, _M_mapping_refs);
+      }
+    } else {
+      unmap(_M_data, _M_filesize, _M_mapping_refs);
+    }
+
     _M_data = MAP_FAILED;
+    _M_mapping_refs = NULL;
   }
 
   if (_M_fd != -1) {
@@ -41,7 +155,7 @@ void fs::file_model::close()
   _M_size_modified = false;
 }
 
-bool fs::file_model::open(const char* filename, open_mode mode)
+bool fs::file_model::open_file(const char* filename, open_mode mode)
 {
   // If the length of the file name is too long...
   size_t len;
@@ -74,6 +188,9 @@ bool fs::file_model::open(const char* filename, open_mode mode)
     return false;
   }
 
+  _M_dev = sbuf.st_dev;
+  _M_ino = sbuf.st_ino;
+
   // Regular file?
   if (S_ISREG(sbuf.st_mode)) {
     _M_block_device = false;
@@ -110,6 +227,18 @@ bool fs::file_model::open(const char* filename, open_mode mode)
       return false;
     }
 
+    // The mapping is shared with the forks.
+    if ((_M_mapping_refs = reinterpret_cast<std::atomic<size_t>*>(
+                             malloc(sizeof(std::atomic<size_t>))
+                           )) == NULL) {
+      munmap(_M_data, _M_filesize);
+      _M_data = MAP_FAILED;
+
+      return false;
+    }
+
+    *_M_mapping_refs = 1;
+
     // Create block.
     struct block* b;
     if ((b = reinterpret_cast<struct block*>(
@@ -137,23 +266,43 @@ bool fs::file_model::open(const char* filename, open_mode mode)
     if (_M_undo_enabled) {
       _M_changes.clear();
     }
+
+    _M_nchange = 0;
+
+    free_mappings();
   }
 
   _M_len = _M_filesize;
 
+  // The file on disk is the current revision (the next change is not
+  // merged into the previous one).
+  _M_saved_change = _M_nchange;
+  _M_changes.seal();
+
   return true;
 }
 
 bool fs::file_model::save()
 {
+  lock_guard lock(this, true);
+
   // If the file has not been modified...
   if (!_M_modified) {
     return true;
   }
 
-  // If the file has neither shrinked nor grown...
-  if (!_M_size_modified) {
-    return save_in_place();
+  // If the file has neither shrinked nor grown and the file on disk is
+  // neither shared with a fork nor replaced (by a fork or a snapshot)...
+  if ((!_M_size_modified) &&
+      ((_M_block_device) ||
+       (((!_M_mapping_refs) || (*_M_mapping_refs == 1)) && (!replaced())))) {
+    if (!save_in_place()) {
+      return false;
+    }
+
+    reset_session();
+
+    return true;
   }
 
   char tmpfilename[PATH_MAX];
@@ -166,25 +315,70 @@ bool fs::file_model::save()
   }
 
   // Write blocks.
+  uint64_t off = 0;
   const struct block* b = _M_header.next;
   while (b != &_M_header) {
-    // Write block.
-    if (write(fd, b->data, b->len) != b->len) {
+    // If the block is made of zeros, skip it (hole).
+    if (zero_fill(b)) {
+      if (lseek(fd, b->len, SEEK_CUR) != static_cast<off_t>(off + b->len)) {
+        ::close(fd);
+        ::remove(tmpfilename);
+
+        return false;
+      }
+    } else if (write(fd, view(b), b->len) != b->len) {
+      // Write block.
       ::close(fd);
       ::remove(tmpfilename);
 
       return false;
     }
 
+    off += b->len;
+
     b = b->next;
   }
 
+  // Set the length of the file (if it ends with a hole).
+  if (ftruncate(fd, off) < 0) {
+    ::close(fd);
+    ::remove(tmpfilename);
+
+    return false;
+  }
+
   ::close(fd);
-  close();
+
+  // The contents don't change: the listeners are not notified.
+  uint64_t len = _M_len;
+  close_file();
+
+  // The file on disk is replaced.
+  _M_index.clear();
 
   rename(tmpfilename, _M_filename);
 
-  return open(_M_filename);
+  if (!open_file(_M_filename, open_mode::kReadWrite)) {
+    if (len > 0) {
+      notify(0, len, 0);
+    }
+
+    return false;
+  }
+
+  reset_session();
+
+  return true;
+}
+
+bool fs::file_model::fork(file_model& fm) const
+{
+  return share(fm, _M_read_only);
+}
+
+bool fs::file_model::snapshot(file_model& fm) const
+{
+  return share(fm, true);
 }
 
 const char* fs::file_model::operation_result_to_string(operation_result res)
@@ -218,705 +412,5717 @@ fs::file_model::operation_result fs::file_model::modify(uint64_t off,
                                                         uint64_t len,
                                                         bool record_change)
 {
+  lock_guard lock(this, true);
+
+  // If a batch is in progress...
+  if (_M_batch) {
+    return stage(off, len, data, len);
+  }
+
+  operation_result res;
+  if (((res = modify_blocks(off, data, len, record_change)) ==
+       operation_result::kSuccess) &&
+      (len > 0)) {
+    journal(off, len, reinterpret_cast<const uint8_t*>(data), len);
+    notify(off, len, len);
+  }
+
+  return res;
+}
+
+fs::file_model::operation_result fs::file_model::add(uint64_t off,
+                                                     const void* data,
+                                                     uint64_t len,
+                                                     bool record_change)
+{
+  lock_guard lock(this, true);
+
+  // If a batch is in progress...
+  if (_M_batch) {
+    return stage(off, 0, data, len);
+  }
+
+  operation_result res;
+  if (((res = add_blocks(off, data, len, record_change)) ==
+       operation_result::kSuccess) &&
+      (len > 0)) {
+    journal(off, 0, reinterpret_cast<const uint8_t*>(data), len);
+    notify(off, 0, len);
+  }
+
+  return res;
+}
+
+fs::file_model::operation_result fs::file_model::remove(uint64_t off,
+                                                        uint64_t len,
+                                                        bool record_change)
+{
+  lock_guard lock(this, true);
+
+  // The data beyond the end of the file is not removed.
+  if ((off < _M_len) && (len > _M_len - off)) {
+    len = _M_len - off;
+  }
+
+  // If a batch is in progress...
+  if (_M_batch) {
+    return stage(off, len, NULL, 0);
+  }
+
+  operation_result res;
+  if (((res = remove_blocks(off, len, record_change)) ==
+       operation_result::kSuccess) &&
+      (len > 0)) {
+    journal(off, len, NULL, 0);
+    notify(off, len, 0);
+  }
+
+  return res;
+}
+
+fs::file_model::operation_result
+fs::file_model::replace_all(const void* needle,
+                            uint64_t needlelen,
+                            const void* replacement,
+                            uint64_t replacementlen,
+                            uint64_t& count,
+                            bool record_change)
+{
+  lock_guard lock(this, true);
+
+  count = 0;
+
   // Read only mode?
   if (_M_read_only) {
     return operation_result::kErrorReadOnly;
   }
 
-  // If the end of the operation is beyond the end of the file...
-  if (off + len > _M_len) {
+  // The replacements cannot be staged.
+  if (_M_batch) {
     return operation_result::kInvalidOperation;
   }
 
-  // If the change is bigger than the maximum memory which can be used...
-  if (len > kMaxMemoryUsed) {
-    return operation_result::kChangeBiggerMaxMemoryUsed;
+  // Block device?
+  if ((_M_block_device) && (needlelen != replacementlen)) {
+    return operation_result::kErrorBlockDevice;
   }
 
-  // Seek to offset.
-  struct block* b;
-  uint64_t pos;
-  if (!seek(off, b, pos)) {
-    // File is empty.
+  if (needlelen == 0) {
     return operation_result::kInvalidOperation;
   }
 
-  // Nothing to modify?
-  if (len == 0) {
-    return operation_result::kSuccess;
+  // Search the occurrences.
+  uint64_t* positions = NULL;
+  size_t npositions = 0;
+  size_t size = 0;
+
+  const struct block* b;
+  uint64_t pos;
+  if ((needlelen <= _M_len) && (seek(0, b, pos))) {
+    uint64_t off = 0;
+
+    while (find_forward(b, pos, off, needle, needlelen)) {
+      if (npositions == size) {
+        size = (size == 0) ? 256 : size * 2;
+
+        uint64_t* p;
+        if ((p = reinterpret_cast<uint64_t*>(
+                   realloc(positions, size * sizeof(uint64_t))
+                 )) == NULL) {
+          free(positions);
+          return operation_result::kNoMemory;
+        }
+
+        positions = p;
+      }
+
+      positions[npositions++] = off + pos;
+
+      // The occurrences don't overlap.
+      pos += needlelen;
+    }
   }
 
-  // Too many changes already?
-  if (_M_memory_used + len > kMaxMemoryUsed) {
-    return operation_result::kErrorNeedSave;
+  // Nothing to replace?
+  if (npositions == 0) {
+    return operation_result::kSuccess;
   }
 
   // If undo is enabled and the change should be recorded...
   if ((record_change &= _M_undo_enabled) == true) {
-    // Get data to be replaced.
+    // If the positions are bigger than the maximum memory which can be
+    // used...
+    if (npositions * sizeof(uint64_t) > kMaxMemoryUsed) {
+      free(positions);
+      return operation_result::kChangeBiggerMaxMemoryUsed;
+    }
+
     uint8_t* olddata;
-    if ((olddata = reinterpret_cast<uint8_t*>(malloc(len))) == NULL) {
+    if ((olddata = reinterpret_cast<uint8_t*>(malloc(needlelen))) == NULL) {
+      free(positions);
       return operation_result::kNoMemory;
     }
 
-    size_t l = len;
-    get(b, pos, olddata, l);
+    memcpy(olddata, needle, needlelen);
 
     _M_changes.erase_from_position(_M_nchange);
 
-    // Record change.
-    if (!_M_changes.modify(off, olddata, data, l)) {
+    // Record change (the positions are owned by the change).
+    if (!_M_changes.replace(olddata,
+                            needlelen,
+                            replacement,
+                            replacementlen,
+                            positions,
+                            npositions)) {
       free(olddata);
+      free(positions);
+
       return operation_result::kNoMemory;
     }
   }
 
-  do {
-    struct block* nextblk;
+  operation_result res;
+  if ((res = replace(positions,
+                     npositions,
+                     0,
+                     needlelen,
+                     reinterpret_cast<const uint8_t*>(replacement),
+                     replacementlen)) != operation_result::kSuccess) {
+    if (record_change) {
+      _M_changes.erase_last_change();
+    } else {
+      free(positions);
+    }
 
-    // If the block is in disk...
-    if (!b->in_memory) {
-      uint8_t* buf;
-      if ((buf = reinterpret_cast<uint8_t*>(
-                   malloc(kMemoryBlockSize)
-                 )) == NULL) {
-        if (record_change) {
-          _M_changes.erase_last_change();
-        }
+    return res;
+  }
 
-        return operation_result::kNoMemory;
-      }
+  if (record_change) {
+    change_recorded();
+  } else {
+    free(positions);
+  }
 
-      // Copy half a block before the offset (it might be modified later).
-      uint64_t begin;
-      uint64_t count;
-      if (pos <= kMidMemoryBlock) {
-        begin = 0;
+  count = npositions;
 
-        if (pos > 0) {
-          count = pos;
-          memcpy(buf, b->data, count);
-        } else {
-          count = 0;
-        }
-      } else {
-        begin = pos - kMidMemoryBlock;
+  return operation_result::kSuccess;
+}
 
-        count = kMidMemoryBlock;
-        memcpy(buf, b->data + begin, count);
-      }
+fs::file_model::operation_result fs::file_model::fill(uint64_t off,
+                                                      uint64_t len,
+                                                      const void* pattern,
+                                                      size_t patternlen,
+                                                      bool record_change)
+{
+  lock_guard lock(this, true);
+
+  return fill_blocks(off,
+                     len,
+                     len,
+                     reinterpret_cast<const uint8_t*>(pattern),
+                     patternlen,
+                     record_change);
+}
 
-      // Left in block in memory.
-      uint64_t left_memory_block = kMemoryBlockSize - count;
+fs::file_model::operation_result fs::file_model::resize(uint64_t len,
+                                                        bool record_change)
+{
+  static const uint8_t kZero = 0;
 
-      uint64_t l = (len < left_memory_block) ? len : left_memory_block;
-      if (pos + l > b->len) {
-        l = b->len - pos;
-      }
+  lock_guard lock(this, true);
 
-      // Copy from user's buffer.
-      memcpy(buf + count, data, l);
-      data = reinterpret_cast<const uint8_t*>(data) + l;
+  // If the file grows...
+  if (len >= _M_len) {
+    return fill_blocks(_M_len, 0, len - _M_len, &kZero, 1, record_change);
+  }
 
-      count += l;
-      left_memory_block -= l;
+  // Read only mode?
+  if (_M_read_only) {
+    return operation_result::kErrorReadOnly;
+  }
 
-      // If we have copied all the user's buffer and there is still space...
-      if (((len -= l) == 0) && (left_memory_block > 0)) {
-        uint64_t end = pos + l;
+  // The removal cannot be staged.
+  if (_M_batch) {
+    return operation_result::kInvalidOperation;
+  }
 
-        if (end < b->len) {
-          // Left in block in disk.
-          uint64_t left_disk_block = b->len - end;
+  uint64_t off = len;
+  len = _M_len - off;
 
-          l = (left_memory_block < left_disk_block) ? left_memory_block :
-                                                      left_disk_block;
+  operation_result res;
+  if ((res = remove_blocks(off, len, record_change)) ==
+      operation_result::kSuccess) {
+    journal(off, len, NULL, 0);
+    notify(off, len, 0);
+  }
 
-          memcpy(buf + count, b->data + end, l);
-          count += l;
-        }
-      }
+  return res;
+}
 
-      // If the new block should be inserted before the current block...
-      if (begin == 0) {
-        // If the new block can replace the old block...
-        if (count == b->len) {
-          b->data = buf;
-          b->in_memory = true;
+fs::file_model::operation_result
+fs::file_model::add_from_file(uint64_t off,
+                              const char* filename,
+                              uint64_t srcoff,
+                              uint64_t len,
+                              bool record_change)
+{
+  lock_guard lock(this, true);
 
-          nextblk = b->next;
-        } else {
-          // Create new block in memory.
-          struct block* memblk;
-          if ((memblk = reinterpret_cast<struct block*>(
-                          malloc(sizeof(struct block))
-                        )) == NULL) {
-            free(buf);
+  // Nothing to add?
+  if (len == 0) {
+    return operation_result::kSuccess;
+  }
 
-            if (record_change) {
-              _M_changes.erase_last_change();
-            }
+  // If the source file cannot be mapped or the range is beyond its end...
+  const struct source_file* src;
+  if (((src = get_source(filename)) == NULL) ||
+      (srcoff > src->size) ||
+      (len > src->size - srcoff)) {
+    return operation_result::kInvalidOperation;
+  }
 
-            return operation_result::kNoMemory;
-          }
+  return source_blocks(off, 0, src->data + srcoff, len, record_change);
+}
 
-          memblk->data = buf;
-          memblk->len = count;
+fs::file_model::operation_result
+fs::file_model::modify_from_file(uint64_t off,
+                                 const char* filename,
+                                 uint64_t srcoff,
+                                 uint64_t len,
+                                 bool record_change)
+{
+  lock_guard lock(this, true);
 
-          memblk->in_memory = true;
+  // Nothing to modify?
+  if (len == 0) {
+    return operation_result::kSuccess;
+  }
 
-          b->data += count;
-          b->len -= count;
+  // If the source file cannot be mapped or the range is beyond its end...
+  const struct source_file* src;
+  if (((src = get_source(filename)) == NULL) ||
+      (srcoff > src->size) ||
+      (len > src->size - srcoff)) {
+    return operation_result::kInvalidOperation;
+  }
 
-          memblk->prev = b->prev;
-          memblk->prev->next = memblk;
+  return source_blocks(off, len, src->data + srcoff, len, record_change);
+}
 
-          memblk->next = b;
-          b->prev = memblk;
+fs::file_model::operation_result fs::file_model::copy_range(uint64_t src,
+                                                            uint64_t len,
+                                                            uint64_t dst,
+                                                            bool record_change)
+{
+  lock_guard lock(this, true);
 
-          nextblk = b;
-        }
-      } else {
-        // Create new block in memory.
-        struct block* memblk;
-        if ((memblk = reinterpret_cast<struct block*>(
-                        malloc(sizeof(struct block))
-                      )) == NULL) {
-          free(buf);
+  return clone_range(src, len, dst, false, record_change);
+}
 
-          if (record_change) {
-            _M_changes.erase_last_change();
-          }
+fs::file_model::operation_result fs::file_model::move_range(uint64_t src,
+                                                            uint64_t len,
+                                                            uint64_t dst,
+                                                            bool record_change)
+{
+  lock_guard lock(this, true);
 
-          return operation_result::kNoMemory;
-        }
+  return clone_range(src, len, dst, true, record_change);
+}
 
-        memblk->data = buf;
-        memblk->len = count;
+bool fs::file_model::build_index()
+{
+  lock_guard lock(this, true);
 
-        memblk->in_memory = true;
+  if (_M_fd == -1) {
+    return false;
+  }
 
-        // If the end of the block in disk is not contained in the block
-        // in memory...
-        uint64_t end;
-        if ((end = begin + count) < b->len) {
-          // Create new block in disk.
-          struct block* diskblk;
-          if ((diskblk = reinterpret_cast<struct block*>(
-                           malloc(sizeof(struct block))
-                         )) == NULL) {
-            free(memblk);
-            free(buf);
+  return _M_index.build(_M_data, _M_filesize);
+}
 
-            if (record_change) {
-              _M_changes.erase_last_change();
-            }
+bool fs::file_model::load_index(const char* filename)
+{
+  lock_guard lock(this, true);
 
-            return operation_result::kNoMemory;
-          }
+  struct stat sbuf;
+  if ((_M_fd == -1) || (fstat(_M_fd, &sbuf) < 0)) {
+    return false;
+  }
 
-          diskblk->data = b->data + end;
-          diskblk->len = b->len - end;
+  return _M_index.load(filename, _M_filesize, sbuf.st_mtim);
+}
 
-          diskblk->in_memory = false;
+bool fs::file_model::save_index(const char* filename) const
+{
+  lock_guard lock(this, false);
 
-          diskblk->next = b->next;
-          diskblk->next->prev = diskblk;
+  struct stat sbuf;
+  if ((_M_fd == -1) || (fstat(_M_fd, &sbuf) < 0)) {
+    return false;
+  }
 
-          memblk->next = diskblk;
-          diskblk->prev = memblk;
+  return _M_index.save(filename, _M_filesize, sbuf.st_mtim);
+}
 
-          nextblk = diskblk;
-        } else {
-          memblk->next = b->next;
-          memblk->next->prev = memblk;
+bool fs::file_model::add_listener(change_listener listener, void* arg)
+{
+  lock_guard lock(this, true);
 
-          nextblk = memblk->next;
-        }
+  if (_M_nlisteners == _M_listeners_size) {
+    size_t size = (_M_listeners_size == 0) ? 4 : _M_listeners_size * 2;
 
-        b->len = begin;
+    struct listener* listeners;
+    if ((listeners = reinterpret_cast<struct listener*>(
+                       realloc(_M_listeners, size * sizeof(struct listener))
+                     )) == NULL) {
+      return false;
+    }
 
-        memblk->prev = b;
-        b->next = memblk;
-      }
+    _M_listeners = listeners;
+    _M_listeners_size = size;
+  }
 
-      b = nextblk;
+  _M_listeners[_M_nlisteners].fn = listener;
+  _M_listeners[_M_nlisteners].arg = arg;
 
-      _M_memory_used += kMemoryBlockSize;
-    } else {
-      // The block is in memory.
+  _M_nlisteners++;
 
-      // Left in block in memory.
-      uint64_t left_memory_block = b->len - pos;
+  return true;
+}
 
-      uint64_t l = (len < left_memory_block) ? len : left_memory_block;
+void fs::file_model::remove_listener(change_listener listener, void* arg)
+{
+  lock_guard lock(this, true);
 
-      // Copy from user's buffer.
-      memcpy(b->data + pos, data, l);
+  for (size_t i = 0; i < _M_nlisteners; i++) {
+    if ((_M_listeners[i].fn == listener) && (_M_listeners[i].arg == arg)) {
+      memmove(_M_listeners + i,
+              _M_listeners + i + 1,
+              (_M_nlisteners - i - 1) * sizeof(struct listener));
 
-      data = reinterpret_cast<const uint8_t*>(data) + l;
-      len -= l;
+      _M_nlisteners--;
 
-      b = b->next;
+      return;
     }
+  }
+}
 
-    pos = 0;
-  } while (len > 0);
+void fs::file_model::set_concurrent(bool concurrent)
+{
+  _M_concurrent = concurrent;
+}
 
-  _M_modified = true;
+void fs::file_model::init_lock()
+{
+  pthread_rwlockattr_t attr;
+  pthread_rwlockattr_init(&attr);
+
+#if defined(__GLIBC__)
+  // The nested operations don't lock again: the lock doesn't need to be
+  // recursive.
+  pthread_rwlockattr_setkind_np(&attr,
+                                PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
 
-  if (record_change) {
-    _M_nchange++;
-  }
+  pthread_rwlock_init(&_M_lock, &attr);
+  pthread_rwlockattr_destroy(&attr);
+}
 
-  return operation_result::kSuccess;
+void fs::file_model::get_fragmentation(fragmentation& frag) const
+{
+  lock_guard lock(this, false);
+
+  frag.blocks = 0;
+  frag.memory_blocks = 0;
+  frag.memory_data = 0;
+  frag.memory_allocated = 0;
+
+  for (const struct block* b = _M_header.next;
+       b != &_M_header;
+       b = b->next) {
+    frag.blocks++;
+
+    if (b->in_memory) {
+      frag.memory_blocks++;
+      frag.memory_data += b->len;
+      frag.memory_allocated += page_header(b->data)->size;
+    }
+  }
 }
 
-fs::file_model::operation_result fs::file_model::add(uint64_t off,
-                                                     const void* data,
-                                                     uint64_t len,
-                                                     bool record_change)
+bool fs::file_model::set_compaction(unsigned interval)
 {
-  // Read only mode?
-  if (_M_read_only) {
-    return operation_result::kErrorReadOnly;
+  if (interval == 0) {
+    if (_M_compaction_running) {
+      pthread_mutex_lock(&_M_compaction_mutex);
+      _M_compaction_stop = true;
+      pthread_cond_signal(&_M_compaction_cond);
+      pthread_mutex_unlock(&_M_compaction_mutex);
+
+      // The worker might be waiting for the lock of the file model.
+      pthread_join(_M_compaction_thread, NULL);
+
+      _M_compaction_running = false;
+    }
+
+    return true;
   }
 
-  // Block device?
-  if (_M_block_device) {
-    return operation_result::kErrorBlockDevice;
+  // The worker runs in parallel with the other operations.
+  if (!_M_concurrent) {
+    return false;
   }
 
-  // If the change is bigger than the maximum memory which can be used...
-  if (len > kMaxMemoryUsed) {
-    return operation_result::kChangeBiggerMaxMemoryUsed;
+  pthread_mutex_lock(&_M_compaction_mutex);
+  _M_compaction_interval = interval;
+  pthread_mutex_unlock(&_M_compaction_mutex);
+
+  if (!_M_compaction_running) {
+    _M_compaction_stop = false;
+
+    if (pthread_create(&_M_compaction_thread,
+                       NULL,
+                       compaction_worker,
+                       this) != 0) {
+      return false;
+    }
+
+    _M_compaction_running = true;
+  }
+
+  return true;
+}
+
+void fs::file_model::get_compaction_stats(compaction_stats& stats) const
+{
+  pthread_mutex_lock(&_M_compaction_mutex);
+  stats = _M_compaction_stats;
+  pthread_mutex_unlock(&_M_compaction_mutex);
+}
+
+bool fs::file_model::compact(uint64_t& off,
+                             uint64_t& merged,
+                             uint64_t& released)
+{
+  lock_guard lock(this, true);
+
+  merged = 0;
+  released = 0;
+
+  // Staged edits might reference the blocks.
+  if (_M_batch) {
+    return false;
   }
 
-  // Seek to offset.
   struct block* b;
   uint64_t pos;
-  if (!seek(off, b, pos)) {
-    // If the offset is at the end of the file...
-    if (off == _M_len) {
-      // Get pointer to last block.
-      b = _M_header.prev;
+  if ((off >= _M_len) || (!seek(off, b, pos))) {
+    return true;
+  }
 
-      pos = b->len;
+  off -= pos;
+
+  // Region around the last edit.
+  uint64_t hotbegin = (_M_last_edit > kCompactionHotZone) ?
+                        _M_last_edit - kCompactionHotZone :
+                        0;
+
+  uint64_t hotend = _M_last_edit + kCompactionHotZone;
+
+  for (size_t i = 0;
+       (i < kCompactionStepBlocks) && (b->next != &_M_header);
+       i++) {
+    // If the blocks are not near the last edit and they can be merged...
+    if (((off + b->len + b->next->len <= hotbegin) || (off >= hotend)) &&
+        (merge(b, released))) {
+      merged++;
     } else {
-      return operation_result::kInvalidOperation;
+      // Compress the block if it is not near the last edit.
+      if ((_M_compression) &&
+          ((off + b->len <= hotbegin) || (off >= hotend)) &&
+          (compress_block(b))) {
+        released++;
+      }
+
+      off += b->len;
+      b = b->next;
     }
   }
 
-  // Nothing to modify?
-  if (len == 0) {
-    return operation_result::kSuccess;
+  if (b->next == &_M_header) {
+    off = _M_len;
+    return true;
   }
 
-  // Too many changes already?
-  if (_M_memory_used + len > kMaxMemoryUsed) {
-    return operation_result::kErrorNeedSave;
+  return false;
+}
+
+bool fs::file_model::merge(struct block* b, uint64_t& released)
+{
+  struct block* next = b->next;
+
+  // The compressed blocks are left alone.
+  if ((compressed(b)) || (compressed(next))) {
+    return false;
   }
 
-  // If undo is enabled and the change should be recorded...
-  if ((record_change &= _M_undo_enabled) == true) {
-    _M_changes.erase_from_position(_M_nchange);
+  if ((b->in_memory) || (next->in_memory)) {
+    // If the data doesn't fit in a buffer...
+    if (b->len + next->len > kMemoryBlockSize) {
+      return false;
+    }
 
-    // Record change.
-    if (!_M_changes.add(off, data, len)) {
-      return operation_result::kNoMemory;
+    if (b->in_memory) {
+      // If the buffer is shared or the data of the next block is a big
+      // chunk of the file on disk...
+      if ((page_header(b->data)->refs > 1) ||
+          ((!next->in_memory) && (next->len > kCompactionMaxCopy)) ||
+          (!grow(b, b->len + next->len))) {
+        return false;
+      }
+
+      memcpy(b->data + b->len, next->data, next->len);
+
+      if (next->in_memory) {
+        _M_memory_used -= release_page(next->data);
+        released++;
+      }
+    } else {
+      // If the buffer is shared or the data of the block is a big chunk
+      // of the file on disk...
+      if ((page_header(next->data)->refs > 1) ||
+          (b->len > kCompactionMaxCopy) ||
+          (!grow(next, b->len + next->len))) {
+        return false;
+      }
+
+      // Prepend the data of the block to the buffer of the next one.
+      memmove(next->data + b->len, next->data, next->len);
+      memcpy(next->data, b->data, b->len);
+
+      b->data = next->data;
+      b->in_memory = true;
+    }
+  } else {
+    const uint8_t* disk = reinterpret_cast<const uint8_t*>(_M_data);
+
+    // If the data of the blocks is not consecutive data of the file on
+    // disk...
+    if ((b->data + b->len != next->data) ||
+        (b->data < disk) ||
+        (next->data + next->len > disk + _M_filesize)) {
+      return false;
+    }
+  }
+
+  b->len += next->len;
+
+  b->next = next->next;
+  next->next->prev = b;
+
+  free(next);
+
+  return true;
+}
+
+void* fs::file_model::compaction_worker(void* arg)
+{
+  file_model* fm = reinterpret_cast<file_model*>(arg);
+
+  // Fragmentation before the current pass.
+  fragmentation before;
+
+  // Is a pass in progress? Offset of the next step.
+  bool pass = false;
+  uint64_t off = 0;
+
+  // Buffers released since the memory was last returned.
+  uint64_t released = 0;
+
+  // Number of edits when the last pass started.
+  uint64_t edits = 0;
+  bool first = true;
+
+  pthread_mutex_lock(&fm->_M_compaction_mutex);
+
+  while (!fm->_M_compaction_stop) {
+    // Wait for the next step.
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    uint64_t ns = ts.tv_nsec +
+                  (static_cast<uint64_t>(fm->_M_compaction_interval) *
+                   1000000ull);
+
+    ts.tv_sec += ns / 1000000000ull;
+    ts.tv_nsec = ns % 1000000000ull;
+
+    pthread_cond_timedwait(&fm->_M_compaction_cond,
+                           &fm->_M_compaction_mutex,
+                           &ts);
+
+    if (fm->_M_compaction_stop) {
+      break;
+    }
+
+    pthread_mutex_unlock(&fm->_M_compaction_mutex);
+
+    // If a new pass should start...
+    if (!pass) {
+      if ((!first) && (fm->_M_edits == edits)) {
+        // Nothing has changed since the last pass.
+        pthread_mutex_lock(&fm->_M_compaction_mutex);
+        continue;
+      }
+
+      edits = fm->_M_edits;
+      first = false;
+
+      fm->get_fragmentation(before);
+
+      pass = true;
+      off = 0;
     }
+
+    uint64_t merged, freed;
+    bool done = fm->compact(off, merged, freed);
+
+    released += freed;
+
+    fragmentation after;
+    if (done) {
+      pass = false;
+
+      // Return the freed memory to the operating system.
+      if (released > 0) {
+#if defined(__GLIBC__)
+        malloc_trim(0);
+#endif
+
+        released = 0;
+      }
+
+      fm->get_fragmentation(after);
+    }
+
+    pthread_mutex_lock(&fm->_M_compaction_mutex);
+
+    fm->_M_compaction_stats.steps++;
+    fm->_M_compaction_stats.merged += merged;
+    fm->_M_compaction_stats.released += freed;
+
+    if (done) {
+      fm->_M_compaction_stats.before = before;
+      fm->_M_compaction_stats.after = after;
+      fm->_M_compaction_stats.passes++;
+    }
+  }
+
+  pthread_mutex_unlock(&fm->_M_compaction_mutex);
+
+  return NULL;
+}
+
+void fs::file_model::set_compression(bool enabled)
+{
+  lock_guard lock(this, true);
+
+  _M_compression = enabled;
+}
+
+uint64_t fs::file_model::compress_blocks()
+{
+  lock_guard lock(this, true);
+
+  return compress_cold_blocks();
+}
+
+void fs::file_model::get_compression_stats(compression_stats& stats) const
+{
+  lock_guard lock(this, false);
+
+  stats.blocks = 0;
+  stats.data = 0;
+  stats.compressed = 0;
+
+  for (const struct block* b = _M_header.next;
+       b != &_M_header;
+       b = b->next) {
+    if (compressed(b)) {
+      stats.blocks++;
+      stats.data += b->len;
+      stats.compressed += page_header(b->data)->size;
+    }
+  }
+
+  stats.compressions = _M_compressions;
+  stats.expansions = _M_expansions;
+  stats.hits = _M_cache_hits;
+  stats.misses = _M_cache_misses;
+}
+
+uint64_t fs::file_model::compress_cold_blocks()
+{
+  // Staged edits might reference the blocks.
+  if (_M_batch) {
+    return 0;
+  }
+
+  uint64_t memory = _M_memory_used;
+
+  // Region around the last edit.
+  uint64_t hotbegin = (_M_last_edit > kCompactionHotZone) ?
+                        _M_last_edit - kCompactionHotZone :
+                        0;
+
+  uint64_t hotend = _M_last_edit + kCompactionHotZone;
+
+  uint64_t off = 0;
+  for (struct block* b = _M_header.next; b != &_M_header; b = b->next) {
+    if ((off + b->len <= hotbegin) || (off >= hotend)) {
+      compress_block(b);
+    }
+
+    off += b->len;
+  }
+
+  return memory - _M_memory_used;
+}
+
+bool fs::file_model::compress_block(struct block* b)
+{
+  // If the block is in disk, small, big, compressed or shared...
+  if ((!b->in_memory) ||
+      (b->len < kMinCompressedBlock) ||
+      (b->len > kMemoryBlockSize) ||
+      (compressed(b)) ||
+      (page_header(b->data)->refs > 1) ||
+      (charged(b->data) == 0)) {
+    return false;
+  }
+
+  // The data has to shrink by a quarter at least.
+  uint8_t buf[kMemoryBlockSize];
+  uint64_t len;
+  if ((len = fs::compress(b->data,
+                          b->len,
+                          buf,
+                          b->len - (b->len / 4))) == 0) {
+    return false;
+  }
+
+  uint8_t* data;
+  if ((data = allocate_page(len)) == NULL) {
+    return false;
+  }
+
+  memcpy(data, buf, len);
+  page_header(data)->id = ++_M_compressed_id;
+
+  _M_memory_used -= release_page(b->data);
+  _M_memory_used += len;
+
+  b->data = data;
+
+  _M_compressions++;
+
+  return true;
+}
+
+bool fs::file_model::expand(struct block* b)
+{
+  uint8_t* buf;
+  if ((buf = allocate_page()) == NULL) {
+    return false;
+  }
+
+  if (!fs::decompress(b->data, page_header(b->data)->size, buf, b->len)) {
+    release_page(buf);
+    return false;
+  }
+
+  _M_memory_used -= release_page(b->data);
+  _M_memory_used += kMemoryBlockSize;
+
+  b->data = buf;
+
+  _M_expansions++;
+
+  return true;
+}
+
+bool fs::file_model::reclaim(uint64_t len)
+{
+  return ((_M_memory_used + len <= kMaxMemoryUsed) ||
+          ((_M_compression) &&
+           (compress_cold_blocks() > 0) &&
+           (_M_memory_used + len <= kMaxMemoryUsed)));
+}
+
+const uint8_t* fs::file_model::decompressed(const struct block* b) const
+{
+  uint64_t id = page_header(b->data)->id;
+
+  // If the block is in the cache...
+  for (size_t i = 0; i < kCacheSize; i++) {
+    if (_M_cache[i].id == id) {
+      _M_cache_hits++;
+      return _M_cache[i].data;
+    }
+  }
+
+  _M_cache_misses++;
+
+  // Replace the oldest entry (the data has been compressed by
+  // compress_block(), it can be decompressed).
+  cache_entry* entry = &_M_cache[_M_cache_next];
+  _M_cache_next = (_M_cache_next + 1) % kCacheSize;
+
+  fs::decompress(b->data, page_header(b->data)->size, entry->data, b->len);
+  entry->id = id;
+
+  return entry->data;
+}
+
+bool fs::file_model::share(file_model& fm, bool read_only) const
+{
+  // Block devices are saved in place.
+  if ((&fm == this) || (_M_block_device)) {
+    return false;
+  }
+
+  lock_guard lock(this, false);
+  lock_guard fmlock(&fm, true);
+
+  fm.close();
+
+  // Start a new history.
+  fm._M_changes.clear();
+  fm._M_nchange = 0;
+
+  fm.free_mappings();
+
+  if ((_M_fd != -1) && ((fm._M_fd = dup(_M_fd)) < 0)) {
+    fm._M_fd = -1;
+    return false;
+  }
+
+  memcpy(fm._M_filename, _M_filename, sizeof(_M_filename));
+
+  fm._M_read_only = read_only;
+  fm._M_block_device = false;
+
+  fm._M_filesize = _M_filesize;
+
+  // Share the mapping.
+  if (_M_data != MAP_FAILED) {
+    fm._M_data = _M_data;
+    fm._M_mapping_refs = _M_mapping_refs;
+
+    ++*_M_mapping_refs;
+  }
+
+  fm._M_dev = _M_dev;
+  fm._M_ino = _M_ino;
+
+  // Share the fill buffers.
+  if (_M_nfills > 0) {
+    if ((fm._M_fills = reinterpret_cast<struct fill_buffer**>(
+                         malloc(_M_nfills * sizeof(struct fill_buffer*))
+                       )) == NULL) {
+      fm.close_file();
+      return false;
+    }
+
+    for (size_t i = 0; i < _M_nfills; i++) {
+      fm._M_fills[i] = _M_fills[i];
+      fm._M_fills[i]->refs++;
+    }
+
+    fm._M_nfills = _M_nfills;
+    fm._M_fills_size = _M_nfills;
+  }
+
+  // Share the mappings of the source files.
+  if (_M_nsources > 0) {
+    if ((fm._M_sources = reinterpret_cast<struct source_file**>(
+                           malloc(_M_nsources * sizeof(struct source_file*))
+                         )) == NULL) {
+      fm.close_file();
+      return false;
+    }
+
+    for (size_t i = 0; i < _M_nsources; i++) {
+      fm._M_sources[i] = _M_sources[i];
+      fm._M_sources[i]->refs++;
+    }
+
+    fm._M_nsources = _M_nsources;
+    fm._M_sources_size = _M_nsources;
+  }
+
+  // Copy the blocks (the buffers in memory are shared).
+  struct block* prev = &fm._M_header;
+
+  for (const struct block* b = _M_header.next; b != &_M_header; b = b->next) {
+    struct block* blk;
+    if ((blk = reinterpret_cast<struct block*>(
+                 malloc(sizeof(struct block))
+               )) == NULL) {
+      prev->next = &fm._M_header;
+      fm._M_header.prev = prev;
+
+      fm.close_file();
+
+      return false;
+    }
+
+    blk->data = b->data;
+    blk->len = b->len;
+    blk->in_memory = b->in_memory;
+
+    if (b->in_memory) {
+      page_header(b->data)->refs++;
+    }
+
+    blk->prev = prev;
+    prev->next = blk;
+
+    prev = blk;
+  }
+
+  prev->next = &fm._M_header;
+  fm._M_header.prev = prev;
+
+  fm._M_len = _M_len;
+
+  // The shared buffers are charged to the file model which has allocated
+  // them.
+  fm._M_memory_used = 0;
+
+  fm._M_modified = _M_modified;
+  fm._M_size_modified = _M_size_modified;
+
+  // The history doesn't contain the file on disk if the file model has
+  // been modified.
+  fm._M_saved_change = _M_modified ? kNoRevision : 0;
+  fm._M_changes.seal();
+
+  if (fm._M_len > 0) {
+    fm.notify(0, 0, fm._M_len);
+  }
+
+  return true;
+}
+
+uint8_t* fs::file_model::allocate_page(uint64_t size) const
+{
+  struct page* p;
+  if ((p = reinterpret_cast<struct page*>(
+             malloc(sizeof(struct page) + size)
+           )) == NULL) {
+    return NULL;
+  }
+
+  p->refs = 1;
+  p->owner = this;
+  p->size = size;
+  p->id = 0;
+
+  return reinterpret_cast<uint8_t*>(p) + sizeof(struct page);
+}
+
+uint64_t fs::file_model::release_page(uint8_t* data) const
+{
+  struct page* p = page_header(data);
+
+  // If the buffer is charged to the file model...
+  const file_model* owner = this;
+  uint64_t memory = p->owner.compare_exchange_strong(owner, NULL) ?
+                      p->size :
+                      0;
+
+  if (--p->refs == 0) {
+    free(p);
+  }
+
+  return memory;
+}
+
+bool fs::file_model::unshare(struct block* b,
+                             uint64_t pos,
+                             uint64_t len,
+                             bool partial)
+{
+  while ((b != &_M_header) && (len > 0)) {
+    uint64_t l = b->len - pos;
+    if (l > len) {
+      l = len;
+    }
+
+    // If the block is in memory and it is about to be modified...
+    if ((b->in_memory) && ((!partial) || (l < b->len))) {
+      if (compressed(b)) {
+        // The data is decompressed into a buffer of its own.
+        if (!expand(b)) {
+          return false;
+        }
+      } else if (page_header(b->data)->refs > 1) {
+        // The buffer is shared.
+        uint64_t size = page_header(b->data)->size;
+
+        uint8_t* buf;
+        if ((buf = allocate_page(size)) == NULL) {
+          return false;
+        }
+
+        memcpy(buf, b->data, b->len);
+
+        _M_memory_used -= release_page(b->data);
+        _M_memory_used += size;
+
+        b->data = buf;
+      }
+    }
+
+    len -= l;
+
+    b = b->next;
+    pos = 0;
+  }
+
+  return true;
+}
+
+bool fs::file_model::grow(struct block* b, uint64_t len)
+{
+  if (len <= page_header(b->data)->size) {
+    return true;
+  }
+
+  if (len > kMemoryBlockSize) {
+    return false;
+  }
+
+  uint8_t* buf;
+  if ((buf = allocate_page()) == NULL) {
+    return false;
+  }
+
+  memcpy(buf, b->data, b->len);
+
+  _M_memory_used -= release_page(b->data);
+  _M_memory_used += kMemoryBlockSize;
+
+  b->data = buf;
+
+  return true;
+}
+
+bool fs::file_model::patch(struct block*& b,
+                           uint64_t pos,
+                           const void* data,
+                           uint64_t len)
+{
+  struct block* prev = b->prev;
+
+  // If the data is close to the end of the previous block in memory or
+  // fits in its buffer...
+  if ((prev != &_M_header) &&
+      (prev->in_memory) &&
+      (!compressed(prev)) &&
+      (page_header(prev->data)->refs == 1) &&
+      (prev->len + pos + len <= kMemoryBlockSize) &&
+      ((pos <= kMaxPatchGap) ||
+       (prev->len + pos + len <= page_header(prev->data)->size))) {
+    if (!grow(prev, prev->len + pos + len)) {
+      return false;
+    }
+
+    // Append the data in between and the new data.
+    memcpy(prev->data + prev->len, b->data, pos);
+    memcpy(prev->data + prev->len + pos, data, len);
+    prev->len += pos + len;
+
+    // If the whole block has been copied...
+    if ((pos + len) == b->len) {
+      prev->next = b->next;
+      b->next->prev = prev;
+
+      free(b);
+
+      b = prev->next;
+    } else {
+      b->data += pos + len;
+      b->len -= pos + len;
+    }
+
+    return true;
+  }
+
+  // Look for the blocks in memory which are in the same page as the patch.
+  struct block* first = NULL;
+  size_t nblocks = 0;
+  uint64_t span = pos + len;
+  for (struct block* blk = prev;
+       (blk != &_M_header) && (span + blk->len <= kMemoryBlockSize);
+       blk = blk->prev) {
+    if (blk->in_memory) {
+      if ((compressed(blk)) || (page_header(blk->data)->refs > 1)) {
+        break;
+      }
+
+      first = blk;
+      nblocks++;
+    }
+
+    span += blk->len;
+  }
+
+  // If the page is dense, the blocks in memory, the data in between and
+  // the patch are merged into a page.
+  if (nblocks >= kMinDensePatches) {
+    return merge_patches(first, b, pos, data, len);
+  }
+
+  // Create patch block.
+  uint8_t* buf;
+  if ((buf = allocate_page(kPatchBlockSize)) == NULL) {
+    return false;
+  }
+
+  memcpy(buf, data, len);
+
+  // If the patch replaces the whole block...
+  if ((pos == 0) && (len == b->len)) {
+    b->data = buf;
+    b->in_memory = true;
+
+    _M_memory_used += kPatchBlockSize;
+
+    b = b->next;
+
+    return true;
+  }
+
+  struct block* patchblk;
+  if ((patchblk = reinterpret_cast<struct block*>(
+                    malloc(sizeof(struct block))
+                  )) == NULL) {
+    release_page(buf);
+    return false;
+  }
+
+  patchblk->data = buf;
+  patchblk->len = len;
+
+  patchblk->in_memory = true;
+
+  if (pos == 0) {
+    // Insert the patch block before the block in disk.
+    patchblk->prev = b->prev;
+    patchblk->prev->next = patchblk;
+
+    patchblk->next = b;
+    b->prev = patchblk;
+
+    b->data += len;
+    b->len -= len;
+  } else {
+    uint64_t end;
+    if ((end = pos + len) < b->len) {
+      // Create new block in disk for the data after the patch.
+      struct block* diskblk;
+      if ((diskblk = reinterpret_cast<struct block*>(
+                       malloc(sizeof(struct block))
+                     )) == NULL) {
+        free(patchblk);
+        release_page(buf);
+
+        return false;
+      }
+
+      diskblk->data = b->data + end;
+      diskblk->len = b->len - end;
+
+      diskblk->in_memory = false;
+
+      diskblk->next = b->next;
+      diskblk->next->prev = diskblk;
+
+      patchblk->next = diskblk;
+      diskblk->prev = patchblk;
+    } else {
+      patchblk->next = b->next;
+      patchblk->next->prev = patchblk;
+    }
+
+    b->len = pos;
+
+    patchblk->prev = b;
+    b->next = patchblk;
+
+    b = patchblk->next;
+  }
+
+  _M_memory_used += kPatchBlockSize;
+
+  return true;
+}
+
+bool fs::file_model::merge_patches(struct block* first,
+                                   struct block*& b,
+                                   uint64_t pos,
+                                   const void* data,
+                                   uint64_t len)
+{
+  uint8_t* buf;
+  if ((buf = allocate_page()) == NULL) {
+    return false;
+  }
+
+  // Copy the blocks before the patch.
+  uint64_t l = 0;
+  for (const struct block* blk = first; blk != b; blk = blk->next) {
+    memcpy(buf + l, blk->data, blk->len);
+    l += blk->len;
+  }
+
+  // Copy the data before the patch and the patch.
+  memcpy(buf + l, b->data, pos);
+  memcpy(buf + l + pos, data, len);
+  l += pos + len;
+
+  // Free the blocks after the first one.
+  struct block* blk = first->next;
+  while (blk != b) {
+    struct block* next = blk->next;
+
+    if (blk->in_memory) {
+      _M_memory_used -= release_page(blk->data);
+    }
+
+    free(blk);
+
+    blk = next;
+  }
+
+  _M_memory_used -= release_page(first->data);
+  _M_memory_used += kMemoryBlockSize;
+
+  first->data = buf;
+  first->len = l;
+
+  // If the whole block has been copied...
+  if ((pos + len) == b->len) {
+    first->next = b->next;
+    b->next->prev = first;
+
+    free(b);
+  } else {
+    b->data += pos + len;
+    b->len -= pos + len;
+
+    first->next = b;
+    b->prev = first;
+  }
+
+  b = first->next;
+
+  return true;
+}
+
+fs::file_model::operation_result
+fs::file_model::fill_blocks(uint64_t off,
+                            uint64_t len,
+                            uint64_t datalen,
+                            const uint8_t* pattern,
+                            size_t patternlen,
+                            bool record_change)
+{
+  // Read only mode?
+  if (_M_read_only) {
+    return operation_result::kErrorReadOnly;
+  }
+
+  // The fills cannot be staged.
+  if (_M_batch) {
+    return operation_result::kInvalidOperation;
+  }
+
+  // Block device?
+  if ((_M_block_device) && (len != datalen)) {
+    return operation_result::kErrorBlockDevice;
+  }
+
+  // If the range is beyond the end of the file or the pattern is not
+  // valid...
+  if ((off > _M_len) ||
+      (len > _M_len - off) ||
+      (patternlen == 0) ||
+      (patternlen > kMaxPatternLength)) {
+    return operation_result::kInvalidOperation;
+  }
+
+  // Nothing to fill?
+  if (datalen == 0) {
+    return operation_result::kSuccess;
+  }
+
+  record_change &= _M_undo_enabled;
+
+  const struct fill_buffer* fb;
+  if ((fb = get_fill_buffer(pattern, patternlen)) == NULL) {
+    return operation_result::kNoMemory;
+  }
+
+  // The new data is made of chunks of the buffer (each of them starts with
+  // the pattern).
+  size_t npieces = (datalen + fb->size - 1) / fb->size;
+
+  file_piece* pieces;
+  if ((pieces = reinterpret_cast<file_piece*>(
+                  malloc(npieces * sizeof(file_piece))
+                )) == NULL) {
+    return operation_result::kNoMemory;
+  }
+
+  for (size_t i = 0; i < npieces; i++) {
+    uint64_t left = datalen - (i * fb->size);
+
+    pieces[i].data = fb->data;
+    pieces[i].len = (left < fb->size) ? left : fb->size;
+    pieces[i].owned = false;
+  }
+
+  struct edit e;
+  e.off = off;
+  e.len = len;
+  e.data = NULL;
+  e.datalen = datalen;
+  e.pieces = pieces;
+  e.npieces = npieces;
+  e.shared = false;
+
+  if (record_change) {
+    // Get data to be replaced.
+    uint8_t* olddata = NULL;
+    file_piece* oldpieces = NULL;
+    size_t noldpieces = 0;
+    uint64_t l;
+    if ((len > 0) &&
+        (!get_undo_data(&e, 1, l, olddata, oldpieces, noldpieces))) {
+      free(pieces);
+      return operation_result::kNoMemory;
+    }
+
+    _M_changes.erase_from_position(_M_nchange);
+
+    // Record change (only the pattern of the new data is recorded).
+    if (!_M_changes.fill(off,
+                         olddata,
+                         oldpieces,
+                         noldpieces,
+                         len,
+                         pattern,
+                         patternlen,
+                         datalen)) {
+      if (olddata) {
+        free(olddata);
+      }
+
+      if (oldpieces) {
+        free(oldpieces);
+      }
+
+      free(pieces);
+
+      return operation_result::kNoMemory;
+    }
+  }
+
+  operation_result res = apply_edits(&e, 1);
+
+  free(pieces);
+
+  if (res != operation_result::kSuccess) {
+    if (record_change) {
+      _M_changes.erase_last_change();
+    }
+
+    return res;
+  }
+
+  if (record_change) {
+    change_recorded();
+  }
+
+  notify(off, len, datalen);
+
+  return operation_result::kSuccess;
+}
+
+const struct fs::file_model::fill_buffer*
+fs::file_model::get_fill_buffer(const uint8_t* pattern, size_t patternlen)
+{
+  // A pattern made of a single byte repeated is a single byte.
+  size_t i;
+  for (i = 1; (i < patternlen) && (pattern[i] == pattern[0]); i++);
+
+  if (i == patternlen) {
+    patternlen = 1;
+  }
+
+  // If there is already a buffer of the pattern...
+  for (i = 0; i < _M_nfills; i++) {
+    if ((_M_fills[i]->patternlen == patternlen) &&
+        (memcmp(_M_fills[i]->data, pattern, patternlen) == 0)) {
+      return _M_fills[i];
+    }
+  }
+
+  if (_M_nfills == _M_fills_size) {
+    size_t size = (_M_fills_size == 0) ? 4 : _M_fills_size * 2;
+
+    struct fill_buffer** fills;
+    if ((fills = reinterpret_cast<struct fill_buffer**>(
+                   realloc(_M_fills, size * sizeof(struct fill_buffer*))
+                 )) == NULL) {
+      return NULL;
+    }
+
+    _M_fills = fills;
+    _M_fills_size = size;
+  }
+
+  struct fill_buffer* fb;
+  if ((fb = reinterpret_cast<struct fill_buffer*>(
+              malloc(sizeof(struct fill_buffer))
+            )) == NULL) {
+    return NULL;
+  }
+
+  void* data;
+
+  // If the pattern is a zero...
+  if ((patternlen == 1) && (*pattern == 0)) {
+    // The pages of an anonymous mapping which is never written are zeros
+    // (and they are not allocated).
+    fb->size = kZeroFillBufferSize;
+
+    if ((data = mmap(NULL,
+                     fb->size,
+                     PROT_READ,
+                     MAP_PRIVATE | MAP_ANONYMOUS,
+                     -1,
+                     0)) == MAP_FAILED) {
+      free(fb);
+      return NULL;
+    }
+  } else {
+    fb->size = kFillBufferSize - (kFillBufferSize % patternlen);
+
+    if ((data = mmap(NULL,
+                     fb->size,
+                     PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS,
+                     -1,
+                     0)) == MAP_FAILED) {
+      free(fb);
+      return NULL;
+    }
+
+    // Repeat the pattern (doubling the data which has been copied).
+    uint8_t* buf = reinterpret_cast<uint8_t*>(data);
+    memcpy(buf, pattern, patternlen);
+
+    for (uint64_t l = patternlen; l < fb->size; l *= 2) {
+      memcpy(buf + l, buf, (l < fb->size - l) ? l : fb->size - l);
+    }
+
+    mprotect(data, fb->size, PROT_READ);
+  }
+
+  fb->refs = 1;
+  fb->data = reinterpret_cast<uint8_t*>(data);
+  fb->patternlen = patternlen;
+
+  _M_fills[_M_nfills++] = fb;
+
+  return fb;
+}
+
+const struct fs::file_model::fill_buffer*
+fs::file_model::find_fill_buffer(const uint8_t* data) const
+{
+  for (size_t i = 0; i < _M_nfills; i++) {
+    const struct fill_buffer* fb = _M_fills[i];
+
+    if ((data >= fb->data) && (data < fb->data + fb->size)) {
+      return fb;
+    }
+  }
+
+  return NULL;
+}
+
+bool fs::file_model::zero_fill(const struct block* b) const
+{
+  const struct fill_buffer* fb;
+  return ((!b->in_memory) &&
+          ((fb = find_fill_buffer(b->data)) != NULL) &&
+          (fb->patternlen == 1) &&
+          (*fb->data == 0));
+}
+
+fs::file_model::operation_result
+fs::file_model::source_blocks(uint64_t off,
+                              uint64_t len,
+                              const uint8_t* data,
+                              uint64_t datalen,
+                              bool record_change)
+{
+  // Read only mode?
+  if (_M_read_only) {
+    return operation_result::kErrorReadOnly;
+  }
+
+  // The references cannot be staged.
+  if (_M_batch) {
+    return operation_result::kInvalidOperation;
+  }
+
+  // Block device?
+  if ((_M_block_device) && (len != datalen)) {
+    return operation_result::kErrorBlockDevice;
+  }
+
+  // If the range is beyond the end of the file...
+  if ((off > _M_len) || (len > _M_len - off)) {
+    return operation_result::kInvalidOperation;
+  }
+
+  // Nothing to add?
+  if (datalen == 0) {
+    return operation_result::kSuccess;
+  }
+
+  // The new data is a single piece which references the mapping.
+  file_piece piece;
+  piece.data = data;
+  piece.len = datalen;
+  piece.owned = false;
+
+  struct edit e;
+  e.off = off;
+  e.len = len;
+  e.data = NULL;
+  e.datalen = datalen;
+  e.pieces = &piece;
+  e.npieces = 1;
+  e.shared = false;
+
+  // If undo is enabled and the change should be recorded...
+  if ((record_change &= _M_undo_enabled) == true) {
+    // Get data to be replaced.
+    uint8_t* olddata = NULL;
+    file_piece* oldpieces = NULL;
+    size_t noldpieces = 0;
+    uint64_t l;
+    if ((len > 0) &&
+        (!get_undo_data(&e, 1, l, olddata, oldpieces, noldpieces))) {
+      return operation_result::kNoMemory;
+    }
+
+    _M_changes.erase_from_position(_M_nchange);
+
+    // Record change (the history references the new data).
+    bool ok = (len > 0) ? _M_changes.modify_reference(off,
+                                                      olddata,
+                                                      oldpieces,
+                                                      noldpieces,
+                                                      data,
+                                                      len) :
+                          _M_changes.add_reference(off, data, datalen);
+
+    if (!ok) {
+      if (olddata) {
+        free(olddata);
+      }
+
+      if (oldpieces) {
+        free(oldpieces);
+      }
+
+      return operation_result::kNoMemory;
+    }
+  }
+
+  operation_result res;
+  if ((res = apply_edits(&e, 1)) != operation_result::kSuccess) {
+    if (record_change) {
+      _M_changes.erase_last_change();
+    }
+
+    return res;
+  }
+
+  if (record_change) {
+    change_recorded();
+  }
+
+  notify(off, len, datalen);
+
+  return operation_result::kSuccess;
+}
+
+const struct fs::file_model::source_file*
+fs::file_model::get_source(const char* filename)
+{
+  // Open file for reading.
+  int fd;
+  if ((fd = ::open(filename, O_RDONLY)) < 0) {
+    return NULL;
+  }
+
+  // If the file is not a regular file, is empty or is the file of the file
+  // model...
+  struct stat sbuf;
+  if ((fstat(fd, &sbuf) < 0) ||
+      (!S_ISREG(sbuf.st_mode)) ||
+      (sbuf.st_size == 0) ||
+      ((_M_fd != -1) &&
+       (sbuf.st_dev == _M_dev) &&
+       (sbuf.st_ino == _M_ino))) {
+    ::close(fd);
+    return NULL;
+  }
+
+  // If the file is already mapped...
+  for (size_t i = 0; i < _M_nsources; i++) {
+    if ((_M_sources[i]->dev == sbuf.st_dev) &&
+        (_M_sources[i]->ino == sbuf.st_ino) &&
+        (_M_sources[i]->size == static_cast<uint64_t>(sbuf.st_size))) {
+      ::close(fd);
+      return _M_sources[i];
+    }
+  }
+
+  if (_M_nsources == _M_sources_size) {
+    size_t size = (_M_sources_size == 0) ? 4 : _M_sources_size * 2;
+
+    struct source_file** sources;
+    if ((sources = reinterpret_cast<struct source_file**>(
+                     realloc(_M_sources, size * sizeof(struct source_file*))
+                   )) == NULL) {
+      ::close(fd);
+      return NULL;
+    }
+
+    _M_sources = sources;
+    _M_sources_size = size;
+  }
+
+  struct source_file* src;
+  if ((src = reinterpret_cast<struct source_file*>(
+               malloc(sizeof(struct source_file))
+             )) == NULL) {
+    ::close(fd);
+    return NULL;
+  }
+
+  // The absolute file name is recorded in the session journal.
+  void* data;
+  if ((realpath(filename, src->filename) == NULL) ||
+      ((data = mmap(NULL,
+                    sbuf.st_size,
+                    PROT_READ,
+                    MAP_SHARED,
+                    fd,
+                    0)) == MAP_FAILED)) {
+    free(src);
+    ::close(fd);
+
+    return NULL;
+  }
+
+  ::close(fd);
+
+  src->refs = 1;
+  src->data = reinterpret_cast<uint8_t*>(data);
+  src->size = sbuf.st_size;
+  src->dev = sbuf.st_dev;
+  src->ino = sbuf.st_ino;
+
+  _M_sources[_M_nsources++] = src;
+
+  return src;
+}
+
+const struct fs::file_model::source_file*
+fs::file_model::find_source(const uint8_t* data) const
+{
+  for (size_t i = 0; i < _M_nsources; i++) {
+    const struct source_file* src = _M_sources[i];
+
+    if ((data >= src->data) && (data < src->data + src->size)) {
+      return src;
+    }
+  }
+
+  return NULL;
+}
+
+bool fs::file_model::mapped(const file_piece* piece) const
+{
+  const uint8_t* begin = reinterpret_cast<const uint8_t*>(_M_data);
+  const uint8_t* end = begin + _M_filesize;
+
+  const struct fill_buffer* fb;
+  const struct source_file* src;
+  return (((_M_data != MAP_FAILED) &&
+           (piece->data >= begin) &&
+           (piece->data + piece->len <= end)) ||
+          (((fb = find_fill_buffer(piece->data)) != NULL) &&
+           (piece->data + piece->len <= fb->data + fb->size)) ||
+          (((src = find_source(piece->data)) != NULL) &&
+           (piece->data + piece->len <= src->data + src->size)));
+}
+
+fs::file_model::operation_result
+fs::file_model::clone_range(uint64_t src,
+                            uint64_t len,
+                            uint64_t dst,
+                            bool move,
+                            bool record_change)
+{
+  // Read only mode?
+  if (_M_read_only) {
+    return operation_result::kErrorReadOnly;
+  }
+
+  // The clones cannot be staged.
+  if (_M_batch) {
+    return operation_result::kInvalidOperation;
+  }
+
+  // Block device?
+  if (_M_block_device) {
+    return operation_result::kErrorBlockDevice;
+  }
+
+  // If the ranges are beyond the end of the file or the destination is
+  // inside of the range which is moved...
+  if ((src > _M_len) ||
+      (len > _M_len - src) ||
+      (dst > _M_len) ||
+      ((move) && (dst > src) && (dst < src + len))) {
+    return operation_result::kInvalidOperation;
+  }
+
+  // Nothing to copy / move?
+  if ((len == 0) || ((move) && ((dst == src) || (dst == src + len)))) {
+    return operation_result::kSuccess;
+  }
+
+  record_change &= _M_undo_enabled;
+
+  const struct block* b;
+  uint64_t pos;
+  seek(src, b, pos);
+
+  // Count the pieces and the bytes which have to be copied.
+  uint8_t* ptr = NULL;
+  uint64_t copied = 0;
+  size_t npieces = 0;
+  collect_clone_pieces(b, pos, len, ptr, NULL, npieces, copied);
+
+  uint8_t* data = NULL;
+  file_piece* pieces;
+  if (!allocate_undo_data(copied, npieces, data, pieces)) {
+    return operation_result::kNoMemory;
+  }
+
+  ptr = data;
+  npieces = 0;
+  collect_clone_pieces(b, pos, len, ptr, pieces, npieces, copied);
+
+  // The data is added at 'dst' (and removed from 'src').
+  struct edit edits[2];
+  size_t nedits = 0;
+
+  struct edit* add = &edits[(move && (dst > src)) ? 1 : 0];
+  add->off = dst;
+  add->len = 0;
+  add->data = NULL;
+  add->datalen = len;
+  add->pieces = pieces;
+  add->npieces = npieces;
+  add->shared = true;
+
+  nedits++;
+
+  if (move) {
+    struct edit* remove = &edits[(dst > src) ? 0 : 1];
+    remove->off = src;
+    remove->len = len;
+    remove->data = NULL;
+    remove->datalen = 0;
+    remove->pieces = NULL;
+    remove->npieces = 0;
+    remove->shared = false;
+
+    nedits++;
+  }
+
+  // If undo is enabled and the change should be recorded (only the
+  // offsets: the range is cloned again when the change is undone or
+  // redone)...
+  if (record_change) {
+    _M_changes.erase_from_position(_M_nchange);
+
+    if (!_M_changes.clone(src, len, dst, move)) {
+      if (data) {
+        free(data);
+      }
+
+      free(pieces);
+
+      return operation_result::kNoMemory;
+    }
+  }
+
+  operation_result res = apply_edits(edits, nedits);
+
+  if (data) {
+    free(data);
+  }
+
+  free(pieces);
+
+  if (res != operation_result::kSuccess) {
+    if (record_change) {
+      _M_changes.erase_last_change();
+    }
+
+    return res;
+  }
+
+  if (record_change) {
+    change_recorded();
+  }
+
+  // Range which changes.
+  if (!move) {
+    notify(dst, 0, len);
+  } else if (dst < src) {
+    notify(dst, src + len - dst, src + len - dst);
+  } else {
+    notify(src, dst - src, dst - src);
+  }
+
+  return operation_result::kSuccess;
+}
+
+uint64_t fs::file_model::collect_clone_pieces(const struct block* b,
+                                              uint64_t pos,
+                                              uint64_t len,
+                                              uint8_t*& ptr,
+                                              file_piece* pieces,
+                                              size_t& npieces,
+                                              uint64_t& copied) const
+{
+  // Has the previous piece been copied?
+  bool prev_copied = false;
+  size_t first = npieces;
+
+  // End of the previous piece in disk (NULL if the previous piece is in
+  // memory).
+  const uint8_t* prev_end = NULL;
+
+  uint64_t left = len;
+
+  while ((left > 0) && (b != &_M_header)) {
+    uint64_t l = b->len - pos;
+    if (l > left) {
+      l = left;
+    }
+
+    if (l > 0) {
+      if (!b->in_memory) {
+        // If the data doesn't follow the previous piece in disk...
+        if ((npieces == first) || (b->data + pos != prev_end)) {
+          if (pieces) {
+            pieces[npieces].data = b->data + pos;
+            pieces[npieces].len = l;
+            pieces[npieces].owned = false;
+          }
+
+          npieces++;
+        } else if (pieces) {
+          pieces[npieces - 1].len += l;
+        }
+
+        prev_end = b->data + pos + l;
+        prev_copied = false;
+      } else if (l == b->len) {
+        // The buffer of the block is shared.
+        if (pieces) {
+          pieces[npieces].data = b->data;
+          pieces[npieces].len = l;
+          pieces[npieces].owned = false;
+        }
+
+        npieces++;
+
+        prev_end = NULL;
+        prev_copied = false;
+      } else {
+        // Part of a block in memory: the data is copied.
+        if ((npieces == first) || (!prev_copied)) {
+          if (pieces) {
+            pieces[npieces].data = ptr;
+            pieces[npieces].len = l;
+            pieces[npieces].owned = true;
+          }
+
+          npieces++;
+        } else if (pieces) {
+          pieces[npieces - 1].len += l;
+        }
+
+        if (ptr) {
+          memcpy(ptr, view(b) + pos, l);
+          ptr += l;
+        }
+
+        if (!pieces) {
+          copied += l;
+        }
+
+        prev_end = NULL;
+        prev_copied = true;
+      }
+    }
+
+    left -= l;
+
+    b = b->next;
+    pos = 0;
+  }
+
+  return len - left;
+}
+
+void fs::file_model::unmap(void* data,
+                           uint64_t len,
+                           std::atomic<size_t>* refs)
+{
+  // If a fork still uses the mapping...
+  if ((refs) && (--*refs > 0)) {
+    return;
+  }
+
+  munmap(data, len);
+
+  if (refs) {
+    free(refs);
+  }
+}
+
+fs::file_model::operation_result
+fs::file_model::modify_blocks(uint64_t off,
+                              const void* data,
+                              uint64_t len,
+                              bool record_change)
+{
+  // Read only mode?
+  if (_M_read_only) {
+    return operation_result::kErrorReadOnly;
+  }
+
+  // If the end of the operation is beyond the end of the file...
+  if (off + len > _M_len) {
+    return operation_result::kInvalidOperation;
+  }
+
+  // If the change is bigger than the maximum memory which can be used...
+  if (len > kMaxMemoryUsed) {
+    return operation_result::kChangeBiggerMaxMemoryUsed;
+  }
+
+  // Seek to offset.
+  struct block* b;
+  uint64_t pos;
+  if (!seek(off, b, pos)) {
+    // File is empty.
+    return operation_result::kInvalidOperation;
+  }
+
+  // Nothing to modify?
+  if (len == 0) {
+    return operation_result::kSuccess;
+  }
+
+  // Too many changes already?
+  if (!reclaim(len)) {
+    return operation_result::kErrorNeedSave;
+  }
+
+  // Copy the shared buffers which are about to be modified.
+  if (!unshare(b, pos, len, false)) {
+    return operation_result::kNoMemory;
+  }
+
+  // If undo is enabled and the change should be recorded...
+  if ((record_change &= _M_undo_enabled) == true) {
+    // Get data to be replaced.
+    uint8_t* olddata;
+    file_piece* pieces;
+    size_t npieces;
+    uint64_t l = len;
+    if (!get_undo_data(b, pos, l, olddata, pieces, npieces)) {
+      return operation_result::kNoMemory;
+    }
+
+    _M_changes.erase_from_position(_M_nchange);
+
+    // Record change.
+    if (!_M_changes.modify(off, olddata, pieces, npieces, data, l)) {
+      if (olddata) {
+        free(olddata);
+      }
+
+      if (pieces) {
+        free(pieces);
+      }
+
+      return operation_result::kNoMemory;
+    }
+  }
+
+  do {
+    struct block* nextblk;
+
+    // If a small part of the block in disk is modified...
+    if ((!b->in_memory) && (len <= kMaxPatchLength)) {
+      uint64_t l = (len < b->len - pos) ? len : b->len - pos;
+
+      if (!patch(b, pos, data, l)) {
+        if (record_change) {
+          _M_changes.erase_last_change();
+        }
+
+        return operation_result::kNoMemory;
+      }
+
+      data = reinterpret_cast<const uint8_t*>(data) + l;
+      len -= l;
+    } else if (!b->in_memory) {
+      // The block is in disk.
+      uint8_t* buf;
+      if ((buf = allocate_page()) == NULL) {
+        if (record_change) {
+          _M_changes.erase_last_change();
+        }
+
+        return operation_result::kNoMemory;
+      }
+
+      // Copy half a block before the offset (it might be modified later).
+      uint64_t begin;
+      uint64_t count;
+      if (pos <= kMidMemoryBlock) {
+        begin = 0;
+
+        if (pos > 0) {
+          count = pos;
+          memcpy(buf, b->data, count);
+        } else {
+          count = 0;
+        }
+      } else {
+        begin = pos - kMidMemoryBlock;
+
+        count = kMidMemoryBlock;
+        memcpy(buf, b->data + begin, count);
+      }
+
+      // Left in block in memory.
+      uint64_t left_memory_block = kMemoryBlockSize - count;
+
+      uint64_t l = (len < left_memory_block) ? len : left_memory_block;
+      if (pos + l > b->len) {
+        l = b->len - pos;
+      }
+
+      // Copy from user's buffer.
+      memcpy(buf + count, data, l);
+      data = reinterpret_cast<const uint8_t*>(data) + l;
+
+      count += l;
+      left_memory_block -= l;
+
+      // If we have copied all the user's buffer and there is still space...
+      if (((len -= l) == 0) && (left_memory_block > 0)) {
+        uint64_t end = pos + l;
+
+        if (end < b->len) {
+          // Left in block in disk.
+          uint64_t left_disk_block = b->len - end;
+
+          l = (left_memory_block < left_disk_block) ? left_memory_block :
+                                                      left_disk_block;
+
+          memcpy(buf + count, b->data + end, l);
+          count += l;
+        }
+      }
+
+      // If the new block should be inserted before the current block...
+      if (begin == 0) {
+        // If the new block can replace the old block...
+        if (count == b->len) {
+          b->data = buf;
+          b->in_memory = true;
+
+          nextblk = b->next;
+        } else {
+          // Create new block in memory.
+          struct block* memblk;
+          if ((memblk = reinterpret_cast<struct block*>(
+                          malloc(sizeof(struct block))
+                        )) == NULL) {
+            release_page(buf);
+
+            if (record_change) {
+              _M_changes.erase_last_change();
+            }
+
+            return operation_result::kNoMemory;
+          }
+
+          memblk->data = buf;
+          memblk->len = count;
+
+          memblk->in_memory = true;
+
+          b->data += count;
+          b->len -= count;
+
+          memblk->prev = b->prev;
+          memblk->prev->next = memblk;
+
+          memblk->next = b;
+          b->prev = memblk;
+
+          nextblk = b;
+        }
+      } else {
+        // Create new block in memory.
+        struct block* memblk;
+        if ((memblk = reinterpret_cast<struct block*>(
+                        malloc(sizeof(struct block))
+                      )) == NULL) {
+          release_page(buf);
+
+          if (record_change) {
+            _M_changes.erase_last_change();
+          }
+
+          return operation_result::kNoMemory;
+        }
+
+        memblk->data = buf;
+        memblk->len = count;
+
+        memblk->in_memory = true;
+
+        // If the end of the block in disk is not contained in the block
+        // in memory...
+        uint64_t end;
+        if ((end = begin + count) < b->len) {
+          // Create new block in disk.
+          struct block* diskblk;
+          if ((diskblk = reinterpret_cast<struct block*>(
+                           malloc(sizeof(struct block))
+                         )) == NULL) {
+            free(memblk);
+            release_page(buf);
+
+            if (record_change) {
+              _M_changes.erase_last_change();
+            }
+
+            return operation_result::kNoMemory;
+          }
+
+          diskblk->data = b->data + end;
+          diskblk->len = b->len - end;
+
+          diskblk->in_memory = false;
+
+          diskblk->next = b->next;
+          diskblk->next->prev = diskblk;
+
+          memblk->next = diskblk;
+          diskblk->prev = memblk;
+
+          nextblk = diskblk;
+        } else {
+          memblk->next = b->next;
+          memblk->next->prev = memblk;
+
+          nextblk = memblk->next;
+        }
+
+        b->len = begin;
+
+        memblk->prev = b;
+        b->next = memblk;
+      }
+
+      b = nextblk;
+
+      _M_memory_used += kMemoryBlockSize;
+    } else {
+      // The block is in memory.
+
+      // Left in block in memory.
+      uint64_t left_memory_block = b->len - pos;
+
+      uint64_t l = (len < left_memory_block) ? len : left_memory_block;
+
+      // Copy from user's buffer.
+      memcpy(b->data + pos, data, l);
+
+      data = reinterpret_cast<const uint8_t*>(data) + l;
+      len -= l;
+
+      b = b->next;
+    }
+
+    pos = 0;
+  } while (len > 0);
+
+  _M_modified = true;
+
+  if (record_change) {
+    change_recorded();
+  }
+
+  return operation_result::kSuccess;
+}
+
+fs::file_model::operation_result
+fs::file_model::add_blocks(uint64_t off,
+                           const void* data,
+                           uint64_t len,
+                           bool record_change)
+{
+  // Read only mode?
+  if (_M_read_only) {
+    return operation_result::kErrorReadOnly;
+  }
+
+  // Block device?
+  if (_M_block_device) {
+    return operation_result::kErrorBlockDevice;
+  }
+
+  // If the change is bigger than the maximum memory which can be used...
+  if (len > kMaxMemoryUsed) {
+    return operation_result::kChangeBiggerMaxMemoryUsed;
+  }
+
+  // Seek to offset.
+  struct block* b;
+  uint64_t pos;
+  if (!seek(off, b, pos)) {
+    // If the offset is at the end of the file...
+    if (off == _M_len) {
+      // Get pointer to last block.
+      b = _M_header.prev;
+
+      pos = b->len;
+    } else {
+      return operation_result::kInvalidOperation;
+    }
+  }
+
+  // Nothing to modify?
+  if (len == 0) {
+    return operation_result::kSuccess;
+  }
+
+  // Too many changes already?
+  if (!reclaim(len)) {
+    return operation_result::kErrorNeedSave;
+  }
+
+  // If the data is added at the beginning of a block and the previous
+  // block in memory has room for some of it, the data is appended to the
+  // previous block (successive insertions at a cursor keep appending to the
+  // same buffer).
+  if ((pos == 0) &&
+      (b->prev != &_M_header) &&
+      (b->prev->in_memory) &&
+      (!compressed(b->prev)) &&
+      (room(b->prev) > 0)) {
+    b = b->prev;
+    pos = b->len;
+  }
+
+  // Copy the buffer of the block if it is shared (the data might be added
+  // to it).
+  if (!unshare(b, 0, b->len, false)) {
+    return operation_result::kNoMemory;
+  }
+
+  // If the data might be added to a small buffer...
+  if ((b->in_memory) &&
+      ((len <= room(b)) || (pos > 0)) &&
+      (!grow(b, kMemoryBlockSize))) {
+    return operation_result::kNoMemory;
+  }
+
+  // If undo is enabled and the change should be recorded...
+  if ((record_change &= _M_undo_enabled) == true) {
+    _M_changes.erase_from_position(_M_nchange);
+
+    // Record change.
+    if (!_M_changes.add(off, data, len)) {
+      return operation_result::kNoMemory;
+    }
+  }
+
+  // If the block is in memory and the data fits...
+  if ((b->in_memory) && (len <= room(b))) {
+    uint64_t n = b->len - pos;
+    if (n > 0) {
+      memmove(b->data + pos + len, b->data + pos, n);
+    }
+
+    // Copy from user's buffer.
+    memcpy(b->data + pos, data, len);
+    b->len += len;
+
+    _M_len += len;
+
+    _M_modified = true;
+    _M_size_modified = true;
+
+    if (record_change) {
+      change_recorded();
+    }
+
+    return operation_result::kSuccess;
+  }
+
+  // Data copied to the buffer of the block once the data after the offset
+  // has been moved to a new block.
+  uint64_t count = 0;
+  if ((b->in_memory) && (pos > 0)) {
+    count = room(b) + (b->len - pos);
+    if (count > len) {
+      count = len;
+    }
+  }
+
+  // Memory allocated.
+  uint64_t memory = 0;
+
+  // If the data after the offset should be moved to a new block...
+  struct block* blk = NULL;
+  if ((pos > 0) && (pos < b->len)) {
+    uint64_t l = b->len - pos;
+
+    uint8_t* buf;
+    if (b->in_memory) {
+      uint64_t size = (l > kMemoryBlockSize) ? l : kMemoryBlockSize;
+
+      if ((buf = allocate_page(size)) == NULL) {
+        if (record_change) {
+          _M_changes.erase_last_change();
+        }
+
+        return operation_result::kNoMemory;
+      }
+
+      memcpy(buf, b->data + pos, l);
+
+      memory += size;
+    } else {
+      buf = b->data + pos;
+    }
+
+    // Create new block.
+    if ((blk = reinterpret_cast<struct block*>(
+                 malloc(sizeof(struct block))
+               )) == NULL) {
+      if (b->in_memory) {
+        release_page(buf);
+      }
+
+      if (record_change) {
+        _M_changes.erase_last_change();
+      }
+
+      return operation_result::kNoMemory;
+    }
+
+    blk->data = buf;
+    blk->len = l;
+    blk->in_memory = b->in_memory;
+    blk->next = NULL;
+  }
+
+  struct block* first = NULL, *last = NULL;
+  uint64_t size = 0;
+  if ((count < len) &&
+      (!add(reinterpret_cast<const uint8_t*>(data) + count,
+            len - count,
+            first,
+            last,
+            size))) {
+    free_block_list(blk, NULL);
+
+    if (record_change) {
+      _M_changes.erase_last_change();
+    }
+
+    return operation_result::kNoMemory;
+  }
+
+  memory += size;
+
+  // If the blocks should be inserted before the current block...
+  if (pos == 0) {
+    first->prev = b->prev;
+    first->prev->next = first;
+
+    last->next = b;
+    b->prev = last;
+  } else {
+    struct block* next = b->next;
+
+    if (blk) {
+      b->len = pos;
+    }
+
+    // Copy from user's buffer.
+    if (count > 0) {
+      memcpy(b->data + pos, data, count);
+      b->len += count;
+    }
+
+    // Link the new blocks after the current block.
+    struct block* prev = b;
+
+    if (first) {
+      prev->next = first;
+      first->prev = prev;
+
+      prev = last;
+    }
+
+    if (blk) {
+      prev->next = blk;
+      blk->prev = prev;
+
+      prev = blk;
+    }
+
+    prev->next = next;
+    next->prev = prev;
+  }
+
+  _M_len += len;
+  _M_memory_used += memory;
+
+  _M_modified = true;
+  _M_size_modified = true;
+
+  if (record_change) {
+    change_recorded();
+  }
+
+  return operation_result::kSuccess;
+}
+
+fs::file_model::operation_result
+fs::file_model::remove_blocks(uint64_t off,
+                              uint64_t len,
+                              bool record_change)
+{
+  // Read only mode?
+  if (_M_read_only) {
+    return operation_result::kErrorReadOnly;
+  }
+
+  // Block device?
+  if (_M_block_device) {
+    return operation_result::kErrorBlockDevice;
+  }
+
+  // Seek to offset.
+  struct block* b;
+  uint64_t pos;
+  if (!seek(off, b, pos)) {
+    return operation_result::kInvalidOperation;
+  }
+
+  // Nothing to modify?
+  if (len == 0) {
+    return operation_result::kSuccess;
+  }
+
+  // Copy the shared buffers of the blocks which are partially removed.
+  if (!unshare(b, pos, len, true)) {
+    return operation_result::kNoMemory;
+  }
+
+  // If undo is enabled and the change should be recorded...
+  if ((record_change &= _M_undo_enabled) == true) {
+    // Get data to be removed.
+    uint8_t* olddata;
+    file_piece* pieces;
+    size_t npieces;
+    uint64_t l = len;
+    if (!get_undo_data(b, pos, l, olddata, pieces, npieces)) {
+      return operation_result::kNoMemory;
+    }
+
+    _M_changes.erase_from_position(_M_nchange);
+
+    // Record change.
+    if (!_M_changes.remove(off, olddata, pieces, npieces, l)) {
+      if (olddata) {
+        free(olddata);
+      }
+
+      if (pieces) {
+        free(pieces);
+      }
+
+      return operation_result::kNoMemory;
+    }
+  }
+
+  if (off + len > _M_len) {
+    len = _M_len - off;
+  }
+
+  // If the change is inside the block...
+  uint64_t n = pos + len;
+  if (n < b->len) {
+    // If the block is in disk...
+    if (!b->in_memory) {
+      // If not at the beginning of the block...
+      if (pos != 0) {
+        // Create new block in disk.
+        struct block* diskblk;
+        if ((diskblk = reinterpret_cast<struct block*>(
+                         malloc(sizeof(struct block))
+                       )) == NULL) {
+          if (record_change) {
+            _M_changes.erase_last_change();
+          }
+
+          return operation_result::kNoMemory;
+        }
+
+        diskblk->data = b->data + n;
+        diskblk->len = b->len - n;
+
+        b->len = pos;
+
+        diskblk->in_memory = false;
+
+        diskblk->prev = b;
+
+        diskblk->next = b->next;
+        diskblk->next->prev = diskblk;
+
+        b->next = diskblk;
+      } else {
+        b->data += len;
+        b->len -= len;
+      }
+    } else {
+      // The block is in memory.
+      memmove(b->data + pos, b->data + n, b->len - n);
+      b->len -= len;
+    }
+
+    _M_len -= len;
+
+    _M_modified = true;
+    _M_size_modified = true;
+
+    if (record_change) {
+      change_recorded();
+    }
+
+    return operation_result::kSuccess;
+  } else if (n == b->len) {
+    b->len = pos;
+    _M_len -= len;
+
+    _M_modified = true;
+    _M_size_modified = true;
+
+    if (record_change) {
+      change_recorded();
+    }
+
+    return operation_result::kSuccess;
+  }
+
+  _M_len -= len;
+
+  // If not at the beginning of the block...
+  if (pos != 0) {
+    len -= (b->len - pos);
+
+    b->len = pos;
+
+    b = b->next;
+  }
+
+  struct block* prev = b->prev;
+
+  do {
+    if (len >= b->len) {
+      struct block* next = b->next;
+
+      len -= b->len;
+
+      // If the data is in memory...
+      if (b->in_memory) {
+        _M_memory_used -= release_page(b->data);
+      }
+
+      free(b);
+
+      b = next;
+    } else {
+      // If the block is in disk...
+      if (!b->in_memory) {
+        b->data += len;
+      } else {
+        memmove(b->data, b->data + len, b->len - len);
+      }
+
+      b->len -= len;
+
+      break;
+    }
+  } while (len > 0);
+
+  prev->next = b;
+  b->prev = prev;
+
+  _M_modified = true;
+  _M_size_modified = true;
+
+  if (record_change) {
+    change_recorded();
+  }
+
+  return operation_result::kSuccess;
+}
+
+struct fs::file_model::sweep {
+  // New block list.
+  struct block** blocks;
+  size_t nblocks;
+  size_t size;
+
+  // Blocks which have been created (freed if the edits cannot be applied).
+  struct block** fresh;
+  size_t nfresh;
+  size_t fresh_size;
+
+  // Blocks of the current list which are not kept (freed once the edits
+  // have been applied).
+  struct block** retired;
+  size_t nretired;
+  size_t retired_size;
+
+  // Memory block being filled.
+  struct block* mb;
+
+  // Memory of the fresh / retired blocks.
+  uint64_t memory_added;
+  uint64_t memory_retired;
+
+  // Would the memory used exceed the maximum?
+  bool need_save;
+};
+
+fs::file_model::operation_result
+fs::file_model::apply_edits(const struct edit* edits, size_t nedits)
+{
+  struct sweep sw;
+  memset(&sw, 0, sizeof(struct sweep));
+
+  struct block* b = _M_header.next;
+  uint64_t boff = 0;
+
+  // Has the current block been either kept or retired?
+  bool done = false;
+
+  uint64_t cur = 0;
+  uint64_t len = _M_len;
+  bool size_modified = false;
+
+  bool error = false;
+
+  for (size_t i = 0; i <= nedits; i++) {
+    uint64_t target = (i < nedits) ? edits[i].off : _M_len;
+
+    // Append the data in [cur, target).
+    while (cur < target) {
+      // Skip the blocks before 'cur'.
+      while (cur >= boff + b->len) {
+        if ((!done) &&
+            (!sweep_append(sw.retired, sw.nretired, sw.retired_size, b))) {
+          error = true;
+          break;
+        }
+
+        if ((!done) && (b->in_memory)) {
+          sw.memory_retired += charged(b->data);
+        }
+
+        boff += b->len;
+        b = b->next;
+
+        done = false;
+      }
+
+      if (error) {
+        break;
+      }
+
+      uint64_t pos = cur - boff;
+      uint64_t l = b->len - pos;
+      if (l > target - cur) {
+        l = target - cur;
+      }
+
+      // If the whole block is kept (a block in disk which fits in the
+      // memory block being filled is copied into it, so that the memory
+      // blocks stay full)...
+      if ((pos == 0) &&
+          (l == b->len) &&
+          ((b->in_memory) ||
+           (!sw.mb) ||
+           (b->len > kMemoryBlockSize - sw.mb->len))) {
+        if (!sweep_append(sw.blocks, sw.nblocks, sw.size, b)) {
+          error = true;
+          break;
+        }
+
+        sw.mb = NULL;
+        done = true;
+      } else {
+        if (!done) {
+          if (!sweep_append(sw.retired, sw.nretired, sw.retired_size, b)) {
+            error = true;
+            break;
+          }
+
+          if (b->in_memory) {
+            sw.memory_retired += charged(b->data);
+          }
+
+          done = true;
+        }
+
+        if (b->in_memory) {
+          if (!sweep_copy(sw, view(b) + pos, l)) {
+            error = true;
+            break;
+          }
+        } else if (!sweep_disk(sw, b->data + pos, l)) {
+          error = true;
+          break;
+        }
+      }
+
+      cur += l;
+    }
+
+    if ((error) || (i == nedits)) {
+      break;
+    }
+
+    // Append the new data.
+    if (edits[i].pieces) {
+      for (size_t j = 0; j < edits[i].npieces; j++) {
+        const file_piece* piece = &edits[i].pieces[j];
+
+        // If the piece references the file on disk, a fill buffer or a
+        // source file...
+        if ((!piece->owned) && (mapped(piece))) {
+          if (!sweep_disk(sw, piece->data, piece->len)) {
+            error = true;
+            break;
+          }
+        } else if ((edits[i].shared) && (!piece->owned)) {
+          // The piece is the buffer of a block in memory.
+          if (!sweep_share(sw, piece->data, piece->len)) {
+            error = true;
+            break;
+          }
+        } else if (!sweep_copy(sw, piece->data, piece->len)) {
+          error = true;
+          break;
+        }
+      }
+
+      if (error) {
+        break;
+      }
+    } else if (!sweep_copy(sw, edits[i].data, edits[i].datalen)) {
+      error = true;
+      break;
+    }
+
+    // Skip the data which is replaced.
+    cur = edits[i].off + edits[i].len;
+
+    len = len - edits[i].len + edits[i].datalen;
+
+    if (edits[i].len != edits[i].datalen) {
+      size_modified = true;
+    }
+  }
+
+  if (error) {
+    // Free the blocks which have been created (the shared buffers are
+    // still referenced by the blocks they come from).
+    for (size_t i = 0; i < sw.nfresh; i++) {
+      if (sw.fresh[i]->in_memory) {
+        if (page_header(sw.fresh[i]->data)->refs > 1) {
+          page_header(sw.fresh[i]->data)->refs--;
+        } else {
+          release_page(sw.fresh[i]->data);
+        }
+      }
+
+      free(sw.fresh[i]);
+    }
+
+    if (sw.fresh) {
+      free(sw.fresh);
+    }
+
+    if (sw.retired) {
+      free(sw.retired);
+    }
+
+    if (sw.blocks) {
+      free(sw.blocks);
+    }
+
+    return sw.need_save ? operation_result::kErrorNeedSave :
+                          operation_result::kNoMemory;
+  }
+
+  // Memory released (a buffer shared by several retired blocks is only
+  // charged once).
+  uint64_t released = 0;
+
+  // Retire the blocks after the last one which has been appended.
+  while (b != &_M_header) {
+    struct block* next = b->next;
+
+    if (!done) {
+      if (b->in_memory) {
+        released += release_page(b->data);
+      }
+
+      free(b);
+    }
+
+    b = next;
+    done = false;
+  }
+
+  // Free the retired blocks.
+  for (size_t i = 0; i < sw.nretired; i++) {
+    if (sw.retired[i]->in_memory) {
+      released += release_page(sw.retired[i]->data);
+    }
+
+    free(sw.retired[i]);
+  }
+
+  // The shared buffers which are only referenced by the new blocks (the
+  // blocks they come from have been retired) are charged again.
+  for (size_t i = 0; i < sw.nfresh; i++) {
+    if (sw.fresh[i]->in_memory) {
+      struct page* p = page_header(sw.fresh[i]->data);
+
+      const file_model* owner = NULL;
+      if ((p->refs == 1) && (p->owner.compare_exchange_strong(owner, this))) {
+        sw.memory_added += p->size;
+      }
+    }
+  }
+
+  // Link the new block list.
+  struct block* prev = &_M_header;
+  for (size_t i = 0; i < sw.nblocks; i++) {
+    prev->next = sw.blocks[i];
+    sw.blocks[i]->prev = prev;
+
+    prev = sw.blocks[i];
+  }
+
+  prev->next = &_M_header;
+  _M_header.prev = prev;
+
+  if (sw.fresh) {
+    free(sw.fresh);
+  }
+
+  if (sw.retired) {
+    free(sw.retired);
+  }
+
+  if (sw.blocks) {
+    free(sw.blocks);
+  }
+
+  _M_len = len;
+  _M_memory_used = _M_memory_used + sw.memory_added - released;
+
+  _M_modified = true;
+
+  if (size_modified) {
+    _M_size_modified = true;
+  }
+
+  journal(edits, nedits);
+
+  return operation_result::kSuccess;
+}
+
+fs::file_model::operation_result
+fs::file_model::replace(const uint64_t* positions,
+                        size_t npositions,
+                        uint64_t shift,
+                        uint64_t len,
+                        const uint8_t* data,
+                        uint64_t datalen)
+{
+  // Block device?
+  if ((_M_block_device) && (len != datalen)) {
+    return operation_result::kErrorBlockDevice;
+  }
+
+  struct edit* edits;
+  if ((edits = reinterpret_cast<struct edit*>(
+                 malloc(npositions * sizeof(struct edit))
+               )) == NULL) {
+    return operation_result::kNoMemory;
+  }
+
+  for (size_t i = 0; i < npositions; i++) {
+    edits[i].off = positions[i] + (i * shift);
+    edits[i].len = len;
+    edits[i].data = data;
+    edits[i].datalen = datalen;
+    edits[i].pieces = NULL;
+    edits[i].npieces = 0;
+    edits[i].shared = false;
+  }
+
+  // If the last edit is beyond the end of the file...
+  if (edits[npositions - 1].off + len > _M_len) {
+    free(edits);
+    return operation_result::kInvalidOperation;
+  }
+
+  operation_result res;
+  if ((res = apply_edits(edits, npositions)) == operation_result::kSuccess) {
+    // Range which has changed.
+    uint64_t off = edits[0].off;
+    uint64_t end = edits[npositions - 1].off + len;
+
+    notify(off, end - off, end - off + (npositions * (datalen - len)));
+  }
+
+  free(edits);
+
+  return res;
+}
+
+fs::file_model::operation_result
+fs::file_model::restore(uint64_t off,
+                        uint64_t len,
+                        const struct file_change* chg)
+{
+  // If the range is beyond the end of the file...
+  if ((off > _M_len) || (len > _M_len - off)) {
+    return operation_result::kInvalidOperation;
+  }
+
+  // Block device?
+  if ((_M_block_device) && (len != chg->len)) {
+    return operation_result::kErrorBlockDevice;
+  }
+
+  struct edit e;
+  e.off = off;
+  e.len = len;
+  e.data = (chg->pieces) ? NULL : chg->olddata;
+  e.datalen = chg->len;
+  e.pieces = chg->pieces;
+  e.npieces = chg->npieces;
+  e.shared = false;
+
+  operation_result res;
+  if ((res = apply_edits(&e, 1)) == operation_result::kSuccess) {
+    notify(off, len, chg->len);
+  }
+
+  return res;
+}
+
+bool fs::file_model::get_undo_data(const struct block* b,
+                                   uint64_t pos,
+                                   uint64_t& len,
+                                   uint8_t*& data,
+                                   file_piece*& pieces,
+                                   size_t& npieces) const
+{
+  // Count the bytes in memory and the pieces.
+  uint8_t* ptr = NULL;
+  uint64_t inmemory = 0;
+  size_t n = 0;
+  len = collect_undo_data(b, pos, len, ptr, NULL, n, inmemory);
+
+  // If all the data is in memory...
+  if (inmemory == len) {
+    if ((data = reinterpret_cast<uint8_t*>(malloc(len))) == NULL) {
+      return false;
+    }
+
+    get(b, pos, data, len);
+
+    pieces = NULL;
+    npieces = 0;
+
+    return true;
+  }
+
+  if (!allocate_undo_data(inmemory, n, data, pieces)) {
+    return false;
+  }
+
+  // Fill the pieces.
+  ptr = data;
+  npieces = 0;
+  collect_undo_data(b, pos, len, ptr, pieces, npieces, inmemory);
+
+  return true;
+}
+
+bool fs::file_model::get_undo_data(const struct edit* edits,
+                                   size_t nedits,
+                                   uint64_t& len,
+                                   uint8_t*& data,
+                                   file_piece*& pieces,
+                                   size_t& npieces) const
+{
+  // Count the bytes in memory and the pieces.
+  uint8_t* ptr = NULL;
+  uint64_t inmemory = 0;
+  size_t n = 0;
+
+  len = 0;
+
+  const struct block* b = _M_header.next;
+  uint64_t boff = 0;
+
+  for (size_t i = 0; i < nedits; i++) {
+    if (edits[i].len > 0) {
+      // Skip the blocks before the edit.
+      while (edits[i].off >= boff + b->len) {
+        boff += b->len;
+        b = b->next;
+      }
+
+      len += collect_undo_data(b,
+                               edits[i].off - boff,
+                               edits[i].len,
+                               ptr,
+                               NULL,
+                               n,
+                               inmemory);
+    }
+  }
+
+  // If all the data is in memory, the pieces are not needed.
+  bool use_pieces = (inmemory != len);
+
+  if (!allocate_undo_data(inmemory, use_pieces ? n : 0, data, pieces)) {
+    return false;
+  }
+
+  // Fill the pieces (or copy the data).
+  ptr = data;
+  npieces = 0;
+
+  b = _M_header.next;
+  boff = 0;
+
+  for (size_t i = 0; i < nedits; i++) {
+    if (edits[i].len > 0) {
+      while (edits[i].off >= boff + b->len) {
+        boff += b->len;
+        b = b->next;
+      }
+
+      if (use_pieces) {
+        collect_undo_data(b,
+                          edits[i].off - boff,
+                          edits[i].len,
+                          ptr,
+                          pieces,
+                          npieces,
+                          inmemory);
+      } else {
+        uint64_t l = edits[i].len;
+        get(b, edits[i].off - boff, ptr, l);
+
+        ptr += l;
+      }
+    }
+  }
+
+  return true;
+}
+
+uint64_t fs::file_model::collect_undo_data(const struct block* b,
+                                           uint64_t pos,
+                                           uint64_t len,
+                                           uint8_t*& ptr,
+                                           file_piece* pieces,
+                                           size_t& npieces,
+                                           uint64_t& inmemory) const
+{
+  // Is the previous piece (of the range) in memory?
+  bool prev_in_memory = false;
+  size_t first = npieces;
+
+  // End of the previous piece in disk.
+  const uint8_t* prev_end = NULL;
+
+  uint64_t left = len;
+
+  while ((left > 0) && (b != &_M_header)) {
+    uint64_t l = b->len - pos;
+    if (l > left) {
+      l = left;
+    }
+
+    if (l > 0) {
+      if (b->in_memory) {
+        if ((npieces == first) || (!prev_in_memory)) {
+          if (pieces) {
+            pieces[npieces].data = ptr;
+            pieces[npieces].len = l;
+            pieces[npieces].owned = false;
+          }
+
+          npieces++;
+        } else if (pieces) {
+          pieces[npieces - 1].len += l;
+        }
+
+        if (ptr) {
+          memcpy(ptr, view(b) + pos, l);
+          ptr += l;
+        }
+
+        if (!pieces) {
+          inmemory += l;
+        }
+
+        prev_in_memory = true;
+      } else {
+        // If the data doesn't follow the previous piece in disk...
+        if ((npieces == first) ||
+            (prev_in_memory) ||
+            (b->data + pos != prev_end)) {
+          if (pieces) {
+            pieces[npieces].data = b->data + pos;
+            pieces[npieces].len = l;
+            pieces[npieces].owned = false;
+          }
+
+          npieces++;
+        } else if (pieces) {
+          pieces[npieces - 1].len += l;
+        }
+
+        prev_end = b->data + pos + l;
+        prev_in_memory = false;
+      }
+    }
+
+    left -= l;
+
+    b = b->next;
+    pos = 0;
+  }
+
+  return len - left;
+}
+
+bool fs::file_model::allocate_undo_data(uint64_t inmemory,
+                                        size_t npieces,
+                                        uint8_t*& data,
+                                        file_piece*& pieces)
+{
+  data = NULL;
+  pieces = NULL;
+
+  if ((inmemory > 0) &&
+      ((data = reinterpret_cast<uint8_t*>(malloc(inmemory))) == NULL)) {
+    return false;
+  }
+
+  if ((npieces > 0) &&
+      ((pieces = reinterpret_cast<file_piece*>(
+                   malloc(npieces * sizeof(file_piece))
+                 )) == NULL)) {
+    if (data) {
+      free(data);
+    }
+
+    return false;
+  }
+
+  return true;
+}
+
+bool fs::file_model::materialize(uint64_t off, uint64_t len)
+{
+  // Current mapping.
+  if ((_M_data != MAP_FAILED) &&
+      (!_M_changes.materialize(
+         reinterpret_cast<const uint8_t*>(_M_data) + off,
+         reinterpret_cast<const uint8_t*>(_M_data) + off + len
+       ))) {
+    return false;
+  }
+
+  // Mappings of the same file which have been closed.
+  for (size_t i = 0; i < _M_nmappings; i++) {
+    const struct mapping* m = &_M_mappings[i];
+
+    if ((m->dev == _M_dev) && (m->ino == _M_ino) && (off < m->len)) {
+      uint64_t l = (len < m->len - off) ? len : m->len - off;
+
+      if (!_M_changes.materialize(m->data + off, m->data + off + l)) {
+        return false;
+      }
+    }
+  }
+
+  return true;
+}
+
+void fs::file_model::free_mappings()
+{
+  if (_M_mappings) {
+    for (size_t i = 0; i < _M_nmappings; i++) {
+      unmap(_M_mappings[i].data, _M_mappings[i].len, _M_mappings[i].refs);
+    }
+
+    free(_M_mappings);
+    _M_mappings = NULL;
+  }
+
+  _M_nmappings = 0;
+  _M_mappings_size = 0;
+
+  if (_M_fills) {
+    for (size_t i = 0; i < _M_nfills; i++) {
+      // If a fork still uses the buffer...
+      if (--_M_fills[i]->refs > 0) {
+        continue;
+      }
+
+      munmap(_M_fills[i]->data, _M_fills[i]->size);
+      free(_M_fills[i]);
+    }
+
+    free(_M_fills);
+    _M_fills = NULL;
+  }
+
+  _M_nfills = 0;
+  _M_fills_size = 0;
+
+  if (_M_sources) {
+    for (size_t i = 0; i < _M_nsources; i++) {
+      // If a fork still uses the mapping...
+      if (--_M_sources[i]->refs > 0) {
+        continue;
+      }
+
+      munmap(_M_sources[i]->data, _M_sources[i]->size);
+      free(_M_sources[i]);
+    }
+
+    free(_M_sources);
+    _M_sources = NULL;
+  }
+
+  _M_nsources = 0;
+  _M_sources_size = 0;
+}
+
+bool fs::file_model::sweep_disk(struct sweep& sw,
+                                const uint8_t* data,
+                                uint64_t len)
+{
+  // If the data fits in the memory block being filled...
+  if ((sw.mb) && (len <= kMemoryBlockSize - sw.mb->len)) {
+    return sweep_copy(sw, data, len);
+  }
+
+  // Create new block in disk.
+  struct block* diskblk;
+  if ((diskblk = reinterpret_cast<struct block*>(
+                   malloc(sizeof(struct block))
+                 )) == NULL) {
+    return false;
+  }
+
+  diskblk->data = const_cast<uint8_t*>(data);
+  diskblk->len = len;
+  diskblk->in_memory = false;
+
+  if (!sweep_append(sw.fresh, sw.nfresh, sw.fresh_size, diskblk)) {
+    free(diskblk);
+    return false;
+  }
+
+  if (!sweep_append(sw.blocks, sw.nblocks, sw.size, diskblk)) {
+    return false;
+  }
+
+  sw.mb = NULL;
+
+  return true;
+}
+
+bool fs::file_model::sweep_copy(struct sweep& sw,
+                                const uint8_t* data,
+                                uint64_t len)
+{
+  while (len > 0) {
+    // If there is no memory block being filled or it is full...
+    if ((!sw.mb) || (sw.mb->len == kMemoryBlockSize)) {
+      // Too many changes already?
+      if (_M_memory_used + sw.memory_added + kMemoryBlockSize >
+          kMaxMemoryUsed + sw.memory_retired) {
+        sw.need_save = true;
+        return false;
+      }
+
+      struct block* mb;
+      if ((mb = reinterpret_cast<struct block*>(
+                  malloc(sizeof(struct block))
+                )) == NULL) {
+        return false;
+      }
+
+      if ((mb->data = allocate_page()) == NULL) {
+        free(mb);
+        return false;
+      }
+
+      mb->len = 0;
+      mb->in_memory = true;
+
+      if (!sweep_append(sw.fresh, sw.nfresh, sw.fresh_size, mb)) {
+        release_page(mb->data);
+        free(mb);
+
+        return false;
+      }
+
+      sw.memory_added += kMemoryBlockSize;
+
+      if (!sweep_append(sw.blocks, sw.nblocks, sw.size, mb)) {
+        return false;
+      }
+
+      sw.mb = mb;
+    }
+
+    uint64_t l = kMemoryBlockSize - sw.mb->len;
+    if (l > len) {
+      l = len;
+    }
+
+    memcpy(sw.mb->data + sw.mb->len, data, l);
+    sw.mb->len += l;
+
+    data += l;
+    len -= l;
+  }
+
+  return true;
+}
+
+bool fs::file_model::sweep_share(struct sweep& sw,
+                                 const uint8_t* data,
+                                 uint64_t len)
+{
+  struct block* b;
+  if ((b = reinterpret_cast<struct block*>(
+             malloc(sizeof(struct block))
+           )) == NULL) {
+    return false;
+  }
+
+  b->data = const_cast<uint8_t*>(data);
+  b->len = len;
+  b->in_memory = true;
+
+  page_header(data)->refs++;
+
+  if (!sweep_append(sw.fresh, sw.nfresh, sw.fresh_size, b)) {
+    page_header(data)->refs--;
+    free(b);
+
+    return false;
+  }
+
+  if (!sweep_append(sw.blocks, sw.nblocks, sw.size, b)) {
+    return false;
+  }
+
+  sw.mb = NULL;
+
+  return true;
+}
+
+bool fs::file_model::sweep_append(struct block**& blocks,
+                                  size_t& nblocks,
+                                  size_t& size,
+                                  struct block* b)
+{
+  if (nblocks == size) {
+    size_t s = (size == 0) ? 256 : size * 2;
+
+    struct block** tmp;
+    if ((tmp = reinterpret_cast<struct block**>(
+                 realloc(blocks, s * sizeof(struct block*))
+               )) == NULL) {
+      return false;
+    }
+
+    blocks = tmp;
+    size = s;
+  }
+
+  blocks[nblocks++] = b;
+
+  return true;
+}
+
+struct fs::file_model::composition {
+  composed_segment* segments;
+  size_t nsegments;
+  size_t size;
+
+  // Length of the composed file.
+  uint64_t len;
+};
+
+fs::file_model::operation_result
+fs::file_model::apply(const file_changes& changes)
+{
+  lock_guard lock(this, true);
+
+  // Read only mode?
+  if (_M_read_only) {
+    return operation_result::kErrorReadOnly;
+  }
+
+  // Batch in progress?
+  if (_M_batch) {
+    return operation_result::kInvalidOperation;
+  }
+
+  struct composition c;
+  c.segments = NULL;
+  c.nsegments = 0;
+  c.size = 0;
+  c.len = 0;
+
+  // The composed file starts as the current file.
+  if ((_M_len > 0) && (!compose(c, 0, 0, NULL, _M_len))) {
+    return operation_result::kNoMemory;
+  }
+
+  operation_result res;
+  for (size_t i = 0; i < changes.size(); i++) {
+    if ((res = compose(c, changes.get(i))) != operation_result::kSuccess) {
+      if (c.segments) {
+        free(c.segments);
+      }
+
+      return res;
+    }
+  }
+
+  if ((res = begin_batch()) != operation_result::kSuccess) {
+    if (c.segments) {
+      free(c.segments);
+    }
+
+    return res;
+  }
+
+  // The data between two segments of the current file (or between the
+  // segment and the end of the file) is replaced with the data of the
+  // segments in between.
+  uint64_t cur = 0;
+  uint64_t datalen = 0;
+  size_t first = 0;
+
+  for (size_t i = 0; i <= c.nsegments; i++) {
+    if ((i < c.nsegments) && (c.segments[i].data)) {
+      datalen += c.segments[i].len;
+      continue;
+    }
+
+    uint64_t off = (i < c.nsegments) ? c.segments[i].off : _M_len;
+
+    if ((off > cur) || (datalen > 0)) {
+      // Block device?
+      if ((_M_block_device) && (off - cur != datalen)) {
+        res = operation_result::kErrorBlockDevice;
+        break;
+      }
+
+      uint8_t* dest;
+      if (!append_staged_edit(cur, off - cur, datalen, dest)) {
+        res = operation_result::kNoMemory;
+        break;
+      }
+
+      for (size_t j = first; j < i; j++) {
+        memcpy(dest, c.segments[j].data, c.segments[j].len);
+        dest += c.segments[j].len;
+      }
+    }
+
+    if (i < c.nsegments) {
+      cur = off + c.segments[i].len;
+      datalen = 0;
+      first = i + 1;
+    }
+  }
+
+  if (c.segments) {
+    free(c.segments);
+  }
+
+  if (res != operation_result::kSuccess) {
+    rollback();
+    return res;
+  }
+
+  return commit();
+}
+
+fs::file_model::operation_result
+fs::file_model::compose_undo(struct composition& c,
+                             const struct file_change* chg)
+{
+  size_t piece = 0;
+  const uint8_t* olddata = chg->olddata;
+
+  switch (chg->t) {
+    case file_change::type::kModify:
+      if ((chg->off > c.len) || (chg->len > c.len - chg->off)) {
+        return operation_result::kInvalidOperation;
+      }
+
+      if (!compose_old_data(c,
+                            chg->off,
+                            chg->len,
+                            chg,
+                            piece,
+                            olddata,
+                            chg->len)) {
+        return operation_result::kNoMemory;
+      }
+
+      break;
+    case file_change::type::kAdd:
+      if ((chg->off > c.len) || (chg->len > c.len - chg->off)) {
+        return operation_result::kInvalidOperation;
+      }
+
+      if (!compose(c, chg->off, chg->len, NULL, 0)) {
+        return operation_result::kNoMemory;
+      }
+
+      break;
+    case file_change::type::kRemove:
+      if (chg->off > c.len) {
+        return operation_result::kInvalidOperation;
+      }
+
+      if (!compose_old_data(c, chg->off, 0, chg, piece, olddata, chg->len)) {
+        return operation_result::kNoMemory;
+      }
+
+      break;
+    case file_change::type::kReplace:
+      // Once the previous positions have been restored, the offset of each
+      // position is the offset before the change.
+      for (size_t i = 0; i < chg->npositions; i++) {
+        uint64_t off = chg->positions[i];
+
+        if ((off > c.len) || (chg->newlen > c.len - off)) {
+          return operation_result::kInvalidOperation;
+        }
+
+        if (!compose(c, off, chg->newlen, chg->olddata, chg->len)) {
+          return operation_result::kNoMemory;
+        }
+      }
+
+      break;
+    case file_change::type::kBatch:
+      // Once the previous edits have been undone, the offset of each edit
+      // is the offset before the change.
+      for (size_t i = 0; i < chg->npositions; i += 3) {
+        uint64_t off = chg->positions[i];
+        uint64_t len = chg->positions[i + 1];
+        uint64_t newlen = chg->positions[i + 2];
+
+        if ((off > c.len) || (newlen > c.len - off)) {
+          return operation_result::kInvalidOperation;
+        }
+
+        if (!compose_old_data(c, off, newlen, chg, piece, olddata, len)) {
+          return operation_result::kNoMemory;
+        }
+      }
+
+      break;
+    default: // file_change::type::kCopy / kMove / kFill.
+      // The new data of the copies / moves and the fills is not recorded.
+      return operation_result::kInvalidOperation;
+  }
+
+  return operation_result::kSuccess;
+}
+
+bool fs::file_model::compose_old_data(struct composition& c,
+                                      uint64_t off,
+                                      uint64_t len,
+                                      const struct file_change* chg,
+                                      size_t& piece,
+                                      const uint8_t*& olddata,
+                                      uint64_t oldlen)
+{
+  if (!chg->pieces) {
+    if (!compose(c, off, len, olddata, oldlen)) {
+      return false;
+    }
+
+    olddata += oldlen;
+
+    return true;
+  }
+
+  if (!compose(c, off, len, NULL, 0)) {
+    return false;
+  }
+
+  for (uint64_t l = 0; l < oldlen; piece++) {
+    const file_piece* p = &chg->pieces[piece];
+
+    if (!compose(c, off + l, 0, p->data, p->len)) {
+      return false;
+    }
+
+    l += p->len;
+  }
+
+  return true;
+}
+
+fs::file_model::operation_result
+fs::file_model::compose(struct composition& c, const struct file_change* chg)
+{
+  // If the data of the change is in the journal...
+  if (chg->spilled) {
+    return operation_result::kInvalidOperation;
+  }
+
+  switch (chg->t) {
+    case file_change::type::kModify:
+      // If the end of the modification is beyond the end of the file...
+      if ((chg->off > c.len) || (chg->len > c.len - chg->off)) {
+        return operation_result::kInvalidOperation;
+      }
+
+      if (!compose(c, chg->off, chg->len, chg->newdata, chg->len)) {
+        return operation_result::kNoMemory;
+      }
+
+      break;
+    case file_change::type::kAdd:
+      if (chg->off > c.len) {
+        return operation_result::kInvalidOperation;
+      }
+
+      if (!compose(c, chg->off, 0, chg->newdata, chg->len)) {
+        return operation_result::kNoMemory;
+      }
+
+      break;
+    case file_change::type::kRemove:
+      if (chg->off > c.len) {
+        return operation_result::kInvalidOperation;
+      }
+
+      if (!compose(c,
+                   chg->off,
+                   (chg->len > c.len - chg->off) ? c.len - chg->off : chg->len,
+                   NULL,
+                   0)) {
+        return operation_result::kNoMemory;
+      }
+
+      break;
+    case file_change::type::kReplace:
+      for (size_t i = 0; i < chg->npositions; i++) {
+        // Offset once the previous positions have been replaced.
+        uint64_t off = chg->positions[i] + (i * (chg->newlen - chg->len));
+
+        if ((off > c.len) || (chg->len > c.len - off)) {
+          return operation_result::kInvalidOperation;
+        }
+
+        if (!compose(c, off, chg->len, chg->newdata, chg->newlen)) {
+          return operation_result::kNoMemory;
+        }
+      }
+
+      break;
+    case file_change::type::kBatch:
+      {
+        const uint8_t* data = chg->newdata;
+        uint64_t shift = 0;
+
+        for (size_t i = 0; i < chg->npositions; i += 3) {
+          // Offset once the previous edits have been performed.
+          uint64_t off = chg->positions[i] + shift;
+          uint64_t len = chg->positions[i + 1];
+          uint64_t newlen = chg->positions[i + 2];
+
+          if ((off > c.len) || (len > c.len - off)) {
+            return operation_result::kInvalidOperation;
+          }
+
+          if (!compose(c, off, len, data, newlen)) {
+            return operation_result::kNoMemory;
+          }
+
+          data += newlen;
+          shift += (newlen - len);
+        }
+      }
+
+      break;
+    default: // file_change::type::kCopy / kMove / kFill.
+      // The new data of the copies / moves and the fills is not recorded.
+      return operation_result::kInvalidOperation;
+  }
+
+  return operation_result::kSuccess;
+}
+
+bool fs::file_model::compose(struct composition& c,
+                             uint64_t off,
+                             uint64_t len,
+                             const uint8_t* data,
+                             uint64_t datalen)
+{
+  size_t first, last;
+  if ((!split(c, off, first)) || (!split(c, off + len, last))) {
+    return false;
+  }
+
+  size_t n = (datalen > 0) ? 1 : 0;
+
+  if (c.nsegments - (last - first) + n > c.size) {
+    size_t size = (c.size == 0) ? 256 : c.size * 2;
+
+    composed_segment* segments;
+    if ((segments = reinterpret_cast<composed_segment*>(
+                      realloc(c.segments, size * sizeof(composed_segment))
+                    )) == NULL) {
+      return false;
+    }
+
+    c.segments = segments;
+    c.size = size;
+  }
+
+  if (last != first + n) {
+    memmove(c.segments + first + n,
+            c.segments + last,
+            (c.nsegments - last) * sizeof(composed_segment));
+  }
+
+  if (n > 0) {
+    c.segments[first].data = data;
+    c.segments[first].off = 0;
+    c.segments[first].len = datalen;
+  }
+
+  c.nsegments = c.nsegments - (last - first) + n;
+  c.len = c.len - len + datalen;
+
+  return true;
+}
+
+bool fs::file_model::split(struct composition& c, uint64_t off, size_t& pos)
+{
+  uint64_t begin = 0;
+
+  for (size_t i = 0; i < c.nsegments; i++) {
+    composed_segment* s = &c.segments[i];
+
+    if (off == begin) {
+      pos = i;
+      return true;
+    }
+
+    if (off < begin + s->len) {
+      if (c.nsegments == c.size) {
+        size_t size = c.size * 2;
+
+        composed_segment* segments;
+        if ((segments = reinterpret_cast<composed_segment*>(
+                          realloc(c.segments, size * sizeof(composed_segment))
+                        )) == NULL) {
+          return false;
+        }
+
+        c.segments = segments;
+        c.size = size;
+
+        s = &c.segments[i];
+      }
+
+      memmove(c.segments + i + 2,
+              c.segments + i + 1,
+              (c.nsegments - i - 1) * sizeof(composed_segment));
+
+      uint64_t l = off - begin;
+
+      composed_segment* next = s + 1;
+      next->data = (s->data) ? s->data + l : NULL;
+      next->off = s->off + l;
+      next->len = s->len - l;
+
+      s->len = l;
+
+      c.nsegments++;
+
+      pos = i + 1;
+      return true;
+    }
+
+    begin += s->len;
+  }
+
+  pos = c.nsegments;
+
+  return true;
+}
+
+fs::file_model::operation_result
+fs::file_model::apply(const struct composition& c,
+                      uint64_t& off,
+                      uint64_t& oldlen,
+                      uint64_t& newlen)
+{
+  off = 0;
+  oldlen = 0;
+  newlen = 0;
+
+  struct edit* edits;
+  if ((edits = reinterpret_cast<struct edit*>(
+                 malloc((c.nsegments + 1) * sizeof(struct edit))
+               )) == NULL) {
+    return operation_result::kNoMemory;
+  }
+
+  file_piece* pieces = NULL;
+  if ((c.nsegments > 0) &&
+      ((pieces = reinterpret_cast<file_piece*>(
+                   malloc(c.nsegments * sizeof(file_piece))
+                 )) == NULL)) {
+    free(edits);
+    return operation_result::kNoMemory;
+  }
+
+  operation_result res = operation_result::kSuccess;
+
+  // The data between two segments of the current file (or between the
+  // segment and the end of the file) is replaced with the data of the
+  // segments in between (the data of the file on disk is referenced).
+  size_t nedits = 0;
+  size_t npieces = 0;
+
+  uint64_t cur = 0;
+  uint64_t datalen = 0;
+  size_t firstpiece = 0;
+
+  // Length of the data which is replaced.
+  uint64_t len = 0;
+
+  for (size_t i = 0; i <= c.nsegments; i++) {
+    if ((i < c.nsegments) && (c.segments[i].data)) {
+      pieces[npieces].data = c.segments[i].data;
+      pieces[npieces].len = c.segments[i].len;
+      pieces[npieces].owned = false;
+
+      npieces++;
+
+      datalen += c.segments[i].len;
+
+      continue;
+    }
+
+    uint64_t end = (i < c.nsegments) ? c.segments[i].off : _M_len;
+
+    if ((end > cur) || (datalen > 0)) {
+      // Block device?
+      if ((_M_block_device) && (end - cur != datalen)) {
+        res = operation_result::kErrorBlockDevice;
+        break;
+      }
+
+      struct edit* e = &edits[nedits++];
+      e->off = cur;
+      e->len = end - cur;
+      e->data = NULL;
+      e->datalen = datalen;
+      e->pieces = pieces + firstpiece;
+      e->npieces = npieces - firstpiece;
+      e->shared = false;
+
+      len += e->len;
+      newlen += datalen;
+    }
+
+    if (i < c.nsegments) {
+      cur = end + c.segments[i].len;
+      datalen = 0;
+      firstpiece = npieces;
+    }
+  }
+
+  if ((res == operation_result::kSuccess) &&
+      (nedits > 0) &&
+      ((res = apply_edits(edits, nedits)) == operation_result::kSuccess)) {
+    // Range which has changed.
+    off = edits[0].off;
+    oldlen = edits[nedits - 1].off + edits[nedits - 1].len - off;
+    newlen = oldlen - len + newlen;
+  } else {
+    newlen = 0;
+  }
+
+  if (pieces) {
+    free(pieces);
+  }
+
+  free(edits);
+
+  return res;
+}
+
+fs::file_model::operation_result fs::file_model::begin_batch()
+{
+  lock_guard lock(this, true);
+
+  // Read only mode?
+  if (_M_read_only) {
+    return operation_result::kErrorReadOnly;
+  }
+
+  // Batch already in progress?
+  if (_M_batch) {
+    return operation_result::kInvalidOperation;
+  }
+
+  _M_batch = true;
+
+  return operation_result::kSuccess;
+}
+
+fs::file_model::operation_result fs::file_model::commit()
+{
+  lock_guard lock(this, true);
+
+  if (!_M_batch) {
+    return operation_result::kInvalidOperation;
+  }
+
+  size_t nedits = _M_nbatch_edits;
+
+  // Nothing to commit?
+  if (nedits == 0) {
+    rollback();
+    return operation_result::kSuccess;
+  }
+
+  qsort(_M_batch_edits, nedits, sizeof(batch_edit), compare_batch_edits);
+
+  uint64_t len = 0;
+  uint64_t newlen = _M_batch_edits[0].datalen;
+
+  // Overlapping edits?
+  for (size_t i = 1; i < nedits; i++) {
+    const batch_edit* prev = &_M_batch_edits[i - 1];
+
+    if (_M_batch_edits[i].off < prev->off + prev->len) {
+      rollback();
+      return operation_result::kInvalidOperation;
+    }
+
+    newlen += _M_batch_edits[i].datalen;
+  }
+
+  struct edit* edits;
+  if ((edits = reinterpret_cast<struct edit*>(
+                 malloc(nedits * sizeof(struct edit))
+               )) == NULL) {
+    rollback();
+    return operation_result::kNoMemory;
+  }
+
+  bool record_change = _M_undo_enabled;
+
+  // The data of the edits (sorted by offset) is owned by the change.
+  uint8_t* newdata = NULL;
+  uint64_t* positions = NULL;
+
+  if (record_change) {
+    if (((newlen > 0) &&
+         ((newdata = reinterpret_cast<uint8_t*>(malloc(newlen))) == NULL)) ||
+        ((positions = reinterpret_cast<uint64_t*>(
+                        malloc(3 * nedits * sizeof(uint64_t))
+                      )) == NULL)) {
+      if (newdata) {
+        free(newdata);
+      }
+
+      free(edits);
+      rollback();
+
+      return operation_result::kNoMemory;
+    }
+  }
+
+  uint8_t* ptr = newdata;
+
+  for (size_t i = 0; i < nedits; i++) {
+    const batch_edit* e = &_M_batch_edits[i];
+
+    edits[i].off = e->off;
+    edits[i].len = e->len;
+    edits[i].datalen = e->datalen;
+    edits[i].pieces = NULL;
+    edits[i].npieces = 0;
+    edits[i].shared = false;
+
+    len += e->len;
+
+    if (record_change) {
+      // The removals have no data (the buffers might be NULL).
+      if (e->datalen > 0) {
+        memcpy(ptr, _M_batch_data + e->dataoff, e->datalen);
+      }
+
+      edits[i].data = ptr;
+
+      ptr += e->datalen;
+
+      positions[3 * i] = e->off;
+      positions[(3 * i) + 1] = e->len;
+      positions[(3 * i) + 2] = e->datalen;
+    } else {
+      edits[i].data = _M_batch_data + e->dataoff;
+    }
+  }
+
+  if (record_change) {
+    // Get data to be replaced.
+    uint8_t* olddata;
+    file_piece* pieces;
+    size_t npieces;
+    uint64_t oldlen;
+    if (!get_undo_data(edits, nedits, oldlen, olddata, pieces, npieces)) {
+      if (newdata) {
+        free(newdata);
+      }
+
+      free(positions);
+      free(edits);
+      rollback();
+
+      return operation_result::kNoMemory;
+    }
+
+    _M_changes.erase_from_position(_M_nchange);
+
+    // Record change.
+    if (!_M_changes.batch(olddata,
+                          oldlen,
+                          pieces,
+                          npieces,
+                          newdata,
+                          newlen,
+                          positions,
+                          nedits)) {
+      if (olddata) {
+        free(olddata);
+      }
+
+      if (pieces) {
+        free(pieces);
+      }
+
+      if (newdata) {
+        free(newdata);
+      }
+
+      free(positions);
+      free(edits);
+      rollback();
+
+      return operation_result::kNoMemory;
+    }
+  }
+
+  // Range which changes.
+  uint64_t off = edits[0].off;
+  uint64_t end = edits[nedits - 1].off + edits[nedits - 1].len;
+
+  operation_result res;
+  if ((res = apply_edits(edits, nedits)) == operation_result::kSuccess) {
+    if (record_change) {
+      change_recorded();
+    }
+
+    notify(off, end - off, end - off - len + newlen);
+  } else if (record_change) {
+    _M_changes.erase_last_change();
+  }
+
+  free(edits);
+  rollback();
+
+  return res;
+}
+
+void fs::file_model::rollback()
+{
+  lock_guard lock(this, true);
+
+  if (_M_batch_edits) {
+    free(_M_batch_edits);
+    _M_batch_edits = NULL;
+  }
+
+  _M_nbatch_edits = 0;
+  _M_batch_edits_size = 0;
+
+  if (_M_batch_data) {
+    free(_M_batch_data);
+    _M_batch_data = NULL;
+  }
+
+  _M_batch_data_len = 0;
+  _M_batch_data_size = 0;
+
+  _M_batch = false;
+}
+
+fs::file_model::operation_result fs::file_model::stage(uint64_t off,
+                                                       uint64_t len,
+                                                       const void* data,
+                                                       uint64_t datalen)
+{
+  // Read only mode?
+  if (_M_read_only) {
+    return operation_result::kErrorReadOnly;
+  }
+
+  // Block device?
+  if ((_M_block_device) && (len != datalen)) {
+    return operation_result::kErrorBlockDevice;
+  }
+
+  // If the end of the edit is beyond the end of the file...
+  if ((off > _M_len) || (len > _M_len - off)) {
+    return operation_result::kInvalidOperation;
+  }
+
+  // Nothing to do?
+  if ((len == 0) && (datalen == 0)) {
+    return operation_result::kSuccess;
+  }
+
+  uint8_t* dest;
+  if (!append_staged_edit(off, len, datalen, dest)) {
+    return operation_result::kNoMemory;
+  }
+
+  if (datalen > 0) {
+    memcpy(dest, data, datalen);
+  }
+
+  return operation_result::kSuccess;
+}
+
+bool fs::file_model::append_staged_edit(uint64_t off,
+                                        uint64_t len,
+                                        uint64_t datalen,
+                                        uint8_t*& data)
+{
+  if (_M_nbatch_edits == _M_batch_edits_size) {
+    size_t size = (_M_batch_edits_size == 0) ? 32 : _M_batch_edits_size * 2;
+
+    batch_edit* e;
+    if ((e = reinterpret_cast<batch_edit*>(
+               realloc(_M_batch_edits, size * sizeof(batch_edit))
+             )) == NULL) {
+      return false;
+    }
+
+    _M_batch_edits = e;
+    _M_batch_edits_size = size;
+  }
+
+  if (datalen > _M_batch_data_size - _M_batch_data_len) {
+    uint64_t size = (_M_batch_data_size == 0) ? 4096 : _M_batch_data_size;
+    while (datalen > size - _M_batch_data_len) {
+      size *= 2;
+    }
+
+    uint8_t* d;
+    if ((d = reinterpret_cast<uint8_t*>(realloc(_M_batch_data, size))) ==
+        NULL) {
+      return false;
+    }
+
+    _M_batch_data = d;
+    _M_batch_data_size = size;
+  }
+
+  data = _M_batch_data + _M_batch_data_len;
+
+  batch_edit* e = &_M_batch_edits[_M_nbatch_edits];
+  e->off = off;
+  e->len = len;
+  e->dataoff = _M_batch_data_len;
+  e->datalen = datalen;
+  e->seq = _M_nbatch_edits;
+
+  _M_nbatch_edits++;
+  _M_batch_data_len += datalen;
+
+  return true;
+}
+
+int fs::file_model::compare_batch_edits(const void* e1, const void* e2)
+{
+  const batch_edit* edit1 = reinterpret_cast<const batch_edit*>(e1);
+  const batch_edit* edit2 = reinterpret_cast<const batch_edit*>(e2);
+
+  if (edit1->off != edit2->off) {
+    return (edit1->off < edit2->off) ? -1 : 1;
+  }
+
+  // The additions go before the data which is replaced at the same offset.
+  if ((edit1->len == 0) != (edit2->len == 0)) {
+    return (edit1->len == 0) ? -1 : 1;
+  }
+
+  return (edit1->seq < edit2->seq) ? -1 : 1;
+}
+
+fs::file_model::operation_result
+fs::file_model::apply_batch(const struct file_change* chg, bool undo)
+{
+  size_t nedits = chg->npositions / 3;
+
+  struct edit* edits;
+  if ((edits = reinterpret_cast<struct edit*>(
+                 malloc(nedits * sizeof(struct edit))
+               )) == NULL) {
+    return operation_result::kNoMemory;
+  }
+
+  const uint8_t* olddata = chg->olddata;
+  const uint8_t* newdata = chg->newdata;
+  size_t piece = 0;
+
+  // Difference of length of the previous edits.
+  uint64_t shift = 0;
+
+  for (size_t i = 0; i < nedits; i++) {
+    uint64_t off = chg->positions[3 * i];
+    uint64_t len = chg->positions[(3 * i) + 1];
+    uint64_t newlen = chg->positions[(3 * i) + 2];
+
+    // Block device?
+    if ((_M_block_device) && (len != newlen)) {
+      free(edits);
+      return operation_result::kErrorBlockDevice;
+    }
+
+    if (undo) {
+      // The new data is replaced with the old data.
+      edits[i].off = off + shift;
+      edits[i].len = newlen;
+      edits[i].datalen = len;
+
+      if (chg->pieces) {
+        // The pieces of the edit.
+        edits[i].data = NULL;
+        edits[i].pieces = chg->pieces + piece;
+        edits[i].npieces = 0;
+
+        for (uint64_t l = 0; l < len; piece++) {
+          l += chg->pieces[piece].len;
+          edits[i].npieces++;
+        }
+      } else {
+        edits[i].data = olddata;
+        edits[i].pieces = NULL;
+        edits[i].npieces = 0;
+
+        olddata += len;
+      }
+    } else {
+      edits[i].off = off;
+      edits[i].len = len;
+      edits[i].data = newdata;
+      edits[i].datalen = newlen;
+      edits[i].pieces = NULL;
+      edits[i].npieces = 0;
+
+      newdata += newlen;
+    }
+
+    edits[i].shared = false;
+
+    shift += (newlen - len);
+  }
+
+  // Range which changes.
+  uint64_t off = edits[0].off;
+  uint64_t end = edits[nedits - 1].off + edits[nedits - 1].len;
+
+  // If the last edit is beyond the end of the file...
+  if (end > _M_len) {
+    free(edits);
+    return operation_result::kInvalidOperation;
+  }
+
+  operation_result res;
+  if ((res = apply_edits(edits, nedits)) == operation_result::kSuccess) {
+    uint64_t len = undo ? chg->newlen : chg->len;
+    uint64_t newlen = undo ? chg->len : chg->newlen;
+
+    notify(off, end - off, end - off - len + newlen);
+  }
+
+  free(edits);
+
+  return res;
+}
+
+fs::file_model::operation_result fs::file_model::undo()
+{
+  lock_guard lock(this, true);
+
+  // Read only mode?
+  if (_M_read_only) {
+    return operation_result::kErrorReadOnly;
+  }
+
+  // Batch in progress?
+  if (_M_batch) {
+    return operation_result::kInvalidOperation;
+  }
+
+  if (!_M_undo_enabled) {
+    return operation_result::kErrorUndoDisabled;
+  }
+
+  if (_M_nchange == 0) {
+    return operation_result::kNoMoreChanges;
+  }
+
+  // If the change has been spilled to the journal...
+  if (!_M_changes.fetch(_M_nchange - 1)) {
+    return operation_result::kNoMemory;
+  }
+
+  const struct file_change* chg = _M_changes.get(_M_nchange - 1);
+
+  operation_result res;
+
+  switch (chg->t) {
+    case file_change::type::kModify:
+      res = (chg->pieces) ? restore(chg->off, chg->len, chg) :
+                            modify(chg->off, chg->olddata, chg->len, false);
+
+      break;
+    case file_change::type::kAdd:
+      res = remove(chg->off, chg->len, false);
+      break;
+    case file_change::type::kRemove:
+      res = (chg->pieces) ? restore(chg->off, 0, chg) :
+                            add(chg->off, chg->olddata, chg->len, false);
+
+      break;
+    case file_change::type::kBatch:
+      res = apply_batch(chg, true);
+      break;
+    case file_change::type::kCopy:
+      res = remove(chg->dst, chg->len, false);
+      break;
+    case file_change::type::kFill:
+      res = restore(chg->off, chg->newlen, chg);
+      break;
+    case file_change::type::kMove:
+      // Move the data back.
+      res = (chg->dst > chg->off) ?
+              clone_range(chg->dst - chg->len, chg->len, chg->off, true, false) :
+              clone_range(chg->dst,
+                          chg->len,
+                          chg->off + chg->len,
+                          true,
+                          false);
+
+      break;
+    default: // file_change::type::kReplace.
+      res = replace(chg->positions,
+                    chg->npositions,
+                    chg->newlen - chg->len,
+                    chg->newlen,
+                    chg->olddata,
+                    chg->len);
+
+      break;
+  }
+
+  if (res == operation_result::kSuccess) {
+    // The next change is not merged into the previous one.
+    _M_changes.seal();
+
+    _M_nchange--;
+    return operation_result::kSuccess;
+  } else {
+    return res;
+  }
+}
+
+fs::file_model::operation_result fs::file_model::redo()
+{
+  lock_guard lock(this, true);
+
+  // Read only mode?
+  if (_M_read_only) {
+    return operation_result::kErrorReadOnly;
+  }
+
+  // Batch in progress?
+  if (_M_batch) {
+    return operation_result::kInvalidOperation;
+  }
+
+  if (!_M_undo_enabled) {
+    return operation_result::kErrorUndoDisabled;
+  }
+
+  if (_M_nchange == _M_changes.size()) {
+    return operation_result::kNoMoreChanges;
+  }
+
+  // If the change has been spilled to the journal...
+  if (!_M_changes.fetch(_M_nchange)) {
+    return operation_result::kNoMemory;
+  }
+
+  const struct file_change* chg = _M_changes.get(_M_nchange);
+
+  operation_result res;
+
+  switch (chg->t) {
+    case file_change::type::kModify:
+      res = chg->referenced ?
+              source_blocks(chg->off, chg->len, chg->newdata, chg->len, false) :
+              modify(chg->off, chg->newdata, chg->len, false);
+
+      break;
+    case file_change::type::kAdd:
+      res = chg->referenced ?
+              source_blocks(chg->off, 0, chg->newdata, chg->len, false) :
+              add(chg->off, chg->newdata, chg->len, false);
+
+      break;
+    case file_change::type::kRemove:
+      res = remove(chg->off, chg->len, false);
+      break;
+    case file_change::type::kBatch:
+      res = apply_batch(chg, false);
+      break;
+    case file_change::type::kCopy:
+    case file_change::type::kMove:
+      res = clone_range(chg->off,
+                        chg->len,
+                        chg->dst,
+                        (chg->t == file_change::type::kMove),
+                        false);
+
+      break;
+    case file_change::type::kFill:
+      res = fill_blocks(chg->off,
+                        chg->len,
+                        chg->newlen,
+                        chg->newdata,
+                        chg->patternlen,
+                        false);
+
+      break;
+    default: // file_change::type::kReplace.
+      res = replace(chg->positions,
+                    chg->npositions,
+                    0,
+                    chg->len,
+                    chg->newdata,
+                    chg->newlen);
+
+      break;
+  }
+
+  if (res == operation_result::kSuccess) {
+    // The next change is not merged into the previous one.
+    _M_changes.seal();
+
+    _M_nchange++;
+    return operation_result::kSuccess;
+  } else {
+    return res;
+  }
+}
+
+fs::file_model::operation_result fs::file_model::goto_revision(size_t n)
+{
+  lock_guard lock(this, true);
+
+  // Read only mode?
+  if (_M_read_only) {
+    return operation_result::kErrorReadOnly;
+  }
+
+  // Batch in progress?
+  if (_M_batch) {
+    return operation_result::kInvalidOperation;
+  }
+
+  if (!_M_undo_enabled) {
+    return operation_result::kErrorUndoDisabled;
+  }
+
+  if (n > _M_changes.size()) {
+    return operation_result::kNoMoreChanges;
+  }
+
+  if (n == _M_nchange) {
+    return operation_result::kSuccess;
+  }
+
+  // If the target is the file on disk...
+  if (n == _M_saved_change) {
+    return revert();
+  }
+
+  size_t first = (n < _M_nchange) ? n : _M_nchange;
+  size_t last = (n < _M_nchange) ? _M_nchange : n;
+
+  // If some of the changes have been spilled to the journal...
+  for (size_t i = first; i < last; i++) {
+    if (!_M_changes.fetch(i)) {
+      return operation_result::kNoMemory;
+    }
+  }
+
+  // The copies / moves and the fills cannot be composed (their new data is
+  // not recorded): the changes are undone / redone one by one.
+  for (size_t i = first; i < last; i++) {
+    file_change::type t = _M_changes.get(i)->t;
+
+    if ((t == file_change::type::kCopy) ||
+        (t == file_change::type::kMove) ||
+        (t == file_change::type::kFill)) {
+      operation_result res = operation_result::kSuccess;
+
+      while ((_M_nchange > n) && (res == operation_result::kSuccess)) {
+        res = undo();
+      }
+
+      while ((_M_nchange < n) && (res == operation_result::kSuccess)) {
+        res = redo();
+      }
+
+      return res;
+    }
+  }
+
+  struct composition c;
+  c.segments = NULL;
+  c.nsegments = 0;
+  c.size = 0;
+  c.len = 0;
+
+  // The composed file starts as the current file.
+  if ((_M_len > 0) && (!compose(c, 0, 0, NULL, _M_len))) {
+    return operation_result::kNoMemory;
+  }
+
+  operation_result res = operation_result::kSuccess;
+
+  if (n < _M_nchange) {
+    // Undo the changes from the last one.
+    size_t i = _M_nchange;
+    while ((i > n) && (res == operation_result::kSuccess)) {
+      res = compose_undo(c, _M_changes.get(--i));
+    }
+  } else {
+    // Redo the changes.
+    size_t i = _M_nchange;
+    while ((i < n) && (res == operation_result::kSuccess)) {
+      res = compose(c, _M_changes.get(i++));
+    }
+  }
+
+  uint64_t off, oldlen, newlen;
+  if ((res == operation_result::kSuccess) &&
+      ((res = apply(c, off, oldlen, newlen)) == operation_result::kSuccess) &&
+      ((oldlen > 0) || (newlen > 0))) {
+    notify(off, oldlen, newlen);
+  }
+
+  if (c.segments) {
+    free(c.segments);
+  }
+
+  if (res == operation_result::kSuccess) {
+    // The next change is not merged into the previous one.
+    _M_changes.seal();
+
+    _M_nchange = n;
+  }
+
+  return res;
+}
+
+fs::file_model::operation_result fs::file_model::revert()
+{
+  lock_guard lock(this, true);
+
+  // Read only mode?
+  if (_M_read_only) {
+    return operation_result::kErrorReadOnly;
+  }
+
+  // Batch in progress?
+  if (_M_batch) {
+    return operation_result::kInvalidOperation;
+  }
+
+  // If the file has not been modified...
+  if (!_M_modified) {
+    return operation_result::kSuccess;
+  }
+
+  struct block* b = NULL;
+
+  // If the file on disk is not empty...
+  if ((_M_filesize > 0) &&
+      ((b = reinterpret_cast<struct block*>(
+              malloc(sizeof(struct block))
+            )) == NULL)) {
+    return operation_result::kNoMemory;
+  }
+
+  uint64_t len = _M_len;
+
+  // Free blocks.
+  free_block_list(_M_header.next, &_M_header);
+
+  _M_header.prev = &_M_header;
+  _M_header.next = &_M_header;
+
+  if (b) {
+    b->data = reinterpret_cast<uint8_t*>(_M_data);
+    b->len = _M_filesize;
+    b->in_memory = false;
+
+    b->prev = &_M_header;
+    b->next = &_M_header;
+
+    _M_header.prev = b;
+    _M_header.next = b;
+  }
+
+  _M_len = _M_filesize;
+
+  _M_memory_used = 0;
+
+  _M_modified = false;
+  _M_size_modified = false;
+
+  // If the history doesn't contain the file on disk...
+  if (_M_saved_change == kNoRevision) {
+    _M_changes.clear();
+    _M_saved_change = 0;
+  }
+
+  _M_nchange = _M_saved_change;
+
+  // The next change is not merged into the previous one.
+  _M_changes.seal();
+
+  if ((_M_session.is_open()) &&
+      (!_M_session.append(session_journal::record_type::kRevert,
+                          0,
+                          0,
+                          NULL,
+                          0,
+                          0))) {
+    _M_session.discard();
+  }
+
+  notify(0, len, _M_len);
+
+  return operation_result::kSuccess;
+}
+
+bool fs::file_model::get(uint64_t off, void* data, uint64_t& len) const
+{
+  lock_guard lock(this, false);
+
+  // Seek to offset.
+  const struct block* b;
+  uint64_t pos;
+  if (!seek(off, b, pos)) {
+    return false;
+  }
+
+  uint64_t start = prefetcher::now();
+
+  get(b, pos, data, len);
+
+  _M_prefetcher.record_read(len, prefetcher::now() - start);
+
+  if (_M_prefetcher.running()) {
+    prefetch(off, len);
+  }
+
+  return true;
+}
+
+bool fs::file_model::dirty_ranges(dirty_range_callback callback,
+                                  void* arg) const
+{
+  lock_guard lock(this, false);
+
+  const uint8_t* disk = reinterpret_cast<const uint8_t*>(_M_data);
+
+  // Offset of the file on disk which follows the last data in its place.
+  uint64_t diskpos = 0;
+
+  dirty_range range;
+  range.off = 0;
+  range.len = 0;
+
+  uint64_t off = 0;
+
+  const struct block* b = _M_header.next;
+  while (true) {
+    // If the end of the file has been reached or the block references the
+    // file on disk after the last data in its place...
+    if ((b == &_M_header) ||
+        ((!b->in_memory) && (on_disk(b->data)) &&
+         (b->data >= disk + diskpos))) {
+      uint64_t diskoff = (b != &_M_header) ? b->data - disk : _M_filesize;
+
+      if ((range.len > 0) || (diskoff > diskpos)) {
+        range.diskoff = diskpos;
+        range.disklen = diskoff - diskpos;
+
+        if (!callback(range, arg)) {
+          return false;
+        }
+      }
+
+      if (b == &_M_header) {
+        return true;
+      }
+
+      diskpos = diskoff + b->len;
+
+      range.off = off + b->len;
+      range.len = 0;
+    } else {
+      range.len += b->len;
+    }
+
+    off += b->len;
+
+    b = b->next;
+  }
+}
+
+bool fs::file_model::save_in_place()
+{
+  // The data would be written to the previous file (unlinked).
+  if ((!_M_block_device) && (replaced())) {
+    return false;
+  }
+
+  // Write blocks.
+  uint64_t off = 0;
+  const struct block* b = _M_header.next;
+  while (b != &_M_header) {
+    // If the block is either in memory or a fill...
+    if ((b->in_memory) || (!on_disk(b->data))) {
+      // Copy the data referenced by the undo records which is about to be
+      // overwritten.
+      if (!materialize(off, b->len)) {
+        return false;
+      }
+
+#if defined(__linux__)
+      // If the zeros can be written as a hole...
+      if ((!_M_block_device) &&
+          (zero_fill(b)) &&
+          (fallocate(_M_fd,
+                     FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                     off,
+                     b->len) == 0)) {
+        _M_index.invalidate(off, b->len);
+
+        off += b->len;
+
+        b = b->next;
+
+        continue;
+      }
+#endif
+
+      // Seek.
+      if (lseek(_M_fd, off, SEEK_SET) != static_cast<off_t>(off)) {
+        return false;
+      }
+
+      // Write block.
+      if (write(_M_fd, view(b), b->len) != b->len) {
+        return false;
+      }
+
+      _M_index.invalidate(off, b->len);
+    }
+
+    off += b->len;
+
+    b = b->next;
+  }
+
+  // The file is mapped with MAP_SHARED: replace the blocks with a single
+  // block referencing the whole mapping (the contents don't change, the
+  // listeners are not notified).
+  struct block* first = _M_header.next;
+  if (first != &_M_header) {
+    free_block_list(first->next, &_M_header);
+
+    if (first->in_memory) {
+      release_page(first->data);
+    }
+
+    first->data = reinterpret_cast<uint8_t*>(_M_data);
+    first->len = _M_filesize;
+    first->in_memory = false;
+    first->next = &_M_header;
+
+    _M_header.prev = first;
+  }
+
+  _M_memory_used = 0;
+
+  _M_modified = false;
+
+  // The file on disk is the current revision (the next change is not
+  // merged into the previous one).
+  _M_saved_change = _M_nchange;
+  _M_changes.seal();
+
+  return true;
+}
+
+bool fs::file_model::open_session()
+{
+  char filename[PATH_MAX];
+  if (snprintf(filename,
+               sizeof(filename),
+               "%s.journal",
+               _M_filename) >= static_cast<int>(sizeof(filename))) {
+    return true;
+  }
+
+  // Get file status.
+  struct stat sbuf;
+  if (fstat(_M_fd, &sbuf) < 0) {
+    return true;
+  }
+
+  // If there is no journal of a previous session (or the file on disk has
+  // changed since)...
+  if (!_M_session.load(filename, _M_filesize, sbuf.st_mtim)) {
+    // Start a new session (the file can be edited without journal).
+    _M_session.create(filename, _M_filesize, sbuf.st_mtim);
+    return true;
+  }
+
+  struct composition c;
+  c.segments = NULL;
+  c.nsegments = 0;
+  c.size = 0;
+  c.len = 0;
+
+  // The composed file starts as the file on disk.
+  bool ok = ((_M_len == 0) || (compose(c, 0, 0, NULL, _M_len)));
+
+  // Replay the edits.
+  session_journal::record r;
+  const struct fill_buffer* fb;
+  const struct source_file* src;
+  char srcname[PATH_MAX];
+  while ((ok) && (_M_session.next(r))) {
+    switch (r.t) {
+      case session_journal::record_type::kData:
+        ok = ((r.off <= c.len) &&
+              (r.len <= c.len - r.off) &&
+              (compose(c, r.off, r.len, r.data, r.datalen)));
+
+        break;
+      case session_journal::record_type::kDisk:
+        ok = ((r.off <= c.len) &&
+              (r.len <= c.len - r.off) &&
+              (r.diskoff <= _M_filesize) &&
+              (r.datalen <= _M_filesize - r.diskoff) &&
+              (compose(c,
+                       r.off,
+                       r.len,
+                       reinterpret_cast<const uint8_t*>(_M_data) + r.diskoff,
+                       r.datalen)));
+
+        break;
+      case session_journal::record_type::kFill:
+        ok = ((r.off <= c.len) &&
+              (r.len <= c.len - r.off) &&
+              (r.datalen > 0) &&
+              (r.diskoff > 0) &&
+              (r.diskoff <= kMaxPatternLength) &&
+              ((fb = get_fill_buffer(r.data, r.diskoff)) != NULL));
+
+        // The fill is made of chunks of the buffer of the pattern.
+        for (uint64_t pos = 0; (ok) && (pos < r.datalen); pos += fb->size) {
+          uint64_t l = ((r.datalen - pos) < fb->size) ? r.datalen - pos :
+                                                        fb->size;
+
+          ok = compose(c,
+                       r.off + pos,
+                       (pos == 0) ? r.len : 0,
+                       fb->data,
+                       l);
+        }
+
+        break;
+      case session_journal::record_type::kSource:
+        // The reference is the offset in the source file followed by its
+        // name.
+        if ((ok = ((r.off <= c.len) &&
+                   (r.len <= c.len - r.off) &&
+                   (r.diskoff > 8) &&
+                   (r.diskoff - 8 < sizeof(srcname)))) == true) {
+          memcpy(srcname, r.data + 8, r.diskoff - 8);
+          srcname[r.diskoff - 8] = 0;
+
+          uint64_t srcoff = get_le64(r.data);
+
+          ok = (((src = get_source(srcname)) != NULL) &&
+                (srcoff <= src->size) &&
+                (r.datalen <= src->size - srcoff) &&
+                (compose(c, r.off, r.len, src->data + srcoff, r.datalen)));
+        }
+
+        break;
+      default: // session_journal::record_type::kRevert.
+        c.nsegments = 0;
+        c.len = 0;
+
+        ok = ((_M_len == 0) || (compose(c, 0, 0, NULL, _M_len)));
+    }
+  }
+
+  // The data of the journal is copied to memory.
+  uint64_t off, oldlen, newlen;
+  ok = ((ok) &&
+        (apply(c, off, oldlen, newlen) == operation_result::kSuccess));
+
+  if (c.segments) {
+    free(c.segments);
+  }
+
+  // If the session cannot be recovered, the journal is kept.
+  if (!ok) {
+    _M_session.close();
+    return false;
+  }
+
+  if (_M_modified) {
+    _M_recovered = true;
+
+    // The history doesn't contain the file on disk.
+    _M_saved_change = kNoRevision;
+  }
+
+  // Continue the session.
+  _M_session.resume();
+
+  return true;
+}
+
+bool fs::file_model::replaced() const
+{
+  struct stat sbuf;
+  return ((stat(_M_filename, &sbuf) < 0) ||
+          (sbuf.st_dev != _M_dev) ||
+          (sbuf.st_ino != _M_ino));
+}
+
+void fs::file_model::reset_session()
+{
+  if (!_M_session.is_open()) {
+    return;
+  }
+
+  // Get file status.
+  struct stat sbuf;
+  if ((fstat(_M_fd, &sbuf) < 0) ||
+      (!_M_session.reset(_M_filesize, sbuf.st_mtim))) {
+    _M_session.discard();
+  }
+}
+
+void fs::file_model::journal(uint64_t off,
+                             uint64_t len,
+                             const uint8_t* data,
+                             uint64_t datalen)
+{
+  if (!_M_session.is_open()) {
+    return;
+  }
+
+  const uint8_t* begin = reinterpret_cast<const uint8_t*>(_M_data);
+
+  bool ok;
+
+  const struct fill_buffer* fb;
+  const struct source_file* src;
+
+  // If the data is in the file on disk...
+  if ((_M_data != MAP_FAILED) &&
+      (datalen > 0) &&
+      (data >= begin) &&
+      (data + datalen <= begin + _M_filesize)) {
+    ok = _M_session.append(session_journal::record_type::kDisk,
+                           off,
+                           len,
+                           NULL,
+                           datalen,
+                           data - begin);
+  } else if ((datalen > 0) && ((fb = find_fill_buffer(data)) != NULL)) {
+    // The data is a pattern repeated (starting at 'data').
+    ok = _M_session.append(session_journal::record_type::kFill,
+                           off,
+                           len,
+                           fb->data + ((data - fb->data) % fb->patternlen),
+                           datalen,
+                           fb->patternlen);
+  } else if ((datalen > 0) &&
+             ((src = find_source(data)) != NULL) &&
+             (data + datalen <= src->data + src->size)) {
+    // The reference is the offset in the source file followed by its name.
+    uint8_t ref[8 + PATH_MAX];
+    size_t namelen = strlen(src->filename);
+
+    put_le64(ref, data - src->data);
+    memcpy(ref + 8, src->filename, namelen);
+
+    ok = _M_session.append(session_journal::record_type::kSource,
+                           off,
+                           len,
+                           ref,
+                           datalen,
+                           8 + namelen);
+  } else {
+    ok = _M_session.append(session_journal::record_type::kData,
+                           off,
+                           len,
+                           data,
+                           datalen,
+                           0);
+  }
+
+  // If the journal cannot be written, the session is not journaled.
+  if (!ok) {
+    _M_session.discard();
   }
+}
 
-  // If the block is in memory...
-  if (b->in_memory) {
-    // Left in block in memory.
-    uint64_t left_memory_block = kMemoryBlockSize - b->len;
+void fs::file_model::journal(const struct edit* edits, size_t nedits)
+{
+  if (!_M_session.is_open()) {
+    return;
+  }
 
-    // If it fits...
-    if (len <= left_memory_block) {
-      uint64_t n = b->len - pos;
-      if (n > 0) {
-        memmove(b->data + pos + len, b->data + pos, n);
-      }
+  // The edits are replayed one after the other: the offsets are shifted
+  // by the previous edits.
+  uint64_t shift = 0;
 
-      // Copy from user's buffer.
-      memcpy(b->data + pos, data, len);
-      b->len += len;
+  for (size_t i = 0; i < nedits; i++) {
+    const struct edit* e = &edits[i];
 
-      _M_len += len;
+    uint64_t off = e->off + shift;
 
-      _M_modified = true;
-      _M_size_modified = true;
+    if ((e->pieces) && (e->npieces > 0)) {
+      // The first piece replaces the range, the next ones are added.
+      uint64_t len = e->len;
 
-      if (record_change) {
-        _M_nchange++;
-      }
+      for (size_t j = 0; j < e->npieces; j++) {
+        const uint8_t* data = e->pieces[j].data;
 
-      return operation_result::kSuccess;
-    } else if ((off == _M_len) && (left_memory_block > 0)) {
-      // Copy from user's buffer.
-      memcpy(b->data + pos, data, left_memory_block);
-      b->len += left_memory_block;
+        // If the piece is the buffer of a block in memory, it might be
+        // compressed.
+        if ((e->shared) && (!e->pieces[j].owned) && (!mapped(&e->pieces[j]))) {
+          struct block b;
+          b.data = const_cast<uint8_t*>(data);
+          b.len = e->pieces[j].len;
+          b.in_memory = true;
 
-      data = reinterpret_cast<const uint8_t*>(data) + left_memory_block;
-      len -= left_memory_block;
+          data = view(&b);
+        }
 
-      _M_len += left_memory_block;
-      off += left_memory_block;
+        journal(off, len, data, e->pieces[j].len);
 
-      _M_modified = true;
-      _M_size_modified = true;
+        off += e->pieces[j].len;
+        len = 0;
+      }
+    } else {
+      journal(off, e->len, e->data, e->datalen);
     }
-  }
 
-  struct block* first, *last;
-  size_t nblocks;
-  if (!add(reinterpret_cast<const uint8_t*>(data), len, first, last, nblocks)) {
-    if (record_change) {
-      _M_changes.erase_last_change();
-    }
+    shift += e->datalen - e->len;
+  }
+}
 
-    return operation_result::kNoMemory;
+void fs::file_model::get(const struct block* b,
+                         uint64_t pos,
+                         void* data,
+                         uint64_t& len) const
+{
+  uint64_t left;
+  if ((left = len) == 0) {
+    return;
   }
 
-  // If the blocks should be inserted before the current block...
-  if (pos == 0) {
-    first->prev = b->prev;
-    first->prev->next = first;
+  uint64_t written = 0;
 
-    last->next = b;
-    b->prev = last;
-  } else if (off != _M_len) {
-    // Not at the end of the file.
+  do {
+    const uint8_t* d = view(b);
 
-    uint8_t* buf;
-    uint64_t l = b->len - pos;
+    uint64_t count = b->len - pos;
+    if (count >= left) {
+      memcpy(data, d + pos, left);
+      len = written + left;
 
-    if (b->in_memory) {
-      if ((buf = reinterpret_cast<uint8_t*>(
-                   malloc(kMemoryBlockSize)
-                 )) == NULL) {
-        free_block_list(first, NULL);
+      return;
+    }
 
-        if (record_change) {
-          _M_changes.erase_last_change();
-        }
+    memcpy(data, d + pos, count);
+    data = reinterpret_cast<uint8_t*>(data) + count;
+    written += count;
+    left -= count;
 
-        return operation_result::kNoMemory;
-      }
+    b = b->next;
+    pos = 0;
+  } while (b != &_M_header);
 
-      memcpy(buf, b->data + pos, l);
+  len = written;
+}
 
-      nblocks++;
-    } else {
-      buf = b->data + pos;
+void fs::file_model::prefetch(uint64_t off, uint64_t len) const
+{
+  prefetcher::range ranges[prefetcher::kMaxRanges];
+  size_t nranges = _M_prefetcher.access(off, len, ranges);
+
+  for (size_t i = 0; i < nranges; i++) {
+    const struct block* b;
+    uint64_t pos;
+    if (!seek(ranges[i].off, b, pos)) {
+      continue;
     }
 
-    // Create new block.
-    struct block* blk;
-    if ((blk = reinterpret_cast<struct block*>(
-                 malloc(sizeof(struct block))
-               )) == NULL) {
-      if (b->in_memory) {
-        free(buf);
-      }
+    uint64_t left = ranges[i].len;
 
-      free_block_list(first, NULL);
+    // Only the data of the file on disk is prefetched.
+    while ((left > 0) && (b != &_M_header)) {
+      uint64_t count = ((b->len - pos) < left) ? b->len - pos : left;
 
-      if (record_change) {
-        _M_changes.erase_last_change();
+      if ((!b->in_memory) && (on_disk(b->data))) {
+        _M_prefetcher.prefetch(b->data + pos, b->data + pos + count);
       }
 
-      return operation_result::kNoMemory;
+      left -= count;
+
+      b = b->next;
+      pos = 0;
     }
+  }
+}
 
-    blk->data = buf;
-    blk->len = l;
+bool fs::file_model::seek(uint64_t off,
+                          const struct block*& b,
+                          uint64_t& pos) const
+{
+  // If the offset is beyond the end of file...
+  if (off >= _M_len) {
+    return false;
+  }
 
-    b->len -= l;
+  uint64_t n = 0;
 
-    blk->in_memory = b->in_memory;
+  // Search block which contains the offset 'off'.
+  const struct block* blk = _M_header.next;
+  do {
+    uint64_t next = n + blk->len;
+
+    if (off < next) {
+      b = blk;
+      pos = off - n;
 
-    blk->prev = last;
-    last->next = blk;
+      return true;
+    }
 
-    blk->next = b->next;
-    blk->next->prev = blk;
+    n = next;
+  } while ((blk = blk->next) != &_M_header);
 
-    b->next = first;
-    first->prev = b;
-  } else {
-    first->prev = b;
-    b->next = first;
+  return false;
+}
 
-    last->next = &_M_header;
-    _M_header.prev = last;
+bool fs::file_model::find_forward(uint64_t off,
+                                  const void* needle,
+                                  uint64_t needlelen,
+                                  uint64_t& position) const
+{
+  if (off + needlelen > _M_len) {
+    return false;
   }
 
-  _M_len += len;
-  _M_memory_used += (nblocks * kMemoryBlockSize);
+  if (needlelen == 0) {
+    return false;
+  }
 
-  _M_modified = true;
-  _M_size_modified = true;
+  // Seek to offset.
+  const struct block* b;
+  uint64_t pos;
+  if (!seek(off, b, pos)) {
+    return false;
+  }
 
-  if (record_change) {
-    _M_nchange++;
+  // Make 'off' point to the beginning of the block.
+  off -= pos;
+
+  if (find_forward(b, pos, off, needle, needlelen)) {
+    position = off + pos;
+    return true;
   }
 
-  return operation_result::kSuccess;
+  return false;
 }
 
-fs::file_model::operation_result fs::file_model::remove(uint64_t off,
-                                                        uint64_t len,
-                                                        bool record_change)
+struct fs::file_model::find_all_context {
+  const file_model* fm;
+
+  const void* needle;
+  uint64_t needlelen;
+
+  struct segment* segments;
+  size_t nsegments;
+
+  // Next segment to be searched.
+  size_t next;
+
+  // Segment being reported and maximum number of segments which can be
+  // searched ahead of it.
+  size_t reported;
+  size_t ahead;
+
+  // Number of bytes searched.
+  uint64_t searched;
+
+  std::atomic<bool> cancel;
+
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+};
+
+fs::file_model::find_all_result
+fs::file_model::find_all(uint64_t off,
+                         const void* needle,
+                         uint64_t needlelen,
+                         find_callback callback,
+                         void* arg,
+                         unsigned nthreads,
+                         progress_callback progress) const
 {
-  // Read only mode?
-  if (_M_read_only) {
-    return operation_result::kErrorReadOnly;
-  }
+  lock_guard lock(this, false);
 
-  // Block device?
-  if (_M_block_device) {
-    return operation_result::kErrorBlockDevice;
+  static const unsigned kSegmentsPerThread = 4;
+
+  if ((needlelen == 0) || (off + needlelen > _M_len)) {
+    return find_all_result::kCompleted;
   }
 
   // Seek to offset.
-  struct block* b;
+  const struct block* b;
   uint64_t pos;
   if (!seek(off, b, pos)) {
-    return operation_result::kInvalidOperation;
+    return find_all_result::kCompleted;
   }
 
-  // Nothing to modify?
-  if (len == 0) {
-    return operation_result::kSuccess;
+  // Range of the starting positions.
+  uint64_t total = _M_len - needlelen + 1 - off;
+
+  if (nthreads == 0) {
+    long n;
+    nthreads = ((n = sysconf(_SC_NPROCESSORS_ONLN)) > 0) ?
+                                                          static_cast<unsigned>(n) :
+                                                          1;
   }
 
-  // If undo is enabled and the change should be recorded...
-  if ((record_change &= _M_undo_enabled) == true) {
-    // Get data to be removed.
-    uint8_t* olddata;
-    if ((olddata = reinterpret_cast<uint8_t*>(malloc(len))) == NULL) {
-      return operation_result::kNoMemory;
+  // If the file is small or there is only one thread...
+  if ((total < kMinParallelSearch) || (nthreads == 1)) {
+    struct segment seg;
+    seg.b = b;
+    seg.pos = pos;
+    seg.off = off - pos;
+    seg.end = off + total;
+
+    while (find_forward(seg.b, seg.pos, seg.off, needle, needlelen, seg.end)) {
+      if (!callback(seg.off + seg.pos, arg)) {
+        return find_all_result::kCancelled;
+      }
+
+      seg.pos++;
     }
 
-    size_t l = len;
-    get(b, pos, olddata, l);
+    if ((progress) && (!progress(total, total, arg))) {
+      return find_all_result::kCancelled;
+    }
 
-    _M_changes.erase_from_position(_M_nchange);
+    return find_all_result::kCompleted;
+  }
 
-    // Record change.
-    if (!_M_changes.remove(off, olddata, l)) {
-      free(olddata);
-      return operation_result::kNoMemory;
-    }
+  // Split the range in segments.
+  size_t nsegments = nthreads * kSegmentsPerThread;
+  if (nsegments > total) {
+    nsegments = total;
+  } else if (total / nsegments > kMaxSegmentSize) {
+    nsegments = (total + kMaxSegmentSize - 1) / kMaxSegmentSize;
   }
 
-  if (off + len > _M_len) {
-    len = _M_len - off;
+  struct segment* segments;
+  if ((segments = reinterpret_cast<struct segment*>(
+                    malloc(nsegments * sizeof(struct segment))
+                  )) == NULL) {
+    return find_all_result::kNoMemory;
   }
 
-  // If the change is inside the block...
-  uint64_t n = pos + len;
-  if (n < b->len) {
-    // If the block is in disk...
-    if (!b->in_memory) {
-      // If not at the beginning of the block...
-      if (pos != 0) {
-        // Create new block in disk.
-        struct block* diskblk;
-        if ((diskblk = reinterpret_cast<struct block*>(
-                         malloc(sizeof(struct block))
-                       )) == NULL) {
-          if (record_change) {
-            _M_changes.erase_last_change();
-          }
+  // Search the first block of each segment.
+  uint64_t blkoff = off - pos;
+  for (size_t i = 0; i < nsegments; i++) {
+    struct segment* seg = &segments[i];
 
-          return operation_result::kNoMemory;
-        }
+    seg->begin = off + ((total / nsegments) * i);
+    seg->end = (i + 1 < nsegments) ? seg->begin + (total / nsegments) :
+                                     off + total;
 
-        diskblk->data = b->data + n;
-        diskblk->len = b->len - n;
+    while (blkoff + b->len <= seg->begin) {
+      blkoff += b->len;
+      b = b->next;
+    }
 
-        b->len = pos;
+    seg->b = b;
+    seg->pos = seg->begin - blkoff;
+    seg->off = blkoff;
 
-        diskblk->in_memory = false;
+    seg->positions = NULL;
+    seg->npositions = 0;
+    seg->size = 0;
 
-        diskblk->prev = b;
+    seg->done = false;
+    seg->full = false;
+    seg->error = false;
+  }
 
-        diskblk->next = b->next;
-        diskblk->next->prev = diskblk;
+  struct find_all_context ctx;
+  ctx.fm = this;
+  ctx.needle = needle;
+  ctx.needlelen = needlelen;
+  ctx.segments = segments;
+  ctx.nsegments = nsegments;
+  ctx.next = 0;
+  ctx.reported = 0;
+  ctx.ahead = nthreads * kSegmentsAhead;
+  ctx.searched = 0;
+  ctx.cancel = false;
+
+  pthread_mutex_init(&ctx.mutex, NULL);
+  pthread_cond_init(&ctx.cond, NULL);
+
+  if (nthreads > nsegments) {
+    nthreads = nsegments;
+  }
 
-        b->next = diskblk;
-      } else {
-        b->data += len;
-        b->len -= len;
-      }
-    } else {
-      // The block is in memory.
-      memmove(b->data + pos, b->data + n, b->len - n);
-      b->len -= len;
-    }
+  // Start threads.
+  pthread_t* threads;
+  if ((threads = reinterpret_cast<pthread_t*>(
+                   malloc(nthreads * sizeof(pthread_t))
+                 )) == NULL) {
+    pthread_cond_destroy(&ctx.cond);
+    pthread_mutex_destroy(&ctx.mutex);
 
-    _M_len -= len;
+    free(segments);
 
-    _M_modified = true;
-    _M_size_modified = true;
+    return find_all_result::kNoMemory;
+  }
 
-    if (record_change) {
-      _M_nchange++;
+  unsigned nstarted;
+  for (nstarted = 0; nstarted < nthreads; nstarted++) {
+    if (pthread_create(&threads[nstarted], NULL, find_all_worker, &ctx) != 0) {
+      break;
     }
+  }
 
-    return operation_result::kSuccess;
-  } else if (n == b->len) {
-    b->len = pos;
-    _M_len -= len;
+  bool ret = (nstarted > 0);
+  bool nomemory = !ret;
 
-    _M_modified = true;
-    _M_size_modified = true;
+  // Report the positions in offset order.
+  for (size_t i = 0; (i < nsegments) && (ret); i++) {
+    struct segment* seg = &segments[i];
 
-    if (record_change) {
-      _M_nchange++;
-    }
+    pthread_mutex_lock(&ctx.mutex);
 
-    return operation_result::kSuccess;
-  }
+    // Let the threads search the next segments.
+    ctx.reported = i;
+    pthread_cond_broadcast(&ctx.cond);
 
-  _M_len -= len;
+    bool done = false;
 
-  // If not at the beginning of the block...
-  if (pos != 0) {
-    len -= (b->len - pos);
+    do {
+      // Wait until the segment has been searched or its buffer is full.
+      while ((!seg->done) && (!seg->full)) {
+        if (progress) {
+          uint64_t searched = ctx.searched;
+          pthread_mutex_unlock(&ctx.mutex);
 
-    b->len = pos;
+          if (!progress(searched, total, arg)) {
+            ret = false;
+          }
 
-    b = b->next;
-  }
+          pthread_mutex_lock(&ctx.mutex);
 
-  struct block* prev = b->prev;
+          if (!ret) {
+            break;
+          }
 
-  do {
-    if (len >= b->len) {
-      struct block* next = b->next;
+          // Wait (at most 100 ms).
+          struct timespec ts;
+          clock_gettime(CLOCK_REALTIME, &ts);
 
-      len -= b->len;
+          if ((ts.tv_nsec += 100 * 1000 * 1000) >= 1000 * 1000 * 1000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000 * 1000 * 1000;
+          }
 
-      // If the data is in memory...
-      if (b->in_memory) {
-        free(b->data);
-        _M_memory_used -= kMemoryBlockSize;
+          pthread_cond_timedwait(&ctx.cond, &ctx.mutex, &ts);
+        } else {
+          pthread_cond_wait(&ctx.cond, &ctx.mutex);
+        }
       }
 
-      free(b);
+      if (!ret) {
+        break;
+      }
+
+      if (seg->error) {
+        nomemory = true;
+        ret = false;
+        break;
+      }
+
+      done = seg->done;
+
+      pthread_mutex_unlock(&ctx.mutex);
 
-      b = next;
-    } else {
-      // If the block is in disk...
-      if (!b->in_memory) {
-        b->data += len;
-      } else {
-        memmove(b->data, b->data + len, b->len - len);
+      for (size_t j = 0; j < seg->npositions; j++) {
+        if (!callback(seg->positions[j], arg)) {
+          ret = false;
+          break;
+        }
       }
 
-      b->len -= len;
+      pthread_mutex_lock(&ctx.mutex);
 
-      break;
-    }
-  } while (len > 0);
+      // The positions have been reported, the thread can go on.
+      seg->npositions = 0;
+      seg->full = false;
 
-  prev->next = b;
-  b->prev = prev;
+      pthread_cond_broadcast(&ctx.cond);
+    } while ((!done) && (ret));
 
-  _M_modified = true;
-  _M_size_modified = true;
+    pthread_mutex_unlock(&ctx.mutex);
 
-  if (record_change) {
-    _M_nchange++;
+    if ((done) && (seg->positions)) {
+      free(seg->positions);
+      seg->positions = NULL;
+    }
   }
 
-  return operation_result::kSuccess;
-}
+  if (!ret) {
+    pthread_mutex_lock(&ctx.mutex);
 
-fs::file_model::operation_result fs::file_model::undo()
-{
-  // Read only mode?
-  if (_M_read_only) {
-    return operation_result::kErrorReadOnly;
+    ctx.cancel = true;
+    pthread_cond_broadcast(&ctx.cond);
+
+    pthread_mutex_unlock(&ctx.mutex);
   }
 
-  if (!_M_undo_enabled) {
-    return operation_result::kErrorUndoDisabled;
+  // Wait for the threads to finish.
+  for (unsigned i = 0; i < nstarted; i++) {
+    pthread_join(threads[i], NULL);
   }
 
-  if (_M_nchange == 0) {
-    return operation_result::kNoMoreChanges;
+  free(threads);
+
+  for (size_t i = 0; i < nsegments; i++) {
+    if (segments[i].positions) {
+      free(segments[i].positions);
+    }
   }
 
-  const struct file_change* chg = _M_changes.get(_M_nchange - 1);
+  free(segments);
 
-  operation_result res;
+  pthread_cond_destroy(&ctx.cond);
+  pthread_mutex_destroy(&ctx.mutex);
 
-  switch (chg->t) {
-    case file_change::type::kModify:
-      res = modify(chg->off, chg->olddata, chg->len, false);
-      break;
-    case file_change::type::kAdd:
-      res = remove(chg->off, chg->len, false);
-      break;
-    default: // file_change::type::kRemove.
-      res = add(chg->off, chg->olddata, chg->len, false);
-      break;
+  if (nomemory) {
+    return find_all_result::kNoMemory;
   }
 
-  if (res == operation_result::kSuccess) {
-    _M_nchange--;
-    return operation_result::kSuccess;
-  } else {
-    return res;
+  if ((!ret) || ((progress) && (!progress(total, total, arg)))) {
+    return find_all_result::kCancelled;
   }
+
+  return find_all_result::kCompleted;
 }
 
-fs::file_model::operation_result fs::file_model::redo()
+bool fs::file_model::find_range(uint64_t begin,
+                                uint64_t end,
+                                const void* needle,
+                                uint64_t needlelen,
+                                find_callback callback,
+                                void* arg) const
 {
-  // Read only mode?
-  if (_M_read_only) {
-    return operation_result::kErrorReadOnly;
-  }
+  lock_guard lock(this, false);
 
-  if (!_M_undo_enabled) {
-    return operation_result::kErrorUndoDisabled;
+  if ((needlelen == 0) || (begin >= end) || (begin + needlelen > _M_len)) {
+    return true;
   }
 
-  if (_M_nchange == _M_changes.size()) {
-    return operation_result::kNoMoreChanges;
+  // Seek to offset.
+  const struct block* b;
+  uint64_t pos;
+  if (!seek(begin, b, pos)) {
+    return true;
   }
 
-  const struct file_change* chg = _M_changes.get(_M_nchange);
+  uint64_t off = begin - pos;
 
-  operation_result res;
+  while (find_forward(b, pos, off, needle, needlelen, end)) {
+    if (!callback(off + pos, arg)) {
+      return false;
+    }
 
-  switch (chg->t) {
-    case file_change::type::kModify:
-      res = modify(chg->off, chg->newdata, chg->len, false);
-      break;
-    case file_change::type::kAdd:
-      res = add(chg->off, chg->newdata, chg->len, false);
-      break;
-    default: // file_change::type::kRemove.
-      res = remove(chg->off, chg->len, false);
-      break;
+    pos++;
   }
 
-  if (res == operation_result::kSuccess) {
-    _M_nchange++;
-    return operation_result::kSuccess;
-  } else {
-    return res;
-  }
+  return true;
 }
 
-bool fs::file_model::get(uint64_t off, void* data, uint64_t& len) const
+bool fs::file_model::find(uint64_t off,
+                          regex& re,
+                          uint64_t& begin,
+                          uint64_t& end) const
 {
+  lock_guard lock(this, false);
+
   // Seek to offset.
   const struct block* b;
   uint64_t pos;
@@ -924,138 +6130,154 @@ bool fs::file_model::get(uint64_t off, void* data, uint64_t& len) const
     return false;
   }
 
-  get(b, pos, data, len);
-
-  return true;
-}
+  // Make 'off' point to the beginning of the block.
+  off -= pos;
 
-bool fs::file_model::save_in_place()
-{
-  // Write blocks.
-  uint64_t off = 0;
-  const struct block* b = _M_header.next;
-  while (b != &_M_header) {
-    // If the block is in memory...
-    if (b->in_memory) {
-      // Seek.
-      if (lseek(_M_fd, off, SEEK_SET) != static_cast<off_t>(off)) {
-        return false;
-      }
+  size_t prefixlen;
+  const uint8_t* prefix = re.prefix(prefixlen);
 
-      // Write block.
-      if (write(_M_fd, b->data, b->len) != b->len) {
-        return false;
-      }
+  // If the regular expression has a literal prefix...
+  if (prefixlen > 0) {
+    // Skip to the first occurrence of the prefix.
+    if (!find_forward(b, pos, off, prefix, prefixlen)) {
+      return false;
     }
-
-    off += b->len;
-
-    b = b->next;
   }
 
-  close();
-
-  return open(_M_filename);
-}
-
-void fs::file_model::get(const struct block* b,
-                         uint64_t pos,
-                         void* data,
-                         uint64_t& len) const
-{
-  uint64_t left;
-  if ((left = len) == 0) {
-    return;
+  if (!re.begin(off + pos, beginning_of_line(b, pos))) {
+    return false;
   }
 
-  uint64_t written = 0;
-
   do {
-    uint64_t count = b->len - pos;
-    if (count >= left) {
-      memcpy(data, b->data + pos, left);
-      len = written + left;
+    size_t consumed;
+    switch (re.feed(view(b) + pos, b->len - pos, consumed)) {
+      case regex::result::kMatch:
+        re.match(begin, end);
+        return true;
+      case regex::result::kIdle:
+        pos += consumed;
 
-      return;
-    }
+        // Skip to the next occurrence of the prefix.
+        if ((!find_forward(b, pos, off, prefix, prefixlen)) ||
+            (!re.begin(off + pos, beginning_of_line(b, pos)))) {
+          return false;
+        }
 
-    memcpy(data, b->data + pos, count);
-    data = reinterpret_cast<uint8_t*>(data) + count;
-    written += count;
-    left -= count;
+        break;
+      case regex::result::kNeedMoreData:
+        off += b->len;
 
-    b = b->next;
-    pos = 0;
-  } while (b != &_M_header);
+        // If we have reached the end of the file...
+        if ((b = b->next) == &_M_header) {
+          if (re.finish()) {
+            re.match(begin, end);
+            return true;
+          }
 
-  len = written;
+          return false;
+        }
+
+        pos = 0;
+        break;
+      default: // regex::result::kError.
+        return false;
+    }
+  } while (true);
 }
 
-bool fs::file_model::seek(uint64_t off,
-                          const struct block*& b,
-                          uint64_t& pos) const
+bool fs::file_model::find_forward(const struct block*& b,
+                                  uint64_t& pos,
+                                  uint64_t& off,
+                                  const void* needle,
+                                  uint64_t needlelen,
+                                  uint64_t end) const
 {
-  // If the offset is beyond the end of file...
-  if (off >= _M_len) {
-    return false;
-  }
+  // Trigrams of the needle (if the file has been indexed).
+  ngram_index::query q;
+  bool indexed = ((!_M_index.empty()) &&
+                  (_M_index.prepare(needle, needlelen, q)));
+
+  // The position might be past the end of the block (e.g. after skipping
+  // an occurrence which crosses the block boundary).
+  while ((pos > b->len) && (b->next != &_M_header)) {
+    pos -= b->len;
+    off += b->len;
 
-  uint64_t n = 0;
+    b = b->next;
+  }
 
-  // Search block which contains the offset 'off'.
-  const struct block* blk = _M_header.next;
   do {
-    uint64_t next = n + blk->len;
-
-    if (off < next) {
-      b = blk;
-      pos = off - n;
+    // If the search has reached the end offset...
+    if (off + pos >= end) {
+      return false;
+    }
 
-      return true;
+    // Length of the block which can contain occurrences starting before
+    // 'end'.
+    uint64_t len = b->len;
+    if ((end - off < len) && (end - off + needlelen - 1 < len)) {
+      len = end - off + needlelen - 1;
     }
 
-    n = next;
-  } while ((blk = blk->next) != &_M_header);
+    // If the block is in disk and the file has been indexed...
+    if ((indexed) && (!b->in_memory) && (on_disk(b->data))) {
+      // Offset of the block in the file on disk.
+      uint64_t base = b->data - reinterpret_cast<const uint8_t*>(_M_data);
 
-  return false;
-}
+      // Positions where the trigrams of the needle are inside the block.
+      uint64_t limit = (len >= q.prefixlen) ? len - q.prefixlen + 1 : 0;
 
-bool fs::file_model::find_forward(uint64_t off,
-                                  const void* needle,
-                                  uint64_t needlelen,
-                                  uint64_t& position) const
-{
-  if (off + needlelen > _M_len) {
-    return false;
-  }
+      while (pos < limit) {
+        // Skip the chunks which cannot contain an occurrence.
+        if ((pos = _M_index.next_candidate(q, base + pos, base + limit) -
+                   base) >= limit) {
+          break;
+        }
 
-  if (needlelen == 0) {
-    return false;
-  }
+        // Search the occurrences which start in the chunk.
+        uint64_t chunkend = ngram_index::chunk_end(base + pos) - base;
+        if (chunkend > limit) {
+          chunkend = limit;
+        }
 
-  // Seek to offset.
-  const struct block* b;
-  uint64_t pos;
-  if (!seek(off, b, pos)) {
-    return false;
-  }
+        uint64_t l = chunkend + needlelen - 1;
+        if (l > len) {
+          l = len;
+        }
 
-  // Make 'off' point to the beginning of the block.
-  off -= pos;
+        const uint8_t* p;
+        if ((p = reinterpret_cast<const uint8_t*>(memmem(b->data + pos,
+                                                         l - pos,
+                                                         needle,
+                                                         needlelen))) !=
+            NULL) {
+          pos = p - b->data;
+          return true;
+        }
+
+        pos = chunkend;
+      }
+    }
 
-  do {
     // If the needle fits in the current block...
-    if (pos + needlelen <= b->len) {
+    if (pos + needlelen <= len) {
+      const uint8_t* data = view(b);
+
       const uint8_t* p;
-      if ((p = reinterpret_cast<const uint8_t*>(memmem(b->data + pos,
-                                                       b->len - pos,
+      if ((p = reinterpret_cast<const uint8_t*>(memmem(data + pos,
+                                                       len - pos,
                                                        needle,
                                                        needlelen))) != NULL) {
-        position = off + (p - b->data);
+        pos = p - data;
         return true;
       }
 
-      pos = b->len - needlelen + 1;
+      // If the occurrences starting before 'end' have been searched...
+      if (len < b->len) {
+        return false;
+      }
+
+      pos = len - needlelen + 1;
     }
 
     const struct block* next;
@@ -1064,22 +6286,25 @@ bool fs::file_model::find_forward(uint64_t off,
     }
 
     for (uint64_t left = b->len - pos; left > 0; left--, pos++) {
-      if (memcmp(b->data + pos, needle, left) == 0) {
+      if (off + pos >= end) {
+        return false;
+      }
+
+      if (memcmp(view(b) + pos, needle, left) == 0) {
         uint64_t l = needlelen - left;
         uint64_t idx = left;
 
         do {
           if (l <= next->len) {
-            if (memcmp(next->data,
+            if (memcmp(view(next),
                        reinterpret_cast<const uint8_t*>(needle) + idx,
                        l) == 0) {
-              position = off + pos;
               return true;
             }
 
             break;
           } else {
-            if (memcmp(next->data,
+            if (memcmp(view(next),
                        reinterpret_cast<const uint8_t*>(needle) + idx,
                        next->len) == 0) {
               idx += next->len;
@@ -1103,6 +6328,113 @@ bool fs::file_model::find_forward(uint64_t off,
   } while (true);
 }
 
+bool fs::file_model::search_segment(struct segment* seg,
+                                    struct find_all_context* ctx) const
+{
+  while (find_forward(seg->b,
+                      seg->pos,
+                      seg->off,
+                      ctx->needle,
+                      ctx->needlelen,
+                      seg->end)) {
+    if (ctx->cancel) {
+      return true;
+    }
+
+    // If the buffer is full, wait until the positions have been reported.
+    if (seg->npositions == kMaxSegmentPositions) {
+      pthread_mutex_lock(&ctx->mutex);
+
+      seg->full = true;
+      pthread_cond_broadcast(&ctx->cond);
+
+      while ((seg->full) && (!ctx->cancel)) {
+        pthread_cond_wait(&ctx->cond, &ctx->mutex);
+      }
+
+      pthread_mutex_unlock(&ctx->mutex);
+
+      if (ctx->cancel) {
+        return true;
+      }
+    }
+
+    if (seg->npositions == seg->size) {
+      size_t size = (seg->size == 0) ? 256 : seg->size * 2;
+
+      uint64_t* positions;
+      if ((positions = reinterpret_cast<uint64_t*>(
+                         realloc(seg->positions, size * sizeof(uint64_t))
+                       )) == NULL) {
+        return false;
+      }
+
+      seg->positions = positions;
+      seg->size = size;
+    }
+
+    seg->positions[seg->npositions++] = seg->off + seg->pos;
+
+    seg->pos++;
+  }
+
+  return true;
+}
+
+void* fs::file_model::find_all_worker(void* arg)
+{
+  struct find_all_context* ctx = reinterpret_cast<struct find_all_context*>(
+                                   arg
+                                 );
+
+  pthread_mutex_lock(&ctx->mutex);
+
+  while ((ctx->next < ctx->nsegments) && (!ctx->cancel)) {
+    // Don't search too far ahead of the segment being reported.
+    if (ctx->next >= ctx->reported + ctx->ahead) {
+      pthread_cond_wait(&ctx->cond, &ctx->mutex);
+      continue;
+    }
+
+    struct segment* seg = &ctx->segments[ctx->next++];
+
+    pthread_mutex_unlock(&ctx->mutex);
+
+    bool error = !ctx->fm->search_segment(seg, ctx);
+
+    pthread_mutex_lock(&ctx->mutex);
+
+    seg->error = error;
+    seg->done = true;
+
+    ctx->searched += (seg->end - seg->begin);
+
+    pthread_cond_broadcast(&ctx->cond);
+  }
+
+  pthread_mutex_unlock(&ctx->mutex);
+
+  return NULL;
+}
+
+bool fs::file_model::beginning_of_line(const struct block* b,
+                                       uint64_t pos) const
+{
+  if (pos > 0) {
+    return (view(b)[pos - 1] == '\n');
+  }
+
+  // Skip empty blocks.
+  while ((b = b->prev) != &_M_header) {
+    if (b->len > 0) {
+      return (view(b)[b->len - 1] == '\n');
+    }
+  }
+
+  // Beginning of the file.
+  return true;
+}
+
 bool fs::file_model::find_backward(uint64_t off,
                                    const void* needle,
                                    uint64_t needlelen,
@@ -1140,9 +6472,11 @@ bool fs::file_model::find_backward(uint64_t off,
   do {
     // If the needle fits in the current block...
     if (needlelen <= pos) {
-      for (const uint8_t* p = b->data + pos - needlelen; p >= b->data; p--) {
+      const uint8_t* data = view(b);
+
+      for (const uint8_t* p = data + pos - needlelen; p >= data; p--) {
         if (memcmp(p, needle, needlelen) == 0) {
-          position = off + (p - b->data);
+          position = off + (p - data);
           return true;
         }
       }
@@ -1159,7 +6493,7 @@ bool fs::file_model::find_backward(uint64_t off,
 
     for (uint64_t left = pos; left > 0; left--) {
       uint64_t l = needlelen - left;
-      if (memcmp(b->data,
+      if (memcmp(view(b),
                  reinterpret_cast<const uint8_t*>(needle) + l,
                  left) == 0) {
         uint64_t tmpoff = off;
@@ -1168,14 +6502,14 @@ bool fs::file_model::find_backward(uint64_t off,
           if (l <= prev->len) {
             uint64_t idx = prev->len - l;
 
-            if (memcmp(prev->data + idx, needle, l) == 0) {
+            if (memcmp(view(prev) + idx, needle, l) == 0) {
               position = tmpoff + idx;
               return true;
             }
 
             break;
           } else {
-            if (memcmp(prev->data,
+            if (memcmp(view(prev),
                        reinterpret_cast<const uint8_t*>(needle) +
                        (l - prev->len),
                        prev->len) == 0) {
@@ -1203,16 +6537,21 @@ bool fs::file_model::add(const uint8_t* data,
                          uint64_t len,
                          struct block*& first,
                          struct block*& last,
-                         size_t& nblocks)
+                         uint64_t& size) const
 {
   struct block* header = NULL;
   struct block* prev = NULL;
 
-  size_t count = 0;
+  uint64_t memory = 0;
 
   while (len > 0) {
+    // Bulk data is stored in bigger buffers (fewer blocks), the end of the
+    // data in a buffer which has room for more data.
+    uint64_t bufsize = (len >= kLargeMemoryBlockSize) ? kLargeMemoryBlockSize :
+                                                        kMemoryBlockSize;
+
     uint8_t* buf;
-    if ((buf = reinterpret_cast<uint8_t*>(malloc(kMemoryBlockSize))) == NULL) {
+    if ((buf = allocate_page(bufsize)) == NULL) {
       free_block_list(header, NULL);
       return false;
     }
@@ -1221,13 +6560,13 @@ bool fs::file_model::add(const uint8_t* data,
     if ((b = reinterpret_cast<struct block*>(
                malloc(sizeof(struct block))
              )) == NULL) {
-      free(buf);
+      release_page(buf);
       free_block_list(header, NULL);
 
       return false;
     }
 
-    uint64_t l = (len < kMemoryBlockSize) ? len : kMemoryBlockSize;
+    uint64_t l = (len < bufsize) ? len : bufsize;
 
     memcpy(buf, data, l);
     data += l;
@@ -1249,26 +6588,26 @@ bool fs::file_model::add(const uint8_t* data,
 
     prev = b;
 
-    count++;
+    memory += bufsize;
   }
 
   first = header;
   last = prev;
 
-  nblocks = count;
+  size = memory;
 
   return true;
 }
 
 void fs::file_model::free_block_list(struct block* begin,
-                                     const struct block* end)
+                                     const struct block* end) const
 {
   while (begin != end) {
     struct block* next = begin->next;
 
     // If the data is in memory...
     if (begin->in_memory) {
-      free(begin->data);
+      release_page(begin->data);
     }
 
     free(begin);
@@ -3,9 +3,16 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <sys/types.h>
 #include <sys/mman.h>
 #include <limits.h>
+#include <pthread.h>
+#include <atomic>
 #include "fs/file_change.h"
+#include "fs/ngram_index.h"
+#include "fs/session_journal.h"
+#include "fs/prefetcher.h"
+#include "fs/regex.h"
 #include "types/direction.h"
 
 namespace fs {
@@ -32,6 +39,19 @@ namespace fs {
       // Save.
       bool save();
 
+      // Fork: 'fm' becomes an independent copy of the file model (without
+      // the history of changes) which can be edited.
+      //
+      // The blocks are copied, but not their data: the data in memory is
+      // shared until either file model modifies it (copy-on-write) and it
+      // is only charged to the file model which has allocated it. While the
+      // file on disk is shared, save() writes a new file (the forks keep
+      // the old one mapped). Block devices cannot be forked.
+      bool fork(file_model& fm) const;
+
+      // Snapshot: 'fm' becomes a read-only fork of the file model.
+      bool snapshot(file_model& fm) const;
+
       enum class operation_result {
         kErrorReadOnly,
         kErrorBlockDevice,
@@ -63,12 +83,148 @@ namespace fs {
                               uint64_t len,
                               bool record_change = true);
 
+      // Replace all the (non-overlapping) occurrences of 'needle' with
+      // 'replacement'.
+      //
+      // The blocks are rebuilt in a single pass and the replacements are
+      // recorded as a single change (undone / redone in one step, the
+      // change is only recorded if its positions are not bigger than the
+      // maximum memory which can be used). 'count' receives the number of
+      // occurrences which have been replaced.
+      operation_result replace_all(const void* needle,
+                                   uint64_t needlelen,
+                                   const void* replacement,
+                                   uint64_t replacementlen,
+                                   uint64_t& count,
+                                   bool record_change = true);
+
+      // Maximum length of a fill pattern.
+      static const size_t kMaxPatternLength = 4 * 1024;
+
+      // Fill [off, off + len) with 'pattern' ('patternlen' bytes) repeated
+      // from 'off'.
+      //
+      // The data is not stored: the blocks reference a read-only buffer of
+      // the pattern (shared by the fills with the same pattern, the zeros
+      // are an anonymous mapping which is never written). The history only
+      // records the pattern and the length of the fill (and the data which
+      // is replaced).
+      operation_result fill(uint64_t off,
+                            uint64_t len,
+                            const void* pattern,
+                            size_t patternlen,
+                            bool record_change = true);
+
+      // Resize the file to 'len' bytes: the data beyond 'len' is removed or
+      // zeros are appended (as by fill()). save() writes the zeros at the
+      // end of the file as a hole and punches holes for the zeros which are
+      // saved in place (where supported).
+      operation_result resize(uint64_t len, bool record_change = true);
+
+      // Add 'len' bytes of the file 'filename' (starting at the offset
+      // 'srcoff') at 'off' / replace [off, off + len) with them.
+      //
+      // The data is not copied: the source file is mapped (shared by the
+      // references to the same file, kept while the blocks or the undo
+      // records might reference it), the blocks reference the mapping and
+      // save() writes the data from it. The history records the reference.
+      // The source file can't be the file of the file model and it must not
+      // be modified while it is referenced.
+      operation_result add_from_file(uint64_t off,
+                                     const char* filename,
+                                     uint64_t srcoff,
+                                     uint64_t len,
+                                     bool record_change = true);
+
+      operation_result modify_from_file(uint64_t off,
+                                        const char* filename,
+                                        uint64_t srcoff,
+                                        uint64_t len,
+                                        bool record_change = true);
+
+      // Copy [src, src + len) to 'dst' / move it to 'dst' ('dst' is an
+      // offset of the file before the change, it can't be inside of the
+      // range which is moved).
+      //
+      // The data is not copied: the new blocks reference the same data as
+      // the blocks of the range (the file on disk, the fill buffers, the
+      // source files and the buffers of the blocks in memory, which are
+      // shared and copied before being modified). Only the parts of the
+      // blocks in memory at the ends of the range are copied. The history
+      // doesn't keep the data either, only the offsets: the range is cloned
+      // again when the change is undone or redone.
+      operation_result copy_range(uint64_t src,
+                                  uint64_t len,
+                                  uint64_t dst,
+                                  bool record_change = true);
+
+      operation_result move_range(uint64_t src,
+                                  uint64_t len,
+                                  uint64_t dst,
+                                  bool record_change = true);
+
+      // Apply the changes of 'changes' (performed one after the other).
+      //
+      // The changes are composed into the final set of edits (sorted by
+      // offset in the current file), which are applied in a single pass
+      // over the blocks and recorded as a single change.
+      operation_result apply(const file_changes& changes);
+
+      // Begin a batch of edits: the following modifications, additions and
+      // removals are staged until the batch is committed (their offsets
+      // refer to the file as it is when the batch begins and they cannot
+      // overlap).
+      operation_result begin_batch();
+
+      // Commit the batch: the staged edits are sorted by offset, applied in
+      // a single pass over the blocks and recorded as a single change.
+      // Either all the edits are applied or none (the batch is discarded).
+      operation_result commit();
+
+      // Discard the staged edits.
+      void rollback();
+
+      // Is a batch in progress?
+      bool in_batch() const;
+
       // Undo.
       operation_result undo();
 
       // Redo.
       operation_result redo();
 
+      // Go to revision 'n' (number of changes of the history which have
+      // been performed): the changes between the current revision and 'n'
+      // are composed into a set of edits, which are applied in a single
+      // pass over the blocks.
+      operation_result goto_revision(size_t n);
+
+      // Discard the changes which haven't been saved: the blocks are
+      // replaced with a single block referencing the file on disk. The
+      // revision of the file on disk becomes the current revision (if the
+      // history no longer contains it, the history is cleared).
+      operation_result revert();
+
+      // Get current revision.
+      size_t revision() const;
+
+      // Get number of changes of the history.
+      size_t revisions() const;
+
+      // Set the limits of the undo history (0: no limit). When the history
+      // uses more than 'max_memory' bytes, the oldest changes are spilled to
+      // the journal (if set) or dropped; when there are more than
+      // 'max_changes' changes, the oldest changes are dropped.
+      void set_undo_limits(uint64_t max_memory, size_t max_changes);
+
+      // Merge consecutive small changes into a single change (see
+      // file_changes::set_coalescing(), disabled by default).
+      void set_undo_coalescing(uint64_t max_len, unsigned window);
+
+      // Spill the oldest changes to a journal ('compress': compress the
+      // spilled changes), they are read back when they are undone.
+      bool set_undo_journal(const char* filename, bool compress = false);
+
       // Get data.
       bool get(uint64_t off, void* data, uint64_t& len) const;
 
@@ -79,6 +235,146 @@ namespace fs {
                 uint64_t needlelen,
                 uint64_t& position) const;
 
+      // Find all the occurrences (including overlapping occurrences)
+      // starting at 'off'.
+      //
+      // The file is split in segments which are searched by 'nthreads'
+      // threads (0: number of processors). The positions are passed to
+      // 'callback' in offset order (from the calling thread).
+      //
+      // 'progress' (if not NULL) is called from time to time with the number
+      // of bytes searched.
+      //
+      // If one of the callbacks returns false, the search is cancelled.
+      //
+      // The threads don't search too far ahead of the positions which are
+      // being reported and each segment keeps a bounded number of
+      // positions (the thread waits until they have been reported), so that
+      // the memory used doesn't depend on the number of occurrences.
+      typedef bool (*find_callback)(uint64_t position, void* arg);
+      typedef bool (*progress_callback)(uint64_t searched,
+                                        uint64_t total,
+                                        void* arg);
+
+      enum class find_all_result {
+        kCompleted, // The whole file has been searched.
+        kCancelled, // A callback has returned false.
+        kNoMemory   // Out of memory (or the threads couldn't be created).
+      };
+
+      find_all_result find_all(uint64_t off,
+                               const void* needle,
+                               uint64_t needlelen,
+                               find_callback callback,
+                               void* arg,
+                               unsigned nthreads = 0,
+                               progress_callback progress = NULL) const;
+
+      // Find all the occurrences starting in [begin, end) (from the calling
+      // thread).
+      //
+      // Returns false if one of the callbacks returns false.
+      bool find_range(uint64_t begin,
+                      uint64_t end,
+                      const void* needle,
+                      uint64_t needlelen,
+                      find_callback callback,
+                      void* arg) const;
+
+      // Find regular expression (the match is [begin, end)).
+      bool find(uint64_t off,
+                regex& re,
+                uint64_t& begin,
+                uint64_t& end) const;
+
+      // Range of the file which differs from the file on disk:
+      // [off, off + len) of the file replaces [diskoff, diskoff + disklen)
+      // of the file on disk (data added if 'disklen' is 0, removed if 'len'
+      // is 0).
+      struct dirty_range {
+        uint64_t off;
+        uint64_t len;
+
+        uint64_t diskoff;
+        uint64_t disklen;
+      };
+
+      // Enumerate the ranges which differ from the file on disk (in offset
+      // order), by walking the blocks: the data in memory and the data of
+      // the file on disk which is not in its place are dirty.
+      //
+      // If the callback returns false, the enumeration is cancelled.
+      typedef bool (*dirty_range_callback)(const dirty_range& range,
+                                           void* arg);
+
+      bool dirty_ranges(dirty_range_callback callback, void* arg) const;
+
+      // Change listener: the range [off, off + oldlen) has been replaced
+      // with 'newlen' bytes.
+      //
+      // The listeners are called after every change (including undos, redos,
+      // open() and close()), once the blocks have been updated.
+      typedef void (*change_listener)(uint64_t off,
+                                      uint64_t oldlen,
+                                      uint64_t newlen,
+                                      void* arg);
+
+      // Add listener.
+      bool add_listener(change_listener listener, void* arg);
+
+      // Remove listener.
+      void remove_listener(change_listener listener, void* arg);
+
+      // Build trigram index of the file on disk (optional: the forward
+      // searches of needles of at least 3 bytes skip the chunks of the file
+      // on disk which cannot contain an occurrence; the data in memory is
+      // always searched).
+      bool build_index();
+
+      // Load index from a sidecar file (fails if the file on disk has
+      // changed since the index was saved).
+      bool load_index(const char* filename);
+
+      // Save index to a sidecar file.
+      bool save_index(const char* filename) const;
+
+      // Index again the chunks which have been overwritten by save().
+      void update_index();
+
+      // Free index.
+      void free_index();
+
+      // Has the file been indexed?
+      bool indexed() const;
+
+      // Enable / disable the session journal (it applies to the files
+      // opened afterwards, in read-write mode).
+      //
+      // The edits are appended to a write-ahead journal next to the file
+      // ("<filename>.journal"). If a previous session hasn't been closed
+      // (crash), open() replays its journal over the file on disk (if the
+      // file hasn't changed since). The journal starts again when the file
+      // is saved and it is removed when the file is closed. The history of
+      // changes is not recovered.
+      void set_session_journal(bool enabled);
+
+      // Write the pending records of the session journal to disk (the
+      // records are otherwise written in groups).
+      bool sync_session_journal();
+
+      // Has the session been recovered from its journal when the file was
+      // opened?
+      bool recovered() const;
+
+      // Enable / disable (distance 0) the prefetcher: when get() reads
+      // the file sequentially (forwards or backwards) or with a constant
+      // stride, the next 'distance' bytes of the file on disk are faulted
+      // in by a helper thread.
+      bool set_prefetch(uint64_t distance);
+
+      // Get statistics of get() and of the prefetcher.
+      void prefetch_stats(prefetcher::stats& stats) const;
+
       // Read only mode?
       bool read_only() const;
 
@@ -88,17 +384,155 @@ namespace fs {
       // Get length.
       uint64_t length() const;
 
-      // Get memory used.
+      // Get memory used (including the undo history).
       uint64_t memory_used() const;
 
       // Has the file been modified?
       bool modified() const;
 
+      // Enable / disable the concurrent mode (before the file model is
+      // shared between threads).
+      //
+      // In concurrent mode, the const operations (get(), find(),
+      // find_all()...) take a read lock and run in parallel with each
+      // other, the operations which modify the file model take a write
+      // lock (writers are preferred, so that the readers don't starve
+      // them). The operations performed by a thread from inside another
+      // operation of the same file model (listeners, callbacks) don't lock
+      // again, but they can only modify the file model if the outer
+      // operation does.
+      void set_concurrent(bool concurrent);
+
+      // Fragmentation of the block list.
+      struct fragmentation {
+        // Number of blocks and number of blocks in memory.
+        size_t blocks;
+        size_t memory_blocks;
+
+        // Data of the blocks in memory and memory allocated for it (bytes).
+        uint64_t memory_data;
+        uint64_t memory_allocated;
+      };
+
+      // Statistics of the compaction worker.
+      struct compaction_stats {
+        // Fragmentation before and after the last pass.
+        fragmentation before;
+        fragmentation after;
+
+        // Number of passes and steps, blocks merged and buffers released.
+        uint64_t passes;
+        uint64_t steps;
+        uint64_t merged;
+        uint64_t released;
+      };
+
+      // Get fragmentation of the block list.
+      void get_fragmentation(fragmentation& frag) const;
+
+      // Start / stop (interval 0) the compaction worker (concurrent mode
+      // only).
+      //
+      // Every 'interval' milliseconds, the worker takes the write lock and
+      // performs a step of compaction: up to kCompactionStepBlocks blocks
+      // are visited, the adjacent blocks whose data fits in a single buffer
+      // (the small chunks of the file on disk between blocks in memory are
+      // copied) and the adjacent blocks which reference consecutive data
+      // of the file on disk are merged. The blocks near the last edit are
+      // left alone. Once the whole list has been visited (a pass), the
+      // freed memory is returned to the operating system. Passes are only
+      // repeated after the file model has been modified.
+      bool set_compaction(unsigned interval);
+
+      // Get statistics of the compaction worker.
+      void get_compaction_stats(compaction_stats& stats) const;
+
+      // Statistics of the compression of the blocks in memory.
+      struct compression_stats {
+        // Number of compressed blocks, their data and memory allocated for
+        // it (bytes).
+        size_t blocks;
+        uint64_t data;
+        uint64_t compressed;
+
+        // Number of blocks which have been compressed and expanded again
+        // (to be modified).
+        uint64_t compressions;
+        uint64_t expansions;
+
+        // Reads of compressed blocks served by the cache / decompressed.
+        uint64_t hits;
+        uint64_t misses;
+      };
+
+      // Enable / disable the compression of the cold blocks in memory.
+      //
+      // The blocks in memory which are away from the last edit are
+      // compressed (in-tree LZ77 codec) when the memory used would exceed
+      // the maximum and by each step of the compaction worker. The readers
+      // (get(), find(), save()...) decompress them into a small cache of
+      // the thread, they are only expanded again when they are modified.
+      // The compressed blocks are charged for their compressed size.
+      void set_compression(bool enabled);
+
+      // Compress the cold blocks in memory (returns the memory released).
+      uint64_t compress_blocks();
+
+      // Get statistics of the compression.
+      void get_compression_stats(compression_stats& stats) const;
+
     private:
       static const uint64_t kMemoryBlockSize = 4 * 1024;
       static const uint64_t kMidMemoryBlock = kMemoryBlockSize / 2;
+
+      // Size of the buffers of bulk insertions (the data is added in
+      // buffers of kLargeMemoryBlockSize bytes while there is enough of it).
+      static const uint64_t kLargeMemoryBlockSize = 64 * 1024;
       static const uint64_t kMaxMemoryUsed = 100 * 1024 * 1024;
 
+      // Small modifications of the file on disk (patches): maximum length,
+      // size of the buffer of a patch block and maximum distance from the
+      // end of the previous block in memory (the data in between is copied
+      // into it).
+      static const uint64_t kMaxPatchLength = 32;
+      static const uint64_t kPatchBlockSize = 64;
+      static const uint64_t kMaxPatchGap = 32;
+
+      // Minimum number of blocks in memory in the page of a patch for them
+      // to be merged into a page with the patch (their patch blocks use at
+      // least half as much memory as the page).
+      static const size_t kMinDensePatches = kMemoryBlockSize /
+                                             (2 * kPatchBlockSize);
+
+      // Fill buffers: size of the buffer of a pattern (rounded down to a
+      // multiple of the length of the pattern) and of the buffer of zeros
+      // (only reserved).
+      static const uint64_t kFillBufferSize = 1024 * 1024;
+      static const uint64_t kZeroFillBufferSize = 1024 * 1024 * 1024;
+
+      // Compaction: maximum number of blocks visited per step, size of the
+      // region around the last edit which is not compacted and maximum
+      // data of the file on disk copied into a buffer to merge blocks.
+      static const size_t kCompactionStepBlocks = 256;
+      static const uint64_t kCompactionHotZone = 64 * 1024;
+      static const uint64_t kCompactionMaxCopy = 256;
+
+      // Compression: minimum length of a compressed block and number of
+      // blocks of the decompressed-block cache (per thread).
+      static const uint64_t kMinCompressedBlock = 256;
+      static const size_t kCacheSize = 8;
+
+      // find_all(): minimum size to search in parallel / maximum size of
+      // a segment.
+      static const uint64_t kMinParallelSearch = 4 * 1024 * 1024;
+      static const uint64_t kMaxSegmentSize = 64 * 1024 * 1024;
+
+      // find_all(): maximum number of positions kept by a segment and
+      // number of segments per thread which can be searched ahead of the
+      // segment being reported.
+      static const size_t kMaxSegmentPositions = 64 * 1024;
+      static const size_t kSegmentsAhead = 2;
+
       // Undo enabled?
       bool _M_undo_enabled;
 
@@ -106,6 +540,12 @@ namespace fs {
       file_changes _M_changes;
       size_t _M_nchange;
 
+      // Revision of the file on disk (kNoRevision if the history doesn't
+      // contain it).
+      static const size_t kNoRevision = SIZE_MAX;
+
+      size_t _M_saved_change;
+
       // File name.
       char _M_filename[PATH_MAX];
 
@@ -124,6 +564,67 @@ namespace fs {
       // Pointer to memory mapped file.
       void* _M_data;
 
+      // Number of file models which share the mapping (forks).
+      std::atomic<size_t>* _M_mapping_refs;
+
+      // Device and inode of the file.
+      dev_t _M_dev;
+      ino_t _M_ino;
+
+      // Mapping of a file which has been closed (the undo records might
+      // reference its data).
+      struct mapping {
+        uint8_t* data;
+        uint64_t len;
+
+        std::atomic<size_t>* refs;
+
+        dev_t dev;
+        ino_t ino;
+      };
+
+      mapping* _M_mappings;
+      size_t _M_nmappings;
+      size_t _M_mappings_size;
+
+      // Buffer of a fill pattern (the pattern repeated, read-only). It is
+      // shared with the forks and kept while the undo records might
+      // reference it.
+      struct fill_buffer {
+        // Number of file models which reference the buffer.
+        std::atomic<size_t> refs;
+
+        uint8_t* data;
+        uint64_t size;
+
+        size_t patternlen;
+      };
+
+      fill_buffer** _M_fills;
+      size_t _M_nfills;
+      size_t _M_fills_size;
+
+      // Mapping of a source file (add_from_file(), modify_from_file()). It
+      // is shared with the forks and kept while the blocks or the undo
+      // records might reference it.
+      struct source_file {
+        // Number of file models which reference the mapping.
+        std::atomic<size_t> refs;
+
+        uint8_t* data;
+        uint64_t size;
+
+        dev_t dev;
+        ino_t ino;
+
+        // Absolute file name.
+        char filename[PATH_MAX];
+      };
+
+      source_file** _M_sources;
+      size_t _M_nsources;
+      size_t _M_sources_size;
+
       // Current length.
       uint64_t _M_len;
 
@@ -132,9 +633,10 @@ namespace fs {
 
       struct block {
         // Block data:
-        //   It points to one of the following two locations:
-        //     - Somewhere in [_M_data, _M_data + _M_filesize)
-        //       if in_memory = false
+        //   It points to one of the following locations:
+        //     - Somewhere in [_M_data, _M_data + _M_filesize), in a fill
+        //       buffer or in the mapping of a source file if
+        //       in_memory = false
         //     - An allocated buffer if in_memory = true
         uint8_t* data;
 
@@ -150,21 +652,529 @@ namespace fs {
 
       block _M_header;
 
+      // Header of the buffer of a block in memory (the buffer is shared
+      // with the forks and with the copies of the block, and copied before
+      // being modified if it is shared).
+      struct page {
+        // Number of blocks which reference the buffer.
+        std::atomic<size_t> refs;
+
+        // File model which is charged for the buffer (NULL once it no
+        // longer references it or once one of its blocks which share the
+        // buffer has released it).
+        std::atomic<const file_model*> owner;
+
+        // Size of the buffer.
+        uint64_t size;
+
+        // Identifier of the compressed data (0 if the data is not
+        // compressed).
+        uint64_t id;
+      };
+
+      // Entry of the decompressed-block cache.
+      struct cache_entry {
+        // Identifier of the compressed data.
+        uint64_t id;
+
+        uint8_t data[kMemoryBlockSize];
+      };
+
+      // Decompressed-block cache of the thread and next entry to be
+      // replaced.
+      static thread_local cache_entry _M_cache[kCacheSize];
+      static thread_local size_t _M_cache_next;
+
+      // Last identifier of compressed data.
+      static std::atomic<uint64_t> _M_compressed_id;
+
       // Has the file been modified?
       bool _M_modified;
 
       // Has the file been shrinked or grown?
       bool _M_size_modified;
 
-      // Save file in-place.
+      struct listener {
+        change_listener fn;
+        void* arg;
+      };
+
+      // Staged edit.
+      struct batch_edit {
+        uint64_t off;
+        uint64_t len;
+
+        // Position of the data in '_M_batch_data'.
+        uint64_t dataoff;
+        uint64_t datalen;
+
+        // Order in which the edit has been staged.
+        size_t seq;
+      };
+
+      // Batch.
+      bool _M_batch;
+
+      batch_edit* _M_batch_edits;
+      size_t _M_nbatch_edits;
+      size_t _M_batch_edits_size;
+
+      uint8_t* _M_batch_data;
+      uint64_t _M_batch_data_len;
+      uint64_t _M_batch_data_size;
+
+      // Change listeners.
+      listener* _M_listeners;
+      size_t _M_nlisteners;
+      size_t _M_listeners_size;
+
+      // Trigram index of the file on disk.
+      ngram_index _M_index;
+
+      // Session journal.
+      bool _M_session_enabled;
+      session_journal _M_session;
+
+      // Has the session been recovered?
+      bool _M_recovered;
+
+      // Prefetcher.
+      mutable prefetcher _M_prefetcher;
+
+      // Offset of the last edit and number of edits.
+      uint64_t _M_last_edit;
+      std::atomic<uint64_t> _M_edits;
+
+      // Compaction worker.
+      pthread_t _M_compaction_thread;
+      bool _M_compaction_running;
+      unsigned _M_compaction_interval;
+      bool _M_compaction_stop;
+      compaction_stats _M_compaction_stats;
+      mutable pthread_mutex_t _M_compaction_mutex;
+      pthread_cond_t _M_compaction_cond;
+
+      // Compression enabled?
+      bool _M_compression;
+
+      // Statistics of the compression.
+      std::atomic<uint64_t> _M_compressions;
+      std::atomic<uint64_t> _M_expansions;
+      mutable std::atomic<uint64_t> _M_cache_hits;
+      mutable std::atomic<uint64_t> _M_cache_misses;
+
+      // Concurrent mode?
+      bool _M_concurrent;
+
+      // Lock (concurrent mode).
+      mutable pthread_rwlock_t _M_lock;
+
+      // File model locked by the current thread.
+      static thread_local const file_model* _M_locked;
+
+      // Lock held while performing an operation (concurrent mode).
+      class lock_guard {
+        public:
+          // Constructor.
+          lock_guard(const file_model* fm, bool write);
+
+          // Destructor.
+          ~lock_guard();
+
+        private:
+          // File model which has been locked (NULL if none).
+          const file_model* _M_fm;
+
+          // File model locked by the current thread before.
+          const file_model* _M_prev;
+
+          // Disable copy constructor and assignment operator.
+          lock_guard(const lock_guard&) = delete;
+          lock_guard& operator=(const lock_guard&) = delete;
+      };
+
+      // Initialize lock.
+      void init_lock();
+
+      // Perform a step of compaction from the offset 'off' (returns true
+      // once the end of the file has been reached).
+      bool compact(uint64_t& off, uint64_t& merged, uint64_t& released);
+
+      // Merge a block with the next one (if possible).
+      bool merge(struct block* b, uint64_t& released);
+
+      // Compaction worker.
+      static void* compaction_worker(void* arg);
+
+      // Compress the blocks in memory away from the last edit (returns the
+      // memory released).
+      uint64_t compress_cold_blocks();
+
+      // Compress the data of a block in memory (if it is worth it).
+      bool compress_block(struct block* b);
+
+      // Decompress the data of a block into a buffer of its own (before
+      // the block is modified).
+      bool expand(struct block* b);
+
+      // If the memory used would exceed the maximum with 'len' more bytes,
+      // compress the cold blocks (if enabled). Returns true if there is
+      // enough memory.
+      bool reclaim(uint64_t len);
+
+      // Get the data of a block (the data of a compressed block is
+      // decompressed into the cache of the thread: it is valid until
+      // kCacheSize other compressed blocks have been read).
+      const uint8_t* view(const struct block* b) const;
+
+      // Decompress the data of a compressed block into the cache.
+      const uint8_t* decompressed(const struct block* b) const;
+
+      // Is the data of the block compressed?
+      static bool compressed(const struct block* b);
+
+      // Make 'fm' a fork of the file model.
+      bool share(file_model& fm, bool read_only) const;
+
+      // Allocate the buffer of a block in memory (charged to the file
+      // model).
+      uint8_t* allocate_page(uint64_t size = kMemoryBlockSize) const;
+
+      // Release the buffer of a block in memory (returns the memory which
+      // was charged to the file model).
+      uint64_t release_page(uint8_t* data) const;
+
+      // Get the memory charged to the file model for the buffer of a block
+      // in memory.
+      uint64_t charged(const uint8_t* data) const;
+
+      // Make the buffer of a block in memory (not shared) big enough for
+      // 'len' bytes (replaced with a buffer of kMemoryBlockSize bytes).
+      bool grow(struct block* b, uint64_t len);
+
+      // Get the number of bytes which can be added to a block in memory
+      // (the small buffers grow up to kMemoryBlockSize bytes).
+      uint64_t room(const struct block* b) const;
+
+      // Modify [pos, pos + len) of a block in disk (small modification):
+      // the data is either appended to the previous block in memory or
+      // stored in a patch block.
+      bool patch(struct block*& b,
+                 uint64_t pos,
+                 const void* data,
+                 uint64_t len);
+
+      // Merge the blocks from 'first' (in memory) to 'b' (in disk), [0, pos)
+      // of 'b' and the patch into a page.
+      bool merge_patches(struct block* first,
+                         struct block*& b,
+                         uint64_t pos,
+                         const void* data,
+                         uint64_t len);
+
+      // Replace [off, off + len) with 'datalen' bytes of 'pattern'
+      // repeated (blocks referencing the buffer of the pattern).
+      operation_result fill_blocks(uint64_t off,
+                                   uint64_t len,
+                                   uint64_t datalen,
+                                   const uint8_t* pattern,
+                                   size_t patternlen,
+                                   bool record_change);
+
+      // Get the buffer of a pattern (created if there is none).
+      const struct fill_buffer* get_fill_buffer(const uint8_t* pattern,
+                                                size_t patternlen);
+
+      // Get the fill buffer which contains 'data' (NULL if none).
+      const struct fill_buffer* find_fill_buffer(const uint8_t* data) const;
+
+      // Does the block in disk reference the zeros?
+      bool zero_fill(const struct block* b) const;
+
+      // Replace [off, off + len) with 'datalen' bytes of a source file
+      // ('data' points into its mapping, the blocks reference it).
+      operation_result source_blocks(uint64_t off,
+                                     uint64_t len,
+                                     const uint8_t* data,
+                                     uint64_t datalen,
+                                     bool record_change);
+
+      // Get the mapping of a source file (mapped if there is none, NULL if
+      // the file cannot be mapped or if it is the file of the file model).
+      const struct source_file* get_source(const char* filename);
+
+      // Get the source file whose mapping contains 'data' (NULL if none).
+      const struct source_file* find_source(const uint8_t* data) const;
+
+      // Does the piece reference the file on disk, a fill buffer or a
+      // source file?
+      bool mapped(const file_piece* piece) const;
+
+      // Copy [src, src + len) to 'dst' (removed from 'src' if 'move').
+      operation_result clone_range(uint64_t src,
+                                   uint64_t len,
+                                   uint64_t dst,
+                                   bool move,
+                                   bool record_change);
+
+      // Count ('pieces' NULL) or fill the pieces of [pos, pos + len) of the
+      // block 'b' to be cloned: the data in disk is referenced, the blocks
+      // in memory which are in the range are referenced by their buffers
+      // and the data of the other ones is copied to 'ptr' (if not NULL, the
+      // pieces are owned). Returns the length of the range (clamped).
+      uint64_t collect_clone_pieces(const struct block* b,
+                                    uint64_t pos,
+                                    uint64_t len,
+                                    uint8_t*& ptr,
+                                    file_piece* pieces,
+                                    size_t& npieces,
+                                    uint64_t& copied) const;
+
+      // Is 'data' in the file on disk?
+      bool on_disk(const uint8_t* data) const;
+
+      // Copy the shared buffers of the blocks in memory which contain
+      // [pos, pos + len) of the block 'b' and expand the compressed ones
+      // ('partial': only the blocks which are partially in the range).
+      bool unshare(struct block* b, uint64_t pos, uint64_t len, bool partial);
+
+      // Get header of the buffer of a block in memory.
+      static struct page* page_header(const uint8_t* data);
+
+      // Unmap the file (unless it is still shared).
+      static void unmap(void* data, uint64_t len, std::atomic<size_t>* refs);
+
+      // Open file.
+      bool open_file(const char* filename, open_mode mode);
+
+      // Close file.
+      void close_file();
+
+      // Save file in-place (fails if the file on disk has been replaced).
       bool save_in_place();
 
+      // Has the file on disk been replaced (e.g. saved by a fork or a
+      // snapshot)?
+      bool replaced() const;
+
+      // Recover the session of the file from its journal or start a new
+      // session.
+      bool open_session();
+
+      // Start the session journal again after saving.
+      void reset_session();
+
+      // Modify blocks.
+      operation_result modify_blocks(uint64_t off,
+                                     const void* data,
+                                     uint64_t len,
+                                     bool record_change);
+
+      // Add blocks.
+      operation_result add_blocks(uint64_t off,
+                                  const void* data,
+                                  uint64_t len,
+                                  bool record_change);
+
+      // Remove blocks.
+      operation_result remove_blocks(uint64_t off,
+                                     uint64_t len,
+                                     bool record_change);
+
+      // Edit: the range [off, off + len) is replaced with 'datalen' bytes.
+      struct edit {
+        uint64_t off;
+        uint64_t len;
+
+        const uint8_t* data;
+        uint64_t datalen;
+
+        // If not NULL, the new data is made of pieces.
+        const file_piece* pieces;
+        size_t npieces;
+
+        // Are the pieces which are neither owned nor references to mapped
+        // data the buffers of blocks in memory (shared by the new blocks)?
+        bool shared;
+      };
+
+      // State of apply_edits().
+      struct sweep;
+
+      // Apply edits (sorted by offset and non-overlapping) in a single pass
+      // over the blocks. Either all the edits are applied or none.
+      operation_result apply_edits(const struct edit* edits, size_t nedits);
+
+      // Append edit to the session journal (the data of the file on disk
+      // is referenced).
+      void journal(uint64_t off,
+                   uint64_t len,
+                   const uint8_t* data,
+                   uint64_t datalen);
+
+      // Append the edits applied by apply_edits() to the session journal.
+      void journal(const struct edit* edits, size_t nedits);
+
+      // Replace 'len' bytes with 'data' at each of the positions (the
+      // position 'i' is shifted 'i * shift' bytes).
+      operation_result replace(const uint64_t* positions,
+                               size_t npositions,
+                               uint64_t shift,
+                               uint64_t len,
+                               const uint8_t* data,
+                               uint64_t datalen);
+
+      // Restore the old data of a change (made of pieces or, if there are
+      // no pieces, 'olddata') in place of [off, off + len).
+      operation_result restore(uint64_t off,
+                               uint64_t len,
+                               const struct file_change* chg);
+
+      // Get the data of [pos, pos + len) of the block 'b' to be recorded
+      // (the data in disk is referenced by pieces, the data in memory is
+      // copied to 'data').
+      bool get_undo_data(const struct block* b,
+                         uint64_t pos,
+                         uint64_t& len,
+                         uint8_t*& data,
+                         file_piece*& pieces,
+                         size_t& npieces) const;
+
+      // Get the data of the ranges replaced by the edits (sorted by offset)
+      // to be recorded (one after the other, the pieces don't span several
+      // edits).
+      bool get_undo_data(const struct edit* edits,
+                         size_t nedits,
+                         uint64_t& len,
+                         uint8_t*& data,
+                         file_piece*& pieces,
+                         size_t& npieces) const;
+
+      // Count ('pieces' NULL) or fill the pieces of the data of
+      // [pos, pos + len) of the block 'b' (the data in memory is copied to
+      // 'ptr' if not NULL). Returns the length of the range (clamped).
+      uint64_t collect_undo_data(const struct block* b,
+                                 uint64_t pos,
+                                 uint64_t len,
+                                 uint8_t*& ptr,
+                                 file_piece* pieces,
+                                 size_t& npieces,
+                                 uint64_t& inmemory) const;
+
+      // Allocate the buffers of the undo data.
+      static bool allocate_undo_data(uint64_t inmemory,
+                                     size_t npieces,
+                                     uint8_t*& data,
+                                     file_piece*& pieces);
+
+      // Stage edit.
+      operation_result stage(uint64_t off,
+                             uint64_t len,
+                             const void* data,
+                             uint64_t datalen);
+
+      // Segment of the file being composed: 'len' bytes either of the
+      // current file from 'off' (if 'data' is NULL) or of 'data'.
+      struct composed_segment {
+        const uint8_t* data;
+        uint64_t off;
+        uint64_t len;
+      };
+
+      // Changes being composed.
+      struct composition;
+
+      // Compose change.
+      static operation_result compose(struct composition& c,
+                                      const struct file_change* chg);
+
+      // Compose the inverse of a change.
+      static operation_result compose_undo(struct composition& c,
+                                           const struct file_change* chg);
+
+      // Replace [off, off + len) of the composed file with the next
+      // 'oldlen' bytes of the old data of 'chg' (from the piece 'piece' or
+      // from 'olddata').
+      static bool compose_old_data(struct composition& c,
+                                   uint64_t off,
+                                   uint64_t len,
+                                   const struct file_change* chg,
+                                   size_t& piece,
+                                   const uint8_t*& olddata,
+                                   uint64_t oldlen);
+
+      // Replace [off, off + len) of the composed file with 'datalen' bytes
+      // of 'data'.
+      static bool compose(struct composition& c,
+                          uint64_t off,
+                          uint64_t len,
+                          const uint8_t* data,
+                          uint64_t datalen);
+
+      // Split the segment which contains 'off' ('pos' receives the index
+      // of the segment which starts at 'off').
+      static bool split(struct composition& c, uint64_t off, size_t& pos);
+
+      // Apply the composed file in a single pass over the blocks ('off',
+      // 'oldlen' and 'newlen' receive the range which has changed).
+      operation_result apply(const struct composition& c,
+                             uint64_t& off,
+                             uint64_t& oldlen,
+                             uint64_t& newlen);
+
+      // Append staged edit ('data' receives where its 'datalen' bytes have
+      // to be copied).
+      bool append_staged_edit(uint64_t off,
+                              uint64_t len,
+                              uint64_t datalen,
+                              uint8_t*& data);
+
+      // Compare staged edits (by offset, the additions first and then in
+      // the order in which they have been staged).
+      static int compare_batch_edits(const void* e1, const void* e2);
+
+      // Undo / redo batch.
+      operation_result apply_batch(const struct file_change* chg, bool undo);
+
+      // Copy the data referenced by the undo records which is about to be
+      // overwritten in [off, off + len).
+      bool materialize(uint64_t off, uint64_t len);
+
+      // A change has been recorded: enforce the limits of the history.
+      void change_recorded();
+
+      // Free the mappings of the files which have been closed and the fill
+      // buffers.
+      void free_mappings();
+
+      // apply_edits(): append data in disk.
+      bool sweep_disk(struct sweep& sw, const uint8_t* data, uint64_t len);
+
+      // apply_edits(): append data in memory.
+      bool sweep_copy(struct sweep& sw, const uint8_t* data, uint64_t len);
+
+      // apply_edits(): append block sharing the buffer of a block in memory.
+      bool sweep_share(struct sweep& sw, const uint8_t* data, uint64_t len);
+
+      // apply_edits(): append block.
+      static bool sweep_append(struct block**& blocks,
+                               size_t& nblocks,
+                               size_t& size,
+                               struct block* b);
+
+      // Notify listeners.
+      void notify(uint64_t off, uint64_t oldlen, uint64_t newlen);
+
       // Get data.
       void get(const struct block* b,
                uint64_t pos,
                void* data,
                uint64_t& len) const;
 
+      // Record the access [off, off + len) and queue the prefetch of the
+      // next ranges of the file on disk.
+      void prefetch(uint64_t off, uint64_t len) const;
+
       // Seek.
       bool seek(uint64_t off, const struct block*& b, uint64_t& pos) const;
       bool seek(uint64_t off, struct block*& b, uint64_t& pos) const;
@@ -181,15 +1191,62 @@ namespace fs {
                          uint64_t needlelen,
                          uint64_t& position) const;
 
-      // Add.
-      static bool add(const uint8_t* data,
-                      uint64_t len,
-                      struct block*& first,
-                      struct block*& last,
-                      size_t& nblocks);
+      // Find forward starting at the position 'pos' of the block 'b'
+      // ('off' is the offset of the block). The occurrence has to start
+      // before 'end'.
+      bool find_forward(const struct block*& b,
+                        uint64_t& pos,
+                        uint64_t& off,
+                        const void* needle,
+                        uint64_t needlelen,
+                        uint64_t end = UINT64_MAX) const;
+
+      // Segment of the file searched by find_all().
+      struct segment {
+        // First block of the segment.
+        const struct block* b;
+        uint64_t pos;
+        uint64_t off;
+
+        // Occurrences starting in [begin, end).
+        uint64_t begin;
+        uint64_t end;
+
+        // Positions found (not reported yet).
+        uint64_t* positions;
+        size_t npositions;
+        size_t size;
+
+        // Has the segment been searched / is the buffer of the positions
+        // full (waiting for them to be reported)?
+        bool done;
+        bool full;
+
+        // Out of memory?
+        bool error;
+      };
+
+      struct find_all_context;
+
+      // Search segment (returns false if out of memory).
+      bool search_segment(struct segment* seg,
+                          struct find_all_context* ctx) const;
+
+      // find_all() worker thread.
+      static void* find_all_worker(void* arg);
+
+      // Is the position at the beginning of a line?
+      bool beginning_of_line(const struct block* b, uint64_t pos) const;
+
+      // Add ('size': memory allocated for the blocks).
+      bool add(const uint8_t* data,
+               uint64_t len,
+               struct block*& first,
+               struct block*& last,
+               uint64_t& size) const;
 
       // Free block list.
-      static void free_block_list(struct block* begin, const struct block* end);
+      void free_block_list(struct block* begin, const struct block* end) const;
 
       // Write.
       static uint64_t write(int fd, const void* buf, uint64_t len);
@@ -202,18 +1259,60 @@ namespace fs {
   inline file_model::file_model(bool undo_enabled)
     : _M_undo_enabled(undo_enabled),
       _M_nchange(0),
+      _M_saved_change(0),
       _M_fd(-1),
       _M_read_only(true),
       _M_block_device(false),
       _M_filesize(0),
       _M_data(MAP_FAILED),
+      _M_mapping_refs(NULL),
+      _M_dev(0),
+      _M_ino(0),
+      _M_mappings(NULL),
+      _M_nmappings(0),
+      _M_mappings_size(0),
+      _M_fills(NULL),
+      _M_nfills(0),
+      _M_fills_size(0),
+      _M_sources(NULL),
+      _M_nsources(0),
+      _M_sources_size(0),
       _M_len(0),
       _M_memory_used(0),
       _M_modified(false),
-      _M_size_modified(false)
+      _M_size_modified(false),
+      _M_batch(false),
+      _M_batch_edits(NULL),
+      _M_nbatch_edits(0),
+      _M_batch_edits_size(0),
+      _M_batch_data(NULL),
+      _M_batch_data_len(0),
+      _M_batch_data_size(0),
+      _M_listeners(NULL),
+      _M_nlisteners(0),
+      _M_listeners_size(0),
+      _M_session_enabled(false),
+      _M_recovered(false),
+      _M_last_edit(0),
+      _M_edits(0),
+      _M_compaction_running(false),
+      _M_compaction_interval(0),
+      _M_compaction_stop(false),
+      _M_compaction_stats(),
+      _M_compression(false),
+      _M_compressions(0),
+      _M_expansions(0),
+      _M_cache_hits(0),
+      _M_cache_misses(0),
+      _M_concurrent(false)
   {
     *_M_filename = 0;
 
+    init_lock();
+
+    pthread_mutex_init(&_M_compaction_mutex, NULL);
+    pthread_cond_init(&_M_compaction_cond, NULL);
+
     _M_header.len = 0;
     _M_header.in_memory = false;
 
@@ -223,7 +1322,44 @@ namespace fs {
 
   inline file_model::~file_model()
   {
+    set_compaction(0);
+
     close();
+    free_mappings();
+
+    if (_M_listeners) {
+      free(_M_listeners);
+    }
+
+    pthread_cond_destroy(&_M_compaction_cond);
+    pthread_mutex_destroy(&_M_compaction_mutex);
+
+    pthread_rwlock_destroy(&_M_lock);
+  }
+
+  inline file_model::lock_guard::lock_guard(const file_model* fm, bool write)
+    : _M_fm(NULL),
+      _M_prev(_M_locked)
+  {
+    // If the operation is not nested in another one...
+    if ((fm->_M_concurrent) && (_M_locked != fm)) {
+      if (write) {
+        pthread_rwlock_wrlock(&fm->_M_lock);
+      } else {
+        pthread_rwlock_rdlock(&fm->_M_lock);
+      }
+
+      _M_fm = fm;
+      _M_locked = fm;
+    }
+  }
+
+  inline file_model::lock_guard::~lock_guard()
+  {
+    if (_M_fm) {
+      _M_locked = _M_prev;
+      pthread_rwlock_unlock(&_M_fm->_M_lock);
+    }
   }
 
   inline bool file_model::find(uint64_t off,
@@ -232,6 +1368,8 @@ namespace fs {
                                uint64_t needlelen,
                                uint64_t& position) const
   {
+    lock_guard lock(this, false);
+
     return (dir == direction::kForward) ?
                                           find_forward(off,
                                                        needle,
@@ -243,28 +1381,177 @@ namespace fs {
                                                         position);
   }
 
+  inline void file_model::notify(uint64_t off,
+                                 uint64_t oldlen,
+                                 uint64_t newlen)
+  {
+    _M_last_edit = off;
+    _M_edits++;
+
+    for (size_t i = 0; i < _M_nlisteners; i++) {
+      _M_listeners[i].fn(off, oldlen, newlen, _M_listeners[i].arg);
+    }
+  }
+
+  inline bool file_model::in_batch() const
+  {
+    lock_guard lock(this, false);
+
+    return _M_batch;
+  }
+
+  inline void file_model::set_undo_limits(uint64_t max_memory,
+                                          size_t max_changes)
+  {
+    lock_guard lock(this, true);
+
+    _M_changes.set_limits(max_memory, max_changes);
+  }
+
+  inline void file_model::set_undo_coalescing(uint64_t max_len,
+                                              unsigned window)
+  {
+    lock_guard lock(this, true);
+
+    _M_changes.set_coalescing(max_len, window);
+  }
+
+  inline bool file_model::set_undo_journal(const char* filename,
+                                           bool compress)
+  {
+    lock_guard lock(this, true);
+
+    return _M_changes.open_journal(filename, compress);
+  }
+
+  inline size_t file_model::revision() const
+  {
+    lock_guard lock(this, false);
+
+    return _M_nchange;
+  }
+
+  inline size_t file_model::revisions() const
+  {
+    lock_guard lock(this, false);
+
+    return _M_changes.size();
+  }
+
+  inline void file_model::change_recorded()
+  {
+    // If the revision of the file on disk has been erased...
+    if ((_M_saved_change != kNoRevision) && (_M_saved_change > _M_nchange)) {
+      _M_saved_change = kNoRevision;
+    }
+
+    // The change might have been merged into the previous one.
+    _M_nchange = _M_changes.size();
+
+    // The oldest changes might be dropped.
+    size_t dropped = _M_changes.trim();
+    _M_nchange -= dropped;
+
+    if (_M_saved_change != kNoRevision) {
+      if (_M_saved_change >= dropped) {
+        _M_saved_change -= dropped;
+      } else {
+        _M_saved_change = kNoRevision;
+      }
+    }
+  }
+
+  inline void file_model::update_index()
+  {
+    lock_guard lock(this, true);
+
+    _M_index.update(_M_data);
+  }
+
+  inline void file_model::free_index()
+  {
+    lock_guard lock(this, true);
+
+    _M_index.clear();
+  }
+
+  inline bool file_model::indexed() const
+  {
+    lock_guard lock(this, false);
+
+    return !_M_index.empty();
+  }
+
+  inline void file_model::set_session_journal(bool enabled)
+  {
+    lock_guard lock(this, true);
+
+    _M_session_enabled = enabled;
+  }
+
+  inline bool file_model::sync_session_journal()
+  {
+    lock_guard lock(this, true);
+
+    return _M_session.sync();
+  }
+
+  inline bool file_model::set_prefetch(uint64_t distance)
+  {
+    lock_guard lock(this, true);
+
+    if (distance == 0) {
+      _M_prefetcher.stop();
+      return true;
+    }
+
+    return _M_prefetcher.start(distance);
+  }
+
+  inline void file_model::prefetch_stats(prefetcher::stats& stats) const
+  {
+    _M_prefetcher.get_stats(stats);
+  }
+
+  inline bool file_model::recovered() const
+  {
+    lock_guard lock(this, false);
+
+    return _M_recovered;
+  }
+
   inline bool file_model::read_only() const
   {
+    lock_guard lock(this, false);
+
     return _M_read_only;
   }
 
   inline bool file_model::block_device() const
   {
+    lock_guard lock(this, false);
+
     return _M_block_device;
   }
 
   inline uint64_t file_model::length() const
   {
+    lock_guard lock(this, false);
+
     return _M_len;
   }
 
   inline uint64_t file_model::memory_used() const
   {
-    return _M_memory_used;
+    lock_guard lock(this, false);
+
+    return _M_memory_used + _M_changes.memory_used();
   }
 
   inline bool file_model::modified() const
   {
+    lock_guard lock(this, false);
+
     return _M_modified;
   }
 
@@ -274,6 +1561,44 @@ namespace fs {
   {
     return seek(off, const_cast<const struct block*&>(b), pos);
   }
+
+  inline uint64_t file_model::charged(const uint8_t* data) const
+  {
+    struct page* p = page_header(data);
+    return (p->owner == this) ? p->size : 0;
+  }
+
+  inline uint64_t file_model::room(const struct block* b) const
+  {
+    uint64_t size = page_header(b->data)->size;
+    return ((size > kMemoryBlockSize) ? size : kMemoryBlockSize) - b->len;
+  }
+
+  inline bool file_model::on_disk(const uint8_t* data) const
+  {
+    const uint8_t* disk = reinterpret_cast<const uint8_t*>(_M_data);
+
+    return ((_M_data != MAP_FAILED) &&
+            (data >= disk) &&
+            (data < disk + _M_filesize));
+  }
+
+  inline const uint8_t* file_model::view(const struct block* b) const
+  {
+    return compressed(b) ? decompressed(b) : b->data;
+  }
+
+  inline bool file_model::compressed(const struct block* b)
+  {
+    return ((b->in_memory) && (page_header(b->data)->id != 0));
+  }
+
+  inline struct file_model::page* file_model::page_header(const uint8_t* data)
+  {
+    return reinterpret_cast<struct page*>(
+             const_cast<uint8_t*>(data) - sizeof(struct page)
+           );
+  }
 }
 
 #endif // FS_FILE_MODEL_H
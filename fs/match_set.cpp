@@ -0,0 +1,204 @@
+#include <string.h>
+#include "fs/match_set.h"
+
+bool fs::match_set::create(file_model& fm,
+                           const void* needle,
+                           uint64_t needlelen)
+{
+  clear();
+
+  if (needlelen == 0) {
+    return false;
+  }
+
+  // Save needle.
+  if ((_M_needle = reinterpret_cast<uint8_t*>(malloc(needlelen))) == NULL) {
+    return false;
+  }
+
+  memcpy(_M_needle, needle, needlelen);
+  _M_needlelen = needlelen;
+
+  if (!fm.add_listener(on_change, this)) {
+    clear();
+    return false;
+  }
+
+  _M_file_model = &fm;
+
+  // Search the whole file.
+  if (!update(0, 0, fm.length())) {
+    clear();
+    return false;
+  }
+
+  _M_valid = true;
+
+  return true;
+}
+
+void fs::match_set::clear()
+{
+  if (_M_file_model) {
+    _M_file_model->remove_listener(on_change, this);
+    _M_file_model = NULL;
+  }
+
+  if (_M_needle) {
+    free(_M_needle);
+    _M_needle = NULL;
+  }
+
+  _M_needlelen = 0;
+
+  if (_M_positions) {
+    free(_M_positions);
+    _M_positions = NULL;
+  }
+
+  _M_npositions = 0;
+  _M_size = 0;
+
+  if (_M_found) {
+    free(_M_found);
+    _M_found = NULL;
+  }
+
+  _M_nfound = 0;
+  _M_found_size = 0;
+
+  _M_valid = false;
+}
+
+size_t fs::match_set::lower_bound(uint64_t off) const
+{
+  size_t i = 0;
+  size_t j = _M_npositions;
+
+  while (i < j) {
+    size_t mid = i + ((j - i) / 2);
+
+    if (_M_positions[mid] < off) {
+      i = mid + 1;
+    } else {
+      j = mid;
+    }
+  }
+
+  return i;
+}
+
+bool fs::match_set::update(uint64_t off, uint64_t oldlen, uint64_t newlen)
+{
+  // The occurrences which start in [begin, off + oldlen) overlap the
+  // changed range.
+  uint64_t begin = (off >= _M_needlelen - 1) ? off - (_M_needlelen - 1) : 0;
+
+  size_t lo = lower_bound(begin);
+  size_t hi = lower_bound(off + oldlen);
+
+  // Search the occurrences which overlap the new range.
+  if (!search(begin, off + newlen)) {
+    return false;
+  }
+
+  // If all the occurrences have been replaced...
+  if ((lo == 0) && (hi == _M_npositions)) {
+    uint64_t* positions = _M_positions;
+    size_t size = _M_size;
+
+    _M_positions = _M_found;
+    _M_npositions = _M_nfound;
+    _M_size = _M_found_size;
+
+    _M_found = positions;
+    _M_nfound = 0;
+    _M_found_size = size;
+
+    return true;
+  }
+
+  size_t npositions = _M_npositions - (hi - lo) + _M_nfound;
+  if (!reserve(_M_positions, _M_size, npositions)) {
+    return false;
+  }
+
+  // Shift the occurrences after the change.
+  if (oldlen != newlen) {
+    for (size_t i = hi; i < _M_npositions; i++) {
+      _M_positions[i] = _M_positions[i] - oldlen + newlen;
+    }
+  }
+
+  if (lo + _M_nfound != hi) {
+    memmove(_M_positions + lo + _M_nfound,
+            _M_positions + hi,
+            (_M_npositions - hi) * sizeof(uint64_t));
+  }
+
+  memcpy(_M_positions + lo, _M_found, _M_nfound * sizeof(uint64_t));
+
+  _M_npositions = npositions;
+
+  return true;
+}
+
+bool fs::match_set::search(uint64_t begin, uint64_t end)
+{
+  _M_nfound = 0;
+
+  // If the range reaches the end of the file...
+  if (end + _M_needlelen > _M_file_model->length()) {
+    // Search in parallel if the range is big enough.
+    return (_M_file_model->find_all(begin,
+                                    _M_needle,
+                                    _M_needlelen,
+                                    add_found,
+                                    this) ==
+            file_model::find_all_result::kCompleted);
+  }
+
+  return _M_file_model->find_range(begin,
+                                   end,
+                                   _M_needle,
+                                   _M_needlelen,
+                                   add_found,
+                                   this);
+}
+
+bool fs::match_set::reserve(uint64_t*& positions, size_t& size, size_t n)
+{
+  if (n <= size) {
+    return true;
+  }
+
+  size_t s = (size == 0) ? 256 : size;
+  while (s < n) {
+    s *= 2;
+  }
+
+  uint64_t* p;
+  if ((p = reinterpret_cast<uint64_t*>(
+             realloc(positions, s * sizeof(uint64_t))
+           )) == NULL) {
+    return false;
+  }
+
+  positions = p;
+  size = s;
+
+  return true;
+}
+
+bool fs::match_set::add_found(uint64_t position, void* arg)
+{
+  match_set* ms = reinterpret_cast<match_set*>(arg);
+
+  if (!reserve(ms->_M_found, ms->_M_found_size, ms->_M_nfound + 1)) {
+    return false;
+  }
+
+  ms->_M_found[ms->_M_nfound++] = position;
+
+  return true;
+}
@@ -0,0 +1,138 @@
+#ifndef FS_MATCH_SET_H
+#define FS_MATCH_SET_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include "fs/file_model.h"
+
+namespace fs {
+  // Set of all the occurrences (including overlapping occurrences) of a
+  // needle in a file_model, which is kept up to date while the file is
+  // being edited.
+  //
+  // After each change, the occurrences which overlap the changed range are
+  // searched again (the changed range plus 'needlelen - 1' bytes before it)
+  // and the positions after the change are shifted.
+  //
+  // The match set has to be cleared (or destroyed) before the file_model is
+  // destroyed.
+  class match_set {
+    public:
+      // Constructor.
+      match_set();
+
+      // Destructor.
+      ~match_set();
+
+      // Create: bind to the file model and search all the occurrences.
+      bool create(file_model& fm, const void* needle, uint64_t needlelen);
+
+      // Clear.
+      void clear();
+
+      // Is the set up to date? (false if an update couldn't be performed,
+      // create() has to be called again).
+      bool valid() const;
+
+      // Get number of occurrences.
+      size_t size() const;
+
+      // Get position of the occurrence 'idx'.
+      uint64_t get(size_t idx) const;
+
+      // Get index of the first occurrence at or after 'off' (size() if there
+      // is none).
+      size_t lower_bound(uint64_t off) const;
+
+    private:
+      // File model.
+      file_model* _M_file_model;
+
+      // Needle.
+      uint8_t* _M_needle;
+      uint64_t _M_needlelen;
+
+      // Positions (sorted).
+      uint64_t* _M_positions;
+      size_t _M_npositions;
+      size_t _M_size;
+
+      // Positions found by the last search.
+      uint64_t* _M_found;
+      size_t _M_nfound;
+      size_t _M_found_size;
+
+      bool _M_valid;
+
+      // Update: the range [off, off + oldlen) has been replaced with
+      // 'newlen' bytes.
+      bool update(uint64_t off, uint64_t oldlen, uint64_t newlen);
+
+      // Search the occurrences starting in [begin, end).
+      bool search(uint64_t begin, uint64_t end);
+
+      // Reserve space for 'n' positions.
+      static bool reserve(uint64_t*& positions, size_t& size, size_t n);
+
+      // Change listener.
+      static void on_change(uint64_t off,
+                            uint64_t oldlen,
+                            uint64_t newlen,
+                            void* arg);
+
+      // Add found position.
+      static bool add_found(uint64_t position, void* arg);
+
+      // Disable copy constructor and assignment operator.
+      match_set(const match_set&) = delete;
+      match_set& operator=(const match_set&) = delete;
+  };
+
+  inline match_set::match_set()
+    : _M_file_model(NULL),
+      _M_needle(NULL),
+      _M_needlelen(0),
+      _M_positions(NULL),
+      _M_npositions(0),
+      _M_size(0),
+      _M_found(NULL),
+      _M_nfound(0),
+      _M_found_size(0),
+      _M_valid(false)
+  {
+  }
+
+  inline match_set::~match_set()
+  {
+    clear();
+  }
+
+  inline bool match_set::valid() const
+  {
+    return _M_valid;
+  }
+
+  inline size_t match_set::size() const
+  {
+    return _M_npositions;
+  }
+
+  inline uint64_t match_set::get(size_t idx) const
+  {
+    return _M_positions[idx];
+  }
+
+  inline void match_set::on_change(uint64_t off,
+                                   uint64_t oldlen,
+                                   uint64_t newlen,
+                                   void* arg)
+  {
+    match_set* ms = reinterpret_cast<match_set*>(arg);
+
+    if (ms->_M_valid) {
+      ms->_M_valid = ms->update(off, oldlen, newlen);
+    }
+  }
+}
+
+#endif // FS_MATCH_SET_H
@@ -0,0 +1,266 @@
+#include <string.h>
+#include <stdio.h>
+#include "fs/ngram_index.h"
+
+bool fs::ngram_index::build(const void* data, uint64_t len)
+{
+  if (!allocate(len)) {
+    return false;
+  }
+
+  for (size_t i = 0; i < _M_nchunks; i++) {
+    index_chunk(reinterpret_cast<const uint8_t*>(data), i);
+  }
+
+  return true;
+}
+
+bool fs::ngram_index::load(const char* filename,
+                           uint64_t filesize,
+                           const struct timespec& mtime)
+{
+  // Open file for reading.
+  FILE* file;
+  if ((file = fopen(filename, "rb")) == NULL) {
+    return false;
+  }
+
+  // Read header.
+  struct header hdr;
+  if ((fread(&hdr, sizeof(struct header), 1, file) != 1) ||
+      (hdr.magic != kMagic) ||
+      (hdr.version != kVersion) ||
+      (hdr.chunk_size != kChunkSize) ||
+      (hdr.filesize != filesize) ||
+      (hdr.mtime_sec != static_cast<uint64_t>(mtime.tv_sec)) ||
+      (hdr.mtime_nsec != static_cast<uint64_t>(mtime.tv_nsec)) ||
+      (!allocate(filesize))) {
+    fclose(file);
+    return false;
+  }
+
+  if ((fread(_M_stale, 1, _M_nchunks, file) != _M_nchunks) ||
+      (fread(_M_bitmaps,
+             kBitmapSize * sizeof(uint32_t),
+             _M_nchunks,
+             file) != _M_nchunks)) {
+    fclose(file);
+    clear();
+
+    return false;
+  }
+
+  fclose(file);
+
+  for (size_t i = 0; i < _M_nchunks; i++) {
+    if (_M_stale[i]) {
+      _M_nstale++;
+    }
+  }
+
+  return true;
+}
+
+bool fs::ngram_index::save(const char* filename,
+                           uint64_t filesize,
+                           const struct timespec& mtime) const
+{
+  if (empty()) {
+    return false;
+  }
+
+  // Open file for writing.
+  FILE* file;
+  if ((file = fopen(filename, "wb")) == NULL) {
+    return false;
+  }
+
+  struct header hdr;
+  hdr.magic = kMagic;
+  hdr.version = kVersion;
+  hdr.chunk_size = kChunkSize;
+  hdr.filesize = filesize;
+  hdr.mtime_sec = mtime.tv_sec;
+  hdr.mtime_nsec = mtime.tv_nsec;
+
+  if ((fwrite(&hdr, sizeof(struct header), 1, file) != 1) ||
+      (fwrite(_M_stale, 1, _M_nchunks, file) != _M_nchunks) ||
+      (fwrite(_M_bitmaps,
+              kBitmapSize * sizeof(uint32_t),
+              _M_nchunks,
+              file) != _M_nchunks)) {
+    fclose(file);
+    remove(filename);
+
+    return false;
+  }
+
+  if (fclose(file) != 0) {
+    remove(filename);
+    return false;
+  }
+
+  return true;
+}
+
+void fs::ngram_index::clear()
+{
+  if (_M_bitmaps) {
+    free(_M_bitmaps);
+    _M_bitmaps = NULL;
+  }
+
+  if (_M_stale) {
+    free(_M_stale);
+    _M_stale = NULL;
+  }
+
+  _M_nstale = 0;
+  _M_nchunks = 0;
+  _M_len = 0;
+}
+
+void fs::ngram_index::invalidate(uint64_t off, uint64_t len)
+{
+  if ((empty()) || (len == 0) || (off >= _M_len)) {
+    return;
+  }
+
+  // The trigrams which start in the two previous bytes overlap the range.
+  size_t first = ((off >= 2) ? off - 2 : 0) / kChunkSize;
+  size_t last = ((len > _M_len - off) ? _M_len - 1 : off + len - 1) /
+                kChunkSize;
+
+  for (size_t i = first; i <= last; i++) {
+    if (!_M_stale[i]) {
+      _M_stale[i] = 1;
+      _M_nstale++;
+    }
+  }
+}
+
+void fs::ngram_index::update(const void* data)
+{
+  for (size_t i = 0; (_M_nstale > 0) && (i < _M_nchunks); i++) {
+    if (_M_stale[i]) {
+      index_chunk(reinterpret_cast<const uint8_t*>(data), i);
+
+      _M_stale[i] = 0;
+      _M_nstale--;
+    }
+  }
+}
+
+bool fs::ngram_index::prepare(const void* needle,
+                              uint64_t needlelen,
+                              query& q) const
+{
+  if (needlelen < kMinNeedleLen) {
+    return false;
+  }
+
+  q.nhashes = needlelen - kMinNeedleLen + 1;
+  if (q.nhashes > query::kMaxTrigrams) {
+    q.nhashes = query::kMaxTrigrams;
+  }
+
+  for (size_t i = 0; i < q.nhashes; i++) {
+    q.hashes[i] = hash(reinterpret_cast<const uint8_t*>(needle) + i);
+  }
+
+  q.prefixlen = q.nhashes + kMinNeedleLen - 1;
+
+  return true;
+}
+
+uint64_t fs::ngram_index::next_candidate(const query& q,
+                                         uint64_t off,
+                                         uint64_t limit) const
+{
+  if (limit > _M_len) {
+    limit = _M_len;
+  }
+
+  while (off < limit) {
+    size_t chunk = off / kChunkSize;
+
+    if (candidate(q, chunk)) {
+      return off;
+    }
+
+    off = static_cast<uint64_t>(chunk + 1) * kChunkSize;
+  }
+
+  return limit;
+}
+
+bool fs::ngram_index::allocate(uint64_t len)
+{
+  clear();
+
+  size_t nchunks = (len + kChunkSize - 1) / kChunkSize;
+  if (nchunks == 0) {
+    nchunks = 1;
+  }
+
+  if ((_M_bitmaps = reinterpret_cast<uint32_t*>(
+                      calloc(nchunks, kBitmapSize * sizeof(uint32_t))
+                    )) == NULL) {
+    return false;
+  }
+
+  if ((_M_stale = reinterpret_cast<uint8_t*>(calloc(nchunks, 1))) == NULL) {
+    clear();
+    return false;
+  }
+
+  _M_nchunks = nchunks;
+  _M_len = len;
+
+  return true;
+}
+
+void fs::ngram_index::index_chunk(const uint8_t* data, size_t chunk)
+{
+  uint32_t* bitmap = _M_bitmaps + chunk * kBitmapSize;
+  memset(bitmap, 0, kBitmapSize * sizeof(uint32_t));
+
+  uint64_t begin = static_cast<uint64_t>(chunk) * kChunkSize;
+  if (begin + kMinNeedleLen > _M_len) {
+    return;
+  }
+
+  // Trigrams which start in the chunk (and the trigrams of the occurrences
+  // which start at the end of the chunk).
+  uint64_t end = begin + kChunkSize + query::kMaxTrigrams - 1;
+  if (end > _M_len - kMinNeedleLen + 1) {
+    end = _M_len - kMinNeedleLen + 1;
+  }
+
+  for (const uint8_t* p = data + begin; p < data + end; p++) {
+    uint32_t h = hash(p);
+    bitmap[h >> 5] |= (1u << (h & 31));
+  }
+}
+
+bool fs::ngram_index::candidate(const query& q, size_t chunk) const
+{
+  // The bitmap of the chunk contains the trigrams which start in the first
+  // bytes of the next chunk.
+  if ((_M_stale[chunk]) ||
+      ((chunk + 1 < _M_nchunks) && (_M_stale[chunk + 1]))) {
+    return true;
+  }
+
+  const uint32_t* bitmap = _M_bitmaps + chunk * kBitmapSize;
+
+  for (size_t i = 0; i < q.nhashes; i++) {
+    uint32_t h = q.hashes[i];
+
+    if ((bitmap[h >> 5] & (1u << (h & 31))) == 0) {
+      return false;
+    }
+  }
+
+  return true;
+}
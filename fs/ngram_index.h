@@ -0,0 +1,161 @@
+#ifndef FS_NGRAM_INDEX_H
+#define FS_NGRAM_INDEX_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+namespace fs {
+  // Trigram index of a file.
+  //
+  // The file is split in chunks and, for each chunk, a bitmap records the
+  // (hashed) trigrams which start in the chunk (or in the first bytes of the
+  // next chunk, so that the trigrams of an occurrence which starts in the
+  // chunk are in the same bitmap). Before searching a chunk,
+  // the trigrams of the needle are looked up in the bitmaps: if one of them
+  // is missing, no occurrence of the needle can start in the chunk (there
+  // might be false positives, but no false negatives).
+  //
+  // When the file is overwritten, the chunks which have changed are marked
+  // as stale (they are always searched) until they are indexed again.
+  class ngram_index {
+    public:
+      static const uint64_t kChunkSize = 64 * 1024;
+      static const uint64_t kMinNeedleLen = 3;
+
+      // Trigrams of a needle.
+      struct query {
+        static const size_t kMaxTrigrams = 64;
+
+        uint32_t hashes[kMaxTrigrams];
+        size_t nhashes;
+
+        // Length of the prefix of the needle which contains the trigrams.
+        uint64_t prefixlen;
+      };
+
+      // Constructor.
+      ngram_index();
+
+      // Destructor.
+      ~ngram_index();
+
+      // Build.
+      bool build(const void* data, uint64_t len);
+
+      // Load from file ('filesize' and 'mtime' identify the indexed file).
+      bool load(const char* filename,
+                uint64_t filesize,
+                const struct timespec& mtime);
+
+      // Save to file.
+      bool save(const char* filename,
+                uint64_t filesize,
+                const struct timespec& mtime) const;
+
+      // Clear.
+      void clear();
+
+      // Empty?
+      bool empty() const;
+
+      // Mark the chunks containing trigrams which overlap [off, off + len)
+      // as stale.
+      void invalidate(uint64_t off, uint64_t len);
+
+      // Index the stale chunks again.
+      void update(const void* data);
+
+      // Prepare query (returns false if the needle is too short).
+      bool prepare(const void* needle, uint64_t needlelen, query& q) const;
+
+      // Get first offset in [off, limit) where an occurrence might start
+      // ('limit' if there is none).
+      uint64_t next_candidate(const query& q,
+                              uint64_t off,
+                              uint64_t limit) const;
+
+      // Get end of the chunk containing 'off'.
+      static uint64_t chunk_end(uint64_t off);
+
+    private:
+      static const unsigned kHashBits = 15;
+      static const size_t kBitmapSize = (1u << kHashBits) / 32;
+
+      static const uint32_t kMagic = 0x78646967; // "gidx"
+      static const uint32_t kVersion = 1;
+
+      // Sidecar file header.
+      struct header {
+        uint32_t magic;
+        uint32_t version;
+        uint64_t chunk_size;
+        uint64_t filesize;
+        uint64_t mtime_sec;
+        uint64_t mtime_nsec;
+      };
+
+      // Bitmaps (one per chunk).
+      uint32_t* _M_bitmaps;
+
+      // Stale chunks.
+      uint8_t* _M_stale;
+      size_t _M_nstale;
+
+      size_t _M_nchunks;
+
+      // Length of the indexed data.
+      uint64_t _M_len;
+
+      // Allocate.
+      bool allocate(uint64_t len);
+
+      // Index chunk.
+      void index_chunk(const uint8_t* data, size_t chunk);
+
+      // Might an occurrence start in the chunk?
+      bool candidate(const query& q, size_t chunk) const;
+
+      // Hash trigram.
+      static uint32_t hash(const uint8_t* p);
+
+      // Disable copy constructor and assignment operator.
+      ngram_index(const ngram_index&) = delete;
+      ngram_index& operator=(const ngram_index&) = delete;
+  };
+
+  inline ngram_index::ngram_index()
+    : _M_bitmaps(NULL),
+      _M_stale(NULL),
+      _M_nstale(0),
+      _M_nchunks(0),
+      _M_len(0)
+  {
+  }
+
+  inline ngram_index::~ngram_index()
+  {
+    clear();
+  }
+
+  inline bool ngram_index::empty() const
+  {
+    return (_M_bitmaps == NULL);
+  }
+
+  inline uint64_t ngram_index::chunk_end(uint64_t off)
+  {
+    return (off / kChunkSize + 1) * kChunkSize;
+  }
+
+  inline uint32_t ngram_index::hash(const uint8_t* p)
+  {
+    uint32_t trigram = static_cast<uint32_t>(p[0]) |
+                       (static_cast<uint32_t>(p[1]) << 8) |
+                       (static_cast<uint32_t>(p[2]) << 16);
+
+    return (trigram * 2654435761u) >> (32 - kHashBits);
+  }
+}
+
+#endif // FS_NGRAM_INDEX_H
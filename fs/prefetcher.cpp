@@ -0,0 +1,308 @@
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "fs/prefetcher.h"
+
+bool fs::prefetcher::start(uint64_t distance)
+{
+  pthread_mutex_lock(&_M_mutex);
+  _M_distance = distance;
+  pthread_mutex_unlock(&_M_mutex);
+
+  if (_M_running) {
+    return true;
+  }
+
+  _M_stop = false;
+
+  if (pthread_create(&_M_thread, NULL, thread, this) != 0) {
+    return false;
+  }
+
+  _M_running = true;
+
+  return true;
+}
+
+void fs::prefetcher::stop()
+{
+  if (!_M_running) {
+    return;
+  }
+
+  pthread_mutex_lock(&_M_mutex);
+
+  _M_stop = true;
+  _M_cancel = true;
+
+  pthread_cond_broadcast(&_M_cond);
+  pthread_mutex_unlock(&_M_mutex);
+
+  pthread_join(_M_thread, NULL);
+
+  _M_running = false;
+
+  _M_npending = 0;
+  _M_cancel = false;
+
+  _M_last_valid = false;
+}
+
+size_t fs::prefetcher::access(uint64_t off, uint64_t len, range* ranges)
+{
+  if (len == 0) {
+    return 0;
+  }
+
+  pthread_mutex_lock(&_M_mutex);
+
+  // Distance from the previous access (0: sequential access).
+  int64_t stride = 0;
+  bool forward = true;
+
+  bool confirmed = false;
+
+  if (_M_last_valid) {
+    if (off == _M_last_off + _M_last_len) {
+      // Sequential forward.
+      confirmed = ((_M_stride == 0) && (_M_hits > 0) && (_M_forward));
+    } else if (off + len == _M_last_off) {
+      // Sequential backward.
+      forward = false;
+      confirmed = ((_M_stride == 0) && (_M_hits > 0) && (!_M_forward));
+    } else {
+      stride = static_cast<int64_t>(off - _M_last_off);
+      forward = (stride > 0);
+
+      confirmed = (stride == _M_stride);
+    }
+  }
+
+  size_t n = 0;
+
+  if (confirmed) {
+    _M_hits++;
+
+    if (stride == 0) {
+      if (forward) {
+        // Keep 'distance' bytes requested ahead of the cursor.
+        uint64_t begin = off + len;
+        uint64_t end = begin + _M_distance;
+
+        if (_M_requested_end < begin + (_M_distance / 2)) {
+          if ((_M_requested_end > begin) && (_M_requested_begin <= begin)) {
+            begin = _M_requested_end;
+          }
+
+          ranges[n].off = begin;
+          ranges[n].len = end - begin;
+          n++;
+
+          _M_requested_begin = off;
+          _M_requested_end = end;
+        }
+      } else {
+        // Keep 'distance' bytes requested behind the cursor.
+        uint64_t end = off;
+        uint64_t begin = (off > _M_distance) ? off - _M_distance : 0;
+
+        if ((_M_requested_begin > begin + (_M_distance / 2)) ||
+            ((begin == 0) && (_M_requested_begin > 0))) {
+          if ((_M_requested_begin < end) && (_M_requested_end >= end)) {
+            end = _M_requested_begin;
+          }
+
+          ranges[n].off = begin;
+          ranges[n].len = end - begin;
+          n++;
+
+          _M_requested_begin = begin;
+          _M_requested_end = off + len;
+        }
+      }
+    } else {
+      // Request the next accesses within 'distance' bytes.
+      uint64_t step = forward ? stride : -stride;
+
+      for (uint64_t d = step;
+           (d <= _M_distance) && (n < kMaxRanges);
+           d += step) {
+        uint64_t pos;
+        if (forward) {
+          if ((pos = off + d) < _M_requested_end) {
+            continue;
+          }
+
+          _M_requested_end = pos + len;
+        } else {
+          if (d > off) {
+            break;
+          }
+
+          if ((pos = off - d) + len > _M_requested_begin) {
+            continue;
+          }
+
+          _M_requested_begin = pos;
+        }
+
+        ranges[n].off = pos;
+        ranges[n].len = len;
+        n++;
+      }
+    }
+  } else {
+    // New pattern.
+    _M_hits = _M_last_valid ? 1 : 0;
+
+    _M_requested_begin = off;
+    _M_requested_end = off + len;
+  }
+
+  _M_stride = stride;
+  _M_forward = forward;
+
+  _M_last_valid = true;
+  _M_last_off = off;
+  _M_last_len = len;
+
+  pthread_mutex_unlock(&_M_mutex);
+
+  return n;
+}
+
+void fs::prefetcher::prefetch(const uint8_t* begin, const uint8_t* end)
+{
+  if (begin >= end) {
+    return;
+  }
+
+  pthread_mutex_lock(&_M_mutex);
+
+  // If there are too many queued ranges, drop the oldest one.
+  if (_M_npending == kMaxPending) {
+    memmove(_M_pending,
+            _M_pending + 1,
+            (kMaxPending - 1) * sizeof(pending_range));
+
+    _M_npending--;
+  }
+
+  _M_pending[_M_npending].begin = begin;
+  _M_pending[_M_npending].end = end;
+  _M_npending++;
+
+  _M_requests++;
+
+  pthread_cond_broadcast(&_M_cond);
+  pthread_mutex_unlock(&_M_mutex);
+}
+
+void fs::prefetcher::cancel()
+{
+  pthread_mutex_lock(&_M_mutex);
+
+  _M_npending = 0;
+
+  _M_cancel = true;
+
+  while (_M_busy) {
+    pthread_cond_wait(&_M_cond, &_M_mutex);
+  }
+
+  _M_cancel = false;
+
+  _M_last_valid = false;
+
+  pthread_mutex_unlock(&_M_mutex);
+}
+
+void fs::prefetcher::get_stats(stats& s) const
+{
+  s.read = _M_read;
+  s.read_time = _M_read_time;
+  s.requests = _M_requests;
+  s.prefetched = _M_prefetched;
+}
+
+void fs::prefetcher::reset_stats()
+{
+  _M_read = 0;
+  _M_read_time = 0;
+  _M_requests = 0;
+  _M_prefetched = 0;
+}
+
+uint64_t fs::prefetcher::now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (static_cast<uint64_t>(ts.tv_sec) * 1000000000ull) + ts.tv_nsec;
+}
+
+void fs::prefetcher::run()
+{
+  pending_range ranges[kMaxPending];
+
+  pthread_mutex_lock(&_M_mutex);
+
+  while (!_M_stop) {
+    if (_M_npending == 0) {
+      pthread_cond_wait(&_M_cond, &_M_mutex);
+      continue;
+    }
+
+    // Take the queued ranges.
+    size_t n = _M_npending;
+    memcpy(ranges, _M_pending, n * sizeof(pending_range));
+    _M_npending = 0;
+
+    _M_busy = true;
+
+    pthread_mutex_unlock(&_M_mutex);
+
+    for (size_t i = 0; (i < n) && (!_M_cancel); i++) {
+      touch(ranges[i]);
+    }
+
+    pthread_mutex_lock(&_M_mutex);
+
+    _M_busy = false;
+
+    pthread_cond_broadcast(&_M_cond);
+  }
+
+  pthread_mutex_unlock(&_M_mutex);
+}
+
+void fs::prefetcher::touch(const pending_range& r)
+{
+  static const uintptr_t kPageSize = sysconf(_SC_PAGESIZE);
+
+  // The mappings start at a page boundary.
+  const uint8_t* begin = reinterpret_cast<const uint8_t*>(
+                           reinterpret_cast<uintptr_t>(r.begin) &
+                           ~(kPageSize - 1)
+                         );
+
+  madvise(const_cast<uint8_t*>(begin), r.end - begin, MADV_WILLNEED);
+
+  // Fault the pages in.
+  for (const volatile uint8_t* p = begin; p < r.end; p += kPageSize) {
+    if (_M_cancel) {
+      return;
+    }
+
+    (void) *p;
+  }
+
+  _M_prefetched += (r.end - r.begin);
+}
+
+void* fs::prefetcher::thread(void* arg)
+{
+  reinterpret_cast<prefetcher*>(arg)->run();
+  return NULL;
+}
@@ -0,0 +1,191 @@
+#ifndef FS_PREFETCHER_H
+#define FS_PREFETCHER_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <atomic>
+
+namespace fs {
+  // Prefetcher of mapped files.
+  //
+  // The accesses are recorded by access(), which detects the access
+  // pattern (sequential forward, sequential backward or strided: the same
+  // distance between consecutive accesses) and returns the ranges which
+  // should be prefetched ('distance' bytes ahead of the cursor). The ranges
+  // of the mappings queued by prefetch() are advised (MADV_WILLNEED) and
+  // touched by a helper thread, so that the page faults happen there and
+  // not in the reader.
+  class prefetcher {
+    public:
+      // Range of the file.
+      struct range {
+        uint64_t off;
+        uint64_t len;
+      };
+
+      // Maximum number of ranges returned by access().
+      static const size_t kMaxRanges = 64;
+
+      // Statistics.
+      struct stats {
+        // Data read (bytes) and time spent reading it (nanoseconds, the
+        // page faults included: stall time).
+        uint64_t read;
+        uint64_t read_time;
+
+        // Number of ranges queued and bytes prefetched.
+        uint64_t requests;
+        uint64_t prefetched;
+      };
+
+      // Constructor.
+      prefetcher();
+
+      // Destructor.
+      ~prefetcher();
+
+      // Start the helper thread.
+      bool start(uint64_t distance);
+
+      // Stop the helper thread.
+      void stop();
+
+      // Is the helper thread running?
+      bool running() const;
+
+      // Record the access [off, off + len): 'ranges' receives the ranges
+      // of the file which should be prefetched (returns their number).
+      size_t access(uint64_t off, uint64_t len, range* ranges);
+
+      // Queue the prefetch of [begin, end) of a mapping (the oldest ranges
+      // are dropped if there are too many).
+      void prefetch(const uint8_t* begin, const uint8_t* end);
+
+      // Drop the queued ranges and wait until the helper thread doesn't
+      // touch any mapping (before unmapping).
+      void cancel();
+
+      // Record a read of 'len' bytes which took 'ns' nanoseconds.
+      void record_read(uint64_t len, uint64_t ns);
+
+      // Get statistics.
+      void get_stats(stats& s) const;
+
+      // Reset statistics.
+      void reset_stats();
+
+      // Get current time (nanoseconds).
+      static uint64_t now();
+
+    private:
+      // Maximum number of queued ranges.
+      static const size_t kMaxPending = 64;
+
+      // Range of a mapping.
+      struct pending_range {
+        const uint8_t* begin;
+        const uint8_t* end;
+      };
+
+      // Helper thread.
+      pthread_t _M_thread;
+      bool _M_running;
+
+      // Prefetch distance.
+      uint64_t _M_distance;
+
+      // Queued ranges.
+      pending_range _M_pending[kMaxPending];
+      size_t _M_npending;
+
+      // Is the helper thread touching a mapping?
+      bool _M_busy;
+
+      // Should the helper thread stop / stop touching the mapping?
+      bool _M_stop;
+      std::atomic<bool> _M_cancel;
+
+      mutable pthread_mutex_t _M_mutex;
+      pthread_cond_t _M_cond;
+
+      // Last access.
+      bool _M_last_valid;
+      uint64_t _M_last_off;
+      uint64_t _M_last_len;
+
+      // Distance between the last two accesses (0: sequential access),
+      // direction and number of accesses which have confirmed them.
+      int64_t _M_stride;
+      bool _M_forward;
+      unsigned _M_hits;
+
+      // Range of the file which has already been requested.
+      uint64_t _M_requested_begin;
+      uint64_t _M_requested_end;
+
+      // Statistics.
+      std::atomic<uint64_t> _M_read;
+      std::atomic<uint64_t> _M_read_time;
+      std::atomic<uint64_t> _M_requests;
+      std::atomic<uint64_t> _M_prefetched;
+
+      // Prefetch ranges (helper thread).
+      void run();
+
+      // Advise and touch the pages of a range.
+      void touch(const pending_range& r);
+
+      // Helper thread.
+      static void* thread(void* arg);
+
+      // Disable copy constructor and assignment operator.
+      prefetcher(const prefetcher&) = delete;
+      prefetcher& operator=(const prefetcher&) = delete;
+  };
+
+  inline prefetcher::prefetcher()
+    : _M_running(false),
+      _M_distance(0),
+      _M_npending(0),
+      _M_busy(false),
+      _M_stop(false),
+      _M_cancel(false),
+      _M_last_valid(false),
+      _M_last_off(0),
+      _M_last_len(0),
+      _M_stride(0),
+      _M_forward(true),
+      _M_hits(0),
+      _M_requested_begin(0),
+      _M_requested_end(0),
+      _M_read(0),
+      _M_read_time(0),
+      _M_requests(0),
+      _M_prefetched(0)
+  {
+    pthread_mutex_init(&_M_mutex, NULL);
+    pthread_cond_init(&_M_cond, NULL);
+  }
+
+  inline prefetcher::~prefetcher()
+  {
+    stop();
+
+    pthread_cond_destroy(&_M_cond);
+    pthread_mutex_destroy(&_M_mutex);
+  }
+
+  inline bool prefetcher::running() const
+  {
+    return _M_running;
+  }
+
+  inline void prefetcher::record_read(uint64_t len, uint64_t ns)
+  {
+    _M_read += len;
+    _M_read_time += ns;
+  }
+}
+
+#endif // FS_PREFETCHER_H
@@ -0,0 +1,1583 @@
+#include <string.h>
+#include "fs/regex.h"
+
+void fs::regex::clear()
+{
+  free_dfa();
+
+  if (_M_charsets) {
+    free(_M_charsets);
+    _M_charsets = NULL;
+  }
+
+  _M_ncharsets = 0;
+  _M_charsets_size = 0;
+
+  if (_M_nodes) {
+    free(_M_nodes);
+    _M_nodes = NULL;
+  }
+
+  _M_nnodes = 0;
+  _M_nodes_size = 0;
+
+  if (_M_insts) {
+    free(_M_insts);
+    _M_insts = NULL;
+  }
+
+  _M_ninsts = 0;
+  _M_insts_size = 0;
+
+  _M_start = -1;
+
+  if (_M_prefix) {
+    free(_M_prefix);
+    _M_prefix = NULL;
+  }
+
+  _M_prefixlen = 0;
+
+  _M_nclasses = 0;
+
+  if (_M_list) {
+    free(_M_list);
+    _M_list = NULL;
+  }
+
+  if (_M_list1) {
+    free(_M_list1);
+    _M_list1 = NULL;
+  }
+
+  if (_M_marks) {
+    free(_M_marks);
+    _M_marks = NULL;
+  }
+
+  _M_mark = 0;
+
+  if (_M_stack) {
+    free(_M_stack);
+    _M_stack = NULL;
+  }
+
+  if (_M_groupmap) {
+    free(_M_groupmap);
+    _M_groupmap = NULL;
+  }
+
+  if (_M_regs) {
+    free(_M_regs);
+    _M_regs = NULL;
+  }
+
+  if (_M_regs1) {
+    free(_M_regs1);
+    _M_regs1 = NULL;
+  }
+
+  _M_cur = -1;
+  _M_off = 0;
+  _M_found = false;
+}
+
+bool fs::regex::compile(const void* pattern, size_t len)
+{
+  clear();
+
+  _M_pattern = reinterpret_cast<const uint8_t*>(pattern);
+  _M_patternlen = len;
+  _M_patternpos = 0;
+
+  // Parse pattern.
+  int root;
+  if (((root = parse_alternation(0)) < 0) || (_M_patternpos != len)) {
+    _M_pattern = NULL;
+    clear();
+
+    return false;
+  }
+
+  _M_pattern = NULL;
+
+  // Compile syntax tree into NFA.
+  int match;
+  if (((match = add_instruction(instruction::opcode::kMatch,
+                                -1,
+                                -1,
+                                -1)) < 0) ||
+      ((_M_start = compile(root, match)) < 0) ||
+      (!extract_prefix(root))) {
+    clear();
+    return false;
+  }
+
+  // The syntax tree is not needed anymore.
+  free(_M_nodes);
+  _M_nodes = NULL;
+  _M_nnodes = 0;
+  _M_nodes_size = 0;
+
+  compute_byte_classes();
+
+  // Allocate scratch buffers.
+  if (((_M_list = reinterpret_cast<thread*>(
+                    malloc(_M_ninsts * sizeof(thread))
+                  )) == NULL) ||
+      ((_M_list1 = reinterpret_cast<thread*>(
+                     malloc(_M_ninsts * sizeof(thread))
+                   )) == NULL) ||
+      ((_M_marks = reinterpret_cast<unsigned*>(
+                     calloc(_M_ninsts, sizeof(unsigned))
+                   )) == NULL) ||
+      ((_M_stack = reinterpret_cast<int*>(
+                     malloc(_M_ninsts * sizeof(int))
+                   )) == NULL) ||
+      ((_M_groupmap = reinterpret_cast<int*>(
+                        malloc((_M_ninsts + 1) * sizeof(int))
+                      )) == NULL) ||
+      ((_M_regs = reinterpret_cast<uint64_t*>(
+                    malloc((_M_ninsts + 1) * sizeof(uint64_t))
+                  )) == NULL) ||
+      ((_M_regs1 = reinterpret_cast<uint64_t*>(
+                     malloc((_M_ninsts + 1) * sizeof(uint64_t))
+                   )) == NULL)) {
+    clear();
+    return false;
+  }
+
+  return true;
+}
+
+bool fs::regex::begin(uint64_t off, bool bol)
+{
+  if (_M_start < 0) {
+    return false;
+  }
+
+  // If the DFA cache is too big...
+  if (_M_cache_size > kMaxCacheSize) {
+    int s = -1;
+    if (!flush_cache(s)) {
+      return false;
+    }
+  }
+
+  if (++_M_mark == 0) {
+    memset(_M_marks, 0, _M_ninsts * sizeof(unsigned));
+    _M_mark = 1;
+  }
+
+  size_t n = add_thread(_M_list, 0, _M_start, 0, bol, false);
+
+  // Empty matches are not reported.
+  size_t m = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (_M_insts[_M_list[i].inst].op != instruction::opcode::kMatch) {
+      _M_list[m++] = _M_list[i];
+    }
+  }
+
+  // Sort threads (canonical form).
+  for (size_t i = 1; i < m; i++) {
+    thread t = _M_list[i];
+
+    size_t j;
+    for (j = i; (j > 0) && (_M_list[j - 1].inst > t.inst); j--) {
+      _M_list[j] = _M_list[j - 1];
+    }
+
+    _M_list[j] = t;
+  }
+
+  int s;
+  if ((s = get_state(_M_list, m, (m > 0) ? 1 : 0, bol, false, m > 0)) < 0) {
+    return false;
+  }
+
+  _M_cur = s;
+  _M_off = off;
+  _M_found = false;
+
+  return true;
+}
+
+fs::regex::result fs::regex::feed(const uint8_t* data,
+                                  size_t len,
+                                  size_t& consumed)
+{
+  const uint8_t* ptr = data;
+  const uint8_t* end = data + len;
+
+  uint64_t off = _M_off;
+
+  // Offset of the row of the current state in the transition table.
+  size_t row = _M_cur * _M_nclasses;
+
+  while (ptr < end) {
+    size_t cls = _M_classes[*ptr];
+
+    // Fast path.
+    int next;
+    if ((next = _M_table[row + cls]) >= 0) {
+      row = next;
+      ptr++;
+
+      continue;
+    }
+
+    int s = static_cast<int>(row / _M_nclasses);
+
+    _M_off = off + (ptr - data);
+
+    // If the transition has not been computed yet...
+    if (_M_states[s].transitions[cls].target < 0) {
+      if (!compute_transition(s, cls)) {
+        _M_cur = s;
+        consumed = ptr - data;
+
+        return result::kError;
+      }
+    }
+
+    const transition* t = &_M_states[s].transitions[cls];
+
+    // Match before the end of line?
+    if (t->eol_accept >= 0) {
+      _M_match_begin = _M_regs[t->eol_accept];
+      _M_match_end = _M_off;
+      _M_found = true;
+    }
+
+    // Match after consuming the byte?
+    if (t->accept != -1) {
+      _M_match_begin = (t->accept >= 0) ? _M_regs[t->accept] : _M_off;
+      _M_match_end = _M_off + 1;
+      _M_found = true;
+    }
+
+    // If the groups have changed...
+    if (t->groupmap >= 0) {
+      const int* groupmap = _M_groupmaps + t->groupmap;
+      int ngroups = *groupmap++;
+
+      for (int i = 0; i < ngroups; i++) {
+        _M_regs1[i] = (groupmap[i] < 0) ? _M_off : _M_regs[groupmap[i]];
+      }
+
+      uint64_t* tmp = _M_regs;
+      _M_regs = _M_regs1;
+      _M_regs1 = tmp;
+    }
+
+    s = t->target;
+    row = s * _M_nclasses;
+
+    ptr++;
+
+    const state* st = &_M_states[s];
+
+    // If there are no threads left and a match has been found...
+    if ((st->nthreads == 0) && (st->matched)) {
+      _M_cur = s;
+      _M_off = off + (ptr - data);
+      consumed = ptr - data;
+
+      return result::kMatch;
+    }
+
+    // If there is a prefix and there is no partial match...
+    if (idle(*st)) {
+      _M_cur = s;
+      _M_off = off + (ptr - data);
+      consumed = ptr - data;
+
+      return result::kIdle;
+    }
+  }
+
+  _M_cur = static_cast<int>(row / _M_nclasses);
+  _M_off = off + len;
+  consumed = len;
+
+  return result::kNeedMoreData;
+}
+
+bool fs::regex::finish()
+{
+  if (_M_cur < 0) {
+    return false;
+  }
+
+  state* st = &_M_states[_M_cur];
+  if (st->nthreads > 0) {
+    if (st->eof_accept == -2) {
+      st->eof_accept = compute_eof_accept(*st);
+    }
+
+    if (st->eof_accept >= 0) {
+      _M_match_begin = _M_regs[st->eof_accept];
+      _M_match_end = _M_off;
+      _M_found = true;
+    }
+  }
+
+  return _M_found;
+}
+
+int fs::regex::parse_alternation(unsigned depth)
+{
+  static const unsigned kMaxDepth = 1000;
+
+  if (depth > kMaxDepth) {
+    return -1;
+  }
+
+  int left;
+  if ((left = parse_concatenation(depth)) < 0) {
+    return -1;
+  }
+
+  while ((_M_patternpos < _M_patternlen) &&
+         (_M_pattern[_M_patternpos] == '|')) {
+    _M_patternpos++;
+
+    int right;
+    if (((right = parse_concatenation(depth)) < 0) ||
+        ((left = add_node(node::type::kAlternation, left, right, -1)) < 0)) {
+      return -1;
+    }
+  }
+
+  return left;
+}
+
+int fs::regex::parse_concatenation(unsigned depth)
+{
+  int res = -1;
+
+  while ((_M_patternpos < _M_patternlen) &&
+         (_M_pattern[_M_patternpos] != '|') &&
+         (_M_pattern[_M_patternpos] != ')')) {
+    int n;
+    if ((n = parse_repetition(depth)) < 0) {
+      return -1;
+    }
+
+    if (res < 0) {
+      res = n;
+    } else if ((res = add_node(node::type::kConcat, res, n, -1)) < 0) {
+      return -1;
+    }
+  }
+
+  return (res >= 0) ? res : add_node(node::type::kEmpty, -1, -1, -1);
+}
+
+int fs::regex::parse_repetition(unsigned depth)
+{
+  int n;
+  if ((n = parse_atom(depth)) < 0) {
+    return -1;
+  }
+
+  while (_M_patternpos < _M_patternlen) {
+    int min, max;
+
+    switch (_M_pattern[_M_patternpos]) {
+      case '*':
+        min = 0;
+        max = -1;
+
+        _M_patternpos++;
+        break;
+      case '+':
+        min = 1;
+        max = -1;
+
+        _M_patternpos++;
+        break;
+      case '?':
+        min = 0;
+        max = 1;
+
+        _M_patternpos++;
+        break;
+      case '{':
+        _M_patternpos++;
+
+        if (!parse_number(min)) {
+          return -1;
+        }
+
+        if (_M_patternpos == _M_patternlen) {
+          return -1;
+        }
+
+        if (_M_pattern[_M_patternpos] == ',') {
+          if (++_M_patternpos == _M_patternlen) {
+            return -1;
+          }
+
+          if (_M_pattern[_M_patternpos] == '}') {
+            max = -1;
+          } else if ((!parse_number(max)) || (max < min)) {
+            return -1;
+          }
+        } else {
+          max = min;
+        }
+
+        if ((_M_patternpos == _M_patternlen) ||
+            (_M_pattern[_M_patternpos] != '}')) {
+          return -1;
+        }
+
+        _M_patternpos++;
+        break;
+      default:
+        return n;
+    }
+
+    if ((n = add_node(node::type::kRepeat, n, -1, -1)) < 0) {
+      return -1;
+    }
+
+    _M_nodes[n].min = min;
+    _M_nodes[n].max = max;
+  }
+
+  return n;
+}
+
+int fs::regex::parse_atom(unsigned depth)
+{
+  charset cs;
+  memset(&cs, 0, sizeof(charset));
+
+  switch (_M_pattern[_M_patternpos++]) {
+    case '(':
+      {
+        // Non-capturing group?
+        if ((_M_patternpos + 1 < _M_patternlen) &&
+            (_M_pattern[_M_patternpos] == '?') &&
+            (_M_pattern[_M_patternpos + 1] == ':')) {
+          _M_patternpos += 2;
+        }
+
+        int n;
+        if (((n = parse_alternation(depth + 1)) < 0) ||
+            (_M_patternpos == _M_patternlen) ||
+            (_M_pattern[_M_patternpos] != ')')) {
+          return -1;
+        }
+
+        _M_patternpos++;
+
+        return n;
+      }
+    case '[':
+      if (!parse_class(cs)) {
+        return -1;
+      }
+
+      break;
+    case '.':
+      add(cs, 0, 0xff);
+      cs.bits['\n' >> 5] &= ~(1u << ('\n' & 31));
+
+      break;
+    case '^':
+      return add_node(node::type::kBeginLine, -1, -1, -1);
+    case '$':
+      return add_node(node::type::kEndLine, -1, -1, -1);
+    case '\\':
+      if (!parse_escape(cs)) {
+        return -1;
+      }
+
+      break;
+    case '*':
+    case '+':
+    case '?':
+    case '{':
+    case ')':
+      // Nothing to repeat / unbalanced parenthesis.
+      return -1;
+    default:
+      add(cs, _M_pattern[_M_patternpos - 1]);
+  }
+
+  int idx;
+  if ((idx = add_charset(cs)) < 0) {
+    return -1;
+  }
+
+  return add_node(node::type::kCharset, -1, -1, idx);
+}
+
+bool fs::regex::parse_escape(charset& cs)
+{
+  if (_M_patternpos == _M_patternlen) {
+    return false;
+  }
+
+  uint8_t c = _M_pattern[_M_patternpos++];
+
+  bool negate = false;
+
+  switch (c) {
+    case 'D':
+      negate = true;
+      // Fall through.
+    case 'd':
+      add(cs, '0', '9');
+      break;
+    case 'W':
+      negate = true;
+      // Fall through.
+    case 'w':
+      add(cs, 'a', 'z');
+      add(cs, 'A', 'Z');
+      add(cs, '0', '9');
+      add(cs, '_');
+
+      break;
+    case 'S':
+      negate = true;
+      // Fall through.
+    case 's':
+      add(cs, ' ');
+      add(cs, '\t', '\r');
+
+      break;
+    case 'n':
+      add(cs, '\n');
+      break;
+    case 'r':
+      add(cs, '\r');
+      break;
+    case 't':
+      add(cs, '\t');
+      break;
+    case 'f':
+      add(cs, '\f');
+      break;
+    case 'v':
+      add(cs, '\v');
+      break;
+    case '0':
+      add(cs, 0);
+      break;
+    case 'x':
+      {
+        if (_M_patternpos + 2 > _M_patternlen) {
+          return false;
+        }
+
+        uint8_t n = 0;
+        for (size_t i = 0; i < 2; i++) {
+          uint8_t d = _M_pattern[_M_patternpos++];
+
+          if ((d >= '0') && (d <= '9')) {
+            n = (n * 16) + (d - '0');
+          } else if ((d >= 'a') && (d <= 'f')) {
+            n = (n * 16) + (d - 'a' + 10);
+          } else if ((d >= 'A') && (d <= 'F')) {
+            n = (n * 16) + (d - 'A' + 10);
+          } else {
+            return false;
+          }
+        }
+
+        add(cs, n);
+      }
+
+      break;
+    default:
+      // Unknown escape sequence?
+      if (((c >= 'a') && (c <= 'z')) ||
+          ((c >= 'A') && (c <= 'Z')) ||
+          ((c >= '0') && (c <= '9'))) {
+        return false;
+      }
+
+      add(cs, c);
+  }
+
+  if (negate) {
+    for (size_t i = 0; i < 8; i++) {
+      cs.bits[i] = ~cs.bits[i];
+    }
+  }
+
+  return true;
+}
+
+bool fs::regex::parse_class(charset& cs)
+{
+  bool negate;
+  if ((_M_patternpos < _M_patternlen) && (_M_pattern[_M_patternpos] == '^')) {
+    negate = true;
+    _M_patternpos++;
+  } else {
+    negate = false;
+  }
+
+  bool first = true;
+
+  do {
+    if (_M_patternpos == _M_patternlen) {
+      return false;
+    }
+
+    uint8_t c = _M_pattern[_M_patternpos++];
+
+    // End of class?
+    if ((c == ']') && (!first)) {
+      break;
+    }
+
+    first = false;
+
+    uint8_t from;
+    if (c == '\\') {
+      charset tmp;
+      memset(&tmp, 0, sizeof(charset));
+
+      if (!parse_escape(tmp)) {
+        return false;
+      }
+
+      // If the escape sequence is not a single byte...
+      int n = -1;
+      for (unsigned i = 0; i < 256; i++) {
+        if (contains(tmp, static_cast<uint8_t>(i))) {
+          if (n != -1) {
+            n = -2;
+            break;
+          }
+
+          n = i;
+        }
+      }
+
+      if (n < 0) {
+        for (size_t i = 0; i < 8; i++) {
+          cs.bits[i] |= tmp.bits[i];
+        }
+
+        continue;
+      }
+
+      from = static_cast<uint8_t>(n);
+    } else {
+      from = c;
+    }
+
+    // Range?
+    if ((_M_patternpos + 1 < _M_patternlen) &&
+        (_M_pattern[_M_patternpos] == '-') &&
+        (_M_pattern[_M_patternpos + 1] != ']')) {
+      _M_patternpos++;
+
+      uint8_t to = _M_pattern[_M_patternpos++];
+      if (to == '\\') {
+        charset tmp;
+        memset(&tmp, 0, sizeof(charset));
+
+        if (!parse_escape(tmp)) {
+          return false;
+        }
+
+        int n = -1;
+        for (unsigned i = 0; i < 256; i++) {
+          if (contains(tmp, static_cast<uint8_t>(i))) {
+            if (n != -1) {
+              return false;
+            }
+
+            n = i;
+          }
+        }
+
+        to = static_cast<uint8_t>(n);
+      }
+
+      if (to < from) {
+        return false;
+      }
+
+      add(cs, from, to);
+    } else {
+      add(cs, from);
+    }
+  } while (true);
+
+  if (negate) {
+    for (size_t i = 0; i < 8; i++) {
+      cs.bits[i] = ~cs.bits[i];
+    }
+  }
+
+  return true;
+}
+
+bool fs::regex::parse_number(int& n)
+{
+  n = 0;
+
+  size_t count = 0;
+  while ((_M_patternpos < _M_patternlen) &&
+         (_M_pattern[_M_patternpos] >= '0') &&
+         (_M_pattern[_M_patternpos] <= '9')) {
+    if ((n = (n * 10) + (_M_pattern[_M_patternpos] - '0')) >
+        kMaxRepetitions) {
+      return false;
+    }
+
+    _M_patternpos++;
+    count++;
+  }
+
+  return (count > 0);
+}
+
+int fs::regex::add_node(node::type t, int left, int right, int cs)
+{
+  if (_M_nnodes == _M_nodes_size) {
+    size_t size = (_M_nodes_size == 0) ? 32 : _M_nodes_size * 2;
+
+    node* nodes;
+    if ((nodes = reinterpret_cast<node*>(
+                   realloc(_M_nodes, size * sizeof(node))
+                 )) == NULL) {
+      return -1;
+    }
+
+    _M_nodes = nodes;
+    _M_nodes_size = size;
+  }
+
+  node* n = &_M_nodes[_M_nnodes];
+
+  n->t = t;
+  n->left = left;
+  n->right = right;
+  n->cs = cs;
+  n->min = 0;
+  n->max = 0;
+
+  return static_cast<int>(_M_nnodes++);
+}
+
+int fs::regex::add_charset(const charset& cs)
+{
+  if (_M_ncharsets == _M_charsets_size) {
+    size_t size = (_M_charsets_size == 0) ? 16 : _M_charsets_size * 2;
+
+    charset* charsets;
+    if ((charsets = reinterpret_cast<charset*>(
+                      realloc(_M_charsets, size * sizeof(charset))
+                    )) == NULL) {
+      return -1;
+    }
+
+    _M_charsets = charsets;
+    _M_charsets_size = size;
+  }
+
+  _M_charsets[_M_ncharsets] = cs;
+
+  return static_cast<int>(_M_ncharsets++);
+}
+
+int fs::regex::compile(int n, int next)
+{
+  // Concatenations are compiled from right to left.
+  while (_M_nodes[n].t == node::type::kConcat) {
+    if ((next = compile(_M_nodes[n].right, next)) < 0) {
+      return -1;
+    }
+
+    n = _M_nodes[n].left;
+  }
+
+  switch (_M_nodes[n].t) {
+    case node::type::kEmpty:
+      return next;
+    case node::type::kCharset:
+      return add_instruction(instruction::opcode::kByte,
+                             next,
+                             -1,
+                             _M_nodes[n].cs);
+    case node::type::kAlternation:
+      {
+        int left, right;
+        if (((left = compile(_M_nodes[n].left, next)) < 0) ||
+            ((right = compile(_M_nodes[n].right, next)) < 0)) {
+          return -1;
+        }
+
+        return add_instruction(instruction::opcode::kSplit, left, right, -1);
+      }
+    case node::type::kRepeat:
+      {
+        int child = _M_nodes[n].left;
+        int min = _M_nodes[n].min;
+        int max = _M_nodes[n].max;
+
+        if (max < 0) {
+          // Loop.
+          int split;
+          if ((split = add_instruction(instruction::opcode::kSplit,
+                                       -1,
+                                       next,
+                                       -1)) < 0) {
+            return -1;
+          }
+
+          int body;
+          if ((body = compile(child, split)) < 0) {
+            return -1;
+          }
+
+          _M_insts[split].out = body;
+
+          // If the loop has to be executed at least once...
+          if (min > 0) {
+            next = body;
+            min--;
+          } else {
+            next = split;
+          }
+        } else {
+          // Optional repetitions.
+          int end = next;
+          for (int i = min; i < max; i++) {
+            int body;
+            if (((body = compile(child, next)) < 0) ||
+                ((next = add_instruction(instruction::opcode::kSplit,
+                                         body,
+                                         end,
+                                         -1)) < 0)) {
+              return -1;
+            }
+          }
+        }
+
+        // Mandatory repetitions.
+        for (int i = 0; i < min; i++) {
+          if ((next = compile(child, next)) < 0) {
+            return -1;
+          }
+        }
+
+        return next;
+      }
+    case node::type::kBeginLine:
+      return add_instruction(instruction::opcode::kBeginLine, next, -1, -1);
+    default: // node::type::kEndLine.
+      return add_instruction(instruction::opcode::kEndLine, next, -1, -1);
+  }
+}
+
+int fs::regex::add_instruction(instruction::opcode op,
+                               int out,
+                               int out1,
+                               int cs)
+{
+  if (_M_ninsts == _M_insts_size) {
+    if (_M_insts_size == kMaxInstructions) {
+      return -1;
+    }
+
+    size_t size = (_M_insts_size == 0) ? 32 : _M_insts_size * 2;
+    if (size > kMaxInstructions) {
+      size = kMaxInstructions;
+    }
+
+    instruction* insts;
+    if ((insts = reinterpret_cast<instruction*>(
+                   realloc(_M_insts, size * sizeof(instruction))
+                 )) == NULL) {
+      return -1;
+    }
+
+    _M_insts = insts;
+    _M_insts_size = size;
+  }
+
+  instruction* inst = &_M_insts[_M_ninsts];
+
+  inst->op = op;
+  inst->out = out;
+  inst->out1 = out1;
+  inst->cs = cs;
+
+  return static_cast<int>(_M_ninsts++);
+}
+
+bool fs::regex::extract_prefix(int root)
+{
+  int* stack;
+  if ((stack = reinterpret_cast<int*>(
+                 malloc(_M_nnodes * sizeof(int))
+               )) == NULL) {
+    return false;
+  }
+
+  if ((_M_prefix = reinterpret_cast<uint8_t*>(malloc(_M_nnodes))) == NULL) {
+    free(stack);
+    return false;
+  }
+
+  _M_prefixlen = 0;
+
+  // Walk the concatenation from left to right while there are literals.
+  size_t sp = 0;
+  stack[sp++] = root;
+
+  while (sp > 0) {
+    const node* n = &_M_nodes[stack[--sp]];
+
+    if (n->t == node::type::kConcat) {
+      stack[sp++] = n->right;
+      stack[sp++] = n->left;
+    } else if (n->t == node::type::kCharset) {
+      const charset& cs = _M_charsets[n->cs];
+
+      int c = -1;
+      for (unsigned i = 0; i < 256; i++) {
+        if (contains(cs, static_cast<uint8_t>(i))) {
+          if (c != -1) {
+            c = -2;
+            break;
+          }
+
+          c = i;
+        }
+      }
+
+      // Not a literal?
+      if (c < 0) {
+        break;
+      }
+
+      _M_prefix[_M_prefixlen++] = static_cast<uint8_t>(c);
+    } else if (n->t != node::type::kEmpty) {
+      break;
+    }
+  }
+
+  free(stack);
+
+  if (_M_prefixlen == 0) {
+    free(_M_prefix);
+    _M_prefix = NULL;
+  }
+
+  return true;
+}
+
+void fs::regex::compute_byte_classes()
+{
+  memset(_M_classes, 0, sizeof(_M_classes));
+  _M_nclasses = 1;
+
+  // '\n' has its own class (line anchors).
+  charset newline;
+  memset(&newline, 0, sizeof(charset));
+  add(newline, '\n');
+
+  for (size_t i = 0; i <= _M_ninsts; i++) {
+    const charset* cs;
+    if (i == _M_ninsts) {
+      cs = &newline;
+    } else if (_M_insts[i].op == instruction::opcode::kByte) {
+      cs = &_M_charsets[_M_insts[i].cs];
+    } else {
+      continue;
+    }
+
+    // Split the classes which are partially in the charset.
+    int in[256], out[256];
+    for (size_t j = 0; j < _M_nclasses; j++) {
+      in[j] = -1;
+      out[j] = -1;
+    }
+
+    size_t nclasses = 0;
+
+    for (unsigned c = 0; c < 256; c++) {
+      int* map = contains(*cs, static_cast<uint8_t>(c)) ? in : out;
+
+      if (map[_M_classes[c]] < 0) {
+        map[_M_classes[c]] = static_cast<int>(nclasses++);
+      }
+
+      _M_classes[c] = static_cast<uint8_t>(map[_M_classes[c]]);
+    }
+
+    _M_nclasses = nclasses;
+  }
+
+  for (int c = 255; c >= 0; c--) {
+    _M_class_byte[_M_classes[c]] = static_cast<uint8_t>(c);
+  }
+}
+
+size_t fs::regex::add_thread(thread* list,
+                             size_t n,
+                             int inst,
+                             int group,
+                             bool bol,
+                             bool eol)
+{
+  if (_M_marks[inst] == _M_mark) {
+    return n;
+  }
+
+  _M_marks[inst] = _M_mark;
+
+  size_t sp = 0;
+  _M_stack[sp++] = inst;
+
+  do {
+    const instruction* i = &_M_insts[_M_stack[--sp]];
+
+    switch (i->op) {
+      case instruction::opcode::kSplit:
+        if (_M_marks[i->out1] != _M_mark) {
+          _M_marks[i->out1] = _M_mark;
+          _M_stack[sp++] = i->out1;
+        }
+
+        if (_M_marks[i->out] != _M_mark) {
+          _M_marks[i->out] = _M_mark;
+          _M_stack[sp++] = i->out;
+        }
+
+        break;
+      case instruction::opcode::kBeginLine:
+        if ((bol) && (_M_marks[i->out] != _M_mark)) {
+          _M_marks[i->out] = _M_mark;
+          _M_stack[sp++] = i->out;
+        }
+
+        break;
+      case instruction::opcode::kEndLine:
+        if (eol) {
+          if (_M_marks[i->out] != _M_mark) {
+            _M_marks[i->out] = _M_mark;
+            _M_stack[sp++] = i->out;
+          }
+
+          break;
+        }
+
+        // Wait for the end of line.
+        // Fall through.
+      default:
+        list[n].inst = static_cast<int>(i - _M_insts);
+        list[n].group = group;
+        n++;
+    }
+  } while (sp > 0);
+
+  return n;
+}
+
+int fs::regex::get_state(const thread* threads,
+                         size_t nthreads,
+                         size_t ngroups,
+                         bool bol,
+                         bool matched,
+                         bool fresh)
+{
+  // Compute hash (FNV-1a).
+  uint32_t hash = 2166136261u;
+  hash = (hash ^ ((bol << 2) | (matched << 1) | fresh)) * 16777619u;
+  hash = (hash ^ static_cast<uint32_t>(ngroups)) * 16777619u;
+
+  for (size_t i = 0; i < nthreads; i++) {
+    hash = (hash ^ static_cast<uint32_t>(threads[i].inst)) * 16777619u;
+    hash = (hash ^ static_cast<uint32_t>(threads[i].group)) * 16777619u;
+  }
+
+  // If the hash table has to be resized...
+  if (2 * (_M_nstates + 1) > _M_hash_size) {
+    size_t size = (_M_hash_size == 0) ? 256 : _M_hash_size * 2;
+
+    int* h;
+    if ((h = reinterpret_cast<int*>(malloc(size * sizeof(int)))) == NULL) {
+      return -1;
+    }
+
+    for (size_t i = 0; i < size; i++) {
+      h[i] = -1;
+    }
+
+    for (size_t i = 0; i < _M_nstates; i++) {
+      size_t idx = _M_states[i].hash & (size - 1);
+      while (h[idx] >= 0) {
+        idx = (idx + 1) & (size - 1);
+      }
+
+      h[idx] = static_cast<int>(i);
+    }
+
+    if (_M_hash) {
+      free(_M_hash);
+    }
+
+    _M_hash = h;
+    _M_hash_size = size;
+  }
+
+  // Search state.
+  size_t idx = hash & (_M_hash_size - 1);
+  while (_M_hash[idx] >= 0) {
+    const state* st = &_M_states[_M_hash[idx]];
+
+    if ((st->hash == hash) &&
+        (st->nthreads == nthreads) &&
+        (st->ngroups == ngroups) &&
+        (st->bol == bol) &&
+        (st->matched == matched) &&
+        (st->fresh == fresh) &&
+        (memcmp(st->threads, threads, nthreads * sizeof(thread)) == 0)) {
+      return _M_hash[idx];
+    }
+
+    idx = (idx + 1) & (_M_hash_size - 1);
+  }
+
+  // Create new state.
+  if (_M_nstates == _M_states_size) {
+    size_t size = (_M_states_size == 0) ? 32 : _M_states_size * 2;
+
+    state* states;
+    if ((states = reinterpret_cast<state*>(
+                    realloc(_M_states, size * sizeof(state))
+                  )) == NULL) {
+      return -1;
+    }
+
+    _M_states = states;
+    _M_states_size = size;
+  }
+
+  state* st = &_M_states[_M_nstates];
+
+  if (nthreads > 0) {
+    if ((st->threads = reinterpret_cast<thread*>(
+                         malloc(nthreads * sizeof(thread))
+                       )) == NULL) {
+      return -1;
+    }
+
+    memcpy(st->threads, threads, nthreads * sizeof(thread));
+  } else {
+    st->threads = NULL;
+  }
+
+  if ((st->transitions = reinterpret_cast<transition*>(
+                           malloc(_M_nclasses * sizeof(transition))
+                         )) == NULL) {
+    if (st->threads) {
+      free(st->threads);
+    }
+
+    return -1;
+  }
+
+  // If the transition table has to be resized...
+  if ((_M_nstates + 1) * _M_nclasses > _M_table_size) {
+    size_t size = (_M_table_size == 0) ? 32 * _M_nclasses : _M_table_size * 2;
+
+    int* table;
+    if ((table = reinterpret_cast<int*>(
+                   realloc(_M_table, size * sizeof(int))
+                 )) == NULL) {
+      free(st->transitions);
+
+      if (st->threads) {
+        free(st->threads);
+      }
+
+      return -1;
+    }
+
+    _M_table = table;
+    _M_table_size = size;
+  }
+
+  int* row = _M_table + (_M_nstates * _M_nclasses);
+
+  for (size_t i = 0; i < _M_nclasses; i++) {
+    st->transitions[i].target = -1;
+    row[i] = -1;
+  }
+
+  st->nthreads = nthreads;
+  st->ngroups = ngroups;
+  st->bol = bol;
+  st->matched = matched;
+  st->fresh = fresh;
+  st->eof_accept = -2;
+  st->hash = hash;
+
+  _M_cache_size += sizeof(state) +
+                   (nthreads * sizeof(thread)) +
+                   (_M_nclasses * (sizeof(transition) + sizeof(int)));
+
+  _M_hash[idx] = static_cast<int>(_M_nstates);
+
+  return static_cast<int>(_M_nstates++);
+}
+
+bool fs::regex::compute_transition(int& s, size_t cls)
+{
+  // If the DFA cache is too big...
+  if ((_M_cache_size > kMaxCacheSize) && (!flush_cache(s))) {
+    return false;
+  }
+
+  const state* st = &_M_states[s];
+
+  uint8_t c = _M_class_byte[cls];
+  bool newline = (c == '\n');
+
+  // Copy threads (the states might be reallocated).
+  thread* cur = _M_list;
+  thread* next = _M_list1;
+
+  size_t n = st->nthreads;
+  memcpy(cur, st->threads, n * sizeof(thread));
+
+  size_t ngroups = st->ngroups;
+  bool matched = st->matched;
+  int fresh = st->fresh ? static_cast<int>(ngroups) - 1 : -1;
+
+  int eol_accept = -1;
+  int accept = -1;
+
+  // If the byte is an end of line and there are threads waiting for it...
+  if (newline) {
+    bool waiting = false;
+    for (size_t i = 0; i < n; i++) {
+      if (_M_insts[cur[i].inst].op == instruction::opcode::kEndLine) {
+        waiting = true;
+        break;
+      }
+    }
+
+    if (waiting) {
+      if (++_M_mark == 0) {
+        memset(_M_marks, 0, _M_ninsts * sizeof(unsigned));
+        _M_mark = 1;
+      }
+
+      size_t m = 0;
+      for (size_t i = 0; i < n; i++) {
+        m = add_thread(next, m, cur[i].inst, cur[i].group, st->bol, true);
+      }
+
+      // Search match (empty matches are not reported).
+      for (size_t i = 0; i < m; i++) {
+        if ((_M_insts[next[i].inst].op == instruction::opcode::kMatch) &&
+            (next[i].group != fresh) &&
+            ((eol_accept < 0) || (next[i].group < eol_accept))) {
+          eol_accept = next[i].group;
+        }
+      }
+
+      // Remove threads which cannot produce a better match.
+      n = 0;
+      for (size_t i = 0; i < m; i++) {
+        if ((_M_insts[next[i].inst].op != instruction::opcode::kMatch) &&
+            ((eol_accept < 0) || (next[i].group <= eol_accept))) {
+          cur[n++] = next[i];
+        }
+      }
+
+      if (eol_accept >= 0) {
+        matched = true;
+      }
+    }
+  }
+
+  // Consume byte.
+  if (++_M_mark == 0) {
+    memset(_M_marks, 0, _M_ninsts * sizeof(unsigned));
+    _M_mark = 1;
+  }
+
+  size_t m = 0;
+  for (size_t i = 0; i < n; i++) {
+    const instruction* inst = &_M_insts[cur[i].inst];
+    if ((inst->op == instruction::opcode::kByte) &&
+        (contains(_M_charsets[inst->cs], c))) {
+      m = add_thread(next, m, inst->out, cur[i].group, newline, false);
+    }
+  }
+
+  // Start a new thread at the next offset (if no match has been found).
+  int newgroup = static_cast<int>(ngroups);
+  if (!matched) {
+    m = add_thread(next, m, _M_start, newgroup, newline, false);
+  }
+
+  // Search match (empty matches are not reported).
+  for (size_t i = 0; i < m; i++) {
+    if ((_M_insts[next[i].inst].op == instruction::opcode::kMatch) &&
+        (next[i].group != newgroup) &&
+        ((accept < 0) || (next[i].group < accept))) {
+      accept = next[i].group;
+    }
+  }
+
+  if (accept >= 0) {
+    matched = true;
+  }
+
+  // Remove threads which cannot produce a better match and renumber groups.
+  size_t count = 0;
+  size_t k = 0;
+  int last = -1;
+  for (size_t i = 0; i < m; i++) {
+    if ((_M_insts[next[i].inst].op != instruction::opcode::kMatch) &&
+        ((accept < 0) || (next[i].group <= accept))) {
+      if (next[i].group != last) {
+        last = next[i].group;
+        _M_groupmap[k++] = (last == newgroup) ? -1 : last;
+      }
+
+      cur[count].inst = next[i].inst;
+      cur[count].group = static_cast<int>(k - 1);
+      count++;
+    }
+  }
+
+  // Sort the threads of each group (canonical form).
+  for (size_t i = 1; i < count; i++) {
+    thread t = cur[i];
+
+    size_t j;
+    for (j = i;
+         (j > 0) &&
+         (cur[j - 1].group == t.group) &&
+         (cur[j - 1].inst > t.inst);
+         j--) {
+      cur[j] = cur[j - 1];
+    }
+
+    cur[j] = t;
+  }
+
+  // Map the groups which didn't start at the current offset to the groups
+  // of the source state (the starting offset of the last group is not
+  // saved if it started at the current offset).
+  bool newfresh = (k > 0) && (_M_groupmap[k - 1] == -1);
+  if (newfresh) {
+    k--;
+  }
+
+  bool identity = true;
+  for (size_t i = 0; i < k; i++) {
+    if (_M_groupmap[i] == fresh) {
+      _M_groupmap[i] = -1;
+    }
+
+    if (_M_groupmap[i] != static_cast<int>(i)) {
+      identity = false;
+    }
+  }
+
+  int groupmap;
+  if (!identity) {
+    // Save group map.
+    if (_M_ngroupmaps + k + 1 > _M_groupmaps_size) {
+      size_t size = (_M_groupmaps_size == 0) ? 1024 : _M_groupmaps_size * 2;
+      while (size < _M_ngroupmaps + k + 1) {
+        size *= 2;
+      }
+
+      int* groupmaps;
+      if ((groupmaps = reinterpret_cast<int*>(
+                         realloc(_M_groupmaps, size * sizeof(int))
+                       )) == NULL) {
+        return false;
+      }
+
+      _M_groupmaps = groupmaps;
+      _M_groupmaps_size = size;
+    }
+
+    groupmap = static_cast<int>(_M_ngroupmaps);
+
+    _M_groupmaps[_M_ngroupmaps++] = static_cast<int>(k);
+    memcpy(_M_groupmaps + _M_ngroupmaps, _M_groupmap, k * sizeof(int));
+    _M_ngroupmaps += k;
+
+    _M_cache_size += (k + 1) * sizeof(int);
+  } else {
+    groupmap = -1;
+  }
+
+  // If the group which started at the current offset has matched...
+  if ((accept >= 0) && (accept == fresh)) {
+    accept = kCurrentOffset;
+  }
+
+  int target;
+  if ((target = get_state(cur,
+                          count,
+                          newfresh ? k + 1 : k,
+                          newline,
+                          matched,
+                          newfresh)) < 0) {
+    return false;
+  }
+
+  transition* t = &_M_states[s].transitions[cls];
+
+  t->target = target;
+  t->eol_accept = eol_accept;
+  t->accept = accept;
+  t->groupmap = groupmap;
+
+  // If the transition doesn't require any further processing, it can be
+  // taken by the fast path.
+  const state* st1 = &_M_states[target];
+  if ((eol_accept == -1) &&
+      (accept == -1) &&
+      (groupmap == -1) &&
+      ((st1->nthreads > 0) || (!st1->matched)) &&
+      (!idle(*st1))) {
+    _M_table[(s * _M_nclasses) + cls] = target * static_cast<int>(_M_nclasses);
+  }
+
+  return true;
+}
+
+int fs::regex::compute_eof_accept(const state& st)
+{
+  if (++_M_mark == 0) {
+    memset(_M_marks, 0, _M_ninsts * sizeof(unsigned));
+    _M_mark = 1;
+  }
+
+  int fresh = st.fresh ? static_cast<int>(st.ngroups) - 1 : -1;
+
+  size_t n = 0;
+  for (size_t i = 0; i < st.nthreads; i++) {
+    n = add_thread(_M_list,
+                   n,
+                   st.threads[i].inst,
+                   st.threads[i].group,
+                   st.bol,
+                   true);
+  }
+
+  int accept = -1;
+  for (size_t i = 0; i < n; i++) {
+    if ((_M_insts[_M_list[i].inst].op == instruction::opcode::kMatch) &&
+        (_M_list[i].group != fresh) &&
+        ((accept < 0) || (_M_list[i].group < accept))) {
+      accept = _M_list[i].group;
+    }
+  }
+
+  return accept;
+}
+
+bool fs::regex::flush_cache(int& s)
+{
+  size_t nthreads = 0;
+  size_t ngroups = 0;
+  bool bol = false, matched = false, fresh = false;
+
+  // Save state to be kept.
+  if (s >= 0) {
+    const state* st = &_M_states[s];
+
+    nthreads = st->nthreads;
+    memcpy(_M_list1, st->threads, nthreads * sizeof(thread));
+
+    ngroups = st->ngroups;
+    bol = st->bol;
+    matched = st->matched;
+    fresh = st->fresh;
+  }
+
+  for (size_t i = 0; i < _M_nstates; i++) {
+    if (_M_states[i].threads) {
+      free(_M_states[i].threads);
+    }
+
+    free(_M_states[i].transitions);
+  }
+
+  _M_nstates = 0;
+
+  for (size_t i = 0; i < _M_hash_size; i++) {
+    _M_hash[i] = -1;
+  }
+
+  _M_ngroupmaps = 0;
+  _M_cache_size = 0;
+
+  if (s >= 0) {
+    if ((s = get_state(_M_list1, nthreads, ngroups, bol, matched, fresh)) < 0) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+void fs::regex::free_dfa()
+{
+  if (_M_states) {
+    for (size_t i = 0; i < _M_nstates; i++) {
+      if (_M_states[i].threads) {
+        free(_M_states[i].threads);
+      }
+
+      free(_M_states[i].transitions);
+    }
+
+    free(_M_states);
+    _M_states = NULL;
+  }
+
+  _M_nstates = 0;
+  _M_states_size = 0;
+
+  if (_M_hash) {
+    free(_M_hash);
+    _M_hash = NULL;
+  }
+
+  _M_hash_size = 0;
+
+  if (_M_groupmaps) {
+    free(_M_groupmaps);
+    _M_groupmaps = NULL;
+  }
+
+  _M_ngroupmaps = 0;
+  _M_groupmaps_size = 0;
+
+  if (_M_table) {
+    free(_M_table);
+    _M_table = NULL;
+  }
+
+  _M_table_size = 0;
+
+  _M_cache_size = 0;
+}
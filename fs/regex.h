@@ -0,0 +1,418 @@
+#ifndef FS_REGEX_H
+#define FS_REGEX_H
+
+#include <stdlib.h>
+#include <stdint.h>
+
+namespace fs {
+  // Byte-oriented regular expression which is matched by a lazily built DFA.
+  //
+  // Supported syntax:
+  //   - Literals, '.' (any byte but '\n'), character classes ("[a-z]",
+  //     "[^0-9]").
+  //   - Escapes: \n \r \t \f \v \xHH \d \D \w \W \s \S and escaped
+  //     punctuation.
+  //   - Groups: "(...)" and "(?:...)" (no captures).
+  //   - Alternation: '|'.
+  //   - Repetitions: '*', '+', '?', "{n}", "{n,}" and "{n,m}".
+  //   - Line anchors: '^' and '$'.
+  //
+  // Matches are leftmost-longest and empty matches are not reported.
+  //
+  // The search is streamed: the data is fed chunk by chunk and the state is
+  // carried from one chunk to the next one, so the text doesn't have to be
+  // contiguous in memory. The search runs in linear time (there is no
+  // backtracking).
+  //
+  // The DFA is built while searching, so a regex object can only be used by
+  // one search at a time.
+  class regex {
+    public:
+      // Constructor.
+      regex();
+
+      // Destructor.
+      ~regex();
+
+      // Compile.
+      bool compile(const char* pattern);
+      bool compile(const void* pattern, size_t len);
+
+      // Clear.
+      void clear();
+
+      // Get literal prefix (every match starts with the literal prefix).
+      const uint8_t* prefix(size_t& len) const;
+
+      // Begin search at offset 'off' ('bol' is true if 'off' is at the
+      // beginning of a line).
+      bool begin(uint64_t off, bool bol);
+
+      enum class result {
+        kMatch,        // A match has been found.
+        kIdle,         // No partial match (the caller might skip to the
+                       // next occurrence of the prefix).
+        kNeedMoreData, // All the data has been consumed.
+        kError         // Out of memory.
+      };
+
+      // Feed data.
+      result feed(const uint8_t* data, size_t len, size_t& consumed);
+
+      // End of data has been reached.
+      bool finish();
+
+      // Get offset of the next byte to be fed.
+      uint64_t offset() const;
+
+      // Get match.
+      void match(uint64_t& begin, uint64_t& end) const;
+
+    private:
+      static const size_t kMaxInstructions = 64 * 1024;
+      static const int kMaxRepetitions = 1000;
+      static const size_t kMaxCacheSize = 8 * 1024 * 1024;
+      static const int kCurrentOffset = -2;
+
+      // Charset.
+      struct charset {
+        uint32_t bits[8];
+      };
+
+      // Syntax tree node.
+      struct node {
+        enum class type : uint8_t {
+          kEmpty,
+          kCharset,
+          kConcat,
+          kAlternation,
+          kRepeat,
+          kBeginLine,
+          kEndLine
+        };
+
+        type t;
+
+        int left;
+        int right;
+
+        int cs;
+
+        int min;
+        int max;
+      };
+
+      // NFA instruction.
+      struct instruction {
+        enum class opcode : uint8_t {
+          kByte,
+          kSplit,
+          kBeginLine,
+          kEndLine,
+          kMatch
+        };
+
+        opcode op;
+
+        int out;
+        int out1;
+
+        int cs;
+      };
+
+      // Thread: NFA instruction + group of threads which started at the
+      // same offset (groups are sorted by starting offset).
+      struct thread {
+        int inst;
+        int group;
+      };
+
+      // DFA transition.
+      struct transition {
+        // Target state (-1: not computed yet).
+        int target;
+
+        // Group which has matched before consuming the byte
+        // (end of line) or -1.
+        int eol_accept;
+
+        // Group which has matched after consuming the byte, -1 or
+        // kCurrentOffset (the group which started at the offset of the
+        // byte has matched).
+        int accept;
+
+        // Offset of the group map in '_M_groupmaps' or -1 (identity).
+        //
+        // Group map: number of groups followed by the group of the source
+        // state of each group (-1: the group started at the offset of the
+        // byte). The group which starts after the byte is not in the map.
+        int groupmap;
+      };
+
+      // DFA state.
+      struct state {
+        thread* threads;
+        size_t nthreads;
+
+        size_t ngroups;
+
+        // At the beginning of a line?
+        bool bol;
+
+        // Has a match been found? (new threads are not started)
+        bool matched;
+
+        // Did the last group start at the current offset?
+        bool fresh;
+
+        // Group which matches at the end of the data (-1: none,
+        // -2: not computed yet).
+        int eof_accept;
+
+        uint32_t hash;
+
+        transition* transitions;
+      };
+
+      // Pattern being parsed.
+      const uint8_t* _M_pattern;
+      size_t _M_patternlen;
+      size_t _M_patternpos;
+
+      // Charsets.
+      charset* _M_charsets;
+      size_t _M_ncharsets;
+      size_t _M_charsets_size;
+
+      // Syntax tree.
+      node* _M_nodes;
+      size_t _M_nnodes;
+      size_t _M_nodes_size;
+
+      // NFA.
+      instruction* _M_insts;
+      size_t _M_ninsts;
+      size_t _M_insts_size;
+      int _M_start;
+
+      // Literal prefix.
+      uint8_t* _M_prefix;
+      size_t _M_prefixlen;
+
+      // Byte classes.
+      uint8_t _M_classes[256];
+      uint8_t _M_class_byte[256];
+      size_t _M_nclasses;
+
+      // DFA states.
+      state* _M_states;
+      size_t _M_nstates;
+      size_t _M_states_size;
+      size_t _M_cache_size;
+
+      // Transition table (fast path): offset of the row of the target
+      // state or -1 (the transition has to be processed by the slow path).
+      int* _M_table;
+      size_t _M_table_size;
+
+      // Hash table of DFA states.
+      int* _M_hash;
+      size_t _M_hash_size;
+
+      // Group maps.
+      int* _M_groupmaps;
+      size_t _M_ngroupmaps;
+      size_t _M_groupmaps_size;
+
+      // Scratch thread lists.
+      thread* _M_list;
+      thread* _M_list1;
+      unsigned* _M_marks;
+      unsigned _M_mark;
+      int* _M_stack;
+      int* _M_groupmap;
+
+      // Search state.
+      int _M_cur;
+      uint64_t _M_off;
+
+      // Starting offset of each group (but the last one if it started at
+      // the current offset).
+      uint64_t* _M_regs;
+      uint64_t* _M_regs1;
+      bool _M_found;
+      uint64_t _M_match_begin;
+      uint64_t _M_match_end;
+
+      // Parse.
+      int parse_alternation(unsigned depth);
+      int parse_concatenation(unsigned depth);
+      int parse_repetition(unsigned depth);
+      int parse_atom(unsigned depth);
+      bool parse_escape(charset& cs);
+      bool parse_class(charset& cs);
+      bool parse_number(int& n);
+
+      // Add node.
+      int add_node(node::type t, int left, int right, int cs);
+
+      // Add charset.
+      int add_charset(const charset& cs);
+
+      // Compile syntax tree into NFA.
+      int compile(int n, int next);
+
+      // Add instruction.
+      int add_instruction(instruction::opcode op, int out, int out1, int cs);
+
+      // Extract literal prefix.
+      bool extract_prefix(int root);
+
+      // Compute byte classes.
+      void compute_byte_classes();
+
+      // Add thread (and follow empty transitions).
+      size_t add_thread(thread* list,
+                        size_t n,
+                        int inst,
+                        int group,
+                        bool bol,
+                        bool eol);
+
+      // Get state.
+      int get_state(const thread* threads,
+                    size_t nthreads,
+                    size_t ngroups,
+                    bool bol,
+                    bool matched,
+                    bool fresh);
+
+      // Compute transition.
+      bool compute_transition(int& s, size_t cls);
+
+      // Can the search skip to the next occurrence of the prefix?
+      bool idle(const state& st) const;
+
+      // Compute group which matches at the end of the data.
+      int compute_eof_accept(const state& st);
+
+      // Flush DFA cache (keeps state 's').
+      bool flush_cache(int& s);
+
+      // Free DFA.
+      void free_dfa();
+
+      // Is the byte in the charset?
+      static bool contains(const charset& cs, uint8_t c);
+
+      // Add byte / range to charset.
+      static void add(charset& cs, uint8_t c);
+      static void add(charset& cs, uint8_t from, uint8_t to);
+
+      // Disable copy constructor and assignment operator.
+      regex(const regex&) = delete;
+      regex& operator=(const regex&) = delete;
+  };
+
+  inline regex::regex()
+    : _M_pattern(NULL),
+      _M_patternlen(0),
+      _M_patternpos(0),
+      _M_charsets(NULL),
+      _M_ncharsets(0),
+      _M_charsets_size(0),
+      _M_nodes(NULL),
+      _M_nnodes(0),
+      _M_nodes_size(0),
+      _M_insts(NULL),
+      _M_ninsts(0),
+      _M_insts_size(0),
+      _M_start(-1),
+      _M_prefix(NULL),
+      _M_prefixlen(0),
+      _M_nclasses(0),
+      _M_states(NULL),
+      _M_nstates(0),
+      _M_states_size(0),
+      _M_cache_size(0),
+      _M_table(NULL),
+      _M_table_size(0),
+      _M_hash(NULL),
+      _M_hash_size(0),
+      _M_groupmaps(NULL),
+      _M_ngroupmaps(0),
+      _M_groupmaps_size(0),
+      _M_list(NULL),
+      _M_list1(NULL),
+      _M_marks(NULL),
+      _M_mark(0),
+      _M_stack(NULL),
+      _M_groupmap(NULL),
+      _M_cur(-1),
+      _M_off(0),
+      _M_regs(NULL),
+      _M_regs1(NULL),
+      _M_found(false),
+      _M_match_begin(0),
+      _M_match_end(0)
+  {
+  }
+
+  inline regex::~regex()
+  {
+    clear();
+  }
+
+  inline bool regex::compile(const char* pattern)
+  {
+    size_t len = 0;
+    while (pattern[len]) {
+      len++;
+    }
+
+    return compile(pattern, len);
+  }
+
+  inline const uint8_t* regex::prefix(size_t& len) const
+  {
+    len = _M_prefixlen;
+    return _M_prefix;
+  }
+
+  inline uint64_t regex::offset() const
+  {
+    return _M_off;
+  }
+
+  inline void regex::match(uint64_t& begin, uint64_t& end) const
+  {
+    begin = _M_match_begin;
+    end = _M_match_end;
+  }
+
+  inline bool regex::idle(const state& st) const
+  {
+    return ((_M_prefixlen > 0) &&
+            (!st.matched) &&
+            ((st.ngroups == 0) || ((st.ngroups == 1) && (st.fresh))));
+  }
+
+  inline bool regex::contains(const charset& cs, uint8_t c)
+  {
+    return ((cs.bits[c >> 5] & (1u << (c & 31))) != 0);
+  }
+
+  inline void regex::add(charset& cs, uint8_t c)
+  {
+    cs.bits[c >> 5] |= (1u << (c & 31));
+  }
+
+  inline void regex::add(charset& cs, uint8_t from, uint8_t to)
+  {
+    for (unsigned c = from; c <= to; c++) {
+      add(cs, static_cast<uint8_t>(c));
+    }
+  }
+}
+
+#endif // FS_REGEX_H
@@ -0,0 +1,403 @@
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "fs/session_journal.h"
+#include "fs/byte_order.h"
+
+// Get length of the padding of the data of a record.
+static uint64_t padding(uint64_t len);
+
+bool fs::session_journal::create(const char* filename,
+                                 uint64_t filesize,
+                                 const struct timespec& mtime)
+{
+  close();
+
+  if (!set_filename(filename)) {
+    return false;
+  }
+
+  // Open file for writing.
+  if ((_M_fd = ::open(filename, O_CREAT | O_TRUNC | O_WRONLY, 0644)) < 0) {
+    _M_fd = -1;
+    return false;
+  }
+
+  if (!write_header(filesize, mtime)) {
+    discard();
+    return false;
+  }
+
+  return true;
+}
+
+bool fs::session_journal::load(const char* filename,
+                               uint64_t filesize,
+                               const struct timespec& mtime)
+{
+  close();
+
+  if (!set_filename(filename)) {
+    return false;
+  }
+
+  // Open file for reading.
+  int fd;
+  if ((fd = ::open(filename, O_RDONLY)) < 0) {
+    return false;
+  }
+
+  // Get file status.
+  struct stat sbuf;
+  if ((fstat(fd, &sbuf) < 0) ||
+      (!S_ISREG(sbuf.st_mode)) ||
+      (static_cast<uint64_t>(sbuf.st_size) < kHeaderSize)) {
+    ::close(fd);
+    return false;
+  }
+
+  // Map file into memory.
+  if ((_M_data = mmap(NULL,
+                      sbuf.st_size,
+                      PROT_READ,
+                      MAP_SHARED,
+                      fd,
+                      0)) == MAP_FAILED) {
+    ::close(fd);
+    return false;
+  }
+
+  ::close(fd);
+
+  _M_len = sbuf.st_size;
+
+  // Check header (the previous versions don't have kFill or kSource
+  // records).
+  const uint8_t* hdr = reinterpret_cast<const uint8_t*>(_M_data);
+  if ((get_le32(hdr) != kMagic) ||
+      (get_le32(hdr + 4) == 0) ||
+      (get_le32(hdr + 4) > kVersion) ||
+      (get_le64(hdr + 8) != filesize) ||
+      (get_le64(hdr + 16) != static_cast<uint64_t>(mtime.tv_sec)) ||
+      (get_le64(hdr + 24) != static_cast<uint64_t>(mtime.tv_nsec)) ||
+      (get_le32(hdr + 32) != crc32(0, hdr, 32))) {
+    unmap();
+    return false;
+  }
+
+  _M_off = kHeaderSize;
+
+  return true;
+}
+
+bool fs::session_journal::next(record& r)
+{
+  if ((_M_data == MAP_FAILED) || (_M_len - _M_off < kRecordHeaderSize)) {
+    return false;
+  }
+
+  const uint8_t* rec = reinterpret_cast<const uint8_t*>(_M_data) + _M_off;
+
+  switch (get_le32(rec)) {
+    case static_cast<uint32_t>(record_type::kData):
+      r.t = record_type::kData;
+      break;
+    case static_cast<uint32_t>(record_type::kDisk):
+      r.t = record_type::kDisk;
+      break;
+    case static_cast<uint32_t>(record_type::kRevert):
+      r.t = record_type::kRevert;
+      break;
+    case static_cast<uint32_t>(record_type::kFill):
+      r.t = record_type::kFill;
+      break;
+    case static_cast<uint32_t>(record_type::kSource):
+      r.t = record_type::kSource;
+      break;
+    default:
+      return false;
+  }
+
+  r.off = get_le64(rec + 8);
+  r.len = get_le64(rec + 16);
+  r.datalen = get_le64(rec + 24);
+  r.diskoff = get_le64(rec + 32);
+
+  // Length of the data of the record (kFill: the pattern, kSource: the
+  // reference).
+  uint64_t datalen = (r.t == record_type::kData) ? r.datalen :
+                     ((r.t == record_type::kFill) ||
+                      (r.t == record_type::kSource)) ? r.diskoff : 0;
+
+  uint64_t left = _M_len - _M_off - kRecordHeaderSize;
+  if ((datalen > left) || (padding(datalen) > left - datalen)) {
+    return false;
+  }
+
+  r.data = (datalen > 0) ? rec + kRecordHeaderSize : NULL;
+
+  if (get_le32(rec + 4) != record_crc(rec, r.data, datalen)) {
+    return false;
+  }
+
+  _M_off += kRecordHeaderSize + datalen + padding(datalen);
+
+  return true;
+}
+
+bool fs::session_journal::resume()
+{
+  if (_M_data == MAP_FAILED) {
+    return false;
+  }
+
+  unmap();
+
+  // Open file for writing.
+  if ((_M_fd = ::open(_M_filename, O_WRONLY)) < 0) {
+    _M_fd = -1;
+    return false;
+  }
+
+  // Drop the torn records.
+  if ((ftruncate(_M_fd, _M_off) < 0) ||
+      (lseek(_M_fd, _M_off, SEEK_SET) != static_cast<off_t>(_M_off)) ||
+      (fdatasync(_M_fd) < 0)) {
+    // The journal is kept (the session has not been saved).
+    ::close(_M_fd);
+    _M_fd = -1;
+
+    return false;
+  }
+
+  return true;
+}
+
+bool fs::session_journal::reset(uint64_t filesize,
+                                const struct timespec& mtime)
+{
+  if (!is_open()) {
+    return false;
+  }
+
+  // Drop the pending records.
+  _M_buflen = 0;
+
+  return ((ftruncate(_M_fd, 0) == 0) &&
+          (lseek(_M_fd, 0, SEEK_SET) == 0) &&
+          (write_header(filesize, mtime)));
+}
+
+bool fs::session_journal::append(record_type t,
+                                 uint64_t off,
+                                 uint64_t len,
+                                 const uint8_t* data,
+                                 uint64_t datalen,
+                                 uint64_t diskoff)
+{
+  static const uint8_t kPadding[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+
+  if (!is_open()) {
+    return false;
+  }
+
+  // Length of the data of the record (kFill: the pattern, kSource: the
+  // reference).
+  uint64_t inlinelen = (t == record_type::kData) ? datalen :
+                       ((t == record_type::kFill) ||
+                        (t == record_type::kSource)) ? diskoff : 0;
+
+  uint8_t rec[kRecordHeaderSize];
+  put_le32(rec, static_cast<uint32_t>(t));
+  put_le64(rec + 8, off);
+  put_le64(rec + 16, len);
+  put_le64(rec + 24, datalen);
+  put_le64(rec + 32, diskoff);
+  put_le32(rec + 4, record_crc(rec, data, inlinelen));
+
+  // If the record is too big to be buffered...
+  if (kRecordHeaderSize + inlinelen > kGroupCommitSize) {
+    return ((flush()) &&
+            (write(_M_fd, rec, kRecordHeaderSize)) &&
+            (write(_M_fd, data, inlinelen)) &&
+            (write(_M_fd, kPadding, padding(inlinelen))) &&
+            (fdatasync(_M_fd) == 0));
+  }
+
+  if (_M_buflen == 0) {
+    _M_pending_since = now();
+  }
+
+  if ((!buffer(rec, kRecordHeaderSize)) ||
+      (!buffer(data, inlinelen)) ||
+      (!buffer(kPadding, padding(inlinelen)))) {
+    return false;
+  }
+
+  // Group commit.
+  if ((_M_buflen >= kGroupCommitSize) ||
+      (now() - _M_pending_since >= kGroupCommitInterval)) {
+    return sync();
+  }
+
+  return true;
+}
+
+bool fs::session_journal::sync()
+{
+  return ((is_open()) && (flush()) && (fdatasync(_M_fd) == 0));
+}
+
+void fs::session_journal::close()
+{
+  if (_M_fd != -1) {
+    sync();
+
+    ::close(_M_fd);
+    _M_fd = -1;
+  }
+
+  unmap();
+
+  if (_M_buf) {
+    free(_M_buf);
+    _M_buf = NULL;
+  }
+
+  _M_buflen = 0;
+  _M_bufsize = 0;
+}
+
+void fs::session_journal::discard()
+{
+  if (_M_fd != -1) {
+    ::close(_M_fd);
+    _M_fd = -1;
+
+    unlink(_M_filename);
+  }
+
+  close();
+}
+
+bool fs::session_journal::set_filename(const char* filename)
+{
+  // If the length of the file name is too long...
+  size_t len;
+  if ((len = strlen(filename)) >= sizeof(_M_filename)) {
+    return false;
+  }
+
+  memcpy(_M_filename, filename, len);
+  _M_filename[len] = 0;
+
+  return true;
+}
+
+bool fs::session_journal::write_header(uint64_t filesize,
+                                       const struct timespec& mtime)
+{
+  uint8_t hdr[kHeaderSize];
+  put_le32(hdr, kMagic);
+  put_le32(hdr + 4, kVersion);
+  put_le64(hdr + 8, filesize);
+  put_le64(hdr + 16, mtime.tv_sec);
+  put_le64(hdr + 24, mtime.tv_nsec);
+  put_le32(hdr + 32, crc32(0, hdr, 32));
+  put_le32(hdr + 36, 0);
+
+  return ((write(_M_fd, hdr, kHeaderSize)) && (fdatasync(_M_fd) == 0));
+}
+
+bool fs::session_journal::buffer(const void* data, uint64_t len)
+{
+  if (len == 0) {
+    return true;
+  }
+
+  if (_M_buflen + len > _M_bufsize) {
+    uint64_t size = (_M_bufsize == 0) ? 64 * 1024 : _M_bufsize * 2;
+    while (size < _M_buflen + len) {
+      size *= 2;
+    }
+
+    uint8_t* buf;
+    if ((buf = reinterpret_cast<uint8_t*>(realloc(_M_buf, size))) == NULL) {
+      return false;
+    }
+
+    _M_buf = buf;
+    _M_bufsize = size;
+  }
+
+  memcpy(_M_buf + _M_buflen, data, len);
+  _M_buflen += len;
+
+  return true;
+}
+
+bool fs::session_journal::flush()
+{
+  if (_M_buflen == 0) {
+    return true;
+  }
+
+  if (!write(_M_fd, _M_buf, _M_buflen)) {
+    return false;
+  }
+
+  _M_buflen = 0;
+
+  return true;
+}
+
+void fs::session_journal::unmap()
+{
+  if (_M_data != MAP_FAILED) {
+    munmap(_M_data, _M_len);
+    _M_data = MAP_FAILED;
+  }
+
+  _M_len = 0;
+}
+
+uint32_t fs::session_journal::record_crc(const uint8_t* rec,
+                                         const uint8_t* data,
+                                         uint64_t datalen)
+{
+  // The type, the offsets, the lengths and the data.
+  return crc32(crc32(crc32(0, rec, 4), rec + 8, 32), data, datalen);
+}
+
+uint64_t fs::session_journal::now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (static_cast<uint64_t>(ts.tv_sec) * 1000) + (ts.tv_nsec / 1000000);
+}
+
+bool fs::session_journal::write(int fd, const void* buf, uint64_t len)
+{
+  static const uint64_t kMaxWrite = 1024ull * 1024ull * 1024ull;
+
+  while (len > 0) {
+    uint64_t n = (len > kMaxWrite) ? kMaxWrite : len;
+
+    ssize_t ret;
+    if ((ret = ::write(fd, buf, n)) < 0) {
+      return false;
+    } else if (ret > 0) {
+      buf = reinterpret_cast<const uint8_t*>(buf) + ret;
+      len -= ret;
+    }
+  }
+
+  return true;
+}
+
+uint64_t padding(uint64_t len)
+{
+  return (8 - (len % 8)) % 8;
+}
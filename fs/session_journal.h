@@ -0,0 +1,208 @@
+#ifndef FS_SESSION_JOURNAL_H
+#define FS_SESSION_JOURNAL_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/mman.h>
+
+namespace fs {
+  // Write-ahead journal of the edits of a session (crash recovery).
+  //
+  // The edits are appended as they are performed and can be replayed, in
+  // the same order, over the file on disk which the journal was created
+  // for. All the integers are little-endian:
+  //   - Header (40 bytes): magic ("FWAL"), version (4 bytes), size of the
+  //     file on disk (8 bytes), modification time of the file on disk
+  //     (8 bytes seconds, 8 bytes nanoseconds), CRC-32 of the previous
+  //     32 bytes (4 bytes) and 4 reserved bytes.
+  //   - One record per edit (40 bytes): type (4 bytes), CRC-32 of the type,
+  //     the next 32 bytes and the data (4 bytes), offset (8 bytes), length
+  //     of the range which is replaced (8 bytes), length of the new data
+  //     (8 bytes) and offset of the new data in the file on disk (kDisk)
+  //     or length of the pattern (kFill) or of the reference (kSource)
+  //     (8 bytes), followed by the new data (kData), the pattern (kFill)
+  //     or the reference (kSource: offset of the new data in the source
+  //     file (8 bytes) followed by the name of the source file) padded to
+  //     a multiple of 8 bytes.
+  //
+  // Group commit: the records are buffered and written (and synced) once
+  // kGroupCommitSize bytes are pending, once the oldest pending record is
+  // older than kGroupCommitInterval milliseconds (checked when a record is
+  // appended) or when sync() is called. A crash might lose the last
+  // records, but the records which have been written are replayed up to
+  // the first torn one.
+  class session_journal {
+    public:
+      static const size_t kHeaderSize = 40;
+      static const size_t kRecordHeaderSize = 40;
+
+      static const uint64_t kGroupCommitSize = 1024 * 1024;
+      static const uint64_t kGroupCommitInterval = 100;
+
+      enum class record_type {
+        // [off, off + len) is replaced with 'data'.
+        kData,
+
+        // [off, off + len) is replaced with data of the file on disk.
+        kDisk,
+
+        // The file is reverted to the file on disk.
+        kRevert,
+
+        // [off, off + len) is replaced with a pattern repeated.
+        kFill,
+
+        // [off, off + len) is replaced with data of a source file.
+        kSource
+      };
+
+      // Edit.
+      struct record {
+        record_type t;
+
+        uint64_t off;
+        uint64_t len;
+
+        // New data ('datalen' bytes either from 'data' (kData, it points
+        // into the mapping), from the offset 'diskoff' of the file on disk
+        // (kDisk), the pattern 'data' ('diskoff' bytes, kFill) repeated or
+        // from the source file referenced by 'data' ('diskoff' bytes,
+        // kSource)).
+        const uint8_t* data;
+        uint64_t datalen;
+        uint64_t diskoff;
+      };
+
+      // Constructor.
+      session_journal();
+
+      // Destructor.
+      ~session_journal();
+
+      // Create ('filesize' and 'mtime' identify the file on disk).
+      bool create(const char* filename,
+                  uint64_t filesize,
+                  const struct timespec& mtime);
+
+      // Load the journal of a previous session (fails if the file on disk
+      // has changed since the journal was created).
+      bool load(const char* filename,
+                uint64_t filesize,
+                const struct timespec& mtime);
+
+      // Get next record of the journal which has been loaded (returns false
+      // once all the records have been read or at the first torn or
+      // corrupted record).
+      bool next(record& r);
+
+      // Continue the session which has been loaded: the records are
+      // appended after the last record read by next() (the rest of the
+      // journal is discarded).
+      bool resume();
+
+      // Start again for a new file on disk (the records are discarded).
+      bool reset(uint64_t filesize, const struct timespec& mtime);
+
+      // Append record.
+      bool append(record_type t,
+                  uint64_t off,
+                  uint64_t len,
+                  const uint8_t* data,
+                  uint64_t datalen,
+                  uint64_t diskoff);
+
+      // Write the pending records and sync.
+      bool sync();
+
+      // Close (the pending records are written, the journal is kept).
+      void close();
+
+      // Close and remove the journal.
+      void discard();
+
+      // Is the journal open for appending?
+      bool is_open() const;
+
+    private:
+      static const uint32_t kMagic = 0x4c415746; // "FWAL"
+      static const uint32_t kVersion = 3;
+
+      // File name.
+      char _M_filename[PATH_MAX];
+
+      // File descriptor.
+      int _M_fd;
+
+      // Pending records.
+      uint8_t* _M_buf;
+      uint64_t _M_buflen;
+      uint64_t _M_bufsize;
+
+      // When the oldest pending record has been appended (milliseconds).
+      uint64_t _M_pending_since;
+
+      // Journal which has been loaded (mapped into memory).
+      void* _M_data;
+      uint64_t _M_len;
+
+      // Next record.
+      uint64_t _M_off;
+
+      // Save file name.
+      bool set_filename(const char* filename);
+
+      // Write header.
+      bool write_header(uint64_t filesize, const struct timespec& mtime);
+
+      // Buffer 'len' bytes.
+      bool buffer(const void* data, uint64_t len);
+
+      // Write the pending records (without syncing).
+      bool flush();
+
+      // Unmap the journal which has been loaded.
+      void unmap();
+
+      // Compute CRC-32 of a record.
+      static uint32_t record_crc(const uint8_t* rec,
+                                 const uint8_t* data,
+                                 uint64_t datalen);
+
+      // Get current time (milliseconds).
+      static uint64_t now();
+
+      // Write.
+      static bool write(int fd, const void* buf, uint64_t len);
+
+      // Disable copy constructor and assignment operator.
+      session_journal(const session_journal&) = delete;
+      session_journal& operator=(const session_journal&) = delete;
+  };
+
+  inline session_journal::session_journal()
+    : _M_fd(-1),
+      _M_buf(NULL),
+      _M_buflen(0),
+      _M_bufsize(0),
+      _M_pending_since(0),
+      _M_data(MAP_FAILED),
+      _M_len(0),
+      _M_off(0)
+  {
+    *_M_filename = 0;
+  }
+
+  inline session_journal::~session_journal()
+  {
+    close();
+  }
+
+  inline bool session_journal::is_open() const
+  {
+    return (_M_fd != -1);
+  }
+}
+
+#endif // FS_SESSION_JOURNAL_H
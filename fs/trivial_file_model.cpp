@@ -218,6 +218,33 @@ bool fs::trivial_file_model::remove(uint64_t off, uint64_t len)
   return open(_M_filename);
 }
 
+bool fs::trivial_file_model::replace_all(const void* needle,
+                                         uint64_t needlelen,
+                                         const void* replacement,
+                                         uint64_t replacementlen,
+                                         uint64_t& count)
+{
+  count = 0;
+
+  uint64_t off = 0;
+  uint64_t pos;
+  while (find_forward(off, needle, needlelen, pos)) {
+    if (needlelen == replacementlen) {
+      if (!modify(pos, replacement, replacementlen)) {
+        return false;
+      }
+    } else if ((!remove(pos, needlelen)) ||
+               (!add(pos, replacement, replacementlen))) {
+      return false;
+    }
+
+    off = pos + replacementlen;
+    count++;
+  }
+
+  return true;
+}
+
 bool fs::trivial_file_model::get(uint64_t off, void* data, uint64_t& len) const
 {
   if (off >= _M_filesize) {
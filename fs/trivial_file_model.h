@@ -30,6 +30,13 @@ namespace fs {
       // Remove.
       bool remove(uint64_t off, uint64_t len);
 
+      // Replace all.
+      bool replace_all(const void* needle,
+                       uint64_t needlelen,
+                       const void* replacement,
+                       uint64_t replacementlen,
+                       uint64_t& count);
+
       // Get data.
       bool get(uint64_t off, void* data, uint64_t& len) const;
 
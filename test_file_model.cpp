@@ -1,13 +1,24 @@
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdio.h>
 #include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include <regex.h>
+#include <atomic>
 #include "fs/file_model.h"
+#include "fs/match_set.h"
 #include "fs/trivial_file_model.h"
 #include "fs/file_change.h"
 #include "fs/random_file.h"
 #include "fs/copy.h"
 #include "fs/diff.h"
+#include "fs/compress.h"
+#include "fs/change_journal.h"
+#include "fs/change_feed.h"
 
 static const char* kFileModelName = "file_model.bin";
 static const char* kOriginalFile = "file_model.org";
@@ -16,6 +27,13 @@ static const size_t kRandomFileMinSize = 100 * 1024;
 static const size_t kRandomFileMaxSize = 10 * 1024 * 1024;
 static const uint64_t kMinSearch = 4 * 1024;
 static const uint64_t kMaxSearch = 32 * 1024;
+static const uint64_t kMaxRegexSearch = 64;
+
+// Edits performed one byte at a time (coalesced undos).
+static const uint64_t kTypedBytes = 100;
+static const uint64_t kBackspaces = 50;
+static const uint64_t kModifiedBytes = 64;
+static const uint64_t kDeletedBytes = 30;
 
 static bool generate_random_changes(fs::file_changes& changes);
 static bool perform_changes(const fs::file_changes& changes,
@@ -43,6 +61,206 @@ static bool perform_search(const uint8_t* needle,
                            const fs::file_model& file_model,
                            const fs::trivial_file_model& trivial_file_model);
 
+static bool perform_find_alls(const fs::file_model& file_model,
+                              const fs::trivial_file_model& trivial_file_model);
+
+static bool perform_find_all(const uint8_t* needle,
+                             uint64_t needlelen,
+                             uint64_t off,
+                             size_t maxpositions,
+                             const fs::file_model& file_model,
+                             const fs::trivial_file_model& trivial_file_model);
+
+static bool add_position(uint64_t position, void* arg);
+
+static bool perform_find_all_chunks();
+
+static bool check_sequence(uint64_t position, void* arg);
+
+static bool check_match_set(const fs::match_set& match_set,
+                            const uint8_t* needle,
+                            uint64_t needlelen,
+                            const fs::trivial_file_model& trivial_file_model);
+
+static bool perform_regex_searches(
+              const fs::file_model& file_model,
+              const fs::trivial_file_model& trivial_file_model
+            );
+
+static bool perform_regex_search(const uint8_t* data,
+                                 uint64_t len,
+                                 const fs::file_model& file_model);
+
+static bool perform_regex_syntax();
+
+static bool check_regex(const char* pattern,
+                        const char* text,
+                        uint64_t off,
+                        const fs::file_model& file_model,
+                        uint64_t& begin,
+                        uint64_t& end,
+                        bool& found);
+
+static uint64_t build_regex(const uint8_t* data,
+                            uint64_t pos,
+                            uint64_t needlelen,
+                            char* pattern,
+                            uint8_t* from,
+                            uint8_t* to);
+
+static bool regex_match(const uint8_t* data,
+                        uint64_t len,
+                        uint64_t off,
+                        const uint8_t* from,
+                        const uint8_t* to,
+                        uint64_t needlelen,
+                        uint64_t& position);
+
+static bool perform_replacements(fs::file_model& file_model,
+                                 fs::trivial_file_model& trivial_file_model);
+
+static bool perform_boundary_replacements();
+
+static bool perform_dense_replacements();
+
+static bool perform_indexed_searches(
+              fs::file_model& file_model,
+              fs::trivial_file_model& trivial_file_model
+            );
+
+static bool perform_indexed_searches(
+              unsigned nsearches,
+              uint64_t begin,
+              uint64_t end,
+              const fs::file_model& file_model,
+              const fs::trivial_file_model& trivial_file_model
+            );
+
+static bool perform_disk_undos(fs::file_model& file_model,
+                               fs::trivial_file_model& trivial_file_model);
+
+static bool perform_spilled_pieces();
+
+static bool check_spilled_pieces(const fs::file_changes& changes,
+                                 size_t nchanges,
+                                 const uint8_t* expected,
+                                 const uint8_t* mapped,
+                                 uint64_t piecelen);
+
+static bool perform_bounded_undos(
+              fs::file_model& file_model,
+              fs::trivial_file_model& trivial_file_model
+            );
+
+static bool perform_coalesced_undos(
+              fs::file_model& file_model,
+              fs::trivial_file_model& trivial_file_model
+            );
+
+static bool perform_batch(fs::file_model& file_model,
+                          fs::trivial_file_model& trivial_file_model);
+
+static bool perform_script(fs::file_model& file_model,
+                           fs::trivial_file_model& trivial_file_model);
+
+static bool generate_script(uint64_t filesize,
+                            unsigned nchanges,
+                            fs::file_changes& script);
+
+static bool perform_script_changes(
+              const fs::file_changes& script,
+              size_t first,
+              size_t last,
+              fs::file_model* file_model,
+              fs::trivial_file_model* trivial_file_model
+            );
+
+static bool perform_revisions(fs::file_model& file_model,
+                              fs::trivial_file_model& trivial_file_model);
+
+static bool perform_session_recovery(
+              fs::file_model& file_model,
+              fs::trivial_file_model& trivial_file_model
+            );
+
+static bool perform_dirty_ranges(fs::file_model& file_model,
+                                 fs::trivial_file_model& trivial_file_model);
+
+static bool add_dirty_range(const fs::file_model::dirty_range& range,
+                            void* arg);
+
+static void add_event(uint64_t off,
+                      uint64_t oldlen,
+                      uint64_t newlen,
+                      void* arg);
+
+static bool perform_concurrent_access();
+
+static void* concurrent_reader(void* arg);
+
+static bool perform_forks(fs::file_model& file_model,
+                          fs::trivial_file_model& trivial_file_model);
+
+static bool perform_patches(fs::file_model& file_model,
+                            fs::trivial_file_model& trivial_file_model);
+
+static bool perform_compaction(fs::file_model& file_model,
+                               fs::trivial_file_model& trivial_file_model);
+
+static bool perform_prefetch(fs::file_model& file_model,
+                             fs::trivial_file_model& trivial_file_model);
+
+static bool read_chunk(uint64_t off,
+                       uint64_t len,
+                       const fs::file_model& file_model,
+                       const fs::trivial_file_model& trivial_file_model);
+
+static bool perform_fills(fs::file_model& file_model,
+                          fs::trivial_file_model& trivial_file_model);
+
+static bool perform_large_fills();
+
+static bool check_large_fills(const fs::file_model& file_model,
+                              uint64_t filloff,
+                              uint64_t filllen,
+                              const uint8_t* pattern,
+                              size_t patternlen);
+
+static bool perform_compression(fs::file_model& file_model,
+                                fs::trivial_file_model& trivial_file_model);
+
+static bool perform_insertions(fs::file_model& file_model,
+                               fs::trivial_file_model& trivial_file_model);
+
+static bool perform_sources(fs::file_model& file_model,
+                            fs::trivial_file_model& trivial_file_model);
+
+static bool perform_ranges(fs::file_model& file_model,
+                           fs::trivial_file_model& trivial_file_model);
+
+static bool type_text(uint64_t off,
+                      const uint8_t* data,
+                      uint64_t len,
+                      fs::file_model& file_model,
+                      fs::trivial_file_model& trivial_file_model);
+
+static bool write_text(uint64_t off,
+                       uint64_t len,
+                       fs::file_model& file_model,
+                       fs::trivial_file_model& trivial_file_model);
+
+static bool check_change_formats(uint64_t filesize);
+
+static bool perform_edits(const uint8_t* data,
+                          uint64_t offsets[3],
+                          fs::file_model* file_model,
+                          fs::trivial_file_model* trivial_file_model);
+
+static bool modify(uint64_t off,
+                   const uint8_t* data,
+                   uint64_t len,
+                   fs::file_model& file_model);
+
 static bool perform_undos(fs::file_model& file_model, size_t nchanges);
 static bool perform_redos(fs::file_model& file_model, size_t nchanges);
 
@@ -58,6 +276,13 @@ static bool equal(const fs::file_model& file_model,
                   const fs::trivial_file_model& trivial_file_model);
 
 static void fill_random_data(uint8_t* data, size_t len);
+static void fill_text(uint8_t* data, size_t len);
+
+static bool write_file(const char* filename, const void* data, uint64_t len);
+static bool create_file_model(const char* filename,
+                              const void* data,
+                              uint64_t len,
+                              fs::file_model& file_model);
 
 int main(int argc, const char** argv)
 {
@@ -98,6 +323,26 @@ int main(int argc, const char** argv)
     return -1;
   }
 
+  // Create match set (kept up to date while performing the changes).
+  static const uint64_t kMatchSetNeedleLen = 2;
+
+  uint8_t needle[kMatchSetNeedleLen];
+  uint64_t needlelen = kMatchSetNeedleLen;
+  if (!trivial_file_model.get(random() % (trivial_file_model.length() -
+                                          kMatchSetNeedleLen +
+                                          1),
+                              needle,
+                              needlelen)) {
+    fprintf(stderr, "Error getting data from the trivial_file_model.\n");
+    return -1;
+  }
+
+  fs::match_set match_set;
+  if (!match_set.create(file_model, needle, needlelen)) {
+    fprintf(stderr, "Error creating match set.\n");
+    return -1;
+  }
+
   // Perform changes.
   if (!perform_changes(changes, file_model, trivial_file_model)) {
     return -1;
@@ -121,11 +366,36 @@ int main(int argc, const char** argv)
     return 0;
   }
 
+  // Check match set.
+  if (!check_match_set(match_set, needle, needlelen, trivial_file_model)) {
+    return -1;
+  }
+
   // Perform searches.
   if (!perform_searches(file_model, trivial_file_model)) {
     return -1;
   }
 
+  // Search all the occurrences.
+  if (!perform_find_alls(file_model, trivial_file_model)) {
+    return -1;
+  }
+
+  // Search all the occurrences when there are too many to be kept.
+  if (!perform_find_all_chunks()) {
+    return -1;
+  }
+
+  // Perform regular expression searches.
+  if (!perform_regex_searches(file_model, trivial_file_model)) {
+    return -1;
+  }
+
+  // Search regular expressions with repetitions, alternations and anchors.
+  if (!perform_regex_syntax()) {
+    return -1;
+  }
+
   // Perform undos.
   if (!perform_undos(file_model, changes.size())) {
     return -1;
@@ -136,6 +406,136 @@ int main(int argc, const char** argv)
     return -1;
   }
 
+  // Check match set.
+  if (!check_match_set(match_set, needle, needlelen, trivial_file_model)) {
+    return -1;
+  }
+
+  // Replace all the occurrences.
+  if (!perform_replacements(file_model, trivial_file_model)) {
+    return -1;
+  }
+
+  // Replace occurrences which cross block boundaries.
+  if (!perform_boundary_replacements()) {
+    return -1;
+  }
+
+  // Undo the replacement of dense occurrences.
+  if (!perform_dense_replacements()) {
+    return -1;
+  }
+
+  // Check match set.
+  if (!check_match_set(match_set, needle, needlelen, trivial_file_model)) {
+    return -1;
+  }
+
+  // Perform searches using the index.
+  if (!perform_indexed_searches(file_model, trivial_file_model)) {
+    return -1;
+  }
+
+  // Undo changes of the data on disk.
+  if (!perform_disk_undos(file_model, trivial_file_model)) {
+    return -1;
+  }
+
+  // Spill changes whose old data references the file.
+  if (!perform_spilled_pieces()) {
+    return -1;
+  }
+
+  // Undo with a bounded history.
+  if (!perform_bounded_undos(file_model, trivial_file_model)) {
+    return -1;
+  }
+
+  // Undo small edits which have been merged.
+  if (!perform_coalesced_undos(file_model, trivial_file_model)) {
+    return -1;
+  }
+
+  // Perform a batch of edits.
+  if (!perform_batch(file_model, trivial_file_model)) {
+    return -1;
+  }
+
+  // Apply a script of changes.
+  if (!perform_script(file_model, trivial_file_model)) {
+    return -1;
+  }
+
+  // Go to other revisions.
+  if (!perform_revisions(file_model, trivial_file_model)) {
+    return -1;
+  }
+
+  // Recover an interrupted session.
+  if (!perform_session_recovery(file_model, trivial_file_model)) {
+    return -1;
+  }
+
+  // Enumerate the changed ranges.
+  if (!perform_dirty_ranges(file_model, trivial_file_model)) {
+    return -1;
+  }
+
+  // Read while another thread is writing.
+  if (!perform_concurrent_access()) {
+    return -1;
+  }
+
+  // Fork the file model.
+  if (!perform_forks(file_model, trivial_file_model)) {
+    return -1;
+  }
+
+  // Modify isolated bytes of the file on disk.
+  if (!perform_patches(file_model, trivial_file_model)) {
+    return -1;
+  }
+
+  // Compact the blocks in the background.
+  if (!perform_compaction(file_model, trivial_file_model)) {
+    return -1;
+  }
+
+  // Read with the prefetcher.
+  if (!perform_prefetch(file_model, trivial_file_model)) {
+    return -1;
+  }
+
+  // Fill ranges with patterns and resize.
+  if (!perform_fills(file_model, trivial_file_model)) {
+    return -1;
+  }
+
+  // Compress the cold blocks in memory.
+  if (!perform_compression(file_model, trivial_file_model)) {
+    return -1;
+  }
+
+  // Insert data at a cursor and in bulk.
+  if (!perform_insertions(file_model, trivial_file_model)) {
+    return -1;
+  }
+
+  // Add and modify data of another file by reference.
+  if (!perform_sources(file_model, trivial_file_model)) {
+    return -1;
+  }
+
+  // Copy and move ranges by sharing blocks.
+  if (!perform_ranges(file_model, trivial_file_model)) {
+    return -1;
+  }
+
+  // Save changes in text and binary format.
+  if (!check_change_formats(trivial_file_model.length())) {
+    return -1;
+  }
+
   // Empty files.
   if (!remove_all(file_model, trivial_file_model)) {
     return -1;
@@ -146,6 +546,11 @@ int main(int argc, const char** argv)
     return -1;
   }
 
+  // Check match set.
+  if (!check_match_set(match_set, needle, needlelen, trivial_file_model)) {
+    return -1;
+  }
+
   return 0;
 }
 
@@ -368,6 +773,19 @@ bool perform_change(const fs::file_change* change,
       }
 
       break;
+    case fs::file_change::type::kReplace:
+      fprintf(stderr, "[Replace] Replacements cannot be performed.\n");
+      return false;
+    case fs::file_change::type::kBatch:
+      fprintf(stderr, "[Batch] Batches cannot be performed.\n");
+      return false;
+    case fs::file_change::type::kCopy:
+    case fs::file_change::type::kMove:
+      fprintf(stderr, "[Clone] Copies / moves cannot be performed.\n");
+      return false;
+    case fs::file_change::type::kFill:
+      fprintf(stderr, "[Fill] Fills cannot be performed.\n");
+      return false;
   }
 
   return true;
@@ -532,65 +950,140 @@ bool perform_search(const uint8_t* needle,
   return true;
 }
 
-bool perform_undos(fs::file_model& file_model, size_t nchanges)
+struct positions {
+  uint64_t* positions;
+  size_t npositions;
+  size_t size;
+
+  // Maximum number of positions to be received (cancel search).
+  size_t max;
+};
+
+bool perform_find_alls(const fs::file_model& file_model,
+                       const fs::trivial_file_model& trivial_file_model)
 {
-  printf("Performing undos...\n");
+  static const unsigned kNumberSearches = 20;
+  static const uint64_t kMaxNeedleLen = 3;
 
-  for (size_t i = 0; i < nchanges; i++) {
-    fs::file_model::operation_result res;
-    if ((res = file_model.undo()) !=
-        fs::file_model::operation_result::kSuccess) {
-      fprintf(stderr,
-              "[Undo] %s\n",
-              fs::file_model::operation_result_to_string(res));
+  // If the file is empty...
+  if (trivial_file_model.length() == 0) {
+    printf("File is empty => no search.\n");
+    return true;
+  }
+
+  printf("Searching all occurrences...\n");
+
+  for (unsigned i = 0; i < kNumberSearches; i++) {
+    uint64_t len = (random() % kMaxNeedleLen) + 1;
+    uint64_t pos = random() % trivial_file_model.length();
 
+    uint8_t needle[kMaxNeedleLen];
+    if ((!trivial_file_model.get(pos, needle, len)) || (len == 0)) {
+      fprintf(stderr, "Error getting data from the trivial_file_model.\n");
       return false;
     }
-  }
-
-  if (!file_model.save()) {
-    fprintf(stderr, "Error saving file_model.\n");
-    return false;
-  }
 
-  if (!fs::diff(kOriginalFile, kFileModelName)) {
-    fprintf(stderr,
-            "Files %s and %s are different.\n",
-            kOriginalFile,
-            kFileModelName);
+    // Cancel some of the searches.
+    size_t max = (random() % 4 == 0) ? (random() % 64) + 1 : SIZE_MAX;
 
-    return false;
+    if (!perform_find_all(needle,
+                          len,
+                          random() % (pos + 1),
+                          max,
+                          file_model,
+                          trivial_file_model)) {
+      return false;
+    }
   }
 
   return true;
 }
 
-bool perform_redos(fs::file_model& file_model, size_t nchanges)
+bool perform_find_all(const uint8_t* needle,
+                      uint64_t needlelen,
+                      uint64_t off,
+                      size_t maxpositions,
+                      const fs::file_model& file_model,
+                      const fs::trivial_file_model& trivial_file_model)
 {
-  printf("Performing redos...\n");
+  struct positions positions;
+  positions.positions = NULL;
+  positions.npositions = 0;
+  positions.size = 0;
+  positions.max = maxpositions;
+
+  fs::file_model::find_all_result res = file_model.find_all(off,
+                                                            needle,
+                                                            needlelen,
+                                                            add_position,
+                                                            &positions,
+                                                            (random() % 8) + 1);
+
+  if (res == fs::file_model::find_all_result::kNoMemory) {
+    fprintf(stderr, "[Find all] Out of memory.\n");
+
+    if (positions.positions) {
+      free(positions.positions);
+    }
 
-  for (size_t i = 0; i < nchanges; i++) {
-    fs::file_model::operation_result res;
-    if ((res = file_model.redo()) !=
-        fs::file_model::operation_result::kSuccess) {
-      fprintf(stderr,
-              "[Redo] %s\n",
-              fs::file_model::operation_result_to_string(res));
+    return false;
+  }
 
+  bool ret = (res == fs::file_model::find_all_result::kCompleted);
+
+  // Compare with the positions found by the trivial_file_model.
+  size_t i = 0;
+  uint64_t position;
+  while ((i < positions.npositions) &&
+         (trivial_file_model.find(off,
+                                  direction::kForward,
+                                  needle,
+                                  needlelen,
+                                  position))) {
+    if (positions.positions[i] != position) {
+      fprintf(stderr,
+              "[Find all] Positions are different (file_model: %llu, "
+              "trivial_file_model: %llu, offset: %llu, length: %llu).\n",
+              positions.positions[i],
+              position,
+              off,
+              needlelen);
+
+      free(positions.positions);
       return false;
     }
+
+    off = position + 1;
+    i++;
   }
 
-  if (!file_model.save()) {
-    fprintf(stderr, "Error saving file_model.\n");
+  if (positions.positions) {
+    free(positions.positions);
+  }
+
+  if (i != positions.npositions) {
+    fprintf(stderr, "[Find all] Found more positions than expected.\n");
     return false;
   }
 
-  if (!fs::diff(kFileModelName, kTrivialFileModelName)) {
+  // If the search has been cancelled...
+  if (positions.npositions == maxpositions) {
+    if (ret) {
+      fprintf(stderr, "[Find all] The search has not been cancelled.\n");
+      return false;
+    }
+  } else if (!ret) {
+    fprintf(stderr, "[Find all] Error searching all the occurrences.\n");
+    return false;
+  } else if (trivial_file_model.find(off,
+                                     direction::kForward,
+                                     needle,
+                                     needlelen,
+                                     position)) {
     fprintf(stderr,
-            "Files %s and %s are different.\n",
-            kFileModelName,
-            kTrivialFileModelName);
+            "[Find all] Position %llu not found (length: %llu).\n",
+            position,
+            needlelen);
 
     return false;
   }
@@ -598,42 +1091,4822 @@ bool perform_redos(fs::file_model& file_model, size_t nchanges)
   return true;
 }
 
-bool remove_all(fs::file_model& file_model,
-                fs::trivial_file_model& trivial_file_model)
+bool add_position(uint64_t position, void* arg)
 {
-  printf("Removing all...\n");
+  struct positions* positions = reinterpret_cast<struct positions*>(arg);
 
-  if (!trivial_file_model.remove(0, trivial_file_model.length())) {
-    fprintf(stderr, "Error emptying trivial_file_model.\n");
-    return false;
-  }
+  if (positions->npositions == positions->size) {
+    size_t size = (positions->size == 0) ? 1024 : positions->size * 2;
 
-  fs::file_model::operation_result res;
-  if ((res = file_model.remove(0, file_model.length())) !=
-      fs::file_model::operation_result::kSuccess) {
-    fprintf(stderr,
-            "Error emptying file_model (%s).\n",
-            fs::file_model::operation_result_to_string(res));
+    uint64_t* p;
+    if ((p = reinterpret_cast<uint64_t*>(
+               realloc(positions->positions, size * sizeof(uint64_t))
+             )) == NULL) {
+      return false;
+    }
 
-    return false;
+    positions->positions = p;
+    positions->size = size;
   }
 
-  if (!file_model.save()) {
-    fprintf(stderr, "Error saving file_model.\n");
-    return false;
-  }
+  positions->positions[positions->npositions++] = position;
 
-  if (!fs::diff(kFileModelName, kTrivialFileModelName)) {
-    fprintf(stderr,
-            "The files %s and %s are different.\n",
-            kFileModelName,
-            kTrivialFileModelName);
+  // Continue?
+  return (positions->npositions < positions->max);
+}
 
-    return false;
-  }
+struct sequence {
+  // Next position expected.
+  uint64_t next;
 
-  return true;
-}
+  // Maximum position to be received (cancel search).
+  uint64_t max;
+};
+
+bool perform_find_all_chunks()
+{
+  static const uint64_t kChunksLength = 12 * 1024 * 1024;
+  static const char* kChunksName = "file_model.chk";
+  static const char* kNeedle = "aa";
+
+  printf("Searching all the occurrences in chunks...\n");
+
+  // Every position (but the last one) is an occurrence.
+  uint8_t* data;
+  if ((data = reinterpret_cast<uint8_t*>(malloc(kChunksLength))) == NULL) {
+    fprintf(stderr, "Error allocating memory.\n");
+    return false;
+  }
+
+  memset(data, 'a', kChunksLength);
+
+  fs::file_model file_model;
+  bool ok = create_file_model(kChunksName, data, kChunksLength, file_model);
+
+  free(data);
+
+  if (!ok) {
+    return false;
+  }
+
+  // Whole search (the positions are reported in order).
+  struct sequence seq;
+  seq.next = 0;
+  seq.max = UINT64_MAX;
+
+  if ((file_model.find_all(0, kNeedle, 2, check_sequence, &seq, 4) !=
+       fs::file_model::find_all_result::kCompleted) ||
+      (seq.next != kChunksLength - 1)) {
+    fprintf(stderr,
+            "[Find all in chunks] Error searching all the occurrences "
+            "(next: %llu).\n",
+            seq.next);
+
+    ok = false;
+  }
+
+  // Cancelled search.
+  seq.next = 0;
+  seq.max = kChunksLength / 3;
+
+  if ((ok) &&
+      ((file_model.find_all(0, kNeedle, 2, check_sequence, &seq, 4) !=
+        fs::file_model::find_all_result::kCancelled) ||
+       (seq.next != seq.max + 1))) {
+    fprintf(stderr,
+            "[Find all in chunks] The search has not been cancelled "
+            "(next: %llu).\n",
+            seq.next);
+
+    ok = false;
+  }
+
+  file_model.close();
+  unlink(kChunksName);
+
+  return ok;
+}
+
+bool check_sequence(uint64_t position, void* arg)
+{
+  struct sequence* seq = reinterpret_cast<struct sequence*>(arg);
+
+  if (position != seq->next) {
+    fprintf(stderr,
+            "[Find all in chunks] Unexpected position %llu (expected: %llu)."
+            "\n",
+            position,
+            seq->next);
+
+    return false;
+  }
+
+  // Continue?
+  return (seq->next++ < seq->max);
+}
+
+bool check_match_set(const fs::match_set& match_set,
+                     const uint8_t* needle,
+                     uint64_t needlelen,
+                     const fs::trivial_file_model& trivial_file_model)
+{
+  printf("Checking match set...\n");
+
+  if (!match_set.valid()) {
+    fprintf(stderr, "[Match set] The match set is not valid.\n");
+    return false;
+  }
+
+  size_t i = 0;
+  uint64_t off = 0;
+  uint64_t position;
+  while (trivial_file_model.find(off,
+                                 direction::kForward,
+                                 needle,
+                                 needlelen,
+                                 position)) {
+    if ((i == match_set.size()) || (match_set.get(i) != position)) {
+      fprintf(stderr,
+              "[Match set] Position %llu not found (index: %zu).\n",
+              position,
+              i);
+
+      return false;
+    }
+
+    off = position + 1;
+    i++;
+  }
+
+  if (i != match_set.size()) {
+    fprintf(stderr,
+            "[Match set] Found %zu positions instead of %zu.\n",
+            match_set.size(),
+            i);
+
+    return false;
+  }
+
+  return true;
+}
+
+bool perform_regex_searches(const fs::file_model& file_model,
+                            const fs::trivial_file_model& trivial_file_model)
+{
+  static const unsigned kNumberSearches = 200;
+
+  // If the file is empty...
+  if (trivial_file_model.length() == 0) {
+    printf("File is empty => no regular expression search.\n");
+    return true;
+  }
+
+  printf("Searching regular expressions...\n");
+
+  // Get the whole file from the trivial_file_model.
+  uint64_t len = trivial_file_model.length();
+
+  uint8_t* data;
+  if ((data = reinterpret_cast<uint8_t*>(malloc(len))) == NULL) {
+    fprintf(stderr, "Error allocating %llu bytes of memory.\n", len);
+    return false;
+  }
+
+  if ((!trivial_file_model.get(0, data, len)) ||
+      (len != trivial_file_model.length())) {
+    fprintf(stderr, "Error getting data from the trivial_file_model.\n");
+
+    free(data);
+    return false;
+  }
+
+  for (unsigned i = 0; i < kNumberSearches; i++) {
+    if (!perform_regex_search(data, len, file_model)) {
+      free(data);
+      return false;
+    }
+  }
+
+  free(data);
+
+  return true;
+}
+
+bool perform_regex_search(const uint8_t* data,
+                          uint64_t len,
+                          const fs::file_model& file_model)
+{
+  // Each byte of the needles is converted into a literal or a range.
+  char pattern[2 * 10 * kMaxRegexSearch + 8];
+  uint8_t from1[kMaxRegexSearch], to1[kMaxRegexSearch];
+  uint8_t from2[kMaxRegexSearch], to2[kMaxRegexSearch];
+
+  uint64_t needlelen1 = (random() % kMaxRegexSearch) + 1;
+  uint64_t pos1 = random() % len;
+  if (pos1 + needlelen1 > len) {
+    needlelen1 = len - pos1;
+  }
+
+  uint64_t n = build_regex(data, pos1, needlelen1, pattern, from1, to1);
+
+  uint64_t off = random() % (pos1 + 1);
+
+  // Alternation?
+  uint64_t needlelen2 = 0;
+  if (random() % 4 == 0) {
+    needlelen2 = (random() % kMaxRegexSearch) + 1;
+    uint64_t pos2 = random() % len;
+    if (pos2 + needlelen2 > len) {
+      needlelen2 = len - pos2;
+    }
+
+    pattern[n++] = '|';
+    build_regex(data, pos2, needlelen2, pattern + n, from2, to2);
+
+    if (pos2 < off) {
+      off = pos2;
+    }
+  }
+
+  // Search with the reference implementation.
+  uint64_t begin1, end1;
+  if (!regex_match(data, len, off, from1, to1, needlelen1, begin1)) {
+    fprintf(stderr, "Regular expression '%s' not found.\n", pattern);
+    return false;
+  }
+
+  end1 = begin1 + needlelen1;
+
+  uint64_t begin2;
+  if ((needlelen2 > 0) &&
+      (regex_match(data, len, off, from2, to2, needlelen2, begin2))) {
+    uint64_t end2 = begin2 + needlelen2;
+
+    // Leftmost-longest.
+    if ((begin2 < begin1) || ((begin2 == begin1) && (end2 > end1))) {
+      begin1 = begin2;
+      end1 = end2;
+    }
+  }
+
+  fs::regex re;
+  if (!re.compile(pattern)) {
+    fprintf(stderr, "Error compiling regular expression '%s'.\n", pattern);
+    return false;
+  }
+
+  uint64_t begin, end;
+  if (!file_model.find(off, re, begin, end)) {
+    fprintf(stderr,
+            "Regular expression '%s' not found in file_model "
+            "(offset: %llu).\n",
+            pattern,
+            off);
+
+    return false;
+  }
+
+  if ((begin != begin1) || (end != end1)) {
+    fprintf(stderr,
+            "Regular expression matches are different (file_model: "
+            "[%llu, %llu), expected: [%llu, %llu), offset: %llu).\n",
+            begin,
+            end,
+            begin1,
+            end1,
+            off);
+
+    return false;
+  }
+
+  return true;
+}
+
+bool perform_regex_syntax()
+{
+  static const uint64_t kTextLength = 256 * 1024;
+  static const unsigned kNumberInsertions = 8;
+  static const unsigned kNumberRemovals = 8;
+  static const unsigned kNumberOffsets = 20;
+  static const char* kTextName = "file_model.rex";
+  static const char* kTrivialTextName = "file_model.rxt";
+  static const char* kInserted = "XYZ";
+
+  // The matches are compared with the POSIX extended regular expressions
+  // (leftmost-longest as well).
+  static const char* kPatterns[] = {
+    "mo*del",
+    "(re)+do",
+    "s[a-z]+h",
+    "d[a-z]{2,4}",
+    "o{1,2}[a-z]",
+    "(un|re)do",
+    "(b(lo|uf)(ck|fer)|pa(g|ge)e?) [a-z]+",
+    "((the|file) (model|block)|(disk|data)+) [a-z]*",
+    "^save",
+    "page$",
+    "^[a-z]+ [a-z]+$",
+    "^(undo|redo)( [a-z]+)*$",
+    ".{2}XYZ.{2}",
+    "[a-z]+ ?X+YZ[a-z ]*"
+  };
+
+  printf("Searching regular expressions with repetitions...\n");
+
+  // Text file.
+  char* text;
+  if ((text = reinterpret_cast<char*>(malloc(kTextLength + 1))) == NULL) {
+    fprintf(stderr, "Error allocating memory.\n");
+    return false;
+  }
+
+  fill_text(reinterpret_cast<uint8_t*>(text), kTextLength);
+
+  fs::file_model file_model;
+  if (!create_file_model(kTextName, text, kTextLength, file_model)) {
+    free(text);
+    return false;
+  }
+
+  fs::trivial_file_model trivial_file_model;
+  if ((!fs::copy(kTextName, kTrivialTextName)) ||
+      (!trivial_file_model.open(kTrivialTextName))) {
+    fprintf(stderr, "Error opening file %s.\n", kTrivialTextName);
+
+    unlink(kTextName);
+    free(text);
+
+    return false;
+  }
+
+  bool ok = true;
+
+  // The insertions and the removals split the blocks (offsets of the block
+  // boundaries).
+  uint64_t boundaries[(2 * kNumberInsertions) + kNumberRemovals];
+  size_t nboundaries = 0;
+
+  size_t insertedlen = strlen(kInserted);
+
+  for (unsigned i = 0; i < kNumberInsertions + kNumberRemovals; i++) {
+    uint64_t off = 16 + (random() % (trivial_file_model.length() - 32));
+
+    bool add = (i < kNumberInsertions);
+
+    if (add) {
+      ok = ((file_model.add(off, kInserted, insertedlen) ==
+             fs::file_model::operation_result::kSuccess) &&
+            (trivial_file_model.add(off, kInserted, insertedlen)));
+    } else {
+      ok = ((file_model.remove(off, 1) ==
+             fs::file_model::operation_result::kSuccess) &&
+            (trivial_file_model.remove(off, 1)));
+    }
+
+    if (!ok) {
+      fprintf(stderr, "Error modifying file %s.\n", kTextName);
+
+      free(text);
+      return false;
+    }
+
+    // Shift the previous boundaries.
+    for (size_t j = 0; j < nboundaries; j++) {
+      if (boundaries[j] > off) {
+        if (add) {
+          boundaries[j] += insertedlen;
+        } else {
+          boundaries[j]--;
+        }
+      }
+    }
+
+    boundaries[nboundaries++] = off;
+
+    if (add) {
+      boundaries[nboundaries++] = off + insertedlen;
+    }
+  }
+
+  uint64_t len = trivial_file_model.length();
+
+  char* tmp;
+  if ((tmp = reinterpret_cast<char*>(realloc(text, len + 1))) == NULL) {
+    fprintf(stderr, "Error allocating memory.\n");
+
+    free(text);
+    return false;
+  }
+
+  text = tmp;
+
+  if ((!trivial_file_model.get(0, text, len)) ||
+      (len != trivial_file_model.length())) {
+    fprintf(stderr, "Error getting data from the trivial_file_model.\n");
+
+    free(text);
+    return false;
+  }
+
+  text[len] = 0;
+
+  // Number of matches which cross a block boundary.
+  unsigned crossing = 0;
+
+  size_t npatterns = sizeof(kPatterns) / sizeof(kPatterns[0]);
+
+  for (size_t i = 0; i < npatterns + nboundaries; i++) {
+    char pattern[64];
+    uint64_t offsets[kNumberOffsets];
+
+    if (i < npatterns) {
+      snprintf(pattern, sizeof(pattern), "%s", kPatterns[i]);
+
+      offsets[0] = 0;
+      for (unsigned j = 1; j < kNumberOffsets; j++) {
+        offsets[j] = random() % len;
+      }
+    } else {
+      // The bytes around the boundary (letters and spaces) and the
+      // following letters.
+      uint64_t off = boundaries[i - npatterns] - 3;
+
+      if (memchr(text + off, '\n', 6) != NULL) {
+        continue;
+      }
+
+      memcpy(pattern, text + off, 6);
+      strcpy(pattern + 6, "[a-z]*");
+
+      for (unsigned j = 0; j < kNumberOffsets; j++) {
+        offsets[j] = off - j;
+      }
+    }
+
+    for (unsigned j = 0; j < kNumberOffsets; j++) {
+      uint64_t begin, end;
+      bool found;
+      if (!check_regex(pattern,
+                       text,
+                       offsets[j],
+                       file_model,
+                       begin,
+                       end,
+                       found)) {
+        free(text);
+        return false;
+      }
+
+      if (found) {
+        for (size_t k = 0; k < nboundaries; k++) {
+          if ((begin < boundaries[k]) && (end > boundaries[k])) {
+            crossing++;
+            break;
+          }
+        }
+      }
+    }
+  }
+
+  free(text);
+
+  file_model.close();
+  unlink(kTextName);
+  unlink(kTrivialTextName);
+
+  if (crossing == 0) {
+    fprintf(stderr, "No match crosses a block boundary.\n");
+    return false;
+  }
+
+  return true;
+}
+
+bool check_regex(const char* pattern,
+                 const char* text,
+                 uint64_t off,
+                 const fs::file_model& file_model,
+                 uint64_t& begin,
+                 uint64_t& end,
+                 bool& found)
+{
+  // Search with the reference implementation.
+  regex_t preg;
+  if (regcomp(&preg, pattern, REG_EXTENDED | REG_NEWLINE) != 0) {
+    fprintf(stderr, "Error compiling regular expression '%s'.\n", pattern);
+    return false;
+  }
+
+  int eflags = ((off > 0) && (text[off - 1] != '\n')) ? REG_NOTBOL : 0;
+
+  regmatch_t m;
+  found = (regexec(&preg, text + off, 1, &m, eflags) == 0);
+
+  regfree(&preg);
+
+  uint64_t begin1 = found ? off + m.rm_so : 0;
+  uint64_t end1 = found ? off + m.rm_eo : 0;
+
+  fs::regex re;
+  if (!re.compile(pattern)) {
+    fprintf(stderr, "Error compiling regular expression '%s'.\n", pattern);
+    return false;
+  }
+
+  if (file_model.find(off, re, begin, end) != found) {
+    fprintf(stderr,
+            "Regular expression '%s' %s in file_model (offset: %llu).\n",
+            pattern,
+            found ? "not found" : "found",
+            off);
+
+    return false;
+  }
+
+  if ((found) && ((begin != begin1) || (end != end1))) {
+    fprintf(stderr,
+            "Regular expression matches are different (file_model: "
+            "[%llu, %llu), expected: [%llu, %llu), pattern: '%s', "
+            "offset: %llu).\n",
+            begin,
+            end,
+            begin1,
+            end1,
+            pattern,
+            off);
+
+    return false;
+  }
+
+  return true;
+}
+
+uint64_t build_regex(const uint8_t* data,
+                     uint64_t pos,
+                     uint64_t needlelen,
+                     char* pattern,
+                     uint8_t* from,
+                     uint8_t* to)
+{
+  uint64_t n = 0;
+
+  for (uint64_t i = 0; i < needlelen; i++) {
+    uint8_t c = data[pos + i];
+
+    if (random() % 4 == 0) {
+      unsigned min = random() % 16;
+      unsigned max = random() % 16;
+
+      from[i] = (c >= min) ? c - min : 0;
+      to[i] = (c + max <= 0xff) ? c + max : 0xff;
+
+      n += sprintf(pattern + n, "[\\x%02x-\\x%02x]", from[i], to[i]);
+    } else {
+      from[i] = c;
+      to[i] = c;
+
+      n += sprintf(pattern + n, "\\x%02x", c);
+    }
+  }
+
+  return n;
+}
+
+bool regex_match(const uint8_t* data,
+                 uint64_t len,
+                 uint64_t off,
+                 const uint8_t* from,
+                 const uint8_t* to,
+                 uint64_t needlelen,
+                 uint64_t& position)
+{
+  for (; off + needlelen <= len; off++) {
+    uint64_t i;
+    for (i = 0;
+         (i < needlelen) &&
+         (data[off + i] >= from[i]) &&
+         (data[off + i] <= to[i]);
+         i++);
+
+    if (i == needlelen) {
+      position = off;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+bool perform_replacements(fs::file_model& file_model,
+                          fs::trivial_file_model& trivial_file_model)
+{
+  static const uint64_t kMaxLen = 8;
+
+  static const struct {
+    uint64_t needlelen;
+    uint64_t replacementlen;
+  } replacements[] = {
+    {2, 2},
+    {3, 5},
+    {3, 1},
+    {3, 0}
+  };
+
+  // If the file is too small...
+  if (trivial_file_model.length() < kMaxLen) {
+    printf("File is too small => no replacement.\n");
+    return true;
+  }
+
+  printf("Replacing all...\n");
+
+  for (size_t i = 0; i < sizeof(replacements) / sizeof(replacements[0]); i++) {
+    uint8_t needle[kMaxLen];
+    uint64_t needlelen = replacements[i].needlelen;
+    if (!trivial_file_model.get(random() % (trivial_file_model.length() -
+                                            needlelen +
+                                            1),
+                                needle,
+                                needlelen)) {
+      fprintf(stderr, "Error getting data from the trivial_file_model.\n");
+      return false;
+    }
+
+    uint8_t replacement[kMaxLen];
+    uint64_t replacementlen = replacements[i].replacementlen;
+    fill_random_data(replacement, replacementlen);
+
+    uint64_t count1;
+    fs::file_model::operation_result res;
+    if ((res = file_model.replace_all(needle,
+                                      needlelen,
+                                      replacement,
+                                      replacementlen,
+                                      count1)) !=
+        fs::file_model::operation_result::kSuccess) {
+      fprintf(stderr,
+              "[Replace] %s\n",
+              fs::file_model::operation_result_to_string(res));
+
+      return false;
+    }
+
+    // The replacements are undone in one step.
+    if ((res = file_model.undo()) !=
+        fs::file_model::operation_result::kSuccess) {
+      fprintf(stderr,
+              "[Replace] [Undo] %s\n",
+              fs::file_model::operation_result_to_string(res));
+
+      return false;
+    }
+
+    if (!equal(file_model, trivial_file_model)) {
+      return false;
+    }
+
+    if ((res = file_model.redo()) !=
+        fs::file_model::operation_result::kSuccess) {
+      fprintf(stderr,
+              "[Replace] [Redo] %s\n",
+              fs::file_model::operation_result_to_string(res));
+
+      return false;
+    }
+
+    uint64_t count2;
+    if (!trivial_file_model.replace_all(needle,
+                                        needlelen,
+                                        replacement,
+                                        replacementlen,
+                                        count2)) {
+      fprintf(stderr, "Error replacing in trivial_file_model.\n");
+      return false;
+    }
+
+    if (count1 != count2) {
+      fprintf(stderr,
+              "[Replace] Number of replacements are different (file_model: "
+              "%llu, trivial_file_model: %llu).\n",
+              count1,
+              count2);
+
+      return false;
+    }
+
+    if (!equal(file_model, trivial_file_model)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool perform_boundary_replacements()
+{
+  static const uint64_t kBoundaryLength = 100 * 1024;
+  static const char* kBoundaryName = "file_model.bnd";
+
+  // Odd offsets (from the end, so that the previous offsets don't move).
+  static const uint64_t kRemoved[] = {90001, 70001, 50001, 30001, 10001};
+
+  printf("Replacing occurrences across block boundaries...\n");
+
+  // "abab..."
+  uint8_t* data;
+  uint8_t* expected;
+  if ((data = reinterpret_cast<uint8_t*>(malloc(2 * kBoundaryLength))) ==
+      NULL) {
+    fprintf(stderr, "Error allocating memory.\n");
+    return false;
+  }
+
+  expected = data + kBoundaryLength;
+
+  for (uint64_t i = 0; i < kBoundaryLength; i++) {
+    data[i] = (i % 2 == 0) ? 'a' : 'b';
+  }
+
+  fs::file_model file_model;
+  if (!create_file_model(kBoundaryName, data, kBoundaryLength, file_model)) {
+    free(data);
+    return false;
+  }
+
+  bool ok = true;
+
+  // Each removal leaves an "aa" across the boundary of two blocks.
+  uint64_t len = kBoundaryLength;
+  for (size_t i = 0; (i < sizeof(kRemoved) / sizeof(kRemoved[0])) && (ok);
+       i++) {
+    if (file_model.remove(kRemoved[i], 1) !=
+        fs::file_model::operation_result::kSuccess) {
+      fprintf(stderr, "[Boundary replace] Error removing data.\n");
+      ok = false;
+    } else {
+      memmove(data + kRemoved[i],
+              data + kRemoved[i] + 1,
+              len - kRemoved[i] - 1);
+      len--;
+    }
+  }
+
+  // Expected result.
+  uint64_t expectedlen = 0;
+  uint64_t expectedcount = 0;
+  for (uint64_t i = 0; i < len; ) {
+    if ((i + 1 < len) && (data[i] == 'a') && (data[i + 1] == 'a')) {
+      expected[expectedlen++] = 'X';
+      expectedcount++;
+
+      i += 2;
+    } else {
+      expected[expectedlen++] = data[i++];
+    }
+  }
+
+  uint64_t count;
+  if ((ok) &&
+      ((file_model.replace_all("aa", 2, "X", 1, count) !=
+        fs::file_model::operation_result::kSuccess) ||
+       (count != expectedcount) ||
+       (file_model.length() != expectedlen))) {
+    fprintf(stderr,
+            "[Boundary replace] Error replacing (count: %llu, expected: "
+            "%llu).\n",
+            count,
+            expectedcount);
+
+    ok = false;
+  }
+
+  if (ok) {
+    uint64_t l = expectedlen;
+    if ((!file_model.get(0, data, l)) ||
+        (l != expectedlen) ||
+        (memcmp(data, expected, expectedlen) != 0)) {
+      fprintf(stderr, "[Boundary replace] Data is different.\n");
+      ok = false;
+    }
+  }
+
+  file_model.close();
+  unlink(kBoundaryName);
+
+  free(data);
+
+  return ok;
+}
+
+bool perform_dense_replacements()
+{
+  static const uint64_t kDenseLength = 4 * 1024 * 1024;
+  static const char* kDenseName = "file_model.dns";
+  static const char kLine[] = "abcd012345678901234567890";
+  static const uint64_t kLineLength = sizeof(kLine) - 1;
+
+  printf("Undoing dense replacements...\n");
+
+  // An occurrence every kLineLength bytes.
+  uint8_t* data;
+  if ((data = reinterpret_cast<uint8_t*>(malloc(kDenseLength))) == NULL) {
+    fprintf(stderr, "Error allocating memory.\n");
+    return false;
+  }
+
+  for (uint64_t off = 0; off < kDenseLength; off += kLineLength) {
+    uint64_t l = kDenseLength - off;
+    memcpy(data + off, kLine, (l < kLineLength) ? l : kLineLength);
+  }
+
+  fs::file_model file_model;
+  bool ok = create_file_model(kDenseName, data, kDenseLength, file_model);
+
+  free(data);
+
+  if (!ok) {
+    return false;
+  }
+
+  uint64_t len = kDenseLength;
+
+  // The blocks in disk between the occurrences are copied into the memory
+  // blocks, which are rebuilt when the replacements are undone.
+  fs::file_model::fragmentation replaced, undone;
+  uint64_t count;
+  if ((file_model.replace_all("abcd", 4, "xyz", 3, count) !=
+       fs::file_model::operation_result::kSuccess) ||
+      (file_model.length() != len - count)) {
+    fprintf(stderr, "[Dense replace] Error replacing.\n");
+    ok = false;
+  }
+
+  if (ok) {
+    file_model.get_fragmentation(replaced);
+
+    if (file_model.undo() != fs::file_model::operation_result::kSuccess) {
+      fprintf(stderr, "[Dense replace] Error undoing.\n");
+      ok = false;
+    } else {
+      file_model.get_fragmentation(undone);
+
+      // The memory blocks are full.
+      if ((file_model.length() != len) ||
+          (undone.memory_allocated >
+           replaced.memory_allocated + (replaced.memory_allocated / 8))) {
+        fprintf(stderr,
+                "[Dense replace] Too much memory allocated (%llu bytes, "
+                "%llu bytes before undoing).\n",
+                undone.memory_allocated,
+                replaced.memory_allocated);
+
+        ok = false;
+      }
+    }
+  }
+
+  // The data is the original data.
+  for (uint64_t off = 0; (off < len) && (ok); off += kLineLength) {
+    char line[kLineLength];
+    uint64_t l = (len - off < kLineLength) ? len - off : kLineLength;
+    if ((!file_model.get(off, line, l)) ||
+        (memcmp(line, kLine, l) != 0)) {
+      fprintf(stderr, "[Dense replace] Data is different.\n");
+      ok = false;
+    }
+  }
+
+  file_model.close();
+  unlink(kDenseName);
+
+  return ok;
+}
+
+bool perform_indexed_searches(fs::file_model& file_model,
+                              fs::trivial_file_model& trivial_file_model)
+{
+  static const unsigned kNumberSearches = 100;
+  static const uint64_t kModificationSize = 8 * 1024;
+  static const char* kIndexFile = "file_model.idx";
+
+  // If the file is too small...
+  if (trivial_file_model.length() < kModificationSize) {
+    printf("File is too small => no indexed search.\n");
+    return true;
+  }
+
+  printf("Searching with index...\n");
+
+  // Index the file on disk.
+  if (!file_model.save()) {
+    fprintf(stderr, "Error saving file_model.\n");
+    return false;
+  }
+
+  if (!file_model.build_index()) {
+    fprintf(stderr, "Error building index.\n");
+    return false;
+  }
+
+  if ((!perform_indexed_searches(kNumberSearches,
+                                 0,
+                                 trivial_file_model.length(),
+                                 file_model,
+                                 trivial_file_model)) ||
+      (!perform_find_alls(file_model, trivial_file_model))) {
+    return false;
+  }
+
+  // Modify the file (the data in memory is not indexed).
+  uint8_t data[kModificationSize];
+  fill_random_data(data, sizeof(data));
+
+  uint64_t off = random() % (trivial_file_model.length() -
+                             kModificationSize +
+                             1);
+
+  if (!trivial_file_model.modify(off, data, sizeof(data))) {
+    fprintf(stderr, "Error modifying trivial_file_model.\n");
+    return false;
+  }
+
+  fs::file_model::operation_result res;
+  if ((res = file_model.modify(off, data, sizeof(data))) !=
+      fs::file_model::operation_result::kSuccess) {
+    fprintf(stderr,
+            "Error modifying file_model (%s).\n",
+            fs::file_model::operation_result_to_string(res));
+
+    return false;
+  }
+
+  if (!perform_indexed_searches(kNumberSearches,
+                                off,
+                                off + sizeof(data),
+                                file_model,
+                                trivial_file_model)) {
+    return false;
+  }
+
+  // Save the file (the chunks which are overwritten become stale).
+  if (!file_model.save()) {
+    fprintf(stderr, "Error saving file_model.\n");
+    return false;
+  }
+
+  if (!perform_indexed_searches(kNumberSearches,
+                                off,
+                                off + sizeof(data),
+                                file_model,
+                                trivial_file_model)) {
+    return false;
+  }
+
+  // Index the stale chunks and save / load the index.
+  file_model.update_index();
+
+  if (!file_model.save_index(kIndexFile)) {
+    fprintf(stderr, "Error saving index.\n");
+    return false;
+  }
+
+  file_model.free_index();
+
+  if (!file_model.load_index(kIndexFile)) {
+    fprintf(stderr, "Error loading index.\n");
+    return false;
+  }
+
+  unlink(kIndexFile);
+
+  return perform_indexed_searches(kNumberSearches,
+                                  0,
+                                  trivial_file_model.length(),
+                                  file_model,
+                                  trivial_file_model);
+}
+
+bool perform_indexed_searches(unsigned nsearches,
+                              uint64_t begin,
+                              uint64_t end,
+                              const fs::file_model& file_model,
+                              const fs::trivial_file_model& trivial_file_model)
+{
+  static const uint64_t kMaxNeedleLen = 128;
+
+  for (unsigned i = 0; i < nsearches; i++) {
+    uint64_t len = (random() % (kMaxNeedleLen - 2)) + 3;
+    uint64_t pos = begin + (random() % (end - begin));
+
+    if (pos + len > trivial_file_model.length()) {
+      pos = trivial_file_model.length() - len;
+    }
+
+    uint8_t needle[kMaxNeedleLen];
+    if (!trivial_file_model.get(pos, needle, len)) {
+      fprintf(stderr, "Error getting data from the trivial_file_model.\n");
+      return false;
+    }
+
+    if (!perform_search(needle,
+                        len,
+                        direction::kForward,
+                        random() % (pos + 1),
+                        file_model,
+                        trivial_file_model)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool perform_disk_undos(fs::file_model& file_model,
+                        fs::trivial_file_model& trivial_file_model)
+{
+  static const uint64_t kModificationSize = 8 * 1024;
+
+  // If the file is too small...
+  if (trivial_file_model.length() < kModificationSize) {
+    printf("File is too small => no undos of data on disk.\n");
+    return true;
+  }
+
+  printf("Undoing changes of data on disk...\n");
+
+  if (!file_model.save()) {
+    fprintf(stderr, "Error saving file_model.\n");
+    return false;
+  }
+
+  // Remove a big range (the undo record references the file on disk) and
+  // save (the file is replaced).
+  uint64_t len = (random() % (trivial_file_model.length() / 2)) + 1;
+  uint64_t off = random() % (trivial_file_model.length() - len + 1);
+
+  fs::file_model::operation_result res;
+  if ((res = file_model.remove(off, len)) !=
+      fs::file_model::operation_result::kSuccess) {
+    fprintf(stderr,
+            "Error removing from file_model (%s).\n",
+            fs::file_model::operation_result_to_string(res));
+
+    return false;
+  }
+
+  if (!file_model.save()) {
+    fprintf(stderr, "Error saving file_model.\n");
+    return false;
+  }
+
+  if ((res = file_model.undo()) !=
+      fs::file_model::operation_result::kSuccess) {
+    fprintf(stderr,
+            "Error undoing remove (%s).\n",
+            fs::file_model::operation_result_to_string(res));
+
+    return false;
+  }
+
+  if (!equal(file_model, trivial_file_model)) {
+    return false;
+  }
+
+  // Modify a range and save in place (the data on disk referenced by the
+  // undo record is overwritten).
+  if (!file_model.save()) {
+    fprintf(stderr, "Error saving file_model.\n");
+    return false;
+  }
+
+  uint8_t data[kModificationSize];
+  fill_random_data(data, sizeof(data));
+
+  off = random() % (trivial_file_model.length() - kModificationSize + 1);
+
+  if ((res = file_model.modify(off, data, sizeof(data))) !=
+      fs::file_model::operation_result::kSuccess) {
+    fprintf(stderr,
+            "Error modifying file_model (%s).\n",
+            fs::file_model::operation_result_to_string(res));
+
+    return false;
+  }
+
+  if (!file_model.save()) {
+    fprintf(stderr, "Error saving file_model.\n");
+    return false;
+  }
+
+  if ((res = file_model.undo()) !=
+      fs::file_model::operation_result::kSuccess) {
+    fprintf(stderr,
+            "Error undoing modification (%s).\n",
+            fs::file_model::operation_result_to_string(res));
+
+    return false;
+  }
+
+  if (!equal(file_model, trivial_file_model)) {
+    return false;
+  }
+
+  // Redo the modification.
+  if ((res = file_model.redo()) !=
+      fs::file_model::operation_result::kSuccess) {
+    fprintf(stderr,
+            "Error redoing modification (%s).\n",
+            fs::file_model::operation_result_to_string(res));
+
+    return false;
+  }
+
+  if (!trivial_file_model.modify(off, data, sizeof(data))) {
+    fprintf(stderr, "Error modifying trivial_file_model.\n");
+    return false;
+  }
+
+  return equal(file_model, trivial_file_model);
+}
+
+bool perform_spilled_pieces()
+{
+  static const uint64_t kPieceLength = 4 * 1024;
+  static const size_t kNumberChanges = 8;
+  static const size_t kNumberPieces = 4;
+  static const char* kJournalFile = "file_model.spl";
+
+  // Memory used by a change: a piece pointing to the old data, an owned
+  // piece and the array of pieces.
+  static const uint64_t kChangeMemory = (2 * kPieceLength) +
+                                        (kNumberPieces *
+                                         sizeof(fs::file_piece));
+
+  printf("Spilling changes made of pieces...\n");
+
+  // Data referenced by the pieces (as if it was a mapped file).
+  static uint8_t mapped[2 * kPieceLength];
+  fill_random_data(mapped, sizeof(mapped));
+
+  // Expected old data of each change.
+  static uint8_t expected[kNumberChanges][kNumberPieces * kPieceLength];
+
+  fs::file_changes changes;
+  if (!changes.open_journal(kJournalFile, false)) {
+    fprintf(stderr, "Error opening journal %s.\n", kJournalFile);
+    return false;
+  }
+
+  // Spill all the changes but the last one.
+  changes.set_limits(1, 0);
+
+  for (size_t i = 0; i < kNumberChanges; i++) {
+    uint8_t* olddata;
+    uint8_t* owned;
+    fs::file_piece* pieces;
+    if ((olddata = reinterpret_cast<uint8_t*>(malloc(kPieceLength))) == NULL) {
+      fprintf(stderr, "Error allocating memory.\n");
+      return false;
+    }
+
+    if ((owned = reinterpret_cast<uint8_t*>(malloc(kPieceLength))) == NULL) {
+      fprintf(stderr, "Error allocating memory.\n");
+
+      free(olddata);
+      return false;
+    }
+
+    if ((pieces = reinterpret_cast<fs::file_piece*>(
+                    malloc(kNumberPieces * sizeof(fs::file_piece))
+                  )) == NULL) {
+      fprintf(stderr, "Error allocating memory.\n");
+
+      free(owned);
+      free(olddata);
+
+      return false;
+    }
+
+    fill_random_data(olddata, kPieceLength);
+    fill_random_data(owned, kPieceLength);
+
+    // Mapped data, old data, owned data, mapped data.
+    pieces[0].data = mapped;
+    pieces[1].data = olddata;
+    pieces[2].data = owned;
+    pieces[3].data = mapped + kPieceLength;
+
+    for (size_t j = 0; j < kNumberPieces; j++) {
+      pieces[j].len = kPieceLength;
+      pieces[j].owned = (j == 2);
+
+      memcpy(expected[i] + (j * kPieceLength), pieces[j].data, kPieceLength);
+    }
+
+    if (!changes.remove(i * kPieceLength,
+                        olddata,
+                        pieces,
+                        kNumberPieces,
+                        kNumberPieces * kPieceLength)) {
+      fprintf(stderr, "Error registering change.\n");
+
+      free(pieces);
+      free(owned);
+      free(olddata);
+
+      return false;
+    }
+
+    changes.trim();
+  }
+
+  // Only the pieces which reference the mapped data are kept in memory.
+  if ((changes.memory_used() !=
+       kChangeMemory + ((kNumberChanges - 1) *
+                        kNumberPieces *
+                        sizeof(fs::file_piece))) ||
+      (!changes.get(0)->spilled) ||
+      (changes.get(0)->pieces[0].data != mapped)) {
+    fprintf(stderr,
+            "[Spilled pieces] Unexpected memory used: %llu.\n",
+            changes.memory_used());
+
+    return false;
+  }
+
+  // Read the changes back, spill them again and read them back again.
+  for (unsigned pass = 0; pass < 2; pass++) {
+    for (size_t i = 0; i < kNumberChanges; i++) {
+      if (!changes.fetch(i)) {
+        fprintf(stderr, "[Spilled pieces] Error reading change %zu.\n", i);
+        return false;
+      }
+    }
+
+    // The mapped data is not read back as a copy.
+    if (changes.memory_used() != kNumberChanges * kChangeMemory) {
+      fprintf(stderr,
+              "[Spilled pieces] Unexpected memory used: %llu.\n",
+              changes.memory_used());
+
+      return false;
+    }
+
+    if (!check_spilled_pieces(changes,
+                              kNumberChanges,
+                              &expected[0][0],
+                              mapped,
+                              kPieceLength)) {
+      return false;
+    }
+
+    changes.trim();
+  }
+
+  return true;
+}
+
+bool perform_bounded_undos(fs::file_model& file_model,
+                           fs::trivial_file_model& trivial_file_model)
+{
+  static const size_t kNumberChanges = 64;
+  static const uint64_t kModificationSize = 8 * 1024;
+  static const uint64_t kMaxUndoMemory = 64 * 1024;
+  static const size_t kMaxUndoChanges = 4;
+  static const char* kJournalFile = "file_model.jnl";
+  static const char* kChangesFile = "file_model.chg";
+
+  // If the file is too small...
+  if (trivial_file_model.length() < kModificationSize) {
+    printf("File is too small => no bounded undos.\n");
+    return true;
+  }
+
+  printf("Undoing with a bounded history...\n");
+
+  // Data with repetitions (so that it can be compressed).
+  uint8_t data[kNumberChanges][kModificationSize];
+  for (size_t i = 0; i < kNumberChanges; i++) {
+    size_t period = (random() % 64) + 1;
+    fill_random_data(data[i], period);
+
+    for (size_t j = period; j < kModificationSize; j++) {
+      data[i][j] = ((random() % 16) == 0) ? random() : data[i][j - period];
+    }
+
+    uint8_t compressed[kModificationSize + (kModificationSize / 255) + 16];
+    uint8_t decompressed[kModificationSize];
+    uint64_t len = fs::compress(data[i],
+                                kModificationSize,
+                                compressed,
+                                fs::compress_bound(kModificationSize));
+
+    if ((len == 0) ||
+        (!fs::decompress(compressed, len, decompressed, kModificationSize)) ||
+        (memcmp(data[i], decompressed, kModificationSize) != 0)) {
+      fprintf(stderr, "Error compressing / decompressing data.\n");
+      return false;
+    }
+  }
+
+  uint64_t offsets[kNumberChanges];
+  for (size_t i = 0; i < kNumberChanges; i++) {
+    offsets[i] = random() % (trivial_file_model.length() -
+                             kModificationSize +
+                             1);
+  }
+
+  // Spill the oldest changes to the journal.
+  if (!file_model.set_undo_journal(kJournalFile, true)) {
+    fprintf(stderr, "Error opening journal %s.\n", kJournalFile);
+    return false;
+  }
+
+  file_model.set_undo_limits(kMaxUndoMemory, 0);
+
+  for (size_t i = 0; i < kNumberChanges; i++) {
+    if (!modify(offsets[i], data[i], kModificationSize, file_model)) {
+      return false;
+    }
+  }
+
+  // Save changes which have been spilled and load them.
+  fs::file_changes changes;
+  if (!changes.open_journal(kJournalFile, true)) {
+    fprintf(stderr, "Error opening journal %s.\n", kJournalFile);
+    return false;
+  }
+
+  changes.set_limits(kMaxUndoMemory, 0);
+
+  for (size_t i = 0; i < kNumberChanges; i++) {
+    if (!changes.add(offsets[i], data[i], kModificationSize)) {
+      fprintf(stderr, "Error registering change.\n");
+      return false;
+    }
+
+    changes.trim();
+  }
+
+  fs::file_changes loaded;
+  if ((!changes.save(kChangesFile)) || (!loaded.load(kChangesFile))) {
+    fprintf(stderr, "Error saving / loading changes.\n");
+    return false;
+  }
+
+  for (size_t i = 0; i < kNumberChanges; i++) {
+    const fs::file_change* chg = loaded.get(i);
+
+    if ((!chg) ||
+        (chg->off != offsets[i]) ||
+        (chg->len != kModificationSize) ||
+        (memcmp(chg->newdata, data[i], kModificationSize) != 0)) {
+      fprintf(stderr, "Change %zu has not been saved properly.\n", i);
+      return false;
+    }
+  }
+
+  // Undo all the changes (read back from the journal).
+  fs::file_model::operation_result res;
+  for (size_t i = 0; i < kNumberChanges; i++) {
+    if ((res = file_model.undo()) !=
+        fs::file_model::operation_result::kSuccess) {
+      fprintf(stderr,
+              "Error undoing change %zu (%s).\n",
+              kNumberChanges - i,
+              fs::file_model::operation_result_to_string(res));
+
+      return false;
+    }
+  }
+
+  if (!equal(file_model, trivial_file_model)) {
+    return false;
+  }
+
+  // Redo all the changes.
+  for (size_t i = 0; i < kNumberChanges; i++) {
+    if ((res = file_model.redo()) !=
+        fs::file_model::operation_result::kSuccess) {
+      fprintf(stderr,
+              "Error redoing change %zu (%s).\n",
+              i + 1,
+              fs::file_model::operation_result_to_string(res));
+
+      return false;
+    }
+
+    if (!trivial_file_model.modify(offsets[i], data[i], kModificationSize)) {
+      fprintf(stderr, "Error modifying trivial_file_model.\n");
+      return false;
+    }
+  }
+
+  if (!equal(file_model, trivial_file_model)) {
+    return false;
+  }
+
+  // Keep only the last changes.
+  file_model.set_undo_limits(0, kMaxUndoChanges);
+
+  for (size_t i = 0; i < kMaxUndoChanges; i++) {
+    if (!modify(offsets[i], data[i + 1], kModificationSize, file_model)) {
+      return false;
+    }
+
+    if (!trivial_file_model.modify(offsets[i],
+                                   data[i + 1],
+                                   kModificationSize)) {
+      fprintf(stderr, "Error modifying trivial_file_model.\n");
+      return false;
+    }
+  }
+
+  for (size_t i = 0; i < kMaxUndoChanges; i++) {
+    if (!modify(offsets[i], data[i + 2], kModificationSize, file_model)) {
+      return false;
+    }
+  }
+
+  for (size_t i = 0; i < kMaxUndoChanges; i++) {
+    if ((res = file_model.undo()) !=
+        fs::file_model::operation_result::kSuccess) {
+      fprintf(stderr,
+              "Error undoing change (%s).\n",
+              fs::file_model::operation_result_to_string(res));
+
+      return false;
+    }
+  }
+
+  if ((res = file_model.undo()) !=
+      fs::file_model::operation_result::kNoMoreChanges) {
+    fprintf(stderr,
+            "Undo beyond the limit of the history (%s).\n",
+            fs::file_model::operation_result_to_string(res));
+
+    return false;
+  }
+
+  file_model.set_undo_limits(0, 0);
+
+  unlink(kChangesFile);
+
+  return equal(file_model, trivial_file_model);
+}
+
+bool perform_coalesced_undos(fs::file_model& file_model,
+                             fs::trivial_file_model& trivial_file_model)
+{
+  static const uint64_t kMaxCoalesced = 1024;
+  static const uint64_t kMinFileSize = 1024;
+  static const size_t kNumberSteps = 4;
+
+  // If the file is too small...
+  if (trivial_file_model.length() < kMinFileSize) {
+    printf("File is too small => no coalesced undos.\n");
+    return true;
+  }
+
+  printf("Undoing coalesced changes...\n");
+
+  uint8_t data[kTypedBytes + kModifiedBytes];
+  fill_random_data(data, sizeof(data));
+
+  uint64_t offsets[3];
+  offsets[0] = random() % (trivial_file_model.length() - kTypedBytes + 1);
+  offsets[1] = random() % (trivial_file_model.length() - kModifiedBytes + 1);
+  offsets[2] = random() % (trivial_file_model.length() - kDeletedBytes + 1);
+
+  // Each kind of edit is recorded as a single change.
+  file_model.set_undo_coalescing(kMaxCoalesced, 0);
+
+  if (!perform_edits(data, offsets, &file_model, NULL)) {
+    return false;
+  }
+
+  file_model.set_undo_coalescing(0, 0);
+
+  fs::file_model::operation_result res;
+  for (size_t i = 0; i < kNumberSteps; i++) {
+    if ((res = file_model.undo()) !=
+        fs::file_model::operation_result::kSuccess) {
+      fprintf(stderr,
+              "Error undoing coalesced change (%s).\n",
+              fs::file_model::operation_result_to_string(res));
+
+      return false;
+    }
+
+    // The bytes typed are only removed by the last undo.
+    if ((i + 1 < kNumberSteps) &&
+        (file_model.length() == trivial_file_model.length())) {
+      fprintf(stderr, "The changes have not been coalesced.\n");
+      return false;
+    }
+  }
+
+  if (!equal(file_model, trivial_file_model)) {
+    return false;
+  }
+
+  for (size_t i = 0; i < kNumberSteps; i++) {
+    if ((res = file_model.redo()) !=
+        fs::file_model::operation_result::kSuccess) {
+      fprintf(stderr,
+              "Error redoing coalesced change (%s).\n",
+              fs::file_model::operation_result_to_string(res));
+
+      return false;
+    }
+  }
+
+  return ((perform_edits(data, offsets, NULL, &trivial_file_model)) &&
+          (equal(file_model, trivial_file_model)));
+}
+
+bool perform_batch(fs::file_model& file_model,
+                   fs::trivial_file_model& trivial_file_model)
+{
+  static const size_t kNumberEdits = 32;
+  static const uint64_t kMaxEditLen = 256;
+
+  // Size of the region of each edit.
+  uint64_t region = trivial_file_model.length() / kNumberEdits;
+
+  // If the file is too small...
+  if (region < 2 * kMaxEditLen) {
+    printf("File is too small => no batch.\n");
+    return true;
+  }
+
+  printf("Performing batch...\n");
+
+  uint8_t data[kNumberEdits * kMaxEditLen];
+  fill_random_data(data, sizeof(data));
+
+  // Edits (0: modify, 1: add, 2: remove).
+  int types[kNumberEdits];
+  uint64_t offsets[kNumberEdits];
+  uint64_t lengths[kNumberEdits];
+
+  for (size_t i = 0; i < kNumberEdits; i++) {
+    types[i] = random() % 3;
+    offsets[i] = (i * region) + (random() % (region - kMaxEditLen));
+    lengths[i] = 1 + (random() % kMaxEditLen);
+  }
+
+  fs::file_model::operation_result res;
+
+  // Discard a batch.
+  if (((res = file_model.begin_batch()) !=
+       fs::file_model::operation_result::kSuccess) ||
+      ((res = file_model.remove(offsets[0], lengths[0])) !=
+       fs::file_model::operation_result::kSuccess)) {
+    fprintf(stderr,
+            "Error staging edit (%s).\n",
+            fs::file_model::operation_result_to_string(res));
+
+    return false;
+  }
+
+  file_model.rollback();
+
+  if (!equal(file_model, trivial_file_model)) {
+    return false;
+  }
+
+  if ((res = file_model.begin_batch()) !=
+      fs::file_model::operation_result::kSuccess) {
+    fprintf(stderr,
+            "Error beginning batch (%s).\n",
+            fs::file_model::operation_result_to_string(res));
+
+    return false;
+  }
+
+  // Stage the edits from the end (they are sorted by the commit).
+  for (size_t i = kNumberEdits; i > 0; i--) {
+    uint64_t off = offsets[i - 1];
+    uint64_t len = lengths[i - 1];
+    const uint8_t* d = data + ((i - 1) * kMaxEditLen);
+
+    switch (types[i - 1]) {
+      case 0:
+        res = file_model.modify(off, d, len);
+        break;
+      case 1:
+        res = file_model.add(off, d, len);
+        break;
+      default:
+        res = file_model.remove(off, len);
+    }
+
+    if (res != fs::file_model::operation_result::kSuccess) {
+      fprintf(stderr,
+              "Error staging edit (%s).\n",
+              fs::file_model::operation_result_to_string(res));
+
+      file_model.rollback();
+
+      return false;
+    }
+  }
+
+  if ((res = file_model.commit()) !=
+      fs::file_model::operation_result::kSuccess) {
+    fprintf(stderr,
+            "Error committing batch (%s).\n",
+            fs::file_model::operation_result_to_string(res));
+
+    return false;
+  }
+
+  // The batch is undone in a single step.
+  if ((res = file_model.undo()) !=
+      fs::file_model::operation_result::kSuccess) {
+    fprintf(stderr,
+            "Error undoing batch (%s).\n",
+            fs::file_model::operation_result_to_string(res));
+
+    return false;
+  }
+
+  if (!equal(file_model, trivial_file_model)) {
+    return false;
+  }
+
+  if ((res = file_model.redo()) !=
+      fs::file_model::operation_result::kSuccess) {
+    fprintf(stderr,
+            "Error redoing batch (%s).\n",
+            fs::file_model::operation_result_to_string(res));
+
+    return false;
+  }
+
+  // Perform the edits from the end.
+  for (size_t i = kNumberEdits; i > 0; i--) {
+    uint64_t off = offsets[i - 1];
+    uint64_t len = lengths[i - 1];
+    const uint8_t* d = data + ((i - 1) * kMaxEditLen);
+
+    bool ok;
+    switch (types[i - 1]) {
+      case 0:
+        ok = trivial_file_model.modify(off, d, len);
+        break;
+      case 1:
+        ok = trivial_file_model.add(off, d, len);
+        break;
+      default:
+        ok = trivial_file_model.remove(off, len);
+    }
+
+    if (!ok) {
+      fprintf(stderr, "Error editing trivial_file_model.\n");
+      return false;
+    }
+  }
+
+  if (!equal(file_model, trivial_file_model)) {
+    return false;
+  }
+
+  // Batch made only of removals (no new data).
+  if ((region = trivial_file_model.length() / kNumberEdits) <= kMaxEditLen) {
+    return true;
+  }
+
+  if ((res = file_model.begin_batch()) !=
+      fs::file_model::operation_result::kSuccess) {
+    fprintf(stderr,
+            "Error beginning batch (%s).\n",
+            fs::file_model::operation_result_to_string(res));
+
+    return false;
+  }
+
+  for (size_t i = kNumberEdits; i > 0; i--) {
+    if ((res = file_model.remove((i - 1) * region, lengths[i - 1])) !=
+        fs::file_model::operation_result::kSuccess) {
+      fprintf(stderr,
+              "Error staging removal (%s).\n",
+              fs::file_model::operation_result_to_string(res));
+
+      file_model.rollback();
+
+      return false;
+    }
+  }
+
+  if (((res = file_model.commit()) !=
+       fs::file_model::operation_result::kSuccess) ||
+      ((res = file_model.undo()) !=
+       fs::file_model::operation_result::kSuccess)) {
+    fprintf(stderr,
+            "Error committing / undoing removals (%s).\n",
+            fs::file_model::operation_result_to_string(res));
+
+    return false;
+  }
+
+  if (!equal(file_model, trivial_file_model)) {
+    return false;
+  }
+
+  if ((res = file_model.redo()) !=
+      fs::file_model::operation_result::kSuccess) {
+    fprintf(stderr,
+            "Error redoing removals (%s).\n",
+            fs::file_model::operation_result_to_string(res));
+
+    return false;
+  }
+
+  for (size_t i = kNumberEdits; i > 0; i--) {
+    if (!trivial_file_model.remove((i - 1) * region, lengths[i - 1])) {
+      fprintf(stderr, "Error editing trivial_file_model.\n");
+      return false;
+    }
+  }
+
+  return equal(file_model, trivial_file_model);
+}
+
+bool perform_script(fs::file_model& file_model,
+                    fs::trivial_file_model& trivial_file_model)
+{
+  static const unsigned kNumberChanges = 200;
+
+  printf("Applying script...\n");
+
+  fs::file_changes script;
+  if (!generate_script(trivial_file_model.length(), kNumberChanges, script)) {
+    return false;
+  }
+
+  fs::file_model::operation_result res;
+  if ((res = file_model.apply(script)) !=
+      fs::file_model::operation_result::kSuccess) {
+    fprintf(stderr,
+            "Error applying script (%s).\n",
+            fs::file_model::operation_result_to_string(res));
+
+    return false;
+  }
+
+  // The script is undone in a single step.
+  if ((res = file_model.undo()) !=
+      fs::file_model::operation_result::kSuccess) {
+    fprintf(stderr,
+            "Error undoing script (%s).\n",
+            fs::file_model::operation_result_to_string(res));
+
+    return false;
+  }
+
+  if (!equal(file_model, trivial_file_model)) {
+    return false;
+  }
+
+  if ((res = file_model.redo()) !=
+      fs::file_model::operation_result::kSuccess) {
+    fprintf(stderr,
+            "Error redoing script (%s).\n",
+            fs::file_model::operation_result_to_string(res));
+
+    return false;
+  }
+
+  // Perform the changes one after the other.
+  return ((perform_script_changes(script,
+                                  0,
+                                  script.size(),
+                                  NULL,
+                                  &trivial_file_model)) &&
+          (equal(file_model, trivial_file_model)));
+}
+
+bool generate_script(uint64_t filesize,
+                     unsigned nchanges,
+                     fs::file_changes& script)
+{
+  static const size_t kMaxChangeSize = 4 * 1024;
+
+  // Generate random changes.
+  while (script.size() < nchanges) {
+    uint64_t len = random() % (kMaxChangeSize + 1);
+    uint64_t off = (filesize > 0) ? random() % filesize : 0;
+
+    uint8_t buf[kMaxChangeSize];
+    fill_random_data(buf, len);
+
+    bool ok;
+    switch (random() % 3) {
+      case 0: // Modify.
+        if (off + len > filesize) {
+          len = filesize - off;
+        }
+
+        ok = script.modify(off, NULL, buf, len);
+        break;
+      case 1: // Add.
+        ok = script.add(off, buf, len);
+        filesize += len;
+
+        break;
+      default: // Remove.
+        if (off + len > filesize) {
+          len = filesize - off;
+        }
+
+        ok = script.remove(off, NULL, len);
+        filesize -= len;
+    }
+
+    if (!ok) {
+      fprintf(stderr, "Error recording change.\n");
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool perform_script_changes(const fs::file_changes& script,
+                            size_t first,
+                            size_t last,
+                            fs::file_model* file_model,
+                            fs::trivial_file_model* trivial_file_model)
+{
+  fs::file_model::operation_result res =
+    fs::file_model::operation_result::kSuccess;
+  bool ok = true;
+
+  for (size_t i = first; (ok) && (i < last); i++) {
+    const fs::file_change* change = script.get(i);
+
+    switch (change->t) {
+      case fs::file_change::type::kModify:
+        if (file_model) {
+          ok = ((res = file_model->modify(change->off,
+                                          change->newdata,
+                                          change->len)) ==
+                fs::file_model::operation_result::kSuccess);
+        } else {
+          ok = trivial_file_model->modify(change->off,
+                                          change->newdata,
+                                          change->len);
+        }
+
+        break;
+      case fs::file_change::type::kAdd:
+        if (file_model) {
+          ok = ((res = file_model->add(change->off,
+                                       change->newdata,
+                                       change->len)) ==
+                fs::file_model::operation_result::kSuccess);
+        } else {
+          ok = trivial_file_model->add(change->off,
+                                       change->newdata,
+                                       change->len);
+        }
+
+        break;
+      default:
+        if (file_model) {
+          ok = ((res = file_model->remove(change->off, change->len)) ==
+                fs::file_model::operation_result::kSuccess);
+        } else {
+          ok = trivial_file_model->remove(change->off, change->len);
+        }
+    }
+  }
+
+  if (!ok) {
+    if (file_model) {
+      fprintf(stderr,
+              "Error editing file_model (%s).\n",
+              fs::file_model::operation_result_to_string(res));
+    } else {
+      fprintf(stderr, "Error editing trivial_file_model.\n");
+    }
+
+    return false;
+  }
+
+  return true;
+}
+
+bool perform_revisions(fs::file_model& file_model,
+                       fs::trivial_file_model& trivial_file_model)
+{
+  static const unsigned kNumberChanges = 50;
+
+  printf("Going to other revisions...\n");
+
+  // The file on disk is the first revision.
+  if (!file_model.save()) {
+    fprintf(stderr, "Error saving file_model.\n");
+    return false;
+  }
+
+  size_t first = file_model.revision();
+
+  fs::file_changes script;
+  if ((!generate_script(trivial_file_model.length(), kNumberChanges, script)) ||
+      (!perform_script_changes(script,
+                               0,
+                               script.size(),
+                               &file_model,
+                               NULL))) {
+    return false;
+  }
+
+  if (file_model.revision() != first + script.size()) {
+    fprintf(stderr, "The changes have not been recorded.\n");
+    return false;
+  }
+
+  size_t mid = 1 + (random() % (script.size() - 1));
+
+  // Undo the last changes.
+  fs::file_model::operation_result res;
+  if ((res = file_model.goto_revision(first + mid)) !=
+      fs::file_model::operation_result::kSuccess) {
+    fprintf(stderr,
+            "Error going to revision %zu (%s).\n",
+            first + mid,
+            fs::file_model::operation_result_to_string(res));
+
+    return false;
+  }
+
+  fs::trivial_file_model disk;
+  if (!disk.open(kFileModelName)) {
+    fprintf(stderr, "Error opening file %s.\n", kFileModelName);
+    return false;
+  }
+
+  if ((!perform_script_changes(script, 0, mid, NULL, &trivial_file_model)) ||
+      (!equal(file_model, trivial_file_model))) {
+    return false;
+  }
+
+  // Revert to the file on disk.
+  if ((res = file_model.goto_revision(first)) !=
+      fs::file_model::operation_result::kSuccess) {
+    fprintf(stderr,
+            "Error reverting file_model (%s).\n",
+            fs::file_model::operation_result_to_string(res));
+
+    return false;
+  }
+
+  if ((file_model.modified()) || (!equal(file_model, disk))) {
+    fprintf(stderr, "file_model has not been reverted.\n");
+    return false;
+  }
+
+  // Redo all the changes.
+  if ((res = file_model.goto_revision(first + script.size())) !=
+      fs::file_model::operation_result::kSuccess) {
+    fprintf(stderr,
+            "Error going to revision %zu (%s).\n",
+            first + script.size(),
+            fs::file_model::operation_result_to_string(res));
+
+    return false;
+  }
+
+  return ((perform_script_changes(script,
+                                  mid,
+                                  script.size(),
+                                  NULL,
+                                  &trivial_file_model)) &&
+          (equal(file_model, trivial_file_model)));
+}
+
+bool perform_session_recovery(fs::file_model& file_model,
+                              fs::trivial_file_model& trivial_file_model)
+{
+  static const unsigned kNumberChanges = 100;
+  static const char* kJournalFile = "file_model.bin.journal";
+
+  printf("Recovering session...\n");
+
+  // The file on disk is the starting point of the session.
+  if (!file_model.save()) {
+    fprintf(stderr, "Error saving file_model.\n");
+    return false;
+  }
+
+  fs::file_changes script;
+  if (!generate_script(trivial_file_model.length(), kNumberChanges, script)) {
+    return false;
+  }
+
+  size_t mid = 1 + (random() % (script.size() - 1));
+
+  // The session is interrupted: the child process exits without closing
+  // the file.
+  pid_t pid;
+  if ((pid = fork()) < 0) {
+    fprintf(stderr, "Error creating process.\n");
+    return false;
+  }
+
+  if (pid == 0) {
+    fs::file_model session;
+    session.set_session_journal(true);
+
+    bool ok = ((session.open(kFileModelName)) &&
+               (perform_script_changes(script,
+                                       0,
+                                       script.size(),
+                                       &session,
+                                       NULL)) &&
+               (session.goto_revision(mid) ==
+                fs::file_model::operation_result::kSuccess) &&
+               (session.sync_session_journal()));
+
+    _exit(ok ? 0 : 1);
+  }
+
+  int status;
+  if ((waitpid(pid, &status, 0) != pid) ||
+      (!WIFEXITED(status)) ||
+      (WEXITSTATUS(status) != 0)) {
+    fprintf(stderr, "Error running the session.\n");
+    return false;
+  }
+
+  // Append a torn record.
+  FILE* file;
+  if ((file = fopen(kJournalFile, "ab")) == NULL) {
+    fprintf(stderr, "Error opening file %s.\n", kJournalFile);
+    return false;
+  }
+
+  uint8_t buf[fs::session_journal::kRecordHeaderSize / 2];
+  fill_random_data(buf, sizeof(buf));
+
+  if (fwrite(buf, 1, sizeof(buf), file) != sizeof(buf)) {
+    fclose(file);
+
+    fprintf(stderr, "Error writing file %s.\n", kJournalFile);
+    return false;
+  }
+
+  fclose(file);
+
+  fs::file_model recovered;
+  recovered.set_session_journal(true);
+
+  if ((!recovered.open(kFileModelName)) || (!recovered.recovered())) {
+    fprintf(stderr, "The session has not been recovered.\n");
+    return false;
+  }
+
+  if ((!perform_script_changes(script, 0, mid, &file_model, NULL)) ||
+      (!perform_script_changes(script, 0, mid, NULL, &trivial_file_model)) ||
+      (!equal(file_model, trivial_file_model)) ||
+      (!equal(recovered, trivial_file_model))) {
+    return false;
+  }
+
+  // The file on disk is not in the history of the recovered session.
+  fs::file_model::operation_result res;
+  if (((res = recovered.revert()) !=
+       fs::file_model::operation_result::kSuccess) ||
+      (recovered.modified())) {
+    fprintf(stderr,
+            "Error reverting the recovered session (%s).\n",
+            fs::file_model::operation_result_to_string(res));
+
+    return false;
+  }
+
+  // The journal is removed when the file is closed.
+  recovered.close();
+
+  if (access(kJournalFile, F_OK) == 0) {
+    fprintf(stderr, "The journal %s has not been removed.\n", kJournalFile);
+    return false;
+  }
+
+  return true;
+}
+
+bool perform_dirty_ranges(fs::file_model& file_model,
+                          fs::trivial_file_model& trivial_file_model)
+{
+  static const unsigned kNumberChanges = 100;
+  static const size_t kReadBufferSize = 4 * 1024;
+
+  printf("Enumerating dirty ranges...\n");
+
+  // The file on disk is the reference.
+  if (!file_model.save()) {
+    fprintf(stderr, "Error saving file_model.\n");
+    return false;
+  }
+
+  fs::trivial_file_model disk;
+  if (!disk.open(kFileModelName)) {
+    fprintf(stderr, "Error opening file %s.\n", kFileModelName);
+    return false;
+  }
+
+  // Events of the change feed (3 values per event).
+  struct positions events;
+  events.positions = NULL;
+  events.npositions = 0;
+  events.size = 0;
+  events.max = SIZE_MAX;
+
+  fs::change_feed feed;
+  if (!feed.create(file_model, add_event, &events)) {
+    fprintf(stderr, "Error creating change feed.\n");
+    return false;
+  }
+
+  fs::file_changes script;
+  if ((!generate_script(trivial_file_model.length(), kNumberChanges, script)) ||
+      (!perform_script_changes(script,
+                               0,
+                               script.size(),
+                               &file_model,
+                               NULL)) ||
+      (!perform_script_changes(script,
+                               0,
+                               script.size(),
+                               NULL,
+                               &trivial_file_model))) {
+    free(events.positions);
+    return false;
+  }
+
+  // Type: the additions are merged into a single event.
+  feed.flush();
+  size_t nevents = events.npositions;
+
+  uint64_t off = random() % (trivial_file_model.length() + 1);
+  for (uint64_t i = 0; i < kTypedBytes; i++) {
+    uint8_t c = 'a' + (random() % 26);
+
+    if ((file_model.add(off + i, &c, 1) !=
+         fs::file_model::operation_result::kSuccess) ||
+        (!trivial_file_model.add(off + i, &c, 1))) {
+      fprintf(stderr, "Error typing.\n");
+
+      free(events.positions);
+      return false;
+    }
+  }
+
+  feed.clear();
+
+  if (events.npositions != nevents + 3) {
+    fprintf(stderr, "The typed bytes have not been merged.\n");
+
+    free(events.positions);
+    return false;
+  }
+
+  // Replay the events over the file on disk: the bytes which are not in a
+  // changed range must be those of the file on disk.
+  uint64_t len = disk.length();
+  uint64_t size = len + 1;
+
+  uint8_t* data = reinterpret_cast<uint8_t*>(malloc(size));
+  uint8_t* known = reinterpret_cast<uint8_t*>(malloc(size));
+
+  if ((!data) || (!known) || (!disk.get(0, data, len))) {
+    fprintf(stderr, "Error getting data from the trivial_file_model.\n");
+
+    free(data);
+    free(known);
+    free(events.positions);
+
+    return false;
+  }
+
+  memset(known, 1, len);
+
+  bool ok = true;
+
+  for (size_t i = 0; (ok) && (i < events.npositions); i += 3) {
+    uint64_t o = events.positions[i];
+    uint64_t oldlen = events.positions[i + 1];
+    uint64_t newlen = events.positions[i + 2];
+
+    if ((o > len) || (oldlen > len - o)) {
+      fprintf(stderr, "Wrong event (offset: %llu).\n", o);
+      ok = false;
+
+      break;
+    }
+
+    if (len - oldlen + newlen > size) {
+      size = (len - oldlen + newlen) * 2;
+
+      uint8_t* p;
+      if ((p = reinterpret_cast<uint8_t*>(realloc(data, size))) == NULL) {
+        fprintf(stderr, "Error allocating memory.\n");
+        ok = false;
+
+        break;
+      }
+
+      data = p;
+
+      if ((p = reinterpret_cast<uint8_t*>(realloc(known, size))) == NULL) {
+        fprintf(stderr, "Error allocating memory.\n");
+        ok = false;
+
+        break;
+      }
+
+      known = p;
+    }
+
+    memmove(data + o + newlen, data + o + oldlen, len - o - oldlen);
+    memmove(known + o + newlen, known + o + oldlen, len - o - oldlen);
+    memset(known + o, 0, newlen);
+
+    len = len - oldlen + newlen;
+  }
+
+  if ((ok) && (len != trivial_file_model.length())) {
+    fprintf(stderr,
+            "Wrong length after the events (%llu instead of %llu).\n",
+            len,
+            trivial_file_model.length());
+
+    ok = false;
+  }
+
+  for (uint64_t o = 0; (ok) && (o < len); o += kReadBufferSize) {
+    uint8_t buf[kReadBufferSize];
+    uint64_t l = kReadBufferSize;
+    if (!trivial_file_model.get(o, buf, l)) {
+      fprintf(stderr, "Error getting data from the trivial_file_model.\n");
+      ok = false;
+
+      break;
+    }
+
+    for (uint64_t j = 0; j < l; j++) {
+      if ((known[o + j]) && (data[o + j] != buf[j])) {
+        fprintf(stderr, "Change at offset %llu not reported.\n", o + j);
+        ok = false;
+
+        break;
+      }
+    }
+  }
+
+  free(data);
+  free(known);
+  free(events.positions);
+
+  if (!ok) {
+    return false;
+  }
+
+  // Dirty ranges (4 values per range).
+  struct positions ranges;
+  ranges.positions = NULL;
+  ranges.npositions = 0;
+  ranges.size = 0;
+  ranges.max = SIZE_MAX;
+
+  if (!file_model.dirty_ranges(add_dirty_range, &ranges)) {
+    fprintf(stderr, "Error enumerating dirty ranges.\n");
+
+    free(ranges.positions);
+    return false;
+  }
+
+  // Rebuild the file from the file on disk (from the last range: the
+  // offsets of the file on disk don't move).
+  for (size_t i = ranges.npositions; (ok) && (i > 0); i -= 4) {
+    const uint64_t* r = ranges.positions + i - 4;
+
+    uint8_t* buf = NULL;
+    uint64_t l = r[1];
+
+    ok = (((l == 0) ||
+           (((buf = reinterpret_cast<uint8_t*>(malloc(l))) != NULL) &&
+            (file_model.get(r[0], buf, l)) &&
+            (l == r[1]))) &&
+          (disk.remove(r[2], r[3])) &&
+          (disk.add(r[2], buf, l)));
+
+    free(buf);
+  }
+
+  free(ranges.positions);
+
+  if (!ok) {
+    fprintf(stderr, "Error applying dirty ranges.\n");
+    return false;
+  }
+
+  return ((equal(file_model, disk)) &&
+          (equal(file_model, trivial_file_model)));
+}
+
+bool add_dirty_range(const fs::file_model::dirty_range& range, void* arg)
+{
+  return ((add_position(range.off, arg)) &&
+          (add_position(range.len, arg)) &&
+          (add_position(range.diskoff, arg)) &&
+          (add_position(range.disklen, arg)));
+}
+
+void add_event(uint64_t off, uint64_t oldlen, uint64_t newlen, void* arg)
+{
+  add_position(off, arg);
+  add_position(oldlen, arg);
+  add_position(newlen, arg);
+}
+
+// perform_concurrent_access(): the file is made of chunks of equal bytes.
+static const uint64_t kChunkSize = 64;
+
+// Reader thread of perform_concurrent_access().
+struct concurrent_reader_context {
+  const fs::file_model* file_model;
+
+  // Length of the file and sum of the first byte of every chunk.
+  uint64_t length;
+  uint64_t sum;
+
+  unsigned seed;
+
+  // Number of reads.
+  uint64_t nreads;
+
+  // Have the reads been consistent?
+  bool ok;
+
+  const std::atomic<bool>* done;
+};
+
+bool perform_concurrent_access()
+{
+  static const char* files[] = {"file_model.rw", "trivial_file_model.rw"};
+  static const unsigned kNumberChunks = 4 * 1024;
+  static const unsigned kNumberReaders = 8;
+  static const unsigned kNumberWrites = 5000;
+  static const uint64_t kFileLength = kNumberChunks * kChunkSize;
+
+  printf("Reading concurrently...\n");
+
+  // Generate files.
+  uint8_t* data;
+  if ((data = reinterpret_cast<uint8_t*>(malloc(kFileLength))) == NULL) {
+    fprintf(stderr, "Error allocating memory.\n");
+    return false;
+  }
+
+  for (unsigned i = 0; i < kNumberChunks; i++) {
+    memset(data + (i * kChunkSize), i, kChunkSize);
+  }
+
+  fs::file_model file_model;
+  file_model.set_concurrent(true);
+
+  bool ok = ((write_file(files[1], data, kFileLength)) &&
+             (create_file_model(files[0], data, kFileLength, file_model)));
+
+  free(data);
+
+  fs::trivial_file_model trivial_file_model;
+
+  if ((!ok) || (!trivial_file_model.open(files[1]))) {
+    fprintf(stderr, "Error opening files.\n");
+
+    unlink(files[1]);
+    return false;
+  }
+
+  uint64_t sum = 0;
+  for (unsigned i = 0; i < kNumberChunks; i++) {
+    sum += static_cast<uint8_t>(i);
+  }
+
+  std::atomic<bool> done(false);
+
+  struct concurrent_reader_context contexts[kNumberReaders];
+  pthread_t threads[kNumberReaders];
+  unsigned nthreads = 0;
+
+  for (; nthreads < kNumberReaders; nthreads++) {
+    struct concurrent_reader_context* ctx = &contexts[nthreads];
+    ctx->file_model = &file_model;
+    ctx->length = kFileLength;
+    ctx->sum = sum;
+    ctx->seed = random();
+    ctx->nreads = 0;
+    ctx->ok = true;
+    ctx->done = &done;
+
+    if (pthread_create(&threads[nthreads], NULL, concurrent_reader, ctx) != 0) {
+      fprintf(stderr, "Error creating thread.\n");
+      break;
+    }
+  }
+
+  // Write: move whole chunks (a chunk is removed and added somewhere else
+  // in a single batch, the length and the sum of the bytes don't change).
+  uint8_t chunk[kChunkSize];
+
+  ok = (nthreads == kNumberReaders);
+
+  for (unsigned i = 0; (ok) && (i < kNumberWrites); i++) {
+    uint64_t from = (random() % kNumberChunks) * kChunkSize;
+    uint64_t to = (random() % (kNumberChunks + 1)) * kChunkSize;
+    if (to == from) {
+      continue;
+    }
+
+    uint64_t len = kChunkSize;
+    if ((!trivial_file_model.get(from, chunk, len)) || (len != kChunkSize)) {
+      fprintf(stderr, "Error reading chunk.\n");
+
+      ok = false;
+      break;
+    }
+
+    fs::file_model::operation_result res;
+    if (((res = file_model.begin_batch()) !=
+         fs::file_model::operation_result::kSuccess) ||
+        ((res = file_model.remove(from, kChunkSize)) !=
+         fs::file_model::operation_result::kSuccess) ||
+        ((res = file_model.add(to, chunk, kChunkSize)) !=
+         fs::file_model::operation_result::kSuccess) ||
+        ((res = file_model.commit()) !=
+         fs::file_model::operation_result::kSuccess)) {
+      fprintf(stderr,
+              "Error moving chunk (%s).\n",
+              fs::file_model::operation_result_to_string(res));
+
+      ok = false;
+      break;
+    }
+
+    if (to > from) {
+      ok = ((trivial_file_model.add(to, chunk, kChunkSize)) &&
+            (trivial_file_model.remove(from, kChunkSize)));
+    } else {
+      ok = ((trivial_file_model.remove(from, kChunkSize)) &&
+            (trivial_file_model.add(to, chunk, kChunkSize)));
+    }
+  }
+
+  done = true;
+
+  uint64_t nreads = 0;
+
+  for (unsigned i = 0; i < nthreads; i++) {
+    pthread_join(threads[i], NULL);
+
+    if (!contexts[i].ok) {
+      fprintf(stderr, "A reader has seen an inconsistent file.\n");
+      ok = false;
+    }
+
+    nreads += contexts[i].nreads;
+  }
+
+  if (ok) {
+    printf("  %llu reads.\n", nreads);
+
+    ok = equal(file_model, trivial_file_model);
+  }
+
+  file_model.close();
+
+  unlink(files[0]);
+  unlink(files[1]);
+
+  return ok;
+}
+
+void* concurrent_reader(void* arg)
+{
+  struct concurrent_reader_context* ctx =
+    reinterpret_cast<struct concurrent_reader_context*>(arg);
+
+  uint64_t size = ctx->length;
+
+  uint8_t* buf;
+  if ((buf = reinterpret_cast<uint8_t*>(malloc(size))) == NULL) {
+    ctx->ok = false;
+    return NULL;
+  }
+
+  while ((ctx->ok) && (!*ctx->done)) {
+    if (rand_r(&ctx->seed) % 2 == 0) {
+      // Read the whole file: the length and the sum of the bytes don't
+      // change and every chunk is made of equal bytes.
+      uint64_t len = size;
+      if ((!ctx->file_model->get(0, buf, len)) || (len != size)) {
+        ctx->ok = false;
+        break;
+      }
+
+      uint64_t sum = 0;
+      for (uint64_t off = 0; off < len; off += kChunkSize) {
+        for (uint64_t i = 1; i < kChunkSize; i++) {
+          if (buf[off + i] != buf[off]) {
+            ctx->ok = false;
+            break;
+          }
+        }
+
+        sum += buf[off];
+      }
+
+      if (sum != ctx->sum) {
+        ctx->ok = false;
+      }
+    } else {
+      // Search a chunk.
+      uint64_t off = (rand_r(&ctx->seed) % (size / kChunkSize)) * kChunkSize;
+
+      uint8_t chunk[kChunkSize];
+      memset(chunk, rand_r(&ctx->seed), kChunkSize);
+
+      uint64_t position;
+      ctx->file_model->find(off,
+                            direction::kBackward,
+                            chunk,
+                            kChunkSize,
+                            position);
+    }
+
+    ctx->nreads++;
+  }
+
+  free(buf);
+
+  return NULL;
+}
+
+bool perform_forks(fs::file_model& file_model,
+                   fs::trivial_file_model& trivial_file_model)
+{
+  static const unsigned kNumberChanges = 100;
+  static const char* kSnapshotName = "trivial_file_model.snp";
+  static const char* kForkName = "trivial_file_model.frk";
+
+  printf("Forking...\n");
+
+  // Edit the file (the blocks in memory are shared with the forks).
+  fs::file_changes script;
+  if ((!file_model.save()) ||
+      (!generate_script(trivial_file_model.length(), kNumberChanges, script)) ||
+      (!perform_script_changes(script,
+                               0,
+                               script.size(),
+                               &file_model,
+                               NULL)) ||
+      (!perform_script_changes(script,
+                               0,
+                               script.size(),
+                               NULL,
+                               &trivial_file_model))) {
+    return false;
+  }
+
+  fs::file_model snapshot;
+  fs::file_model fork;
+  fs::trivial_file_model trivial_snapshot;
+  fs::trivial_file_model trivial_fork;
+
+  if ((!file_model.snapshot(snapshot)) ||
+      (!file_model.fork(fork)) ||
+      (!fs::copy(kTrivialFileModelName, kSnapshotName)) ||
+      (!fs::copy(kTrivialFileModelName, kForkName)) ||
+      (!trivial_snapshot.open(kSnapshotName)) ||
+      (!trivial_fork.open(kForkName))) {
+    fprintf(stderr, "Error forking.\n");
+    return false;
+  }
+
+  // The shared buffers are charged to the file model.
+  uint8_t c = 0;
+  if ((!snapshot.read_only()) ||
+      (snapshot.modify(0, &c, 1) !=
+       fs::file_model::operation_result::kErrorReadOnly) ||
+      (snapshot.memory_used() != 0) ||
+      (fork.memory_used() != 0) ||
+      (!fork.modified()) ||
+      (fork.revisions() != 0)) {
+    fprintf(stderr, "Invalid fork.\n");
+    return false;
+  }
+
+  // Edit the file model and the fork.
+  fs::file_changes script1, script2;
+  if ((!generate_script(trivial_file_model.length(), kNumberChanges, script1)) ||
+      (!generate_script(trivial_fork.length(), kNumberChanges, script2)) ||
+      (!perform_script_changes(script1,
+                               0,
+                               script1.size(),
+                               &file_model,
+                               NULL)) ||
+      (!perform_script_changes(script1,
+                               0,
+                               script1.size(),
+                               NULL,
+                               &trivial_file_model)) ||
+      (!perform_script_changes(script2,
+                               0,
+                               script2.size(),
+                               &fork,
+                               NULL)) ||
+      (!perform_script_changes(script2,
+                               0,
+                               script2.size(),
+                               NULL,
+                               &trivial_fork))) {
+    return false;
+  }
+
+  if ((!equal(file_model, trivial_file_model)) ||
+      (!equal(snapshot, trivial_snapshot)) ||
+      (!equal(fork, trivial_fork))) {
+    return false;
+  }
+
+  // Save: the forks keep the previous file on disk.
+  if (!file_model.save()) {
+    fprintf(stderr, "Error saving file_model.\n");
+    return false;
+  }
+
+  if ((!equal(file_model, trivial_file_model)) ||
+      (!equal(snapshot, trivial_snapshot)) ||
+      (!equal(fork, trivial_fork))) {
+    return false;
+  }
+
+  // Save the fork: the file on disk of the file model is replaced.
+  fs::trivial_file_model disk;
+  if ((!fork.save()) || (!disk.open(kFileModelName))) {
+    fprintf(stderr, "Error saving fork.\n");
+    return false;
+  }
+
+  if (!equal(fork, disk)) {
+    return false;
+  }
+
+  disk.close();
+
+  // Modify and save the file model (a new file is written).
+  uint64_t off = random() % trivial_file_model.length();
+  c = random();
+
+  if ((file_model.modify(off, &c, 1) !=
+       fs::file_model::operation_result::kSuccess) ||
+      (!trivial_file_model.modify(off, &c, 1)) ||
+      (!file_model.save()) ||
+      (!disk.open(kFileModelName))) {
+    fprintf(stderr, "Error saving file_model.\n");
+    return false;
+  }
+
+  if ((!equal(file_model, disk)) ||
+      (!equal(file_model, trivial_file_model)) ||
+      (!equal(snapshot, trivial_snapshot))) {
+    return false;
+  }
+
+  disk.close();
+
+  // A snapshot saves the file first: the file model writes a new file
+  // instead of saving in place (the previous file has been unlinked).
+  fs::file_model saved;
+  off = random() % trivial_file_model.length();
+  c = random();
+
+  if ((file_model.modify(off, &c, 1) !=
+       fs::file_model::operation_result::kSuccess) ||
+      (!trivial_file_model.modify(off, &c, 1)) ||
+      (!file_model.snapshot(saved)) ||
+      (!saved.save())) {
+    fprintf(stderr, "Error saving snapshot.\n");
+    return false;
+  }
+
+  saved.close();
+
+  off = random() % trivial_file_model.length();
+  c = random();
+
+  if ((file_model.modify(off, &c, 1) !=
+       fs::file_model::operation_result::kSuccess) ||
+      (!trivial_file_model.modify(off, &c, 1)) ||
+      (!file_model.save()) ||
+      (!disk.open(kFileModelName))) {
+    fprintf(stderr, "Error saving file_model.\n");
+    return false;
+  }
+
+  unlink(kSnapshotName);
+  unlink(kForkName);
+
+  return ((equal(file_model, disk)) &&
+          (equal(file_model, trivial_file_model)));
+}
+
+bool perform_patches(fs::file_model& file_model,
+                     fs::trivial_file_model& trivial_file_model)
+{
+  static const unsigned kMaxPatches = 2000;
+  static const uint64_t kMinDistance = 256;
+  static const uint64_t kDenseRegionSize = 4 * 1024;
+  static const uint64_t kDenseDistance = 4;
+  static const uint64_t kNearRegionSize = 64 * 1024;
+  static const uint64_t kNearDistance = 80;
+  static const char* kSavedName = "file_model.pat";
+
+  // If the file is too small...
+  if (trivial_file_model.length() < 2 * kDenseRegionSize) {
+    printf("File is too small => no patches.\n");
+    return true;
+  }
+
+  printf("Patching...\n");
+
+  // The whole file is on disk.
+  fs::trivial_file_model saved;
+  if ((!file_model.save()) ||
+      (!fs::copy(kFileModelName, kSavedName)) ||
+      (!saved.open(kSavedName))) {
+    fprintf(stderr, "Error saving file_model.\n");
+    return false;
+  }
+
+  size_t revision = file_model.revision();
+
+  // Isolated patches.
+  uint64_t distance = trivial_file_model.length() / kMaxPatches;
+  if (distance < kMinDistance) {
+    distance = kMinDistance;
+  }
+
+  fs::file_model::fragmentation before, after;
+  file_model.get_fragmentation(before);
+
+  unsigned npatches = 0;
+  for (uint64_t off = random() % 8;
+       off < trivial_file_model.length();
+       off += distance) {
+    uint8_t c = random();
+
+    if ((file_model.modify(off, &c, 1) !=
+         fs::file_model::operation_result::kSuccess) ||
+        (!trivial_file_model.modify(off, &c, 1))) {
+      fprintf(stderr, "Error modifying data.\n");
+      return false;
+    }
+
+    npatches++;
+  }
+
+  file_model.get_fragmentation(after);
+
+  // Much less than a page per patch.
+  if (after.memory_allocated - before.memory_allocated >
+      npatches * (kMinDistance / 2)) {
+    fprintf(stderr,
+            "Too much memory allocated for %u patches (%llu bytes).\n",
+            npatches,
+            after.memory_allocated - before.memory_allocated);
+
+    return false;
+  }
+
+  if (!equal(file_model, trivial_file_model)) {
+    return false;
+  }
+
+  // Dense patches (merged into blocks in memory).
+  before = after;
+
+  uint64_t region = random() % (trivial_file_model.length() -
+                                kDenseRegionSize +
+                                1);
+
+  npatches = 0;
+  for (uint64_t off = region;
+       off < region + kDenseRegionSize;
+       off += kDenseDistance) {
+    uint8_t c = random();
+
+    if ((file_model.modify(off, &c, 1) !=
+         fs::file_model::operation_result::kSuccess) ||
+        (!trivial_file_model.modify(off, &c, 1))) {
+      fprintf(stderr, "Error modifying data.\n");
+      return false;
+    }
+
+    npatches++;
+  }
+
+  file_model.get_fragmentation(after);
+
+  if (after.memory_blocks - before.memory_blocks >= npatches / 8) {
+    fprintf(stderr, "Dense patches have not been merged.\n");
+    return false;
+  }
+
+  if (!equal(file_model, trivial_file_model)) {
+    return false;
+  }
+
+  // Patches further apart than the maximum gap (merged once their page is
+  // dense).
+  if (trivial_file_model.length() >= 2 * kNearRegionSize) {
+    before = after;
+
+    region = random() % (trivial_file_model.length() - kNearRegionSize + 1);
+
+    npatches = 0;
+    for (uint64_t off = region;
+         off < region + kNearRegionSize;
+         off += kNearDistance) {
+      uint8_t c = random();
+
+      if ((file_model.modify(off, &c, 1) !=
+           fs::file_model::operation_result::kSuccess) ||
+          (!trivial_file_model.modify(off, &c, 1))) {
+        fprintf(stderr, "Error modifying data.\n");
+        return false;
+      }
+
+      npatches++;
+    }
+
+    file_model.get_fragmentation(after);
+
+    if (after.blocks >= before.blocks + (npatches / 4)) {
+      fprintf(stderr,
+              "Patches have not been merged (%u patches, %zu blocks).\n",
+              npatches,
+              after.blocks);
+
+      return false;
+    }
+
+    if (!equal(file_model, trivial_file_model)) {
+      return false;
+    }
+  }
+
+  // Undo and redo the patches.
+  size_t last = file_model.revision();
+
+  fs::file_model::operation_result res;
+  if ((res = file_model.goto_revision(revision)) !=
+      fs::file_model::operation_result::kSuccess) {
+    fprintf(stderr,
+            "[Goto revision] %s\n",
+            fs::file_model::operation_result_to_string(res));
+
+    return false;
+  }
+
+  if (!equal(file_model, saved)) {
+    return false;
+  }
+
+  if ((res = file_model.goto_revision(last)) !=
+      fs::file_model::operation_result::kSuccess) {
+    fprintf(stderr,
+            "[Goto revision] %s\n",
+            fs::file_model::operation_result_to_string(res));
+
+    return false;
+  }
+
+  unlink(kSavedName);
+
+  return equal(file_model, trivial_file_model);
+}
+
+bool perform_compaction(fs::file_model& file_model,
+                        fs::trivial_file_model& trivial_file_model)
+{
+  static const uint64_t kRegionSize = 2 * 1024;
+  static const unsigned kNumberEdits = 200;
+  static const uint64_t kMinFileSize = 256 * 1024;
+  static const unsigned kMaxWait = 10 * 1000;
+
+  // If the file is too small...
+  if (trivial_file_model.length() < kMinFileSize) {
+    printf("File is too small => no compaction.\n");
+    return true;
+  }
+
+  printf("Compacting...\n");
+
+  // The compaction worker requires the concurrent mode.
+  if (file_model.set_compaction(1)) {
+    fprintf(stderr, "Compaction worker started in non-concurrent mode.\n");
+    return false;
+  }
+
+  // Fragment a region of the file (far from its end).
+  uint64_t region = random() % (trivial_file_model.length() - kMinFileSize + 1);
+
+  for (unsigned i = 0; i < kNumberEdits; i++) {
+    uint64_t off = region + (random() % kRegionSize);
+    uint8_t c = random();
+
+    if (i % 2 == 0) {
+      if ((file_model.add(off, &c, 1) !=
+           fs::file_model::operation_result::kSuccess) ||
+          (!trivial_file_model.add(off, &c, 1))) {
+        fprintf(stderr, "Error adding data.\n");
+        return false;
+      }
+    } else {
+      if ((file_model.remove(off, 1) !=
+           fs::file_model::operation_result::kSuccess) ||
+          (!trivial_file_model.remove(off, 1))) {
+        fprintf(stderr, "Error removing data.\n");
+        return false;
+      }
+    }
+  }
+
+  // The last edit is at the end of the file.
+  uint64_t off = trivial_file_model.length() - 1;
+  uint8_t c = random();
+
+  if ((file_model.modify(off, &c, 1) !=
+       fs::file_model::operation_result::kSuccess) ||
+      (!trivial_file_model.modify(off, &c, 1))) {
+    fprintf(stderr, "Error modifying data.\n");
+    return false;
+  }
+
+  fs::file_model::fragmentation before;
+  file_model.get_fragmentation(before);
+
+  uint64_t memory_used = file_model.memory_used();
+
+  file_model.set_concurrent(true);
+
+  if (!file_model.set_compaction(1)) {
+    fprintf(stderr, "Error starting compaction worker.\n");
+    return false;
+  }
+
+  // Wait for a pass.
+  fs::file_model::compaction_stats stats;
+  unsigned waited = 0;
+  do {
+    usleep(1000);
+    file_model.get_compaction_stats(stats);
+  } while ((stats.passes == 0) && (++waited < kMaxWait));
+
+  fs::file_model::fragmentation after;
+  file_model.get_fragmentation(after);
+
+  if ((stats.passes == 0) ||
+      (stats.merged == 0) ||
+      (after.blocks >= before.blocks) ||
+      (after.memory_allocated > before.memory_allocated) ||
+      (file_model.memory_used() > memory_used)) {
+    fprintf(stderr, "Blocks have not been compacted.\n");
+    return false;
+  }
+
+  if (!equal(file_model, trivial_file_model)) {
+    return false;
+  }
+
+  // Edit while the worker is running.
+  fs::file_changes script;
+  if ((!generate_script(trivial_file_model.length(), 100, script)) ||
+      (!perform_script_changes(script,
+                               0,
+                               script.size(),
+                               &file_model,
+                               NULL)) ||
+      (!perform_script_changes(script,
+                               0,
+                               script.size(),
+                               NULL,
+                               &trivial_file_model))) {
+    return false;
+  }
+
+  usleep(10 * 1000);
+
+  if ((!file_model.set_compaction(0)) ||
+      (!equal(file_model, trivial_file_model))) {
+    return false;
+  }
+
+  file_model.set_concurrent(false);
+
+  return true;
+}
+
+bool perform_prefetch(fs::file_model& file_model,
+                      fs::trivial_file_model& trivial_file_model)
+{
+  static const uint64_t kDistance = 256 * 1024;
+  static const uint64_t kChunkLength = 4096;
+  static const uint64_t kStride = 64 * 1024;
+  static const uint64_t kStridedLength = 512;
+  static const uint64_t kMinFileSize = 4 * kStride;
+
+  // If the file is too small...
+  if (trivial_file_model.length() < kMinFileSize) {
+    printf("File is too small => no prefetching.\n");
+    return true;
+  }
+
+  printf("Prefetching...\n");
+
+  // Read the file on disk.
+  if ((!file_model.save()) || (!file_model.set_prefetch(kDistance))) {
+    fprintf(stderr, "Error starting prefetcher.\n");
+    return false;
+  }
+
+  fs::prefetcher::stats before;
+  file_model.prefetch_stats(before);
+
+  uint64_t filesize = trivial_file_model.length();
+  uint64_t read = 0;
+
+  // Sequential forward.
+  for (uint64_t off = 0; off < filesize; off += kChunkLength) {
+    if (!read_chunk(off, kChunkLength, file_model, trivial_file_model)) {
+      return false;
+    }
+
+    read += ((filesize - off) < kChunkLength) ? filesize - off : kChunkLength;
+  }
+
+  // Sequential backward.
+  for (uint64_t end = filesize; end > 0; ) {
+    uint64_t len = (end < kChunkLength) ? end : kChunkLength;
+    end -= len;
+
+    if (!read_chunk(end, len, file_model, trivial_file_model)) {
+      return false;
+    }
+
+    read += len;
+  }
+
+  // Strided.
+  for (uint64_t off = 0; off + kStridedLength <= filesize; off += kStride) {
+    if (!read_chunk(off, kStridedLength, file_model, trivial_file_model)) {
+      return false;
+    }
+
+    read += kStridedLength;
+  }
+
+  fs::prefetcher::stats after;
+  file_model.prefetch_stats(after);
+
+  if ((after.read - before.read != read) ||
+      (after.requests == before.requests)) {
+    fprintf(stderr, "Invalid prefetch statistics.\n");
+    return false;
+  }
+
+  // Edits while prefetching.
+  fs::file_changes script;
+  if ((!generate_script(filesize, 100, script)) ||
+      (!perform_script_changes(script,
+                               0,
+                               script.size(),
+                               &file_model,
+                               NULL)) ||
+      (!perform_script_changes(script,
+                               0,
+                               script.size(),
+                               NULL,
+                               &trivial_file_model)) ||
+      (!equal(file_model, trivial_file_model)) ||
+      (!file_model.save())) {
+    return false;
+  }
+
+  return ((equal(file_model, trivial_file_model)) &&
+          (file_model.set_prefetch(0)));
+}
+
+bool read_chunk(uint64_t off,
+                uint64_t len,
+                const fs::file_model& file_model,
+                const fs::trivial_file_model& trivial_file_model)
+{
+  uint8_t buf1[4096];
+  uint8_t buf2[4096];
+
+  uint64_t len1 = len;
+  uint64_t len2 = len;
+  if ((!file_model.get(off, buf1, len1)) ||
+      (!trivial_file_model.get(off, buf2, len2)) ||
+      (len1 != len2) ||
+      (memcmp(buf1, buf2, len1) != 0)) {
+    fprintf(stderr, "Error reading offset %llu.\n", off);
+    return false;
+  }
+
+  return true;
+}
+
+bool perform_fills(fs::file_model& file_model,
+                   fs::trivial_file_model& trivial_file_model)
+{
+  static const unsigned kNumberFills = 20;
+  static const uint64_t kMaxFillLength = 64 * 1024;
+  static const size_t kMaxPatternLength = 16;
+  static const uint64_t kGrowth = 100 * 1024;
+  static const uint64_t kShrink = 10 * 1024;
+  static const char* kSavedName = "file_model.fil";
+
+  struct fill {
+    uint64_t off;
+    uint64_t len;
+
+    uint8_t pattern[kMaxPatternLength];
+    size_t patternlen;
+  };
+
+  // If the file is too small...
+  uint64_t filesize = trivial_file_model.length();
+  if (filesize < 2 * kMaxFillLength) {
+    printf("File is too small => no fills.\n");
+    return true;
+  }
+
+  printf("Filling...\n");
+
+  // The file on disk is the starting point.
+  fs::trivial_file_model saved;
+  if ((!file_model.save()) ||
+      (!fs::copy(kFileModelName, kSavedName)) ||
+      (!saved.open(kSavedName))) {
+    fprintf(stderr, "Error saving file_model.\n");
+    return false;
+  }
+
+  size_t revision = file_model.revision();
+
+  // Generate the fills (one out of four with zeros).
+  struct fill fills[kNumberFills];
+  for (unsigned i = 0; i < kNumberFills; i++) {
+    fills[i].len = 1 + (random() % kMaxFillLength);
+    fills[i].off = random() % (filesize - fills[i].len + 1);
+    fills[i].patternlen = 1 + (random() % kMaxPatternLength);
+
+    if ((i % 4) == 0) {
+      memset(fills[i].pattern, 0, fills[i].patternlen);
+    } else {
+      fill_random_data(fills[i].pattern, fills[i].patternlen);
+    }
+  }
+
+  // The session is interrupted after the fills: the child process exits
+  // without closing the file.
+  pid_t pid;
+  if ((pid = fork()) < 0) {
+    fprintf(stderr, "Error creating process.\n");
+    return false;
+  }
+
+  if (pid == 0) {
+    fs::file_model session;
+    session.set_session_journal(true);
+
+    bool ok = session.open(kFileModelName);
+
+    for (unsigned i = 0; (ok) && (i < kNumberFills); i++) {
+      ok = (session.fill(fills[i].off,
+                         fills[i].len,
+                         fills[i].pattern,
+                         fills[i].patternlen) ==
+            fs::file_model::operation_result::kSuccess);
+    }
+
+    ok = ((ok) &&
+          (session.resize(filesize + kGrowth) ==
+           fs::file_model::operation_result::kSuccess) &&
+          (session.sync_session_journal()));
+
+    _exit(ok ? 0 : 1);
+  }
+
+  int status;
+  if ((waitpid(pid, &status, 0) != pid) ||
+      (!WIFEXITED(status)) ||
+      (WEXITSTATUS(status) != 0)) {
+    fprintf(stderr, "Error running the session.\n");
+    return false;
+  }
+
+  uint8_t* buf;
+  if ((buf = reinterpret_cast<uint8_t*>(calloc(1, kGrowth))) == NULL) {
+    fprintf(stderr, "Error allocating memory.\n");
+    return false;
+  }
+
+  for (unsigned i = 0; i < kNumberFills; i++) {
+    for (uint64_t j = 0; j < fills[i].len; j++) {
+      buf[j] = fills[i].pattern[j % fills[i].patternlen];
+    }
+
+    fs::file_model::operation_result res;
+    if ((res = file_model.fill(fills[i].off,
+                               fills[i].len,
+                               fills[i].pattern,
+                               fills[i].patternlen)) !=
+        fs::file_model::operation_result::kSuccess) {
+      fprintf(stderr,
+              "Error filling file_model (%s).\n",
+              fs::file_model::operation_result_to_string(res));
+
+      free(buf);
+      return false;
+    }
+
+    if (!trivial_file_model.modify(fills[i].off, buf, fills[i].len)) {
+      fprintf(stderr, "Error modifying trivial_file_model.\n");
+
+      free(buf);
+      return false;
+    }
+  }
+
+  // Grow the file.
+  memset(buf, 0, kGrowth);
+
+  bool ok = ((file_model.resize(filesize + kGrowth) ==
+              fs::file_model::operation_result::kSuccess) &&
+             (trivial_file_model.add(filesize, buf, kGrowth)));
+
+  free(buf);
+
+  if (!ok) {
+    fprintf(stderr, "Error growing the file.\n");
+    return false;
+  }
+
+  if (!equal(file_model, trivial_file_model)) {
+    return false;
+  }
+
+  // Recover the session (the fills are replayed).
+  fs::file_model recovered;
+  recovered.set_session_journal(true);
+
+  if ((!recovered.open(kFileModelName)) || (!recovered.recovered())) {
+    fprintf(stderr, "The session has not been recovered.\n");
+    return false;
+  }
+
+  if (!equal(recovered, trivial_file_model)) {
+    return false;
+  }
+
+  recovered.close();
+
+  // Shrink the file.
+  uint64_t len = trivial_file_model.length() - kShrink;
+  if ((file_model.resize(len) != fs::file_model::operation_result::kSuccess) ||
+      (!trivial_file_model.remove(len, kShrink)) ||
+      (!equal(file_model, trivial_file_model))) {
+    fprintf(stderr, "Error shrinking the file.\n");
+    return false;
+  }
+
+  // Undo and redo the fills.
+  size_t last = file_model.revision();
+
+  fs::file_model::operation_result res;
+  if ((res = file_model.goto_revision(revision)) !=
+      fs::file_model::operation_result::kSuccess) {
+    fprintf(stderr,
+            "[Goto revision] %s\n",
+            fs::file_model::operation_result_to_string(res));
+
+    return false;
+  }
+
+  if (!equal(file_model, saved)) {
+    return false;
+  }
+
+  if ((res = file_model.goto_revision(last)) !=
+      fs::file_model::operation_result::kSuccess) {
+    fprintf(stderr,
+            "[Goto revision] %s\n",
+            fs::file_model::operation_result_to_string(res));
+
+    return false;
+  }
+
+  if ((!equal(file_model, trivial_file_model)) || (!file_model.save())) {
+    return false;
+  }
+
+  unlink(kSavedName);
+
+  return ((equal(file_model, trivial_file_model)) && (perform_large_fills()));
+}
+
+bool perform_large_fills()
+{
+  static const uint64_t kLargeSize = 2ull * 1024 * 1024 * 1024;
+  static const uint64_t kPatternFillLength = 16 * 1024 * 1024;
+  static const uint64_t kMaxMemoryUsed = 64 * 1024;
+  static const char* kLargeName = "file_model.big";
+  static const uint8_t kPattern[] = "01234567890123456789";
+  static const size_t kPatternLength = 10;
+  static const uint8_t kZero = 0;
+
+  printf("Filling large file...\n");
+
+  // Empty file.
+  fs::file_model file_model;
+  if (!create_file_model(kLargeName, &kZero, 0, file_model)) {
+    return false;
+  }
+
+  uint64_t filloff = kLargeSize / 2;
+
+  // The zeros and the pattern are not stored.
+  if ((file_model.resize(kLargeSize, false) !=
+       fs::file_model::operation_result::kSuccess) ||
+      (file_model.fill(filloff,
+                       kPatternFillLength,
+                       kPattern,
+                       kPatternLength,
+                       false) != fs::file_model::operation_result::kSuccess) ||
+      (file_model.length() != kLargeSize) ||
+      (file_model.memory_used() > kMaxMemoryUsed)) {
+    fprintf(stderr, "Error filling file %s.\n", kLargeName);
+    return false;
+  }
+
+  // The history only records the pattern of the fills (the data which is
+  // replaced is referenced).
+  if ((file_model.fill(0, kLargeSize, &kZero, 1) !=
+       fs::file_model::operation_result::kSuccess) ||
+      (file_model.resize(2 * kLargeSize) !=
+       fs::file_model::operation_result::kSuccess) ||
+      (file_model.length() != 2 * kLargeSize) ||
+      (file_model.memory_used() > kMaxMemoryUsed) ||
+      (file_model.undo() != fs::file_model::operation_result::kSuccess) ||
+      (file_model.undo() != fs::file_model::operation_result::kSuccess) ||
+      (file_model.redo() != fs::file_model::operation_result::kSuccess) ||
+      (!check_large_fills(file_model,
+                          filloff,
+                          0,
+                          kPattern,
+                          kPatternLength)) ||
+      (file_model.undo() != fs::file_model::operation_result::kSuccess) ||
+      (file_model.length() != kLargeSize) ||
+      (file_model.memory_used() > kMaxMemoryUsed)) {
+    fprintf(stderr, "Error recording large fills.\n");
+    return false;
+  }
+
+  if (!check_large_fills(file_model,
+                         filloff,
+                         kPatternFillLength,
+                         kPattern,
+                         kPatternLength)) {
+    return false;
+  }
+
+  // The zeros are saved as holes.
+  struct stat sbuf;
+  if ((!file_model.save()) ||
+      (stat(kLargeName, &sbuf) < 0) ||
+      (static_cast<uint64_t>(sbuf.st_size) != kLargeSize) ||
+      (static_cast<uint64_t>(sbuf.st_blocks) * 512 >= kLargeSize / 2)) {
+    fprintf(stderr, "Error saving file %s.\n", kLargeName);
+    return false;
+  }
+
+  if (!check_large_fills(file_model,
+                         filloff,
+                         kPatternFillLength,
+                         kPattern,
+                         kPatternLength)) {
+    return false;
+  }
+
+  // Zero the first half of the pattern in place.
+  if ((file_model.fill(filloff, kPatternFillLength / 2, &kZero, 1, false) !=
+       fs::file_model::operation_result::kSuccess) ||
+      (!file_model.save())) {
+    fprintf(stderr, "Error zeroing file %s.\n", kLargeName);
+    return false;
+  }
+
+  bool ok = check_large_fills(file_model,
+                              filloff + (kPatternFillLength / 2),
+                              kPatternFillLength / 2,
+                              kPattern + ((kPatternFillLength / 2) %
+                                          kPatternLength),
+                              kPatternLength);
+
+  file_model.close();
+  unlink(kLargeName);
+
+  return ok;
+}
+
+bool check_large_fills(const fs::file_model& file_model,
+                       uint64_t filloff,
+                       uint64_t filllen,
+                       const uint8_t* pattern,
+                       size_t patternlen)
+{
+  static const uint64_t kChunkLength = 4096;
+
+  // Chunks around the edges of the fill and at both ends of the file.
+  uint64_t offsets[] = {
+    0,
+    filloff - (kChunkLength / 2),
+    filloff + (filllen / 3),
+    filloff + filllen - (kChunkLength / 2),
+    file_model.length() - kChunkLength
+  };
+
+  for (size_t i = 0; i < sizeof(offsets) / sizeof(offsets[0]); i++) {
+    uint8_t buf[kChunkLength];
+    uint64_t len = sizeof(buf);
+    if ((!file_model.get(offsets[i], buf, len)) || (len != sizeof(buf))) {
+      fprintf(stderr, "Error reading offset %llu.\n", offsets[i]);
+      return false;
+    }
+
+    for (uint64_t j = 0; j < len; j++) {
+      uint64_t off = offsets[i] + j;
+
+      // Is the byte part of the fill?
+      uint8_t c = ((off >= filloff) && (off < filloff + filllen)) ?
+                    pattern[(off - filloff) % patternlen] :
+                    0;
+
+      if (buf[j] != c) {
+        fprintf(stderr, "Invalid data at offset %llu.\n", off);
+        return false;
+      }
+    }
+  }
+
+  return true;
+}
+
+bool perform_compression(fs::file_model& file_model,
+                         fs::trivial_file_model& trivial_file_model)
+{
+  static const unsigned kNumberEdits = 100;
+  static const uint64_t kEditLength = 2 * 1024;
+  static const uint64_t kMinFileSize = 1024 * 1024;
+  static const uint64_t kNeedleLength = 16;
+  static const unsigned kMaxWait = 10 * 1000;
+  static const char* kSavedName = "file_model.cmp";
+
+  // If the file is too small...
+  if (trivial_file_model.length() < kMinFileSize) {
+    printf("File is too small => no compression.\n");
+    return true;
+  }
+
+  printf("Compressing...\n");
+
+  // The file on disk is the starting point.
+  fs::trivial_file_model saved;
+  if ((!file_model.save()) ||
+      (!fs::copy(kFileModelName, kSavedName)) ||
+      (!saved.open(kSavedName))) {
+    fprintf(stderr, "Error saving file_model.\n");
+    return false;
+  }
+
+  size_t revision = file_model.revision();
+
+  // Write a contiguous region of text (its blocks only contain the same
+  // lines of text repeated).
+  uint64_t half = trivial_file_model.length() / 2;
+
+  uint8_t text[kEditLength];
+  fill_text(text, kEditLength);
+
+  for (unsigned i = 0; i < kNumberEdits; i++) {
+    uint64_t off = half + (i * kEditLength);
+
+    fs::file_model::operation_result res;
+    if ((res = file_model.modify(off, text, kEditLength)) !=
+        fs::file_model::operation_result::kSuccess) {
+      fprintf(stderr,
+              "Error modifying file_model (%s).\n",
+              fs::file_model::operation_result_to_string(res));
+
+      return false;
+    }
+
+    if (!trivial_file_model.modify(off, text, kEditLength)) {
+      fprintf(stderr, "Error modifying trivial_file_model.\n");
+      return false;
+    }
+  }
+
+  // Middle of the region of text.
+  uint64_t first = half + ((kNumberEdits / 2) * kEditLength);
+
+  // The last edit is at the beginning of the file.
+  if (!write_text(0, 1, file_model, trivial_file_model)) {
+    return false;
+  }
+
+  uint64_t memory_used = file_model.memory_used();
+
+  uint64_t released;
+  fs::file_model::compression_stats before;
+  file_model.get_compression_stats(before);
+
+  if (((released = file_model.compress_blocks()) == 0) ||
+      (file_model.memory_used() != memory_used - released)) {
+    fprintf(stderr, "Blocks have not been compressed.\n");
+    return false;
+  }
+
+  // The text compresses well.
+  fs::file_model::compression_stats stats;
+  file_model.get_compression_stats(stats);
+
+  if ((stats.blocks == 0) || (stats.compressed * 2 > stats.data)) {
+    fprintf(stderr,
+            "Invalid compression statistics (%llu bytes compressed into "
+            "%llu bytes).\n",
+            stats.data,
+            stats.compressed);
+
+    return false;
+  }
+
+  // Write text at random offsets of the second half of the file (the
+  // blocks also contain random data) and compress it.
+  for (unsigned i = 0; i < kNumberEdits; i++) {
+    uint64_t off = half + (random() % (half - kEditLength));
+
+    if (!write_text(off, kEditLength, file_model, trivial_file_model)) {
+      return false;
+    }
+  }
+
+  if (!write_text(0, 1, file_model, trivial_file_model)) {
+    return false;
+  }
+
+  if (file_model.compress_blocks() == 0) {
+    fprintf(stderr, "Blocks have not been compressed.\n");
+    return false;
+  }
+
+  // Read and search the compressed blocks.
+  if (!equal(file_model, trivial_file_model)) {
+    return false;
+  }
+
+  uint8_t needle[kNeedleLength];
+  uint64_t len = sizeof(needle);
+  if (!trivial_file_model.get(first + (kEditLength / 2), needle, len)) {
+    fprintf(stderr, "Error reading trivial_file_model.\n");
+    return false;
+  }
+
+  for (unsigned i = 0; i < 2; i++) {
+    direction dir = (i == 0) ? direction::kForward : direction::kBackward;
+    uint64_t off = (i == 0) ? half : trivial_file_model.length() - 1;
+
+    uint64_t pos1, pos2;
+    bool found1 = file_model.find(off, dir, needle, len, pos1);
+    bool found2 = trivial_file_model.find(off, dir, needle, len, pos2);
+
+    if ((found1 != found2) || ((found1) && (pos1 != pos2))) {
+      fprintf(stderr, "Error searching the compressed blocks.\n");
+      return false;
+    }
+  }
+
+  file_model.get_compression_stats(stats);
+
+  if (stats.misses == before.misses) {
+    fprintf(stderr, "Compressed blocks have not been read.\n");
+    return false;
+  }
+
+  // Modify a compressed block.
+  if (!write_text(first + 100, 10, file_model, trivial_file_model)) {
+    return false;
+  }
+
+  file_model.get_compression_stats(stats);
+
+  if ((stats.expansions == before.expansions) ||
+      (!equal(file_model, trivial_file_model))) {
+    fprintf(stderr, "Compressed block has not been expanded.\n");
+    return false;
+  }
+
+  // The compaction worker compresses the new blocks.
+  for (unsigned i = 0; i < kNumberEdits / 10; i++) {
+    uint64_t off = half + (random() % (half - kEditLength));
+
+    if (!write_text(off, kEditLength, file_model, trivial_file_model)) {
+      return false;
+    }
+  }
+
+  if (!write_text(0, 1, file_model, trivial_file_model)) {
+    return false;
+  }
+
+  file_model.get_compression_stats(before);
+
+  file_model.set_compression(true);
+  file_model.set_concurrent(true);
+
+  if (!file_model.set_compaction(1)) {
+    fprintf(stderr, "Error starting compaction worker.\n");
+    return false;
+  }
+
+  unsigned waited = 0;
+  do {
+    usleep(1000);
+    file_model.get_compression_stats(stats);
+  } while ((stats.compressions == before.compressions) &&
+           (++waited < kMaxWait));
+
+  file_model.set_compaction(0);
+  file_model.set_concurrent(false);
+  file_model.set_compression(false);
+
+  if (stats.compressions == before.compressions) {
+    fprintf(stderr, "Compaction worker has not compressed blocks.\n");
+    return false;
+  }
+
+  if (!equal(file_model, trivial_file_model)) {
+    return false;
+  }
+
+  // Undo and redo the edits.
+  size_t last = file_model.revision();
+
+  fs::file_model::operation_result res;
+  if ((res = file_model.goto_revision(revision)) !=
+      fs::file_model::operation_result::kSuccess) {
+    fprintf(stderr,
+            "[Goto revision] %s\n",
+            fs::file_model::operation_result_to_string(res));
+
+    return false;
+  }
+
+  if (!equal(file_model, saved)) {
+    return false;
+  }
+
+  if ((res = file_model.goto_revision(last)) !=
+      fs::file_model::operation_result::kSuccess) {
+    fprintf(stderr,
+            "[Goto revision] %s\n",
+            fs::file_model::operation_result_to_string(res));
+
+    return false;
+  }
+
+  if ((!equal(file_model, trivial_file_model)) || (!file_model.save())) {
+    return false;
+  }
+
+  unlink(kSavedName);
+
+  return equal(file_model, trivial_file_model);
+}
+
+bool perform_insertions(fs::file_model& file_model,
+                        fs::trivial_file_model& trivial_file_model)
+{
+  static const uint64_t kTypedLength = 10 * 1000;
+  static const uint64_t kPastedLength = 1024 * 1024;
+  static const uint64_t kMinFileSize = 64 * 1024;
+  static const char* kSavedName = "file_model.cmp";
+
+  // If the file is too small...
+  if (trivial_file_model.length() < kMinFileSize) {
+    printf("File is too small => no insertions.\n");
+    return true;
+  }
+
+  printf("Inserting...\n");
+
+  fs::trivial_file_model saved;
+  if ((!file_model.save()) ||
+      (!fs::copy(kFileModelName, kSavedName)) ||
+      (!saved.open(kSavedName))) {
+    fprintf(stderr, "Error saving file_model.\n");
+    return false;
+  }
+
+  size_t revision = file_model.revision();
+
+  uint8_t* data;
+  if ((data = reinterpret_cast<uint8_t*>(malloc(kPastedLength))) == NULL) {
+    fprintf(stderr, "Error allocating memory.\n");
+    return false;
+  }
+
+  // Type text in the middle of the file on disk: the characters are
+  // appended to the same buffers.
+  fill_text(data, kTypedLength);
+
+  fs::file_model::fragmentation before, after;
+  file_model.get_fragmentation(before);
+
+  uint64_t off = trivial_file_model.length() / 2;
+  if (!type_text(off, data, kTypedLength, file_model, trivial_file_model)) {
+    free(data);
+    return false;
+  }
+
+  file_model.get_fragmentation(after);
+
+  if (after.blocks - before.blocks > (kTypedLength / 4096) + 3) {
+    fprintf(stderr,
+            "Too many blocks after typing (%zu -> %zu).\n",
+            before.blocks,
+            after.blocks);
+
+    free(data);
+    return false;
+  }
+
+  // Paste a big chunk of data: big buffers.
+  fill_random_data(data, kPastedLength);
+
+  off = random() % trivial_file_model.length();
+
+  fs::file_model::operation_result res;
+  if ((res = file_model.add(off, data, kPastedLength)) !=
+      fs::file_model::operation_result::kSuccess) {
+    fprintf(stderr,
+            "Error adding to file_model (%s).\n",
+            fs::file_model::operation_result_to_string(res));
+
+    free(data);
+    return false;
+  }
+
+  if (!trivial_file_model.add(off, data, kPastedLength)) {
+    fprintf(stderr, "Error adding to trivial_file_model.\n");
+
+    free(data);
+    return false;
+  }
+
+  file_model.get_fragmentation(before);
+
+  if (before.blocks - after.blocks > (kPastedLength / (64 * 1024)) + 3) {
+    fprintf(stderr,
+            "Too many blocks after pasting (%zu -> %zu).\n",
+            after.blocks,
+            before.blocks);
+
+    free(data);
+    return false;
+  }
+
+  // Type text in the middle of the pasted data (the buffer is split at the
+  // cursor).
+  fill_text(data, kTypedLength);
+
+  if (!type_text(off + (kPastedLength / 2) + 100,
+                 data,
+                 kTypedLength,
+                 file_model,
+                 trivial_file_model)) {
+    free(data);
+    return false;
+  }
+
+  free(data);
+
+  file_model.get_fragmentation(after);
+
+  if (after.blocks - before.blocks > (kTypedLength / 4096) + 3) {
+    fprintf(stderr,
+            "Too many blocks after typing (%zu -> %zu).\n",
+            before.blocks,
+            after.blocks);
+
+    return false;
+  }
+
+  if (!equal(file_model, trivial_file_model)) {
+    return false;
+  }
+
+  // Undo and redo the insertions.
+  size_t last = file_model.revision();
+
+  if ((res = file_model.goto_revision(revision)) !=
+      fs::file_model::operation_result::kSuccess) {
+    fprintf(stderr,
+            "[Goto revision] %s\n",
+            fs::file_model::operation_result_to_string(res));
+
+    return false;
+  }
+
+  if (!equal(file_model, saved)) {
+    return false;
+  }
+
+  if ((res = file_model.goto_revision(last)) !=
+      fs::file_model::operation_result::kSuccess) {
+    fprintf(stderr,
+            "[Goto revision] %s\n",
+            fs::file_model::operation_result_to_string(res));
+
+    return false;
+  }
+
+  if ((!equal(file_model, trivial_file_model)) || (!file_model.save())) {
+    return false;
+  }
+
+  unlink(kSavedName);
+
+  return equal(file_model, trivial_file_model);
+}
+
+bool perform_sources(fs::file_model& file_model,
+                     fs::trivial_file_model& trivial_file_model)
+{
+  static const unsigned kNumberReferences = 20;
+  static const uint64_t kSourceSize = 1024 * 1024;
+  static const uint64_t kMaxReferenceLength = 128 * 1024;
+  static const uint64_t kLargeSourceSize = 256 * 1024 * 1024;
+  static const uint64_t kMaxMemoryUsed = 64 * 1024;
+  static const char* kSourceName = "file_model.src";
+  static const char* kLargeSourceName = "file_model.lsr";
+  static const char* kSavedName = "file_model.ref";
+
+  struct reference {
+    uint64_t off;
+    uint64_t srcoff;
+    uint64_t len;
+
+    // Add or modify?
+    bool add;
+  };
+
+  // If the file is too small...
+  uint64_t filesize = trivial_file_model.length();
+  if (filesize < kMaxReferenceLength) {
+    printf("File is too small => no references.\n");
+    return true;
+  }
+
+  printf("Referencing other files...\n");
+
+  // Source file.
+  uint8_t* src;
+  if ((src = reinterpret_cast<uint8_t*>(malloc(kSourceSize))) == NULL) {
+    fprintf(stderr, "Error allocating memory.\n");
+    return false;
+  }
+
+  fill_random_data(src, kSourceSize);
+
+  if (!write_file(kSourceName, src, kSourceSize)) {
+    free(src);
+    return false;
+  }
+
+  // The file on disk is the starting point.
+  fs::trivial_file_model saved;
+  if ((!file_model.save()) ||
+      (!fs::copy(kFileModelName, kSavedName)) ||
+      (!saved.open(kSavedName))) {
+    fprintf(stderr, "Error saving file_model.\n");
+
+    free(src);
+    return false;
+  }
+
+  size_t revision = file_model.revision();
+
+  // Generate the references (the offsets are valid once the previous
+  // references have been performed).
+  struct reference references[kNumberReferences];
+  for (unsigned i = 0; i < kNumberReferences; i++) {
+    references[i].len = 1 + (random() % kMaxReferenceLength);
+    references[i].srcoff = random() % (kSourceSize - references[i].len + 1);
+    references[i].add = ((random() % 2) == 0);
+    references[i].off = random() % (filesize - references[i].len + 1);
+
+    if (references[i].add) {
+      filesize += references[i].len;
+    }
+  }
+
+  // The session is interrupted after the references: the child process
+  // exits without closing the file.
+  pid_t pid;
+  if ((pid = fork()) < 0) {
+    fprintf(stderr, "Error creating process.\n");
+
+    free(src);
+    return false;
+  }
+
+  if (pid == 0) {
+    fs::file_model session;
+    session.set_session_journal(true);
+
+    bool ok = session.open(kFileModelName);
+
+    for (unsigned i = 0; (ok) && (i < kNumberReferences); i++) {
+      const struct reference* r = &references[i];
+
+      ok = ((r->add ? session.add_from_file(r->off,
+                                            kSourceName,
+                                            r->srcoff,
+                                            r->len) :
+                      session.modify_from_file(r->off,
+                                               kSourceName,
+                                               r->srcoff,
+                                               r->len)) ==
+            fs::file_model::operation_result::kSuccess);
+    }
+
+    _exit(((ok) && (session.sync_session_journal())) ? 0 : 1);
+  }
+
+  int status;
+  if ((waitpid(pid, &status, 0) != pid) ||
+      (!WIFEXITED(status)) ||
+      (WEXITSTATUS(status) != 0)) {
+    fprintf(stderr, "Error running the session.\n");
+
+    free(src);
+    return false;
+  }
+
+  uint64_t memory_used = file_model.memory_used();
+
+  for (unsigned i = 0; i < kNumberReferences; i++) {
+    const struct reference* r = &references[i];
+
+    fs::file_model::operation_result res;
+    if ((res = r->add ? file_model.add_from_file(r->off,
+                                                 kSourceName,
+                                                 r->srcoff,
+                                                 r->len) :
+                        file_model.modify_from_file(r->off,
+                                                    kSourceName,
+                                                    r->srcoff,
+                                                    r->len)) !=
+        fs::file_model::operation_result::kSuccess) {
+      fprintf(stderr,
+              "Error referencing %s (%s).\n",
+              kSourceName,
+              fs::file_model::operation_result_to_string(res));
+
+      free(src);
+      return false;
+    }
+
+    if (!(r->add ? trivial_file_model.add(r->off, src + r->srcoff, r->len) :
+                   trivial_file_model.modify(r->off,
+                                             src + r->srcoff,
+                                             r->len))) {
+      fprintf(stderr, "Error modifying trivial_file_model.\n");
+
+      free(src);
+      return false;
+    }
+  }
+
+  free(src);
+
+  // The data has not been copied (only the small pieces between the
+  // references).
+  if (file_model.memory_used() > memory_used + (kNumberReferences * 16 * 1024)) {
+    fprintf(stderr,
+            "The references use too much memory (%llu bytes).\n",
+            file_model.memory_used() - memory_used);
+
+    return false;
+  }
+
+  if (!equal(file_model, trivial_file_model)) {
+    return false;
+  }
+
+  // The file itself, a missing file and a range beyond the end of the source
+  // file cannot be referenced.
+  if ((file_model.add_from_file(0, kFileModelName, 0, 1) !=
+       fs::file_model::operation_result::kInvalidOperation) ||
+      (file_model.add_from_file(0, "file_model.none", 0, 1) !=
+       fs::file_model::operation_result::kInvalidOperation) ||
+      (file_model.modify_from_file(0, kSourceName, kSourceSize, 1) !=
+       fs::file_model::operation_result::kInvalidOperation)) {
+    fprintf(stderr, "Invalid references have been accepted.\n");
+    return false;
+  }
+
+  // Recover the session (the references are replayed).
+  fs::file_model recovered;
+  recovered.set_session_journal(true);
+
+  if ((!recovered.open(kFileModelName)) || (!recovered.recovered())) {
+    fprintf(stderr, "The session has not been recovered.\n");
+    return false;
+  }
+
+  if (!equal(recovered, trivial_file_model)) {
+    return false;
+  }
+
+  recovered.close();
+
+  // Undo and redo the last reference, then all of them.
+  fs::file_model::operation_result res;
+  if (((res = file_model.undo()) !=
+       fs::file_model::operation_result::kSuccess) ||
+      ((res = file_model.redo()) !=
+       fs::file_model::operation_result::kSuccess)) {
+    fprintf(stderr,
+            "[Undo / redo] %s\n",
+            fs::file_model::operation_result_to_string(res));
+
+    return false;
+  }
+
+  if (!equal(file_model, trivial_file_model)) {
+    return false;
+  }
+
+  size_t last = file_model.revision();
+
+  if ((res = file_model.goto_revision(revision)) !=
+      fs::file_model::operation_result::kSuccess) {
+    fprintf(stderr,
+            "[Goto revision] %s\n",
+            fs::file_model::operation_result_to_string(res));
+
+    return false;
+  }
+
+  if (!equal(file_model, saved)) {
+    return false;
+  }
+
+  if ((res = file_model.goto_revision(last)) !=
+      fs::file_model::operation_result::kSuccess) {
+    fprintf(stderr,
+            "[Goto revision] %s\n",
+            fs::file_model::operation_result_to_string(res));
+
+    return false;
+  }
+
+  if ((!equal(file_model, trivial_file_model)) || (!file_model.save())) {
+    return false;
+  }
+
+  if (!equal(file_model, trivial_file_model)) {
+    return false;
+  }
+
+  // A source file bigger than the memory limit (sparse: zeros) is added
+  // and removed.
+  FILE* file;
+  if ((file = fopen(kLargeSourceName, "wb")) == NULL) {
+    fprintf(stderr, "Error creating file %s.\n", kLargeSourceName);
+    return false;
+  }
+
+  bool ok = (ftruncate(fileno(file), kLargeSourceSize) == 0);
+
+  if ((fclose(file) != 0) || (!ok)) {
+    fprintf(stderr, "Error writing file %s.\n", kLargeSourceName);
+    return false;
+  }
+
+  memory_used = file_model.memory_used();
+  filesize = file_model.length();
+
+  uint8_t buf[16];
+  uint64_t len = sizeof(buf);
+
+  ok = ((file_model.add_from_file(filesize / 2,
+                                  kLargeSourceName,
+                                  0,
+                                  kLargeSourceSize) ==
+         fs::file_model::operation_result::kSuccess) &&
+        (file_model.length() == filesize + kLargeSourceSize) &&
+        (file_model.memory_used() <= memory_used + kMaxMemoryUsed) &&
+        (file_model.get(filesize / 2 + kLargeSourceSize - len, buf, len)) &&
+        (len == sizeof(buf)) &&
+        (memchr(buf, 0, len) == buf) &&
+        (memcmp(buf, buf + 1, len - 1) == 0) &&
+        (file_model.undo() == fs::file_model::operation_result::kSuccess) &&
+        (file_model.length() == filesize));
+
+  unlink(kLargeSourceName);
+
+  if (!ok) {
+    fprintf(stderr, "Error referencing the large source file.\n");
+    return false;
+  }
+
+  unlink(kSourceName);
+  unlink(kSavedName);
+
+  return equal(file_model, trivial_file_model);
+}
+
+bool perform_ranges(fs::file_model& file_model,
+                    fs::trivial_file_model& trivial_file_model)
+{
+  static const unsigned kNumberOperations = 60;
+  static const uint64_t kMaxRangeLength = 256 * 1024;
+  static const uint64_t kModificationLength = 8 * 1024;
+  static const uint64_t kLargeLength = 128 * 1024 * 1024;
+  static const uint64_t kMaxMemoryUsed = 64 * 1024;
+  static const char* kSavedName = "file_model.rng";
+
+  enum class operation_type {
+    kModify,
+    kCopy,
+    kMove
+  };
+
+  struct operation {
+    operation_type t;
+
+    uint64_t src;
+    uint64_t len;
+    uint64_t dst;
+  };
+
+  // If the file is too small...
+  uint64_t filesize = trivial_file_model.length();
+  if (filesize < kMaxRangeLength) {
+    printf("File is too small => no ranges.\n");
+    return true;
+  }
+
+  printf("Copying and moving ranges...\n");
+
+  // The file on disk is the starting point.
+  fs::trivial_file_model saved;
+  if ((!file_model.save()) ||
+      (!fs::copy(kFileModelName, kSavedName)) ||
+      (!saved.open(kSavedName))) {
+    fprintf(stderr, "Error saving file_model.\n");
+    return false;
+  }
+
+  size_t revision = file_model.revision();
+
+  // Text written by the modifications (compressible).
+  uint8_t text[kModificationLength];
+  fill_text(text, kModificationLength);
+
+  // Generate the operations (the modifications create blocks in memory
+  // which are then copied and moved).
+  struct operation operations[kNumberOperations];
+  for (unsigned i = 0; i < kNumberOperations; i++) {
+    struct operation* op = &operations[i];
+
+    switch (random() % 3) {
+      case 0:
+        op->t = operation_type::kModify;
+        op->len = kModificationLength;
+        op->src = random() % (filesize - op->len + 1);
+        op->dst = op->src;
+
+        break;
+      case 1:
+        op->t = operation_type::kCopy;
+        op->len = 1 + (random() % kMaxRangeLength);
+        op->src = random() % (filesize - op->len + 1);
+        op->dst = random() % (filesize + 1);
+
+        filesize += op->len;
+
+        break;
+      default:
+        op->t = operation_type::kMove;
+        op->len = 1 + (random() % kMaxRangeLength);
+        op->src = random() % (filesize - op->len + 1);
+
+        // The destination is either before or after the range.
+        op->dst = random() % (filesize - op->len + 1);
+        if (op->dst > op->src) {
+          op->dst += op->len;
+        }
+    }
+  }
+
+  // The session is interrupted after the operations: the child process
+  // exits without closing the file.
+  pid_t pid;
+  if ((pid = fork()) < 0) {
+    fprintf(stderr, "Error creating process.\n");
+    return false;
+  }
+
+  if (pid == 0) {
+    fs::file_model session;
+    session.set_session_journal(true);
+
+    bool ok = session.open(kFileModelName);
+
+    for (unsigned i = 0; (ok) && (i < kNumberOperations); i++) {
+      const struct operation* op = &operations[i];
+
+      fs::file_model::operation_result res;
+      switch (op->t) {
+        case operation_type::kModify:
+          // The blocks in memory are compressed (the shared buffers are
+          // written decompressed to the journal).
+          session.compress_blocks();
+
+          res = session.modify(op->src, text, op->len);
+          break;
+        case operation_type::kCopy:
+          res = session.copy_range(op->src, op->len, op->dst);
+          break;
+        default:
+          res = session.move_range(op->src, op->len, op->dst);
+      }
+
+      ok = (res == fs::file_model::operation_result::kSuccess);
+    }
+
+    _exit(((ok) && (session.sync_session_journal())) ? 0 : 1);
+  }
+
+  int status;
+  if ((waitpid(pid, &status, 0) != pid) ||
+      (!WIFEXITED(status)) ||
+      (WEXITSTATUS(status) != 0)) {
+    fprintf(stderr, "Error running the session.\n");
+    return false;
+  }
+
+  for (unsigned i = 0; i < kNumberOperations; i++) {
+    const struct operation* op = &operations[i];
+
+    // Data of the range.
+    uint8_t* data;
+    if ((data = reinterpret_cast<uint8_t*>(malloc(op->len))) == NULL) {
+      fprintf(stderr, "Error allocating memory.\n");
+      return false;
+    }
+
+    uint64_t len = op->len;
+    if (!trivial_file_model.get(op->src, data, len)) {
+      fprintf(stderr, "Error reading trivial_file_model.\n");
+
+      free(data);
+      return false;
+    }
+
+    fs::file_model::operation_result res;
+    bool ok;
+
+    switch (op->t) {
+      case operation_type::kModify:
+        file_model.compress_blocks();
+
+        res = file_model.modify(op->src, text, op->len);
+        ok = trivial_file_model.modify(op->src, text, op->len);
+
+        break;
+      case operation_type::kCopy:
+        res = file_model.copy_range(op->src, op->len, op->dst);
+        ok = trivial_file_model.add(op->dst, data, op->len);
+
+        break;
+      default:
+        res = file_model.move_range(op->src, op->len, op->dst);
+        ok = ((trivial_file_model.remove(op->src, op->len)) &&
+              (trivial_file_model.add((op->dst > op->src) ?
+                                        op->dst - op->len :
+                                        op->dst,
+                                      data,
+                                      op->len)));
+    }
+
+    free(data);
+
+    if (res != fs::file_model::operation_result::kSuccess) {
+      fprintf(stderr,
+              "[Operation %u] %s\n",
+              i,
+              fs::file_model::operation_result_to_string(res));
+
+      return false;
+    }
+
+    if (!ok) {
+      fprintf(stderr, "Error modifying trivial_file_model.\n");
+      return false;
+    }
+  }
+
+  if (!equal(file_model, trivial_file_model)) {
+    return false;
+  }
+
+  // A move inside of the range itself is not valid.
+  if (file_model.move_range(0, 2, 1) !=
+      fs::file_model::operation_result::kInvalidOperation) {
+    fprintf(stderr, "An invalid move has been accepted.\n");
+    return false;
+  }
+
+  // Recover the session (the operations are replayed).
+  fs::file_model recovered;
+  recovered.set_session_journal(true);
+
+  if ((!recovered.open(kFileModelName)) || (!recovered.recovered())) {
+    fprintf(stderr, "The session has not been recovered.\n");
+    return false;
+  }
+
+  if (!equal(recovered, trivial_file_model)) {
+    return false;
+  }
+
+  recovered.close();
+
+  // Undo and redo the last operation, then all of them.
+  fs::file_model::operation_result res;
+  if (((res = file_model.undo()) !=
+       fs::file_model::operation_result::kSuccess) ||
+      ((res = file_model.redo()) !=
+       fs::file_model::operation_result::kSuccess)) {
+    fprintf(stderr,
+            "[Undo / redo] %s\n",
+            fs::file_model::operation_result_to_string(res));
+
+    return false;
+  }
+
+  if (!equal(file_model, trivial_file_model)) {
+    return false;
+  }
+
+  size_t last = file_model.revision();
+
+  if ((res = file_model.goto_revision(revision)) !=
+      fs::file_model::operation_result::kSuccess) {
+    fprintf(stderr,
+            "[Goto revision] %s\n",
+            fs::file_model::operation_result_to_string(res));
+
+    return false;
+  }
+
+  if (!equal(file_model, saved)) {
+    return false;
+  }
+
+  if ((res = file_model.goto_revision(last)) !=
+      fs::file_model::operation_result::kSuccess) {
+    fprintf(stderr,
+            "[Goto revision] %s\n",
+            fs::file_model::operation_result_to_string(res));
+
+    return false;
+  }
+
+  if (!equal(file_model, trivial_file_model)) {
+    return false;
+  }
+
+  // The file is doubled (without recording the changes) until it is bigger
+  // than the maximum memory which can be used: the blocks are shared.
+  uint64_t memory_used = file_model.memory_used();
+  filesize = file_model.length();
+
+  uint64_t len = filesize;
+  while (len < kLargeLength) {
+    if ((res = file_model.copy_range(0, len, len, false)) !=
+        fs::file_model::operation_result::kSuccess) {
+      fprintf(stderr,
+              "[Copy range] %s\n",
+              fs::file_model::operation_result_to_string(res));
+
+      return false;
+    }
+
+    len *= 2;
+  }
+
+  uint8_t buf[256];
+  uint8_t expected[256];
+  uint64_t count = sizeof(buf);
+  uint64_t n = count;
+
+  // The copy of the large range is recorded without its data.
+  bool ok = ((file_model.length() == len) &&
+             (file_model.memory_used() <= memory_used + kMaxMemoryUsed) &&
+             (file_model.get(len - filesize, buf, count)) &&
+             (trivial_file_model.get(0, expected, n)) &&
+             (count == n) &&
+             (memcmp(buf, expected, n) == 0) &&
+             (file_model.copy_range(0, len, 0) ==
+              fs::file_model::operation_result::kSuccess) &&
+             (file_model.length() == 2 * len) &&
+             (file_model.memory_used() <= memory_used + kMaxMemoryUsed) &&
+             (file_model.undo() ==
+              fs::file_model::operation_result::kSuccess) &&
+             (file_model.length() == len) &&
+             (file_model.resize(filesize, false) ==
+              fs::file_model::operation_result::kSuccess));
+
+  if (!ok) {
+    fprintf(stderr, "Error copying the large range.\n");
+    return false;
+  }
+
+  unlink(kSavedName);
+
+  return ((equal(file_model, trivial_file_model)) &&
+          (file_model.save()) &&
+          (equal(file_model, trivial_file_model)));
+}
+
+bool type_text(uint64_t off,
+               const uint8_t* data,
+               uint64_t len,
+               fs::file_model& file_model,
+               fs::trivial_file_model& trivial_file_model)
+{
+  // One character at a time.
+  for (uint64_t i = 0; i < len; i++) {
+    fs::file_model::operation_result res;
+    if ((res = file_model.add(off + i, data + i, 1)) !=
+        fs::file_model::operation_result::kSuccess) {
+      fprintf(stderr,
+              "Error adding to file_model (%s).\n",
+              fs::file_model::operation_result_to_string(res));
+
+      return false;
+    }
+  }
+
+  // The same text at once.
+  if (!trivial_file_model.add(off, data, len)) {
+    fprintf(stderr, "Error adding to trivial_file_model.\n");
+    return false;
+  }
+
+  return true;
+}
+
+bool write_text(uint64_t off,
+                uint64_t len,
+                fs::file_model& file_model,
+                fs::trivial_file_model& trivial_file_model)
+{
+  uint8_t buf[4 * 1024];
+  fill_text(buf, len);
+
+  fs::file_model::operation_result res;
+  if ((res = file_model.modify(off, buf, len)) !=
+      fs::file_model::operation_result::kSuccess) {
+    fprintf(stderr,
+            "Error modifying file_model (%s).\n",
+            fs::file_model::operation_result_to_string(res));
+
+    return false;
+  }
+
+  if (!trivial_file_model.modify(off, buf, len)) {
+    fprintf(stderr, "Error modifying trivial_file_model.\n");
+    return false;
+  }
+
+  return true;
+}
+
+bool check_change_formats(uint64_t filesize)
+{
+  static const unsigned kNumberChanges = 200;
+  static const char* kTextFile = "file_model.chg";
+  static const char* kBinaryFile = "file_model.chb";
+  static const char* kConvertedFile = "file_model.ch2";
+
+  printf("Converting changes...\n");
+
+  fs::file_changes changes;
+  if (!generate_script(filesize, kNumberChanges, changes)) {
+    return false;
+  }
+
+  // Text -> binary -> text.
+  fs::file_changes loaded;
+  if ((!changes.save(kTextFile)) ||
+      (!fs::change_journal::to_binary(kTextFile, kBinaryFile)) ||
+      (!loaded.load(kBinaryFile)) ||
+      (!fs::change_journal::to_text(kBinaryFile, kConvertedFile))) {
+    fprintf(stderr, "Error converting changes.\n");
+    return false;
+  }
+
+  if (loaded.size() != changes.size()) {
+    fprintf(stderr,
+            "Wrong number of changes (%zu instead of %zu).\n",
+            loaded.size(),
+            changes.size());
+
+    return false;
+  }
+
+  for (size_t i = 0; i < changes.size(); i++) {
+    const fs::file_change* chg = changes.get(i);
+    const fs::file_change* l = loaded.get(i);
+
+    if ((l->t != chg->t) ||
+        (l->off != chg->off) ||
+        (l->len != chg->len) ||
+        ((chg->t != fs::file_change::type::kRemove) &&
+         (memcmp(l->newdata, chg->newdata, chg->len) != 0))) {
+      fprintf(stderr, "Change %zu has not been converted properly.\n", i);
+      return false;
+    }
+  }
+
+  if (!fs::diff(kTextFile, kConvertedFile)) {
+    fprintf(stderr,
+            "Files %s and %s are different.\n",
+            kTextFile,
+            kConvertedFile);
+
+    return false;
+  }
+
+  // Corrupt the first record: the file cannot be loaded.
+  FILE* file;
+  if ((file = fopen(kBinaryFile, "r+b")) == NULL) {
+    fprintf(stderr, "Error opening file %s.\n", kBinaryFile);
+    return false;
+  }
+
+  long off = fs::change_journal::kHeaderSize +
+             fs::change_journal::kRecordHeaderSize;
+
+  int c;
+  if ((fseek(file, off, SEEK_SET) != 0) ||
+      ((c = fgetc(file)) == EOF) ||
+      (fseek(file, off, SEEK_SET) != 0) ||
+      (fputc(c ^ 0x01, file) == EOF)) {
+    fclose(file);
+
+    fprintf(stderr, "Error corrupting file %s.\n", kBinaryFile);
+    return false;
+  }
+
+  fclose(file);
+
+  fs::file_changes corrupted;
+  if (corrupted.load(kBinaryFile)) {
+    fprintf(stderr, "A corrupted file has been loaded.\n");
+    return false;
+  }
+
+  unlink(kTextFile);
+  unlink(kBinaryFile);
+  unlink(kConvertedFile);
+
+  return true;
+}
+
+bool perform_edits(const uint8_t* data,
+                   uint64_t offsets[3],
+                   fs::file_model* file_model,
+                   fs::trivial_file_model* trivial_file_model)
+{
+  fs::file_model::operation_result res =
+    fs::file_model::operation_result::kSuccess;
+  bool ok = true;
+
+  // Type bytes.
+  for (uint64_t i = 0; (ok) && (i < kTypedBytes); i++) {
+    if (file_model) {
+      ok = ((res = file_model->add(offsets[0] + i, data + i, 1)) ==
+            fs::file_model::operation_result::kSuccess);
+    } else {
+      ok = trivial_file_model->add(offsets[0] + i, data + i, 1);
+    }
+  }
+
+  // Delete the last ones (backspace).
+  for (uint64_t i = 0; (ok) && (i < kBackspaces); i++) {
+    if (file_model) {
+      ok = ((res = file_model->remove(offsets[0] + kTypedBytes - 1 - i, 1)) ==
+            fs::file_model::operation_result::kSuccess);
+    } else {
+      ok = trivial_file_model->remove(offsets[0] + kTypedBytes - 1 - i, 1);
+    }
+  }
+
+  // Overwrite bytes.
+  for (uint64_t i = 0; (ok) && (i < kModifiedBytes); i++) {
+    const uint8_t* d = data + kTypedBytes + i;
+
+    if (file_model) {
+      ok = ((res = file_model->modify(offsets[1] + i, d, 1)) ==
+            fs::file_model::operation_result::kSuccess);
+    } else {
+      ok = trivial_file_model->modify(offsets[1] + i, d, 1);
+    }
+  }
+
+  // Delete bytes (delete key).
+  for (uint64_t i = 0; (ok) && (i < kDeletedBytes); i++) {
+    if (file_model) {
+      ok = ((res = file_model->remove(offsets[2], 1)) ==
+            fs::file_model::operation_result::kSuccess);
+    } else {
+      ok = trivial_file_model->remove(offsets[2], 1);
+    }
+  }
+
+  if (!ok) {
+    if (file_model) {
+      fprintf(stderr,
+              "Error editing file_model (%s).\n",
+              fs::file_model::operation_result_to_string(res));
+    } else {
+      fprintf(stderr, "Error editing trivial_file_model.\n");
+    }
+
+    return false;
+  }
+
+  return true;
+}
+
+bool modify(uint64_t off,
+            const uint8_t* data,
+            uint64_t len,
+            fs::file_model& file_model)
+{
+  fs::file_model::operation_result res;
+  if ((res = file_model.modify(off, data, len)) !=
+      fs::file_model::operation_result::kSuccess) {
+    fprintf(stderr,
+            "Error modifying file_model (%s).\n",
+            fs::file_model::operation_result_to_string(res));
+
+    return false;
+  }
+
+  return true;
+}
+
+bool perform_undos(fs::file_model& file_model, size_t nchanges)
+{
+  printf("Performing undos...\n");
+
+  for (size_t i = 0; i < nchanges; i++) {
+    fs::file_model::operation_result res;
+    if ((res = file_model.undo()) !=
+        fs::file_model::operation_result::kSuccess) {
+      fprintf(stderr,
+              "[Undo] %s\n",
+              fs::file_model::operation_result_to_string(res));
+
+      return false;
+    }
+  }
+
+  if (!file_model.save()) {
+    fprintf(stderr, "Error saving file_model.\n");
+    return false;
+  }
+
+  if (!fs::diff(kOriginalFile, kFileModelName)) {
+    fprintf(stderr,
+            "Files %s and %s are different.\n",
+            kOriginalFile,
+            kFileModelName);
+
+    return false;
+  }
+
+  return true;
+}
+
+bool perform_redos(fs::file_model& file_model, size_t nchanges)
+{
+  printf("Performing redos...\n");
+
+  for (size_t i = 0; i < nchanges; i++) {
+    fs::file_model::operation_result res;
+    if ((res = file_model.redo()) !=
+        fs::file_model::operation_result::kSuccess) {
+      fprintf(stderr,
+              "[Redo] %s\n",
+              fs::file_model::operation_result_to_string(res));
+
+      return false;
+    }
+  }
+
+  if (!file_model.save()) {
+    fprintf(stderr, "Error saving file_model.\n");
+    return false;
+  }
+
+  if (!fs::diff(kFileModelName, kTrivialFileModelName)) {
+    fprintf(stderr,
+            "Files %s and %s are different.\n",
+            kFileModelName,
+            kTrivialFileModelName);
+
+    return false;
+  }
+
+  return true;
+}
+
+bool remove_all(fs::file_model& file_model,
+                fs::trivial_file_model& trivial_file_model)
+{
+  printf("Removing all...\n");
+
+  if (!trivial_file_model.remove(0, trivial_file_model.length())) {
+    fprintf(stderr, "Error emptying trivial_file_model.\n");
+    return false;
+  }
+
+  fs::file_model::operation_result res;
+  if ((res = file_model.remove(0, file_model.length())) !=
+      fs::file_model::operation_result::kSuccess) {
+    fprintf(stderr,
+            "Error emptying file_model (%s).\n",
+            fs::file_model::operation_result_to_string(res));
+
+    return false;
+  }
+
+  if (!file_model.save()) {
+    fprintf(stderr, "Error saving file_model.\n");
+    return false;
+  }
+
+  if (!fs::diff(kFileModelName, kTrivialFileModelName)) {
+    fprintf(stderr,
+            "The files %s and %s are different.\n",
+            kFileModelName,
+            kTrivialFileModelName);
+
+    return false;
+  }
+
+  return true;
+}
 
 bool fill_random_data(fs::file_model& file_model,
                       fs::trivial_file_model& trivial_file_model)
@@ -784,6 +6057,65 @@ bool equal(const fs::file_model& file_model,
   return true;
 }
 
+void fill_text(uint8_t* data, size_t len)
+{
+  static const char* kWords[] = {
+    "the", "file", "model", "block", "memory", "disk", "data", "change",
+    "undo", "redo", "search", "offset", "length", "buffer", "page", "save"
+  };
+
+  size_t i = 0;
+  while (i < len) {
+    const char* word = kWords[random() % (sizeof(kWords) / sizeof(kWords[0]))];
+
+    for (; (*word) && (i < len); word++) {
+      data[i++] = *word;
+    }
+
+    if (i < len) {
+      data[i++] = ((random() % 8) == 0) ? '\n' : ' ';
+    }
+  }
+}
+
+bool check_spilled_pieces(const fs::file_changes& changes,
+                          size_t nchanges,
+                          const uint8_t* expected,
+                          const uint8_t* mapped,
+                          uint64_t piecelen)
+{
+  for (size_t i = 0; i < nchanges; i++) {
+    const fs::file_change* chg = changes.get(i);
+
+    const uint8_t* data = expected + (i * chg->npieces * piecelen);
+    for (size_t j = 0; j < chg->npieces; j++) {
+      if (memcmp(chg->pieces[j].data, data, chg->pieces[j].len) != 0) {
+        fprintf(stderr,
+                "[Spilled pieces] Piece %zu of change %zu is different.\n",
+                j,
+                i);
+
+        return false;
+      }
+
+      data += chg->pieces[j].len;
+    }
+
+    // The pieces still reference the mapped data.
+    if ((chg->pieces[0].data != mapped) ||
+        (chg->pieces[chg->npieces - 1].data != mapped + piecelen)) {
+      fprintf(stderr,
+              "[Spilled pieces] The pieces of change %zu don't reference "
+              "the mapped data.\n",
+              i);
+
+      return false;
+    }
+  }
+
+  return true;
+}
+
 void fill_random_data(uint8_t* data, size_t len)
 {
   size_t i;
@@ -798,3 +6130,42 @@ void fill_random_data(uint8_t* data, size_t len)
     memcpy(data, &n, len - i);
   }
 }
+
+bool write_file(const char* filename, const void* data, uint64_t len)
+{
+  FILE* file;
+  if ((file = fopen(filename, "wb")) == NULL) {
+    fprintf(stderr, "Error creating file %s.\n", filename);
+    return false;
+  }
+
+  bool ok = (fwrite(data, 1, len, file) == len);
+
+  if ((fclose(file) != 0) || (!ok)) {
+    fprintf(stderr, "Error writing file %s.\n", filename);
+
+    unlink(filename);
+    return false;
+  }
+
+  return true;
+}
+
+bool create_file_model(const char* filename,
+                       const void* data,
+                       uint64_t len,
+                       fs::file_model& file_model)
+{
+  if (!write_file(filename, data, len)) {
+    return false;
+  }
+
+  if (!file_model.open(filename)) {
+    fprintf(stderr, "Error opening file %s.\n", filename);
+
+    unlink(filename);
+    return false;
+  }
+
+  return true;
+}